@@ -6,6 +6,11 @@ static fadt_t* g_fadt;
 static uint16_t g_slp_typa;
 static uint16_t g_slp_typb;
 
+// enabled processors from the madt, in the order the firmware lists them; the boot cpu comes first
+static uint8_t g_cpu_apic_ids[ACPI_MAX_CPUS];
+static uint32_t g_cpu_count;
+static uintptr_t g_lapic_base;
+
 static int acpi_checksum(void* ptr, size_t len) {
     uint8_t sum = 0;
     uint8_t* p = ptr;
@@ -49,17 +54,25 @@ static rsdp_t* acpi_find_rsdp(void) {
 }
 
 static void acpi_parse_madt(sdt_t* madt) {
+    // the local apic address and flags sit between the header and the entries
+    g_lapic_base = *(uint32_t*) ((uintptr_t) madt + sizeof(sdt_t));
+
     uintptr_t ptr = (uintptr_t) madt + sizeof(sdt_t) + 8;
     uintptr_t end = (uintptr_t) madt + madt->length;
 
     while (ptr < end) {
         uint8_t type = *(uint8_t*) ptr;
         uint8_t len = *(uint8_t*) (ptr + 1);
+        if (!len) {
+            break;
+        }
 
         if (type == ACPI_MADT_TYPE_LAPIC) {
+            uint8_t apic_id = *(uint8_t*) (ptr + 3);
             uint32_t flags = *(uint32_t*) (ptr + 4);
-            if (flags & 1) {
-                log("acpi: cpu online", GREEN);
+            if ((flags & ACPI_MADT_LAPIC_ENABLED) && g_cpu_count < ACPI_MAX_CPUS) {
+                g_cpu_apic_ids[g_cpu_count++] = apic_id;
+                log("acpi: found cpu\n", GREEN);
             }
         }
 
@@ -67,6 +80,18 @@ static void acpi_parse_madt(sdt_t* madt) {
     }
 }
 
+uint32_t acpi_cpu_count(void) {
+    return g_cpu_count;
+}
+
+uint8_t acpi_cpu_apic_id(uint32_t idx) {
+    return idx < g_cpu_count ? g_cpu_apic_ids[idx] : 0;
+}
+
+uintptr_t acpi_lapic_base(void) {
+    return g_lapic_base;
+}
+
 static void acpi_parse_s5(uint8_t* dsdt, uint32_t len) {
     for (uint32_t i = 0; i < len - 4; i++) {
         if (*(uint32_t*) (dsdt + i) == 0x35535F) {
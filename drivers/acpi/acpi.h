@@ -98,6 +98,14 @@ enum acpi_madt_types {
     ACPI_MADT_TYPE_LAPIC = 0
 };
 
+enum acpi_madt_lapic_flags {
+    ACPI_MADT_LAPIC_ENABLED = 1 << 0
+};
+
+enum acpi_cpu_limits {
+    ACPI_MAX_CPUS = 8
+};
+
 enum acpi_scan_ranges {
     ACPI_SCAN_BIOS_START = 0xE0000,
     ACPI_SCAN_BIOS_END = 0x100000,
@@ -115,6 +123,9 @@ enum acpi_qemu_constants {
 };
 
 int acpi_init(void);
+uint32_t acpi_cpu_count(void);
+uint8_t acpi_cpu_apic_id(uint32_t idx);
+uintptr_t acpi_lapic_base(void);
 void acpi_power_off(void);
 void acpi_qemu_power_off(void);
 
@@ -0,0 +1,89 @@
+/*
+
+Copyright 2024-2026 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of The Flopperating System.
+
+The Flopperating System is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either veregion_startion 3 of the License, or (at your option) any later version.
+
+The Flopperating System is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with The Flopperating System. If not, see <https://www.gnu.org/licenses/>.
+
+
+[DESCRIPTION] - local apic, only what bringing up the other cpus and signalling them needs
+
+*/
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "lapic.h"
+#include "../../mem/vmm.h"
+#include "../../mem/paging.h"
+#include "../../lib/logging.h"
+#include "../../interrupts/interrupts.h"
+
+extern vmm_region_t kernel_region;
+
+static volatile uint32_t* lapic_regs;
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic_regs[reg / sizeof(uint32_t)];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    lapic_regs[reg / sizeof(uint32_t)] = value;
+}
+
+// map the registers uncached where the firmware put them and enable the boot cpu's apic
+int lapic_init(uintptr_t base) {
+    if (!base) {
+        log("lapic: no local apic\n", RED);
+        return -1;
+    }
+
+    if (vmm_map(&kernel_region, base, base, PAGE_RW | PAGE_PCD | PAGE_PWT) < 0) {
+        log("lapic: failed to map registers\n", RED);
+        return -1;
+    }
+
+    lapic_regs = (volatile uint32_t*) base;
+    lapic_enable();
+
+    log("lapic: init - ok\n", GREEN);
+    return 0;
+}
+
+// software enable, every cpu does this for its own apic
+void lapic_enable(void) {
+    lapic_write(LAPIC_REG_SPURIOUS, LAPIC_SPURIOUS_ENABLE | LAPIC_SPURIOUS_VECTOR);
+}
+
+uint8_t lapic_id(void) {
+    return (uint8_t) (lapic_read(LAPIC_REG_ID) >> LAPIC_ID_SHIFT);
+}
+
+void lapic_eoi(void) {
+    lapic_write(LAPIC_REG_EOI, 0);
+}
+
+bool lapic_present(void) {
+    return lapic_regs != NULL;
+}
+
+// writing the low half of the icr sends, wait for the apic to take it before returning
+int lapic_send_ipi(uint8_t apic_id, uint32_t icr) {
+    lapic_write(LAPIC_REG_ESR, 0);
+    lapic_write(LAPIC_REG_ICR_HIGH, (uint32_t) apic_id << LAPIC_ID_SHIFT);
+    lapic_write(LAPIC_REG_ICR_LOW, icr);
+
+    for (uint32_t i = 0; i < LAPIC_ICR_PENDING_SPINS; i++) {
+        if (!(lapic_read(LAPIC_REG_ICR_LOW) & LAPIC_ICR_PENDING)) {
+            return 0;
+        }
+        IA32_CPU_RELAX();
+    }
+
+    log("lapic: ipi was never delivered\n", RED);
+    return -1;
+}
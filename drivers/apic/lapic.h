@@ -0,0 +1,39 @@
+#ifndef LAPIC_H
+#define LAPIC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// register offsets from the base the madt gives
+enum lapic_registers {
+    LAPIC_REG_ID = 0x20,
+    LAPIC_REG_EOI = 0xB0,
+    LAPIC_REG_SPURIOUS = 0xF0,
+    LAPIC_REG_ESR = 0x280,
+    LAPIC_REG_ICR_LOW = 0x300,
+    LAPIC_REG_ICR_HIGH = 0x310
+};
+
+enum lapic_icr_bits {
+    LAPIC_ICR_INIT = 0x500,
+    LAPIC_ICR_STARTUP = 0x600,
+    LAPIC_ICR_PENDING = 1 << 12,
+    LAPIC_ICR_ASSERT = 1 << 14,
+    LAPIC_ICR_LEVEL = 1 << 15
+};
+
+enum lapic_constants {
+    LAPIC_SPURIOUS_ENABLE = 0x100,
+    LAPIC_SPURIOUS_VECTOR = 0xFF,
+    LAPIC_ID_SHIFT = 24,
+    LAPIC_ICR_PENDING_SPINS = 1000000
+};
+
+int lapic_init(uintptr_t base);
+void lapic_enable(void);
+uint8_t lapic_id(void);
+void lapic_eoi(void);
+int lapic_send_ipi(uint8_t apic_id, uint32_t icr);
+bool lapic_present(void);
+
+#endif
@@ -17,13 +17,22 @@ You should have received a copy of the GNU General Public License along with The
 #include "../io/io.h"
 #include "../../lib/logging.h"
 #include "../../task/sched.h"
+#include "../../task/sync/rwsem.h"
 #include "ata.h"
 #include "../../interrupts/interrupts.h"
 
-extern thread_t* current_thread;
 
 ata_queue_t ata_queue;
 static spinlock_t ata_lock = SPINLOCK_INIT;
+// a synchronous command owns the channel's task file from the command to its last sector and may sleep meanwhile,
+// so callers queue on a sleeping lock; the request queue holds its requests back while one runs
+static rwsem_t ata_channel_sem;
+static bool ata_sync_active = false;
+static bool ata_present[2];
+// armed for the request at the head of the queue
+static ktimer_t ata_timeout_timer;
+
+static void ata_internal_timeout(void* arg);
 
 static void ata_bs_wait(void) {
     // wait for bsy to clear and rdy to be set
@@ -68,6 +77,36 @@ void ata_queue_init(void) {
     ata_queue.tail = NULL;
     ata_queue.length = 0;
     spinlock_init(&ata_queue.lock);
+    rwsem_init(&ata_channel_sem);
+    timer_init(&ata_timeout_timer, ata_internal_timeout, NULL);
+}
+
+static void ata_internal_start(ata_request_t* req);
+
+// take the channel for a synchronous command, after a queued request that is in flight has raised its irq
+static void ata_internal_claim(void) {
+    rwsem_down_write(&ata_channel_sem);
+    for (;;) {
+        bool r = spinlock(&ata_lock);
+        if (!ata_queue.head) {
+            ata_sync_active = true;
+            spinlock_unlock(&ata_lock, r);
+            return;
+        }
+        spinlock_unlock(&ata_lock, r);
+        sched_yield();
+    }
+}
+
+// hand the channel back and start what was queued behind the command
+static void ata_internal_release(void) {
+    bool r = spinlock(&ata_lock);
+    ata_sync_active = false;
+    if (ata_queue.head) {
+        ata_internal_start(ata_queue.head);
+    }
+    spinlock_unlock(&ata_lock, r);
+    rwsem_up_write(&ata_channel_sem);
 }
 
 // read sectors into buffer
@@ -78,6 +117,7 @@ void ata_read(uint8_t drive, uint32_t lba, uint8_t sectors, uint8_t* buffer, boo
 
     // prepare read op
     if (!queued) {
+        ata_internal_claim();
         ATA_PREPARE_OP(drive, lba, sectors, ATA_CMD_READ);
     }
 
@@ -96,6 +136,13 @@ void ata_read(uint8_t drive, uint32_t lba, uint8_t sectors, uint8_t* buffer, boo
 
         // move to next sector
         buffer += ATA_SECTOR_SIZE;
+
+        // the drive holds the next sector until it is asked for, so a pio read can give way between them
+        cond_resched();
+    }
+
+    if (!queued) {
+        ata_internal_release();
     }
 }
 
@@ -106,6 +153,7 @@ void ata_write(uint8_t drive, uint32_t lba, uint8_t sectors, uint8_t* buffer, bo
 
     // prepare write op
     if (!queued) {
+        ata_internal_claim();
         ATA_PREPARE_OP(drive, lba, sectors, ATA_CMD_WRITE);
     }
 
@@ -125,6 +173,12 @@ void ata_write(uint8_t drive, uint32_t lba, uint8_t sectors, uint8_t* buffer, bo
         // move to next sector
         buffer += ATA_SECTOR_SIZE;
     }
+
+    if (!queued) {
+        // the last sector is on its way to the platter until bsy clears
+        ata_bs_wait();
+        ata_internal_release();
+    }
 }
 
 static ata_request_t* ata_queue_dequeue_unlocked(void) {
@@ -214,15 +268,43 @@ int ata_finish_request(ata_request_t* req) {
     return -1;
 }
 
+// start the head of the queue and give it until the timeout to raise its irq
+static void ata_internal_start(ata_request_t* req) {
+    ata_start_request(req);
+    timer_add(&ata_timeout_timer, sched_get_ticks() + timer_ms_to_ticks(ATA_REQUEST_TIMEOUT_MS));
+}
+
+// the request at the head of the queue never completed, fail it and move on to the next one
+static void ata_internal_timeout(void* arg) {
+    (void) arg;
+    bool r = spinlock(&ata_lock);
+
+    ata_request_t* req = ata_queue_dequeue_unlocked();
+    if (req) {
+        log("ata: request timed out\n", RED);
+        if (req->completion) {
+            req->completion(req, -1);
+        }
+
+        ata_request_t* next = ata_queue.head;
+        if (next) {
+            ata_internal_start(next);
+        }
+    }
+
+    spinlock_unlock(&ata_lock, r);
+}
+
 void ata_submit(ata_request_t* req) {
     spinlock(&ata_lock);
 
     bool was_empty = (ata_queue.head == NULL);
     ata_queue_enqueue_unlocked(req);
 
-    if (was_empty) {
+    // behind a synchronous command the request is started when the command releases the channel
+    if (was_empty && !ata_sync_active) {
         // if queue empty, start req
-        ata_start_request(req);
+        ata_internal_start(req);
     }
 
     spinlock_unlock(&ata_lock, true);
@@ -234,10 +316,12 @@ void ata_irq_handler(void) {
 
     spinlock(&ata_lock);
 
-    // get current request from queue
-    ata_request_t* req = ata_queue.head;
+    // the irqs of a synchronous command are its own, the head of the queue has not been started yet
+    ata_request_t* req = ata_sync_active ? NULL : ata_queue.head;
 
     if (req) {
+        timer_cancel(&ata_timeout_timer);
+
         // do pio
         int st = ata_finish_request(req);
 
@@ -251,7 +335,7 @@ void ata_irq_handler(void) {
         // start next request if the queue isn't empty
         ata_request_t* next = ata_queue.head;
         if (next) {
-            ata_start_request(next);
+            ata_internal_start(next);
         }
     }
 
@@ -314,7 +398,13 @@ void ata_init(void) {
 
         log_uint("ata: found ata drive at index ", drive);
         ata_init_drive(drive);
+        ata_present[drive] = true;
     }
 
     log("ata: init - ok\n", GREEN);
 }
+
+// whether ata_init found a drive at this index of the primary channel
+bool ata_drive_present(uint8_t drive) {
+    return drive < 2 && ata_present[drive];
+}
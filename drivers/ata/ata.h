@@ -29,6 +29,8 @@ typedef enum ata_cmd {
 #define ATA_RDY 0x40
 #define MAX_SECTORS 256
 #define ATA_SECTOR_SIZE 512
+// a queued request whose irq has not come by then is failed
+#define ATA_REQUEST_TIMEOUT_MS 5000
 #define SECTOR_ITERATE for (uint8_t i = 0; i < sectors; i++)
 
 #define ATA_DRIVE_INIT_PREPARE(drive_num)                                                                              \
@@ -44,11 +46,11 @@ typedef enum ata_cmd {
 
 #define ATA_PREPARE_OP(drive, lba, sectors, cmd)                                                                       \
     do {                                                                                                               \
-        outb(ATA_PORT_DRIVE_HEAD, 0xE0 | ((drive) >> 4) | (((lba) >> 24) & 0x0F));                                     \
+        outb(ATA_PORT_DRIVE_HEAD, 0xE0 | (((drive) & 1) << 4) | (((lba) >> 24) & 0x0F));                               \
         outb(ATA_PORT_SECTOR_COUNT, (sectors));                                                                        \
-        outb(ATA_PORT_LBA_LOW, (uint8_t) ((lba) >> 8));                                                                \
-        outb(ATA_PORT_LBA_MID, (uint8_t) ((lba) >> 16));                                                               \
-        outb(ATA_PORT_LBA_HIGH, ((lba) >> 16) & 0xFF);                                                                 \
+        outb(ATA_PORT_LBA_LOW, (uint8_t) (lba));                                                                       \
+        outb(ATA_PORT_LBA_MID, (uint8_t) ((lba) >> 8));                                                                \
+        outb(ATA_PORT_LBA_HIGH, (uint8_t) ((lba) >> 16));                                                              \
         outb(ATA_PORT_COMMAND, (cmd));                                                                                 \
     } while (0)
 
@@ -121,5 +123,6 @@ void ata_start_request(ata_request_t* req);
 int ata_finish_request(ata_request_t* req);
 
 void ata_init(void);
+bool ata_drive_present(uint8_t drive);
 
 #endif
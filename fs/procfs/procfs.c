@@ -18,11 +18,15 @@ You should have received a copy of the GNU General Public License along with The
 #include "../../mem/paging.h"
 #include "../../mem/utils.h"
 #include "../../mem/vmm.h"
+#include "../../mem/zram.h"
+#include "../../mem/ksm.h"
 #include "../../drivers/vga/vgahandler.h"
 #include "../../lib/str.h"
 #include "../../task/sync/spinlock.h"
+#include "../../task/process.h"
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 struct procfs {
     uint32_t procfs_count;
@@ -34,6 +38,81 @@ struct procfs {
 
 static struct procfs pfs;
 
+#define PROCFS_SHOW_MAX 512
+
+// an open generated file; show renders the whole contents, pid selects the process for per-process files
+// and store, when set, takes writes
+struct procfs_file {
+    int (*show)(pid_t pid, char* buf, size_t size);
+    int (*store)(const char* buf, size_t size);
+    pid_t pid;
+};
+
+static int procfs_show_meminfo(pid_t pid, char* buf, size_t size) {
+    return proc_format_mem_usage_all(buf, size);
+}
+
+static int procfs_show_zram(pid_t pid, char* buf, size_t size) {
+    return zram_format_stats(buf, size);
+}
+
+static int procfs_show_ksm(pid_t pid, char* buf, size_t size) {
+    return ksm_format_stats(buf, size);
+}
+
+static int procfs_show_status(pid_t pid, char* buf, size_t size) {
+    process_t* process = proc_get_process_by_pid(pid);
+    if (!process) {
+        return -1;
+    }
+    return proc_format_mem_usage(process, buf, size);
+}
+
+// map a path below the mount point to its generator: "meminfo", "zram", "ksm", "<pid>" or "<pid>/status"
+static bool procfs_internal_lookup(const char* path, struct procfs_file* out) {
+    while (*path == '/') {
+        path++;
+    }
+
+    out->store = NULL;
+
+    if (flopstrcmp(path, "meminfo") == 0) {
+        out->show = procfs_show_meminfo;
+        out->pid = 0;
+        return true;
+    }
+
+    if (flopstrcmp(path, "zram") == 0) {
+        out->show = procfs_show_zram;
+        out->pid = 0;
+        return true;
+    }
+
+    if (flopstrcmp(path, "ksm") == 0) {
+        out->show = procfs_show_ksm;
+        out->store = ksm_store_tunable;
+        out->pid = 0;
+        return true;
+    }
+
+    if (*path < '0' || *path > '9') {
+        return false;
+    }
+
+    const char* rest = path;
+    while (*rest >= '0' && *rest <= '9') {
+        rest++;
+    }
+
+    if (*rest && flopstrcmp(rest, "/status") != 0) {
+        return false;
+    }
+
+    out->show = procfs_show_status;
+    out->pid = (pid_t) flopatoi(path);
+    return true;
+}
+
 static struct vfs_directory_list* procfs_build_dirlist() {
     struct vfs_directory_list* list = kmalloc(sizeof(struct vfs_directory_list));
     if (!list) {
@@ -79,10 +158,29 @@ void procfs_add_entry(const char* name, int type) {
 }
 
 static struct vfs_node* procfs_open(struct vfs_node* node, char* path) {
+    node->data_pointer = NULL;
+
+    struct procfs_file file;
+    if (!path || !procfs_internal_lookup(path, &file)) {
+        return node;
+    }
+
+    struct procfs_file* open_file = kmalloc(sizeof(struct procfs_file));
+    if (!open_file) {
+        log("procfs: failed to allocate memory for open file\n", RED);
+        return NULL;
+    }
+
+    *open_file = file;
+    node->data_pointer = open_file;
     return node;
 }
 
 static int procfs_close(struct vfs_node* node) {
+    if (node && node->data_pointer) {
+        kfree(node->data_pointer, sizeof(struct procfs_file));
+        node->data_pointer = NULL;
+    }
     return 0;
 }
 
@@ -91,6 +189,22 @@ static int procfs_read(struct vfs_node* node, unsigned char* buf, unsigned long
         return 0;
     }
 
+    // generated files are rendered in full on every read
+    struct procfs_file* file = (struct procfs_file*) node->data_pointer;
+    if (file) {
+        char text[PROCFS_SHOW_MAX];
+        int len = file->show(file->pid, text, sizeof(text));
+        if (len < 0) {
+            return -1;
+        }
+
+        if ((unsigned long) len > size) {
+            len = (int) size;
+        }
+        flop_memcpy(buf, text, (size_t) len);
+        return len;
+    }
+
     size_t len = flopstrlen(node->name);
     if (len > size) {
         len = size;
@@ -100,7 +214,15 @@ static int procfs_read(struct vfs_node* node, unsigned char* buf, unsigned long
 }
 
 static int procfs_write(struct vfs_node* node, unsigned char* buf, unsigned long size) {
-    return -1;
+    if (!node || !buf || size == 0) {
+        return -1;
+    }
+
+    struct procfs_file* file = (struct procfs_file*) node->data_pointer;
+    if (!file || !file->store) {
+        return -1;
+    }
+    return file->store((const char*) buf, (size_t) size);
 }
 
 static void* procfs_mount(char* dev, char* path, int flags) {
@@ -199,6 +321,8 @@ void procfs_init() {
 
     procfs_add_entry("cpuinfo", VFS_FILE);
     procfs_add_entry("meminfo", VFS_FILE);
+    procfs_add_entry("zram", VFS_FILE);
+    procfs_add_entry("ksm", VFS_FILE);
 
     pfs.procfs_ops.open = procfs_open;
     pfs.procfs_ops.close = procfs_close;
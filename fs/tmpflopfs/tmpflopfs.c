@@ -27,6 +27,16 @@ static struct tmpfs_node* tmpfs_node_internal_create(const char* name, tmpfs_nod
     return node;
 }
 
+static void tmpfs_node_internal_free(struct tmpfs_node* node) {
+    for (uint32_t i = 0; i < node->page_count; i++) {
+        pmm_page_put((uintptr_t) node->pages[i]);
+    }
+    if (node->pages) {
+        kfree(node->pages, node->page_count * sizeof(void*));
+    }
+    kfree(node, sizeof(struct tmpfs_node));
+}
+
 static struct tmpfs_node* tmpfs_walk_path(struct tmpfs_node* root, const char* path) {
     if (!path || path[0] == '\0' || (path[0] == '/' && path[1] == '\0')) {
         return root;
@@ -157,6 +167,9 @@ int tmpfs_op_write(struct vfs_node* node, unsigned char* buffer, unsigned long s
         flop_memcpy((uint8_t*) t->pages[p_idx] + p_off, buffer + written, chunk);
         written += chunk;
         t->offset += chunk;
+
+        // a large write is page after page of copying, let a waiting thread in between pages
+        cond_resched();
     }
     if (t->offset > t->size) {
         t->size = t->offset;
@@ -181,8 +194,9 @@ int tmpfs_op_truncate(struct vfs_node* node, uint64_t length) {
     struct tmpfs_node* t = (struct tmpfs_node*) node->data_pointer;
     uint32_t needed = (length + PAGE_SIZE - 1) / PAGE_SIZE;
     if (needed < t->page_count) {
+        // frames still mapped somewhere stay alive until their last mapping goes
         for (uint32_t i = needed; i < t->page_count; i++) {
-            pmm_free_pages(t->pages[i], 0, 1);
+            pmm_page_put((uintptr_t) t->pages[i]);
         }
     }
     t->size = length;
@@ -272,13 +286,12 @@ int tmpfs_op_unlink(struct vfs_mountpoint* mp, char* name) {
             } else {
                 parent->children = curr->next_sibling;
             }
-            for (uint32_t i = 0; i < curr->page_count; i++) {
-                pmm_free_pages(curr->pages[i], 0, 1);
+            if (curr->map_refs) {
+                curr->unlinked = true;
+                curr->parent = NULL;
+                return 0;
             }
-            if (curr->pages) {
-                kfree(curr->pages, curr->page_count * sizeof(void*));
-            }
-            kfree(curr, sizeof(struct tmpfs_node));
+            tmpfs_node_internal_free(curr);
             return 0;
         }
         prev = curr;
@@ -308,6 +321,33 @@ int tmpfs_op_fstat(struct vfs_node* node, struct stat* st) {
     return 0;
 }
 
+// mappings use the file's own frames, so a mapped file costs no copy and no second set of pages
+void* tmpfs_op_mmap(struct vfs_node* node) {
+    struct tmpfs_node* t = (struct tmpfs_node*) node->data_pointer;
+    if (!t || t->type != TMPFS_NODE_FILE) {
+        return NULL;
+    }
+    t->map_refs++;
+    return t;
+}
+
+int tmpfs_op_get_page(void* mapping, uint32_t pgoff, uintptr_t* out_pa) {
+    struct tmpfs_node* t = (struct tmpfs_node*) mapping;
+    if (pgoff >= t->page_count || !t->pages[pgoff]) {
+        return -1;
+    }
+    *out_pa = (uintptr_t) t->pages[pgoff];
+    return 0;
+}
+
+void tmpfs_op_mmap_ref(void* mapping, int delta) {
+    struct tmpfs_node* t = (struct tmpfs_node*) mapping;
+    t->map_refs += delta;
+    if (!t->map_refs && t->unlinked) {
+        tmpfs_node_internal_free(t);
+    }
+}
+
 struct vfs_directory_list* tmpfs_op_listdir(struct vfs_mountpoint* mp, char* path) {
     struct tmpfs_node* root = (struct tmpfs_node*) mp->data_pointer;
     struct tmpfs_node* dir = tmpfs_walk_path(root, path);
@@ -355,5 +395,8 @@ void tmpfs_init() {
     tmpflopfs.op_table.rename = tmpfs_op_rename;
     tmpflopfs.op_table.fstat = tmpfs_op_fstat;
     tmpflopfs.op_table.listdir = tmpfs_op_listdir;
+    tmpflopfs.op_table.mmap = tmpfs_op_mmap;
+    tmpflopfs.op_table.get_page = tmpfs_op_get_page;
+    tmpflopfs.op_table.mmap_ref = tmpfs_op_mmap_ref;
     vfs_acknowledge_fs(&tmpflopfs);
 }
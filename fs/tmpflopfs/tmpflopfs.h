@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include "../vfs/vfs.h"
 
 typedef enum tmpfs_node_type {
@@ -26,6 +27,8 @@ struct tmpfs_node {
 
     void** pages;
     uint32_t page_count;
+    uint32_t map_refs; // vmas mapping the pages in place
+    bool unlinked;     // removed from its directory while still mapped, freed with the last mapping
 
     struct tmpfs_node* parent;
     struct tmpfs_node* children;
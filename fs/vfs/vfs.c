@@ -797,3 +797,23 @@ int vfs_getdents(struct vfs_node* node, linux_dirent_t* dirp, unsigned int count
     log("vfs_getdents: Filesystem type does not support getdents\n", RED);
     return -1;
 }
+
+// pin the pages of a file for mapping them in place; returns the filesystem's handle and op table,
+// or NULL when the filesystem can only be read into private copies
+void* vfs_mmap(struct vfs_node* node, struct vfs_op_tbl** out_ops) {
+    if (node == NULL || out_ops == NULL) {
+        log("vfs_mmap: node is NULL\n", RED);
+        return NULL;
+    }
+
+    struct vfs_op_tbl* ops = &node->mountpoint->filesystem->op_table;
+    if (ops->mmap == NULL || ops->get_page == NULL || ops->mmap_ref == NULL) {
+        return NULL;
+    }
+
+    void* mapping = ops->mmap(node);
+    if (mapping) {
+        *out_ops = ops;
+    }
+    return mapping;
+}
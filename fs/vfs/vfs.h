@@ -131,6 +131,11 @@ struct vfs_op_tbl {
     int (*ioctl)(struct vfs_node* node, unsigned long cmd, unsigned long arg);
     int (*link)(struct vfs_mountpoint*, char*, char*);
     int (*getdents)(struct vfs_node*, linux_dirent_t*, unsigned int);
+    // page cache access for mmap: mmap pins the file's pages and returns a handle to them,
+    // get_page looks up the frame holding page pgoff, mmap_ref adds or drops handle references
+    void* (*mmap)(struct vfs_node*);
+    int (*get_page)(void* mapping, uint32_t pgoff, uintptr_t* out_pa);
+    void (*mmap_ref)(void* mapping, int delta);
 };
 
 struct vfs_fs {
@@ -166,5 +171,6 @@ int vfs_rename(char* oldpath, char* newpath);
 struct vfs_directory_list* vfs_readdir_path(char* path);
 int vfs_ioctl(struct vfs_node* node, unsigned long cmd, unsigned long arg);
 int vfs_getdents(struct vfs_node* node, struct linux_dirent* dirp, unsigned int count);
+void* vfs_mmap(struct vfs_node* node, struct vfs_op_tbl** out_ops);
 
 #endif
@@ -16,6 +16,7 @@ You should have received a copy of the GNU General Public License along with The
             allows you to run certain stages or without for debugging
 */
 #include "../task/sched.h"
+#include "../task/smp.h"
 #include "../drivers/io/io.h"
 #include "../drivers/keyboard/keyboard.h"
 #include "../drivers/ata/ata.h"
@@ -27,6 +28,10 @@ You should have received a copy of the GNU General Public License along with The
 #include <stdbool.h>
 #include <stddef.h>
 #include "../mem/vmm.h"
+#include "../mem/vma.h"
+#include "../mem/swap.h"
+#include "../mem/zram.h"
+#include "../mem/ksm.h"
 #include "../mem/pmm.h"
 #include "../mem/early.h"
 #include "../mem/gdt.h"
@@ -79,7 +84,10 @@ void init_stage_mem(multiboot_info_t* mb_info) {
     pmm_init(mb_info);
     paging_init();
     vmm_init();
+    vma_init();
     heap_init();
+    zram_init();
+    swap_init();
     kmalloc_memtest();
     log("init: mem stage init - ok\n", LIGHT_GRAY);
 }
@@ -93,6 +101,11 @@ void init_stage_middle() {
 void init_stage_task(void) {
     log("init: initializing task stage\n", LIGHT_GRAY);
     sched_init();
+    timer_subsystem_init();
+    smp_init();
+    vma_prefetch_init();
+    ksm_init();
+    vmm_pager_init();
     proc_init();
     log("init: task stage init - ok\n", LIGHT_GRAY);
 }
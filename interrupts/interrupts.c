@@ -13,9 +13,12 @@ You should have received a copy of the GNU General Public License along with The
 */
 #include "interrupts.h"
 #include "../task/sched.h"
+#include "../task/softirq.h"
+#include "../task/tick.h"
 #include "../drivers/io/io.h"
 #include "../drivers/vga/vgahandler.h"
 #include "../drivers/keyboard/keyboard.h"
+#include "../drivers/apic/lapic.h"
 #include "../lib/logging.h"
 #include <stdint.h>
 #include <stdbool.h>
@@ -23,6 +26,7 @@ You should have received a copy of the GNU General Public License along with The
 #include "../mem/vmm.h"
 #include "../mem/pmm.h"
 #include "../mem/paging.h"
+#include "../mem/vma.h"
 #include "../mem/utils.h"
 #include "../kernel/kernel.h"
 
@@ -46,6 +50,31 @@ extern void* isr_stub_table[256];
 
 extern int c_syscall_routine(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5);
 
+// hardware irq handlers run with preemption off and first catch the tick count up if the tick was stopped;
+// on the way out the softirqs they raised run, the tick is stopped or restarted for what is now runnable, and
+// whatever they interrupted, user or kernel, is switched out if a reschedule is pending and it holds no locks
+static inline void isr_irq_enter(bool timer) {
+    preempt_disable();
+    tick_irq_enter(timer);
+}
+
+static inline void isr_irq_exit(void) {
+    softirq_run();
+    tick_nohz_update();
+    preempt_enable_no_resched();
+    if (!preempt_count) {
+        sched_preempt();
+    }
+}
+
+// a syscall runs in the calling thread's context and is preempted like any other kernel code, this catches
+// what it left pending on the way back to user mode
+static inline void isr_preempt_user(int_frame_t* frame) {
+    if ((frame->cs & 3) == 3) {
+        sched_preempt();
+    }
+}
+
 void isr_dispatch(int_frame_t* frame) {
     switch (frame->int_no) {
         case INT_TYPE_DIVIDE_BY_ZERO:
@@ -58,19 +87,39 @@ void isr_dispatch(int_frame_t* frame) {
             log("isr13: GPF\n", RED);
             break;
         case INT_TYPE_PAGE_FAULT: {
+            // faults inside a vma are demand paging or cow, anything else is a real fault
+            if (vma_handle_fault(IA32_READ_CR2(), frame->err_code) == 0) {
+                return;
+            }
             PAGE_FAULT_HANDLER();
             break;
         }
         case INT_TYPE_PIT:
-            global_tick_count++;
+            isr_irq_enter(true);
             pic_eoi(0);
+            isr_irq_exit();
             return;
         case INT_TYPE_KEYBOARD:
+            isr_irq_enter(false);
             keyboard_handler();
             pic_eoi(1);
+            isr_irq_exit();
+            return;
+        case INT_TYPE_RESCHED:
+            // the sender already set need_resched, the irq exit path does the rest
+            isr_irq_enter(false);
+            lapic_eoi();
+            isr_irq_exit();
+            return;
+        case INT_TYPE_TLB_SHOOTDOWN:
+            isr_irq_enter(false);
+            vmm_tlb_serve();
+            lapic_eoi();
+            isr_irq_exit();
             return;
         case INT_TYPE_SYSCALL: {
             SYSCALL_ISR_DISPATCH(frame);
+            isr_preempt_user(frame);
             return;
         }
         default:
@@ -134,21 +183,39 @@ static void pic_init() {
     log("pic: init - ok\n", GREEN);
 }
 
-// timer initialization
-static void pit_init() {
-    // set divisor
-    uint16_t divisor = PIT_BASE_FREQUENCY / PIT_FREQUENCY;
-
+static void pit_load(uint8_t command, uint16_t counts) {
     // tell pit we are configuring channel 0
-    // in square wave mode
-    outb(PIT_COMMAND_PORT, PIT_COMMAND_MODE);
+    outb(PIT_COMMAND_PORT, command);
 
     // load divisor
+    // low byte
+    outb(PIT_CHANNEL0_PORT, counts & PIT_DIVISOR_LSB_MASK);
+
     // high byte
-    outb(PIT_CHANNEL0_PORT, divisor & PIT_DIVISOR_LSB_MASK);
+    outb(PIT_CHANNEL0_PORT, (counts >> PIT_DIVISOR_MSB_SHIFT) & PIT_DIVISOR_LSB_MASK);
+}
 
-    // low byte
-    outb(PIT_CHANNEL0_PORT, (divisor >> PIT_DIVISOR_MSB_SHIFT) & PIT_DIVISOR_LSB_MASK);
+// fire every tick
+void pit_set_periodic(void) {
+    pit_load(PIT_COMMAND_PERIODIC, PIT_TICK_COUNTS);
+}
+
+// fire once after counts input clocks, then stay quiet until reprogrammed
+void pit_set_oneshot(uint16_t counts) {
+    pit_load(PIT_COMMAND_ONESHOT, counts);
+}
+
+// input clocks left before channel 0 next fires
+uint16_t pit_read_count(void) {
+    outb(PIT_COMMAND_PORT, PIT_COMMAND_LATCH);
+    uint16_t lo = inb(PIT_CHANNEL0_PORT);
+    uint16_t hi = inb(PIT_CHANNEL0_PORT);
+    return (uint16_t) ((hi << PIT_DIVISOR_MSB_SHIFT) | lo);
+}
+
+// timer initialization
+static void pit_init() {
+    pit_set_periodic();
 
     // timer is initialized
     log("pit: init - ok\n", GREEN);
@@ -161,6 +228,11 @@ static void idt_set_stubs() {
     }
 }
 
+// every cpu shares the one table
+void idt_load(void) {
+    __asm__ volatile("lidt %0" ::"m"(idtp));
+}
+
 static void idt_init() {
     // set limit to sizeof idt minus one
     idtp.limit = sizeof(idt) - 1;
@@ -170,8 +242,7 @@ static void idt_init() {
 
     idt_set_stubs();
 
-    // load the interrupt descriptor table
-    __asm__ volatile("lidt %0" ::"m"(idtp));
+    idt_load();
 
     // unmask interrupts
     IA32_INT_UNMASK();
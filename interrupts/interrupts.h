@@ -68,6 +68,10 @@ typedef enum int_type {
     INT_TYPE_PIT = 32,
     INT_TYPE_KEYBOARD = 33,
     INT_TYPE_SYSCALL = 80,
+    // sent between cpus through the local apic to make one reach a preemption point
+    INT_TYPE_RESCHED = 0xF0,
+    // asks a cpu to drop tlb entries another one changed, see vmm_tlb_serve
+    INT_TYPE_TLB_SHOOTDOWN = 0xF1,
 } int_type_t;
 
 #define PIC_EOI 0x20
@@ -76,7 +80,13 @@ typedef enum int_type {
 #define PIT_CHANNEL0_PORT 0x40
 #define PIT_BASE_FREQUENCY 1193182
 
-#define PIT_COMMAND_MODE 0x36
+// channel 0, low then high byte; mode 2 rate generator counts down linearly so it can be read back mid tick,
+// mode 0 fires once when the count runs out
+#define PIT_COMMAND_PERIODIC 0x34
+#define PIT_COMMAND_ONESHOT 0x30
+#define PIT_COMMAND_LATCH 0x00
+// input clocks per tick
+#define PIT_TICK_COUNTS (PIT_BASE_FREQUENCY / PIT_FREQUENCY)
 #define PIT_CHANNEL0 0x40
 #define PIT_DIVISOR_LSB_MASK 0xFF
 #define PIT_DIVISOR_MSB_SHIFT 8
@@ -87,6 +97,7 @@ typedef enum int_type {
 #define IDT_FLAGS 0x8E
 
 void interrupts_init(void);
+void idt_load(void);
 
 #define IA32_INT_MASK() __asm__ volatile("cli" ::: "memory")
 
@@ -94,6 +105,9 @@ void interrupts_init(void);
 
 #define IA32_CPU_RELAX() __asm__ volatile("pause" : : : "memory")
 
+// sti only takes effect after the next instruction, so no interrupt can slip in between and be slept through
+#define IA32_CPU_IDLE() __asm__ volatile("sti\n\thlt" ::: "memory")
+
 // this is dogshit (but the only way to do it)
 // :^)
 #define IA32_INT_ENABLED()                                                                                             \
@@ -105,6 +119,13 @@ void interrupts_init(void);
         (eflags & (1 << 9)) != 0;                                                                                      \
     })
 
+#define IA32_READ_CR2()                                                                                                \
+    ({                                                                                                                 \
+        uint32_t fault_va;                                                                                             \
+        __asm__ volatile("mov %%cr2, %0" : "=r"(fault_va));                                                            \
+        fault_va;                                                                                                      \
+    })
+
 #define PAGE_FAULT_HANDLER()                                                                                           \
     uint32_t cr2;                                                                                                      \
     __asm__ volatile("mov %%cr2, %0" : "=r"(cr2));                                                                     \
@@ -112,4 +133,8 @@ void interrupts_init(void);
     log_uint("CR2: ", cr2);                                                                                            \
     log_uint("err code: ", frame->err_code);
 extern uint32_t global_tick_count;
+
+void pit_set_periodic(void);
+void pit_set_oneshot(uint16_t counts);
+uint16_t pit_read_count(void);
 #endif // INTERRUPTS_H
@@ -2,6 +2,8 @@ BITS 32
 SECTION .text
 
 extern isr_dispatch
+
+GDT_PERCPU_SELECTOR equ 0x30
 global isr_stub_table
 
 isr_common:
@@ -21,6 +23,9 @@ isr_common:
     mov ds, ax
     mov es, ax
     mov fs, ax
+
+    ; gs holds the cpu's own data, the selector is the same on every cpu but each has its own gdt
+    mov ax, GDT_PERCPU_SELECTOR
     mov gs, ax
 
     ; argument is pointer to int frame
@@ -0,0 +1,196 @@
+/*
+
+Copyright 2024-2026 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of The Flopperating System.
+
+The Flopperating System is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+The Flopperating System is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with The Flopperating System. If not, see <https://www.gnu.org/licenses/>.
+
+[DESCRIPTION] - lz4 block format compressor and decompressor
+
+*/
+#include "lz4.h"
+#include "../mem/utils.h"
+
+#define LZ4_MIN_MATCH 4
+// the last match has to start this far from the end, and the last bytes are always literals
+#define LZ4_MF_LIMIT 12
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MAX_OFFSET 65535
+
+static inline uint32_t lz4_read32(const uint8_t* p) {
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline uint32_t lz4_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+// write the 255 run that extends a length nibble of 15
+static uint8_t* lz4_put_length(uint8_t* op, size_t len) {
+    for (; len >= 255; len -= 255) {
+        *op++ = 255;
+    }
+    *op++ = (uint8_t) len;
+    return op;
+}
+
+// emit literals followed by a match; a zero offset emits the literals alone and ends the block
+static uint8_t* lz4_put_sequence(
+    uint8_t* op, uint8_t* oend, const uint8_t* lit, size_t lit_len, uint16_t offset, size_t match_len) {
+    // worst case for the token, both length runs, the literals and the offset
+    size_t need = 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1;
+    if ((size_t) (oend - op) < need) {
+        return NULL;
+    }
+
+    uint8_t* token = op++;
+    *token = (uint8_t) ((lit_len < 15 ? lit_len : 15) << 4);
+    if (lit_len >= 15) {
+        op = lz4_put_length(op, lit_len - 15);
+    }
+
+    flop_memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    if (!offset) {
+        return op;
+    }
+
+    *op++ = (uint8_t) offset;
+    *op++ = (uint8_t) (offset >> 8);
+
+    *token |= (uint8_t) (match_len < 15 ? match_len : 15);
+    if (match_len >= 15) {
+        op = lz4_put_length(op, match_len - 15);
+    }
+    return op;
+}
+
+int lz4_compress(const uint8_t* src, size_t len, uint8_t* dst, size_t cap, uint16_t* table) {
+    if (!src || !dst || !table || len > LZ4_MAX_OFFSET + 1) {
+        return -1;
+    }
+
+    flop_memset(table, 0, LZ4_TABLE_ENTRIES * sizeof(uint16_t));
+
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    const uint8_t* end = src + len;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + cap;
+
+    if (len >= LZ4_MF_LIMIT) {
+        const uint8_t* mf_limit = end - LZ4_MF_LIMIT;
+        const uint8_t* match_limit = end - LZ4_LAST_LITERALS;
+
+        while (ip < mf_limit) {
+            uint32_t seq = lz4_read32(ip);
+            uint32_t h = lz4_hash(seq);
+            const uint8_t* ref = src + table[h];
+            table[h] = (uint16_t) (ip - src);
+
+            // the table starts zeroed, so the candidate is checked byte for byte
+            if (ref >= ip || lz4_read32(ref) != seq) {
+                ip++;
+                continue;
+            }
+
+            const uint8_t* mp = ip + LZ4_MIN_MATCH;
+            const uint8_t* rp = ref + LZ4_MIN_MATCH;
+            while (mp < match_limit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+
+            op = lz4_put_sequence(
+                op, oend, anchor, (size_t) (ip - anchor), (uint16_t) (ip - ref), (size_t) (mp - ip - LZ4_MIN_MATCH));
+            if (!op) {
+                return -1;
+            }
+
+            ip = mp;
+            anchor = ip;
+        }
+    }
+
+    op = lz4_put_sequence(op, oend, anchor, (size_t) (end - anchor), 0, 0);
+    return op ? (int) (op - dst) : -1;
+}
+
+// finish a length whose nibble was 15; returns 0 if the run walks off the block
+static size_t lz4_get_length(const uint8_t** ip, const uint8_t* iend, size_t len) {
+    uint8_t b;
+    do {
+        if (*ip >= iend) {
+            return 0;
+        }
+        b = *(*ip)++;
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+int lz4_decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t cap) {
+    if (!src || !dst) {
+        return -1;
+    }
+
+    const uint8_t* ip = src;
+    const uint8_t* iend = src + len;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !(lit_len = lz4_get_length(&ip, iend, lit_len))) {
+            return -1;
+        }
+
+        if ((size_t) (iend - ip) < lit_len || (size_t) (oend - op) < lit_len) {
+            return -1;
+        }
+        flop_memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        // the last sequence is literals only
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = (size_t) ip[0] | ((size_t) ip[1] << 8);
+        ip += 2;
+        if (!offset || offset > (size_t) (op - dst)) {
+            return -1;
+        }
+
+        size_t match_len = token & 15;
+        if (match_len == 15 && !(match_len = lz4_get_length(&ip, iend, match_len))) {
+            return -1;
+        }
+        match_len += LZ4_MIN_MATCH;
+
+        if ((size_t) (oend - op) < match_len) {
+            return -1;
+        }
+
+        // byte by byte, a match may overlap the bytes it produces
+        const uint8_t* ref = op - offset;
+        for (size_t i = 0; i < match_len; i++) {
+            op[i] = ref[i];
+        }
+        op += match_len;
+    }
+
+    return (int) (op - dst);
+}
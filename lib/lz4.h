@@ -0,0 +1,18 @@
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// hash table the compressor needs, passed in so it never lands on a small interrupt stack
+#define LZ4_HASH_BITS 12
+#define LZ4_TABLE_ENTRIES (1 << LZ4_HASH_BITS)
+
+// compress src into an lz4 block; returns the compressed size, or -1 if it would not fit in cap bytes
+// src may be at most 64 KiB, table must hold LZ4_TABLE_ENTRIES entries
+int lz4_compress(const uint8_t* src, size_t len, uint8_t* dst, size_t cap, uint16_t* table);
+
+// expand an lz4 block; returns the decompressed size, or -1 for a malformed block or one larger than cap
+int lz4_decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t cap);
+
+#endif // LZ4_H
@@ -0,0 +1,266 @@
+/*
+
+Copyright 2024-2026 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of The Flopperating System.
+
+The Flopperating System is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+The Flopperating System is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with The Flopperating System. If not, see <https://www.gnu.org/licenses/>.
+
+[DESCRIPTION] - intrusive red-black tree with a cached leftmost node
+
+*/
+#include "rbtree.h"
+
+// put new where old hangs off its parent
+static void rb_internal_replace(rb_root_t* root, rb_node_t* old, rb_node_t* new) {
+    rb_node_t* parent = old->parent;
+    if (!parent) {
+        root->node = new;
+    } else if (parent->left == old) {
+        parent->left = new;
+    } else {
+        parent->right = new;
+    }
+    if (new) {
+        new->parent = parent;
+    }
+}
+
+static void rb_internal_rotate_left(rb_root_t* root, rb_node_t* x) {
+    rb_node_t* y = x->right;
+    x->right = y->left;
+    if (y->left) {
+        y->left->parent = x;
+    }
+    rb_internal_replace(root, x, y);
+    y->left = x;
+    x->parent = y;
+}
+
+static void rb_internal_rotate_right(rb_root_t* root, rb_node_t* x) {
+    rb_node_t* y = x->left;
+    x->left = y->right;
+    if (y->right) {
+        y->right->parent = x;
+    }
+    rb_internal_replace(root, x, y);
+    y->right = x;
+    x->parent = y;
+}
+
+static inline bool rb_internal_is_red(const rb_node_t* node) {
+    return node && node->red;
+}
+
+void rb_insert(rb_root_t* root, rb_node_t* node, rb_less_t less) {
+    rb_node_t* parent = NULL;
+    rb_node_t** link = &root->node;
+    bool leftmost = true;
+
+    while (*link) {
+        parent = *link;
+        if (less(node, parent)) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+            leftmost = false;
+        }
+    }
+
+    node->parent = parent;
+    node->left = NULL;
+    node->right = NULL;
+    node->red = true;
+    *link = node;
+    if (leftmost) {
+        root->leftmost = node;
+    }
+
+    // a red node under a red parent is pushed up by recolouring, or rotated away
+    while ((parent = node->parent) && parent->red) {
+        rb_node_t* gparent = parent->parent;
+
+        if (parent == gparent->left) {
+            rb_node_t* uncle = gparent->right;
+            if (rb_internal_is_red(uncle)) {
+                parent->red = false;
+                uncle->red = false;
+                gparent->red = true;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->right) {
+                rb_internal_rotate_left(root, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->red = false;
+            gparent->red = true;
+            rb_internal_rotate_right(root, gparent);
+        } else {
+            rb_node_t* uncle = gparent->left;
+            if (rb_internal_is_red(uncle)) {
+                parent->red = false;
+                uncle->red = false;
+                gparent->red = true;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->left) {
+                rb_internal_rotate_right(root, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->red = false;
+            gparent->red = true;
+            rb_internal_rotate_left(root, gparent);
+        }
+    }
+    root->node->red = false;
+}
+
+// x took the place of a removed black node and is one black short; x may be NULL, so its parent is passed
+static void rb_internal_erase_fixup(rb_root_t* root, rb_node_t* x, rb_node_t* parent) {
+    while (x != root->node && !rb_internal_is_red(x)) {
+        if (x == parent->left) {
+            rb_node_t* w = parent->right;
+            if (w->red) {
+                w->red = false;
+                parent->red = true;
+                rb_internal_rotate_left(root, parent);
+                w = parent->right;
+            }
+            if (!rb_internal_is_red(w->left) && !rb_internal_is_red(w->right)) {
+                w->red = true;
+                x = parent;
+                parent = x->parent;
+                continue;
+            }
+            if (!rb_internal_is_red(w->right)) {
+                w->left->red = false;
+                w->red = true;
+                rb_internal_rotate_right(root, w);
+                w = parent->right;
+            }
+            w->red = parent->red;
+            parent->red = false;
+            w->right->red = false;
+            rb_internal_rotate_left(root, parent);
+        } else {
+            rb_node_t* w = parent->left;
+            if (w->red) {
+                w->red = false;
+                parent->red = true;
+                rb_internal_rotate_right(root, parent);
+                w = parent->left;
+            }
+            if (!rb_internal_is_red(w->left) && !rb_internal_is_red(w->right)) {
+                w->red = true;
+                x = parent;
+                parent = x->parent;
+                continue;
+            }
+            if (!rb_internal_is_red(w->left)) {
+                w->right->red = false;
+                w->red = true;
+                rb_internal_rotate_left(root, w);
+                w = parent->left;
+            }
+            w->red = parent->red;
+            parent->red = false;
+            w->left->red = false;
+            rb_internal_rotate_right(root, parent);
+        }
+        x = root->node;
+    }
+    if (x) {
+        x->red = false;
+    }
+}
+
+void rb_erase(rb_root_t* root, rb_node_t* node) {
+    if (root->leftmost == node) {
+        root->leftmost = rb_next(node);
+    }
+
+    rb_node_t* child;
+    rb_node_t* parent;
+    bool red;
+
+    if (!node->left || !node->right) {
+        child = node->left ? node->left : node->right;
+        parent = node->parent;
+        red = node->red;
+        rb_internal_replace(root, node, child);
+    } else {
+        // two children, the successor takes the node's place and colour
+        rb_node_t* succ = node->right;
+        while (succ->left) {
+            succ = succ->left;
+        }
+
+        red = succ->red;
+        child = succ->right;
+        if (succ->parent == node) {
+            parent = succ;
+        } else {
+            parent = succ->parent;
+            rb_internal_replace(root, succ, child);
+            succ->right = node->right;
+            succ->right->parent = succ;
+        }
+
+        rb_internal_replace(root, node, succ);
+        succ->left = node->left;
+        succ->left->parent = succ;
+        succ->red = node->red;
+    }
+
+    if (!red) {
+        rb_internal_erase_fixup(root, child, parent);
+    }
+}
+
+rb_node_t* rb_next(const rb_node_t* node) {
+    if (node->right) {
+        node = node->right;
+        while (node->left) {
+            node = node->left;
+        }
+        return (rb_node_t*) node;
+    }
+
+    rb_node_t* parent;
+    while ((parent = node->parent) && node == parent->right) {
+        node = parent;
+    }
+    return parent;
+}
+
+rb_node_t* rb_prev(const rb_node_t* node) {
+    if (node->left) {
+        node = node->left;
+        while (node->right) {
+            node = node->right;
+        }
+        return (rb_node_t*) node;
+    }
+
+    rb_node_t* parent;
+    while ((parent = node->parent) && node == parent->left) {
+        node = parent;
+    }
+    return parent;
+}
+
+rb_node_t* rb_last(const rb_root_t* root) {
+    rb_node_t* node = root->node;
+    while (node && node->right) {
+        node = node->right;
+    }
+    return node;
+}
@@ -0,0 +1,36 @@
+#ifndef RBTREE_H
+#define RBTREE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// an intrusive red-black tree; the node sits inside whatever is being ordered and rb_entry gets back out
+typedef struct rb_node {
+    struct rb_node* parent;
+    struct rb_node* left;
+    struct rb_node* right;
+    bool red;
+} rb_node_t;
+
+typedef struct rb_root {
+    rb_node_t* node;
+    rb_node_t* leftmost; // kept up to date, the smallest node is what most users want
+} rb_root_t;
+
+// strict ordering, equal nodes go to the right of the ones already there
+typedef bool (*rb_less_t)(const rb_node_t* a, const rb_node_t* b);
+
+#define rb_entry(ptr, type, member) ((type*) ((char*) (ptr) - offsetof(type, member)))
+
+void rb_insert(rb_root_t* root, rb_node_t* node, rb_less_t less);
+void rb_erase(rb_root_t* root, rb_node_t* node);
+rb_node_t* rb_next(const rb_node_t* node);
+rb_node_t* rb_prev(const rb_node_t* node);
+rb_node_t* rb_last(const rb_root_t* root);
+
+static inline rb_node_t* rb_first(const rb_root_t* root) {
+    return root->leftmost;
+}
+
+#endif // RBTREE_H
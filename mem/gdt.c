@@ -13,22 +13,23 @@ You should have received a copy of the GNU General Public License along with The
 */
 #include <stdint.h>
 #include "gdt.h"
+#include "utils.h"
 #include "../task/tss.h"
+#include "../task/percpu.h"
 #include "../lib/logging.h"
 
-static uint64_t our_gdt[] = {
+// every cpu starts from a copy of this and fills in its own tss and per cpu segment
+static const uint64_t gdt_template[GDT_ENTRIES] = {
     0x0000000000000000ULL,
     0x00CF9A000000FFFFULL,
     0x00CF92000000FFFFULL,
     0x00CFFA000000FFFFULL,
     0x00CFF2000000FFFFULL,
-    0x0000000000000000ULL // tss (garbage for now)
+    0x0000000000000000ULL, // tss
+    0x0000000000000000ULL  // per cpu data
 };
 
-static const gdtr_t gdt_reg = {sizeof(our_gdt) - 1, (uint32_t) our_gdt};
-
-// only used for tss, rest is done statically
-void gdt_set_gate(int idx, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran) {
+void gdt_set_gate(uint64_t* gdt, int idx, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran) {
     uint64_t desc = 0;
 
     desc |= (limit & 0xFFFFULL);
@@ -38,27 +39,42 @@ void gdt_set_gate(int idx, uint32_t base, uint32_t limit, uint8_t access, uint8_
     desc |= ((uint64_t) (gran & 0xF0) << 48);
     desc |= ((uint64_t) (base >> 24) & 0xFF) << 56;
 
-    our_gdt[idx] = desc;
+    gdt[idx] = desc;
 }
 
-void flush_gdt() {
+// load the table and reload every segment register, %gs with the cpu's own data
+static void flush_gdt(const gdtr_t* reg) {
     __asm__ volatile("lgdt %0\n"
                      "mov $0x10, %%ax\n"
                      "mov %%ax, %%ds\n"
                      "mov %%ax, %%es\n"
                      "mov %%ax, %%fs\n"
-                     "mov %%ax, %%gs\n"
                      "mov %%ax, %%ss\n"
-                     "jmp $0x08, $.flush\n"
-                     ".flush:\n"
+                     "mov %1, %%ax\n"
+                     "mov %%ax, %%gs\n"
+                     "jmp $0x08, $1f\n"
+                     "1:\n"
                      :
-                     : "m"(gdt_reg)
-                     : "eax");
+                     : "m"(*reg), "i"(GDT_PERCPU_SELECTOR)
+                     : "eax", "memory");
+}
+
+// give a cpu its own gdt, tss and per cpu segment; runs on the cpu itself
+void gdt_cpu_init(cpu_t* cpu) {
+    flop_memcpy(cpu->gdt, gdt_template, sizeof(gdt_template));
+    cpu->self = cpu;
+
+    // present, ring 0, writable data, byte granular
+    gdt_set_gate(cpu->gdt, GDT_PERCPU_INDEX, (uint32_t) cpu, sizeof(cpu_t) - 1, 0x92, 0x40);
+
+    gdtr_t reg = {sizeof(cpu->gdt) - 1, (uint32_t) cpu->gdt};
+    flush_gdt(&reg);
+
+    tss_init(cpu, GDT_TSS_INDEX, 0x10, 0x0);
 }
 
 void gdt_init() {
-    flush_gdt();
-    tss_init(3, 0x10, 0x0);
+    gdt_cpu_init(&smp_cpus[0]);
 
     log("gdt: init - ok\n", GREEN);
 }
@@ -3,12 +3,21 @@
 
 #include <stdint.h>
 
+// null, kernel code, kernel data, user code, user data, the cpu's tss and its per cpu data segment
+#define GDT_ENTRIES 7
+#define GDT_TSS_INDEX 5
+#define GDT_PERCPU_INDEX 6
+#define GDT_PERCPU_SELECTOR (GDT_PERCPU_INDEX * 8)
+
 typedef struct __attribute__((packed)) {
     uint16_t limit;
     uint32_t base;
 } gdtr_t;
 
+struct cpu;
+
 void gdt_init(void);
-void gdt_set_gate(int idx, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran);
+void gdt_cpu_init(struct cpu* cpu);
+void gdt_set_gate(uint64_t* gdt, int idx, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran);
 
 #endif
@@ -0,0 +1,613 @@
+/*
+
+Copyright 2024-2026 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of The Flopperating System.
+
+The Flopperating System is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+The Flopperating System is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with The Flopperating System. If not, see <https://www.gnu.org/licenses/>.
+
+[DESCRIPTION] - merging identical anonymous pages into shared copy on write frames
+
+*/
+#include <stdint.h>
+#include "ksm.h"
+#include "vma.h"
+#include "rmap.h"
+#include "vmm.h"
+#include "pmm.h"
+#include "alloc.h"
+#include "paging.h"
+#include "utils.h"
+#include "../task/sched.h"
+#include "../task/sync/spinlock.h"
+#include "../task/sync/rwsem.h"
+#include "../lib/str.h"
+#include "../lib/logging.h"
+
+// a merged frame; ksm holds a reference of its own, so page->refs is the number of ptes mapping it
+typedef struct ksm_stable {
+    struct ksm_stable* next;
+    uint32_t hash;
+    uintptr_t frame;
+} ksm_stable_t;
+
+// a page seen in this scan that has no twin yet; only a hint, checked again before it is merged
+typedef struct ksm_unstable {
+    struct ksm_unstable* next;
+    uint32_t hash;
+    vmm_region_t* region;
+    uintptr_t va;
+} ksm_unstable_t;
+
+static ksm_stable_t* ksm_stable[KSM_HASH_BUCKETS];
+static ksm_unstable_t* ksm_unstable[KSM_HASH_BUCKETS];
+static ksm_tunables_t ksm_tunables = {
+    .run = 1,
+    .pages_to_scan = KSM_DEFAULT_PAGES_TO_SCAN,
+    .sleep_ms = KSM_DEFAULT_SLEEP_MS,
+    .max_page_sharing = KSM_DEFAULT_MAX_PAGE_SHARING,
+};
+static ksm_stats_t ksm_stats;
+// the tunables and the scanner's sleep; the merge tables, the scan cursor and the stats are under ksm_scan_sem,
+// which a batch holds for writing across all its hashing, compares and shootdowns
+static spinlock_t ksm_lock = SPINLOCK_INIT;
+static rwsem_t ksm_scan_sem;
+// the sharing cap the running batch goes by, taken from the tunables when it starts
+static uint32_t ksm_max_sharing = KSM_DEFAULT_MAX_PAGE_SHARING;
+
+static thread_t* ksm_thread = NULL;
+static bool ksm_waiting = false;
+
+// where the next batch picks up, NULL starts a new full scan at the first region
+static vmm_region_t* ksm_scan_region = NULL;
+static uintptr_t ksm_scan_va = 0;
+
+static uint32_t ksm_internal_hash(uintptr_t frame) {
+    const uint32_t* words = (const uint32_t*) frame;
+    uint32_t hash = 2166136261U;
+    for (uint32_t i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+        hash = (hash ^ words[i]) * 16777619U;
+    }
+    return hash;
+}
+
+// the pte of va in a region whose directory may not be loaded
+static uint32_t ksm_internal_pte(vmm_region_t* region, uintptr_t va) {
+    uint32_t* saved = read_pd();
+    load_pd(region->pg_dir);
+    uint32_t pte = vmm_get_pte(region, va);
+    load_pd(saved);
+    return pte;
+}
+
+// only private anonymous frames that no other pte maps are candidates, the same ones swap may take
+static bool ksm_internal_eligible(uint32_t pte) {
+    if (!(pte & PAGE_PRESENT) || (pte & (PAGE_COW | PAGE_SHARED | PAGE_FILE))) {
+        return false;
+    }
+
+    if ((pte & PAGE_MASK) == vma_zero_page()) {
+        return false;
+    }
+
+    struct page* page = phys_to_page_index(pte & PAGE_MASK);
+    return page && !page->refs;
+}
+
+// a page held still while it is compared: its table locked and its pte write protected and flushed from every tlb,
+// so no cpu can store to the frame until the pte is given its access back or pointed at a merged frame
+typedef struct ksm_pin {
+    vmm_region_t* region;
+    uintptr_t va;
+    uint32_t pte;
+    bool locked; // false when the table lock was already taken for the other page of a pair
+    bool r;
+} ksm_pin_t;
+
+// pin va if its pte still maps the frame it did when it was looked at; the region's directory has to be loaded
+static bool ksm_internal_pin(ksm_pin_t* pin, vmm_region_t* region, uintptr_t va, uint32_t pte, bool locked) {
+    pin->region = region;
+    pin->va = va;
+    pin->pte = pte;
+    pin->locked = !locked;
+    if (pin->locked && !vmm_pt_trylock(region, va, &pin->r)) {
+        return false;
+    }
+
+    // the page may have been swapped out or remapped since it was looked at
+    uint32_t keep = PAGE_MASK | PAGE_PRESENT | PAGE_RW;
+    if ((vmm_get_pte(region, va) & keep) != (pte & keep) || vmm_protect(region, va, pte & 0xFFF & ~PAGE_RW) < 0) {
+        if (pin->locked) {
+            vmm_pt_unlock(region, va, pin->r);
+        }
+        return false;
+    }
+    return true;
+}
+
+// point a pinned page at frame read-only with copy on write, keeping the rest of its flags
+static int ksm_internal_share(ksm_pin_t* pin, uintptr_t frame) {
+    uint32_t flags = (pin->pte & 0xFFF & ~(PAGE_PRESENT | PAGE_RW | PAGE_DIRTY)) | PAGE_COW;
+
+    pmm_page_get(frame);
+    if (vmm_map(pin->region, pin->va, frame, flags) < 0) {
+        pmm_page_put(frame);
+        return -1;
+    }
+    return 0;
+}
+
+// let go of a pinned page, handing its write access back unless it was merged; the region's directory has to be
+// loaded
+static void ksm_internal_unpin(ksm_pin_t* pin, bool merged) {
+    if (!merged) {
+        vmm_protect(pin->region, pin->va, vmm_get_flags(pin->region, pin->va) | (pin->pte & PAGE_RW));
+    }
+    if (pin->locked) {
+        vmm_pt_unlock(pin->region, pin->va, pin->r);
+    }
+}
+
+// move the page at va of vma onto a merged frame and free the frame it had; the hash match that found the merged
+// frame was made while the page could still be written, so it is compared again once pinned
+static bool ksm_internal_merge(vmm_vma_t* vma, uintptr_t va, uint32_t pte, uintptr_t frame) {
+    ksm_pin_t pin;
+    if (!ksm_internal_pin(&pin, vma->region, va, pte, false)) {
+        return false;
+    }
+
+    bool merged = flop_memcmp((void*) frame, (void*) (pte & PAGE_MASK), PAGE_SIZE) == 0 &&
+                  ksm_internal_share(&pin, frame) == 0;
+    ksm_internal_unpin(&pin, merged);
+    if (!merged) {
+        return false;
+    }
+
+    rmap_chain_add(frame, vma, va);
+    pmm_free_page((void*) (pte & PAGE_MASK));
+    ksm_stats.merged++;
+    return true;
+}
+
+static ksm_stable_t* ksm_internal_find_stable(uint32_t hash, uintptr_t frame) {
+    for (ksm_stable_t* node = ksm_stable[hash % KSM_HASH_BUCKETS]; node; node = node->next) {
+        if (node->hash != hash) {
+            continue;
+        }
+
+        // a frame that reached the cap keeps its sharers, the page starts a new copy instead
+        struct page* page = phys_to_page_index(node->frame);
+        if (page && page->refs < ksm_max_sharing &&
+            flop_memcmp((void*) node->frame, (void*) frame, PAGE_SIZE) == 0) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+// look for a twin of the candidate page among the ones already seen in this scan; the contents only match as of
+// now, the merge compares them again with both pages pinned
+static ksm_unstable_t* ksm_internal_find_unstable(uint32_t hash, vmm_region_t* region, uintptr_t va,
+                                                  uintptr_t frame, uint32_t* out_pte) {
+    for (ksm_unstable_t** iter = &ksm_unstable[hash % KSM_HASH_BUCKETS]; *iter; iter = &(*iter)->next) {
+        ksm_unstable_t* item = *iter;
+        if (item->hash != hash || (item->region == region && item->va == va)) {
+            continue;
+        }
+
+        uint32_t pte = ksm_internal_pte(item->region, item->va);
+        if (!ksm_internal_eligible(pte) || flop_memcmp((void*) (pte & PAGE_MASK), (void*) frame, PAGE_SIZE) != 0) {
+            continue;
+        }
+
+        *iter = item->next;
+        ksm_stats.pages_unshared--;
+        *out_pte = pte;
+        return item;
+    }
+    return NULL;
+}
+
+// pin both pages of a pair, the candidate at va of vma in the loaded directory and its twin, compare them and if
+// they still match turn the twin's frame into a merged frame that both map
+static void
+ksm_internal_merge_twin(vmm_vma_t* vma, uintptr_t va, uint32_t pte, ksm_unstable_t* twin, uint32_t twin_pte) {
+    vmm_region_t* region = vma->region;
+    vmm_region_t* twin_region = twin->region;
+
+    // the twin's region is not the one being scanned, its layout is held still the same way
+    bool other = twin_region != region;
+    if (other && !rwsem_try_down_read(&twin_region->mm_sem)) {
+        return;
+    }
+
+    vmm_vma_t* twin_vma = vma_find(twin_region, twin->va);
+    ksm_stable_t* node = twin_vma ? (ksm_stable_t*) kmalloc(sizeof(ksm_stable_t)) : NULL;
+    if (!node) {
+        if (other) {
+            rwsem_up_read(&twin_region->mm_sem);
+        }
+        return;
+    }
+
+    uint32_t* saved = read_pd();
+    uintptr_t frame = twin_pte & PAGE_MASK;
+    bool promoted = false;
+    bool merged = false;
+
+    ksm_pin_t pin;
+    ksm_pin_t twin_pin;
+    if (ksm_internal_pin(&pin, region, va, pte, false)) {
+        load_pd(twin_region->pg_dir);
+        bool shared_lock = !other && vmm_pt_same_lock(region, va, twin->va);
+        if (ksm_internal_pin(&twin_pin, twin_region, twin->va, twin_pte, shared_lock)) {
+            // the twin's own pte becomes the first sharer of its frame
+            promoted = flop_memcmp((void*) frame, (void*) (pte & PAGE_MASK), PAGE_SIZE) == 0 &&
+                       ksm_internal_share(&twin_pin, frame) == 0;
+            ksm_internal_unpin(&twin_pin, promoted);
+        }
+
+        load_pd(saved);
+        merged = promoted && ksm_internal_share(&pin, frame) == 0;
+        ksm_internal_unpin(&pin, merged);
+    }
+    load_pd(saved);
+
+    if (merged) {
+        rmap_chain_add(frame, vma, va);
+        pmm_free_page((void*) (pte & PAGE_MASK));
+        ksm_stats.merged++;
+    }
+
+    if (promoted) {
+        // from here on the frame is mapped from many areas, each named by a link of its chain
+        rmap_chain_add(frame, twin_vma, twin->va);
+        node->hash = twin->hash;
+        node->frame = frame;
+        node->next = ksm_stable[node->hash % KSM_HASH_BUCKETS];
+        ksm_stable[node->hash % KSM_HASH_BUCKETS] = node;
+        ksm_stats.pages_shared++;
+    } else {
+        kfree(node, sizeof(ksm_stable_t));
+    }
+
+    if (other) {
+        rwsem_up_read(&twin_region->mm_sem);
+    }
+}
+
+static void ksm_internal_remember(uint32_t hash, vmm_region_t* region, uintptr_t va) {
+    if (ksm_stats.pages_unshared >= KSM_UNSTABLE_MAX) {
+        return;
+    }
+
+    ksm_unstable_t* item = (ksm_unstable_t*) kmalloc(sizeof(ksm_unstable_t));
+    if (!item) {
+        return;
+    }
+
+    item->hash = hash;
+    item->region = region;
+    item->va = va;
+    item->next = ksm_unstable[hash % KSM_HASH_BUCKETS];
+    ksm_unstable[hash % KSM_HASH_BUCKETS] = item;
+    ksm_stats.pages_unshared++;
+}
+
+// one candidate page of vma; the area's directory has to be loaded
+static void ksm_internal_visit(vmm_vma_t* vma, uintptr_t va) {
+    vmm_region_t* region = vma->region;
+    uint32_t pte = vmm_get_pte(region, va);
+    if (!ksm_internal_eligible(pte)) {
+        return;
+    }
+
+    // written since it was last looked at, it is too busy to be worth sharing yet
+    if (vmm_test_and_clear_dirty(region, va)) {
+        return;
+    }
+
+    uintptr_t frame = pte & PAGE_MASK;
+    uint32_t hash = ksm_internal_hash(frame);
+
+    ksm_stable_t* node = ksm_internal_find_stable(hash, frame);
+    if (node) {
+        ksm_internal_merge(vma, va, pte, node->frame);
+        return;
+    }
+
+    uint32_t twin_pte;
+    ksm_unstable_t* twin = ksm_internal_find_unstable(hash, region, va, frame, &twin_pte);
+    if (!twin) {
+        ksm_internal_remember(hash, region, va);
+        return;
+    }
+
+    ksm_internal_merge_twin(vma, va, pte, twin, twin_pte);
+    kfree(twin, sizeof(ksm_unstable_t));
+}
+
+typedef struct ksm_scan {
+    uint32_t budget;      // pages left in this batch
+    vmm_region_t* resume; // region the last batch stopped in, skipped up to until it is seen
+    uintptr_t resume_va;
+} ksm_scan_t;
+
+static bool ksm_internal_scan_region(vmm_region_t* region, void* ctx) {
+    ksm_scan_t* scan = (ksm_scan_t*) ctx;
+    uintptr_t from = 0;
+
+    if (scan->resume) {
+        if (region != scan->resume) {
+            return true;
+        }
+        scan->resume = NULL;
+        from = scan->resume_va;
+    }
+
+    // the kernel region has no areas; the areas hold still under the mm_sem foreach holds
+    if (!region->pt_live) {
+        return true;
+    }
+
+    uint32_t* saved = read_pd();
+    load_pd(region->pg_dir);
+
+    for (vmm_vma_t* vma = region->vma_list; vma; vma = vma->next) {
+        if (vma->kind != VMA_KIND_ANON || vma->file || vma->lazy_free || vma->end <= from) {
+            continue;
+        }
+
+        uintptr_t va = vma->start > from ? vma->start : from;
+        while (va < vma->end) {
+            if (!scan->budget) {
+                ksm_scan_region = region;
+                ksm_scan_va = va;
+                load_pd(saved);
+                return false;
+            }
+            scan->budget--;
+
+            // missing tables and 4 MiB pages are skipped whole
+            uint32_t pde = vmm_get_pde(region, va);
+            if (!(pde & PAGE_PRESENT) || (pde & PAGE_PSE)) {
+                va = (va & HUGE_PAGE_MASK) + HUGE_PAGE_SIZE;
+                continue;
+            }
+
+            ksm_internal_visit(vma, va);
+            ksm_stats.pages_scanned++;
+            va += PAGE_SIZE;
+        }
+    }
+
+    load_pd(saved);
+    return true;
+}
+
+// a full scan is over: forget its candidates and let go of merged frames nobody maps any more
+static void ksm_internal_end_scan(void) {
+    for (uint32_t i = 0; i < KSM_HASH_BUCKETS; i++) {
+        while (ksm_unstable[i]) {
+            ksm_unstable_t* item = ksm_unstable[i];
+            ksm_unstable[i] = item->next;
+            kfree(item, sizeof(ksm_unstable_t));
+        }
+
+        ksm_stable_t** iter = &ksm_stable[i];
+        while (*iter) {
+            ksm_stable_t* node = *iter;
+            struct page* page = phys_to_page_index(node->frame);
+            if (page && page->refs) {
+                iter = &node->next;
+                continue;
+            }
+
+            *iter = node->next;
+            rmap_chain_release(node->frame);
+            pmm_page_put(node->frame);
+            kfree(node, sizeof(ksm_stable_t));
+            ksm_stats.pages_shared--;
+        }
+    }
+
+    ksm_stats.pages_unshared = 0;
+    ksm_stats.full_scans++;
+}
+
+static void ksm_internal_batch(uint32_t budget) {
+    uint64_t start = sched_get_ticks();
+    ksm_scan_t scan = {budget, ksm_scan_region, ksm_scan_va};
+
+    ksm_scan_region = NULL;
+    ksm_scan_va = 0;
+    vmm_region_foreach(ksm_internal_scan_region, &scan);
+
+    // the region the cursor was in is gone, carry on from the top
+    if (scan.resume) {
+        scan.resume = NULL;
+        vmm_region_foreach(ksm_internal_scan_region, &scan);
+    }
+
+    if (!ksm_scan_region) {
+        ksm_internal_end_scan();
+    }
+    ksm_stats.scan_ticks += (uint32_t) (sched_get_ticks() - start);
+}
+
+static void ksm_thread_entry(void) {
+    for (;;) {
+        bool r = spinlock(&ksm_lock);
+        if (!ksm_tunables.run) {
+            ksm_waiting = true;
+            spinlock_unlock(&ksm_lock, r);
+            sched_block();
+            continue;
+        }
+
+        uint32_t pages_to_scan = ksm_tunables.pages_to_scan;
+        uint32_t max_sharing = ksm_tunables.max_page_sharing;
+        uint32_t sleep_ms = ksm_tunables.sleep_ms;
+        spinlock_unlock(&ksm_lock, r);
+
+        rwsem_down_write(&ksm_scan_sem);
+        ksm_max_sharing = max_sharing;
+        ksm_internal_batch(pages_to_scan);
+        rwsem_up_write(&ksm_scan_sem);
+
+        if (sleep_ms) {
+            sched_thread_sleep(sleep_ms);
+        } else {
+            sched_yield();
+        }
+    }
+}
+
+void ksm_init(void) {
+    rwsem_init(&ksm_scan_sem);
+    ksm_thread = sched_create_kernel_thread(ksm_thread_entry, 0, "ksm");
+    if (!ksm_thread) {
+        log("ksm_init: could not create the scanner thread\n", RED);
+    }
+}
+
+void ksm_get_tunables(ksm_tunables_t* out) {
+    bool r = spinlock(&ksm_lock);
+    *out = ksm_tunables;
+    spinlock_unlock(&ksm_lock, r);
+}
+
+int ksm_set_tunables(const ksm_tunables_t* tunables) {
+    if (!tunables || !tunables->pages_to_scan || !tunables->max_page_sharing || tunables->max_page_sharing > 0xFFFF) {
+        return -1;
+    }
+
+    bool r = spinlock(&ksm_lock);
+    ksm_tunables = *tunables;
+    bool wake = ksm_tunables.run && ksm_waiting;
+    if (wake) {
+        ksm_waiting = false;
+    }
+    spinlock_unlock(&ksm_lock, r);
+
+    if (wake) {
+        sched_unblock(ksm_thread);
+    }
+    return 0;
+}
+
+// set one tunable from text of the form "<name> <value>"
+int ksm_store_tunable(const char* buf, size_t size) {
+    char text[48];
+    if (!buf || !size || size >= sizeof(text)) {
+        return -1;
+    }
+    flop_memcpy(text, buf, size);
+    text[size] = '\0';
+
+    char* value = flopstrchr(text, ' ');
+    if (!value) {
+        return -1;
+    }
+    *value++ = '\0';
+
+    ksm_tunables_t tunables;
+    ksm_get_tunables(&tunables);
+
+    uint32_t n = (uint32_t) flopatoi(value);
+    if (flopstrcmp(text, "run") == 0) {
+        tunables.run = n;
+    } else if (flopstrcmp(text, "pages_to_scan") == 0) {
+        tunables.pages_to_scan = n;
+    } else if (flopstrcmp(text, "sleep_ms") == 0) {
+        tunables.sleep_ms = n;
+    } else if (flopstrcmp(text, "max_page_sharing") == 0) {
+        tunables.max_page_sharing = n;
+    } else {
+        return -1;
+    }
+
+    return ksm_set_tunables(&tunables) < 0 ? -1 : (int) size;
+}
+
+void ksm_get_stats(ksm_stats_t* out) {
+    rwsem_down_read(&ksm_scan_sem);
+    *out = ksm_stats;
+
+    // every pte on a merged frame but one is a frame saved
+    out->pages_sharing = 0;
+    for (uint32_t i = 0; i < KSM_HASH_BUCKETS; i++) {
+        for (ksm_stable_t* node = ksm_stable[i]; node; node = node->next) {
+            struct page* page = phys_to_page_index(node->frame);
+            if (page && page->refs) {
+                out->pages_sharing += page->refs - 1U;
+            }
+        }
+    }
+    rwsem_up_read(&ksm_scan_sem);
+}
+
+int ksm_format_stats(char* buf, size_t size) {
+    if (!buf || size == 0) {
+        return -1;
+    }
+
+    ksm_tunables_t tunables;
+    ksm_stats_t st;
+    ksm_get_tunables(&tunables);
+    ksm_get_stats(&st);
+
+    return flopsnprintf(buf,
+                        size,
+                        "run: %u\n"
+                        "pages_to_scan: %u\n"
+                        "sleep_ms: %u\n"
+                        "max_page_sharing: %u\n"
+                        "pages_shared: %u\n"
+                        "pages_sharing: %u\n"
+                        "pages_unshared: %u\n"
+                        "merged: %u\n"
+                        "full_scans: %u\n"
+                        "pages_scanned: %u\n"
+                        "scan_ticks: %u\n",
+                        tunables.run,
+                        tunables.pages_to_scan,
+                        tunables.sleep_ms,
+                        tunables.max_page_sharing,
+                        st.pages_shared,
+                        st.pages_sharing,
+                        st.pages_unshared,
+                        st.merged,
+                        st.full_scans,
+                        st.pages_scanned,
+                        st.scan_ticks);
+}
+
+// drop the candidates and the cursor that point into a region that is going away
+void ksm_forget_region(vmm_region_t* region) {
+    rwsem_down_write(&ksm_scan_sem);
+    for (uint32_t i = 0; i < KSM_HASH_BUCKETS; i++) {
+        ksm_unstable_t** iter = &ksm_unstable[i];
+        while (*iter) {
+            ksm_unstable_t* item = *iter;
+            if (item->region != region) {
+                iter = &item->next;
+                continue;
+            }
+
+            *iter = item->next;
+            kfree(item, sizeof(ksm_unstable_t));
+            ksm_stats.pages_unshared--;
+        }
+    }
+
+    if (ksm_scan_region == region) {
+        ksm_scan_region = NULL;
+        ksm_scan_va = 0;
+    }
+    rwsem_up_write(&ksm_scan_sem);
+}
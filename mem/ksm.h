@@ -0,0 +1,43 @@
+#ifndef KSM_H
+#define KSM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "vmm.h"
+
+// defaults for the tunables, the scanner looks at pages_to_scan pages every sleep_ms
+#define KSM_DEFAULT_PAGES_TO_SCAN 100
+#define KSM_DEFAULT_SLEEP_MS 20
+#define KSM_DEFAULT_MAX_PAGE_SHARING 256
+// buckets of the stable and unstable tables
+#define KSM_HASH_BUCKETS 256
+// candidates remembered per full scan, the rest wait for the next one
+#define KSM_UNSTABLE_MAX 4096
+
+typedef struct ksm_tunables {
+    uint32_t run;              // 0 parks the scanner, anything else lets it run
+    uint32_t pages_to_scan;    // pages looked at per batch
+    uint32_t sleep_ms;         // pause between batches
+    uint32_t max_page_sharing; // ptes a merged frame takes before a second copy is started
+} ksm_tunables_t;
+
+typedef struct ksm_stats {
+    uint32_t pages_shared;   // merged frames
+    uint32_t pages_sharing;  // ptes that point at them beyond the first, i.e. frames saved
+    uint32_t pages_unshared; // candidates waiting for a twin in this scan
+    uint32_t merged;         // ptes merged since boot
+    uint32_t full_scans;
+    uint32_t pages_scanned;
+    uint32_t scan_ticks; // ticks spent scanning, the cpu the merging costs
+} ksm_stats_t;
+
+void ksm_init(void);
+void ksm_get_tunables(ksm_tunables_t* out);
+int ksm_set_tunables(const ksm_tunables_t* tunables);
+int ksm_store_tunable(const char* buf, size_t size);
+void ksm_get_stats(ksm_stats_t* out);
+int ksm_format_stats(char* buf, size_t size);
+void ksm_forget_region(vmm_region_t* region);
+
+#endif // KSM_H
@@ -24,6 +24,7 @@ You should have received a copy of the GNU General Public License along with The
 #include "../apps/echo.h"
 #include "../drivers/vga/vgahandler.h"
 #include "../lib/logging.h"
+#include "../task/percpu.h"
 
 static inline uintptr_t kvirt_to_phys(void* v) {
     uintptr_t va = (uintptr_t) v;
@@ -57,7 +58,11 @@ static inline uint32_t virtual_page_index(uint32_t va) {
     return (va >> 12) & 0x3FF;
 }
 
+// the cpu announces the directory before loading it; a shootdown that misses the announcement made its
+// pte changes before the load, which then caches nothing stale
 void load_pd(uint32_t* pd) {
+    PERCPU_WRITE(loaded_pd, pd);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
     __asm__ volatile("mov %0, %%cr3" ::"r"(pd));
 }
 
@@ -72,12 +77,13 @@ static void enable_paging(uint8_t enable_wp, uint8_t enable_pse) {
                      : "r"(enable_wp ? 0x80010000 : 0x80000000) // 0x80010000 -> PG + WP
     );
 
+    // cr4.pse lets a pde map a 4mib page directly
     if (enable_pse) {
-        __asm__ volatile("mov %%cr0, %0\n"
+        __asm__ volatile("mov %%cr4, %0\n"
                          "or %1, %0\n"
-                         "mov %0, %%cr0"
-                         : "=r"(cr0)
-                         : "r"(enable_wp ? 0x80010000 : 0x80000000)
+                         "mov %0, %%cr4"
+                         : "=r"(cr4)
+                         : "r"(CR4_PSE_BIT)
                          : "memory");
     }
 }
@@ -228,7 +234,8 @@ void paging_init(void) {
     current_pg_dir = pd;
     load_pd(pd);
     log("page directory loaded\n", GREEN);
-    enable_paging(0, 0);
+    // wp makes ring 0 writes honour read only ptes, so the kernel breaks cow like user code does
+    enable_paging(1, 1);
     log("paging enabled\n", GREEN);
 
     int paging_setup_stack_status = paging_init_paging_stack();
@@ -12,7 +12,16 @@
 #define PAGE_PRESENT 0x1
 #define PAGE_RW 0x2
 #define PAGE_USER 0x4
+#define PAGE_PWT 0x8  // write through
+#define PAGE_PCD 0x10 // cache disable, for device registers
 #define PAGE_PRESENT 0x1
+#define PAGE_ACCESSED 0x20
+#define PAGE_DIRTY 0x40
+#define PAGE_PSE 0x80
+#define PAGE_COW 0x200 // available bit, marks a read only pte whose frame is shared until written
+#define PAGE_SHARED 0x400 // available bit, the frame belongs to a shared file mapping and is never copied
+#define PAGE_FILE 0x800 // available bit, the frame is a file page mapped in place rather than anonymous memory
+#define CR4_PSE_BIT 0x10
 
 #define TABLE_BYTES 0x1000
 #define PAGE_ENTRIES 1024
@@ -23,6 +32,12 @@
 void paging_init(void);
 void load_pd(uint32_t* pd);
 
+static inline uint32_t* read_pd(void) {
+    uint32_t* pd;
+    asm volatile("mov %%cr3, %0" : "=r"(pd));
+    return pd;
+}
+
 static inline void invlpg(void* va) {
     asm volatile("invlpg (%0)" : : "a"(va));
 }
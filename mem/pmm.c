@@ -72,7 +72,7 @@ static void pmm_buddy_merge(uintptr_t addr, uint32_t order) {
         return;
     }
 
-    if (buddy_page && buddy_page->is_free && buddy_page->order == order) {
+    if (order < MAX_ORDER && buddy_page && buddy_page->is_free && buddy_page->order == order) {
         // unlink buddy_page from its free list
         struct page** prev = &buddy.free_list[order];
         while (*prev && *prev != buddy_page) {
@@ -162,12 +162,12 @@ static uintptr_t pmm_find_page_info_placement(multiboot_info_t* mb, uintptr_t re
     return 0;
 }
 
+// pages are added in ascending order, so buddies coalesce into max order blocks as we go
 static void pmm_add_free(struct page* page, uintptr_t addr) {
     page->address = addr;
     page->order = 0;
     page->is_free = 1;
-    page->next = buddy.free_list[0];
-    buddy.free_list[0] = page;
+    pmm_buddy_merge(addr, 0);
 }
 
 static bool pmm_addr_in_pageinfo(uintptr_t addr, uintptr_t s, uintptr_t entry) {
@@ -301,6 +301,7 @@ pmm_buddy_init(uint64_t usable_pages, uintptr_t memory_base_region_start_usable,
     }
 
     buddy.page_info = (struct page*) page_info_addr;
+    flop_memset(buddy.page_info, 0, page_info_bytes);
     size_t page_info_pages = (page_info_bytes + PAGE_SIZE - 1) / PAGE_SIZE;
 
     buddy.memory_start = page_info_addr + page_info_pages * PAGE_SIZE;
@@ -433,10 +434,10 @@ static void* pmm_alloc_block(uint32_t order) {
 
     // mark block used
     block->is_free = 0;
-    block->order = order;
 
     // split to order if needed
     pmm_determine_split(block, block->order, order);
+    block->order = order;
 
     return (void*) block->address;
 }
@@ -450,8 +451,11 @@ static void pmm_free_block(uintptr_t addr, uint32_t order) {
         return;
     }
 
-    // mark the block free
+    // mark the block free, nothing maps its frames any more
     page->is_free = 1;
+    for (uint32_t i = 0; i < (1u << order) && page + i < buddy.page_info + buddy.total_pages; i++) {
+        page[i].mapping = 0;
+    }
 
     // Attempt to merge with its buddy to coalesce free space
     pmm_buddy_merge(page->address, order);
@@ -515,6 +519,90 @@ void pmm_free_page(void* addr) {
     pmm_free_pages(addr, 0, 1);
 }
 
+static void pmm_internal_split_allocated(uintptr_t base, uint32_t order) {
+    for (uint32_t i = 0; i < (1u << order); i++) {
+        struct page* page = phys_to_page_index(base + i * PAGE_SIZE);
+        if (!page) {
+            break;
+        }
+        page->address = base + i * PAGE_SIZE;
+        page->order = 0;
+        page->is_free = 0;
+        page->refs = 0;
+        page->next = NULL;
+    }
+}
+
+// turn an allocated block into individually allocated order 0 pages, so each can be freed on its own
+void pmm_split_allocated(void* addr, uint32_t order) {
+    if (!addr || order == 0 || order > MAX_ORDER) {
+        return;
+    }
+
+    bool r = spinlock(&buddy.lock);
+    pmm_internal_split_allocated((uintptr_t) addr, order);
+    spinlock_unlock(&buddy.lock, r);
+}
+
+// allocate up to count single pages under one lock hold, carving them out of the largest blocks that fit
+// so neighbouring pages tend to be physically contiguous; returns how many frames were written to out
+size_t pmm_alloc_bulk(uintptr_t* out, size_t count) {
+    if (!out) {
+        return 0;
+    }
+
+    bool r = spinlock(&buddy.lock);
+    size_t got = 0;
+    while (got < count) {
+        uint32_t order = 0;
+        while (order < MAX_ORDER && ((size_t) 2 << order) <= count - got) {
+            order++;
+        }
+
+        // fall back to smaller blocks when the fitting order has run dry
+        void* block = pmm_alloc_block(order);
+        while (!block && order > 0) {
+            block = pmm_alloc_block(--order);
+        }
+        if (!block) {
+            break;
+        }
+
+        uintptr_t base = (uintptr_t) block;
+        if (order) {
+            pmm_internal_split_allocated(base, order);
+        }
+        for (uint32_t i = 0; i < (1u << order); i++) {
+            out[got++] = base + i * PAGE_SIZE;
+        }
+    }
+    spinlock_unlock(&buddy.lock, r);
+    return got;
+}
+
+// take an extra reference on a frame that is about to be mapped somewhere besides its owner
+void pmm_page_get(uintptr_t addr) {
+    bool r = spinlock(&buddy.lock);
+    struct page* page = phys_to_page_index(addr);
+    if (page) {
+        page->refs++;
+    }
+    spinlock_unlock(&buddy.lock, r);
+}
+
+// drop a reference; the frame goes back to the buddy allocator once nobody else holds it
+void pmm_page_put(uintptr_t addr) {
+    bool r = spinlock(&buddy.lock);
+    struct page* page = phys_to_page_index(addr);
+    if (page && page->refs) {
+        page->refs--;
+        spinlock_unlock(&buddy.lock, r);
+        return;
+    }
+    spinlock_unlock(&buddy.lock, r);
+    pmm_free_page((void*) addr);
+}
+
 uint32_t pmm_get_memory_size(void) {
     return buddy.total_pages * PAGE_SIZE;
 }
@@ -528,7 +616,7 @@ uint32_t pmm_get_free_memory_size(void) {
     for (int i = 0; i <= MAX_ORDER; i++) {
         struct page* page = buddy.free_list[i];
         while (page) {
-            free_pages++;
+            free_pages += 1 << i;
             page = page->next;
         }
     }
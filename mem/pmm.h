@@ -26,7 +26,10 @@ struct page {
     uintptr_t address;
     uint32_t order;
     int is_free;
+    uint16_t refs; // references held on top of the owner's, by mappings that share the frame
     struct page* next;
+    uintptr_t mapping; // who maps the frame, for the reverse map; see rmap.h
+    uint32_t index;    // the frame's page index within mapping
 };
 
 struct buddy_allocator {
@@ -48,6 +51,10 @@ void* pmm_alloc_pages(uint32_t order, uint32_t count);
 void* pmm_alloc_page(void);
 void pmm_free_pages(void* addr, uint32_t order, uint32_t count);
 void pmm_free_page(void* addr);
+void pmm_split_allocated(void* addr, uint32_t order);
+size_t pmm_alloc_bulk(uintptr_t* out, size_t count);
+void pmm_page_get(uintptr_t addr);
+void pmm_page_put(uintptr_t addr);
 uint32_t pmm_get_memory_size();
 uint32_t pmm_get_page_count();
 struct page* phys_to_page_index(uintptr_t addr);
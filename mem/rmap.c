@@ -0,0 +1,391 @@
+/*
+
+Copyright 2024-2026 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of The Flopperating System.
+
+The Flopperating System is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+The Flopperating System is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with The Flopperating System. If not, see <https://www.gnu.org/licenses/>.
+
+[DESCRIPTION] - reverse mapping from physical frames to the ptes that map them
+
+*/
+#include <stdint.h>
+#include "rmap.h"
+#include "vma.h"
+#include "vmm.h"
+#include "pmm.h"
+#include "swap.h"
+#include "alloc.h"
+#include "paging.h"
+#include "../task/sync/spinlock.h"
+#include "../lib/logging.h"
+
+// one (anon, index) pair a merged frame is mapped under
+typedef struct rmap_link {
+    struct rmap_link* next;
+    rmap_anon_t* anon;
+    uint32_t index;
+} rmap_link_t;
+
+// the areas that map a file, found by the file's mapping handle
+typedef struct rmap_file {
+    struct rmap_file* next;
+    void* file;
+    struct vmm_vma* vmas; // chained through file_next
+} rmap_file_t;
+
+static rmap_file_t* rmap_files[RMAP_FILE_BUCKETS];
+static spinlock_t rmap_lock = SPINLOCK_INIT;
+
+static inline uint32_t rmap_internal_index(vmm_vma_t* vma, uintptr_t va) {
+    return vma->pgoff + (va - vma->start) / PAGE_SIZE;
+}
+
+// where page index sits in vma, if the area covers it at all
+static bool rmap_internal_va(vmm_vma_t* vma, uint32_t index, uintptr_t* out_va) {
+    if (index < vma->pgoff || index - vma->pgoff >= (vma->end - vma->start) / PAGE_SIZE) {
+        return false;
+    }
+    *out_va = vma->start + (index - vma->pgoff) * PAGE_SIZE;
+    return true;
+}
+
+static rmap_file_t** rmap_internal_file_slot(void* file) {
+    rmap_file_t** link = &rmap_files[((uintptr_t) file >> 4) % RMAP_FILE_BUCKETS];
+    while (*link && (*link)->file != file) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+static void rmap_internal_anon_put(rmap_anon_t* anon) {
+    if (--anon->refs == 0) {
+        kfree(anon, sizeof(rmap_anon_t));
+    }
+}
+
+// give vma an anon of its own the first time one of its frames needs one
+static rmap_anon_t* rmap_internal_anon_prepare(vmm_vma_t* vma) {
+    if (vma->anon) {
+        return vma->anon;
+    }
+
+    rmap_anon_t* anon = (rmap_anon_t*) kmalloc(sizeof(rmap_anon_t));
+    if (!anon) {
+        log("rmap_internal_anon_prepare: kmalloc failed\n", RED);
+        return NULL;
+    }
+
+    anon->vmas = vma;
+    anon->refs = 1;
+    vma->anon = anon;
+    vma->anon_next = NULL;
+    return anon;
+}
+
+// add an area to the lists of the anon and the file it shares frames with
+void rmap_vma_link(vmm_vma_t* vma) {
+    bool r = spinlock(&rmap_lock);
+    if (vma->anon) {
+        vma->anon_next = vma->anon->vmas;
+        vma->anon->vmas = vma;
+        vma->anon->refs++;
+    }
+
+    if (vma->file) {
+        rmap_file_t** slot = rmap_internal_file_slot(vma->file);
+        if (!*slot) {
+            rmap_file_t* file = (rmap_file_t*) kmalloc(sizeof(rmap_file_t));
+            if (!file) {
+                log("rmap_vma_link: kmalloc failed\n", RED);
+                spinlock_unlock(&rmap_lock, r);
+                return;
+            }
+            file->next = NULL;
+            file->file = vma->file;
+            file->vmas = NULL;
+            *slot = file;
+        }
+        vma->file_next = (*slot)->vmas;
+        (*slot)->vmas = vma;
+    }
+    spinlock_unlock(&rmap_lock, r);
+}
+
+void rmap_vma_unlink(vmm_vma_t* vma) {
+    bool r = spinlock(&rmap_lock);
+    if (vma->anon) {
+        vmm_vma_t** link = &vma->anon->vmas;
+        while (*link && *link != vma) {
+            link = &(*link)->anon_next;
+        }
+        if (*link) {
+            *link = vma->anon_next;
+            rmap_internal_anon_put(vma->anon);
+        }
+        vma->anon = NULL;
+    }
+
+    rmap_file_t** slot = vma->file ? rmap_internal_file_slot(vma->file) : NULL;
+    if (slot && *slot) {
+        vmm_vma_t** link = &(*slot)->vmas;
+        while (*link && *link != vma) {
+            link = &(*link)->file_next;
+        }
+        if (*link) {
+            *link = vma->file_next;
+        }
+
+        if (!(*slot)->vmas) {
+            rmap_file_t* file = *slot;
+            *slot = file->next;
+            kfree(file, sizeof(rmap_file_t));
+        }
+    }
+    spinlock_unlock(&rmap_lock, r);
+}
+
+// record that pages contiguous frames from frame were faulted into vma at va
+void rmap_add_anon(vmm_vma_t* vma, uintptr_t va, uintptr_t frame, size_t pages) {
+    bool r = spinlock(&rmap_lock);
+    rmap_anon_t* anon = rmap_internal_anon_prepare(vma);
+    for (size_t i = 0; anon && i < pages; i++) {
+        struct page* page = phys_to_page_index(frame + i * PAGE_SIZE);
+        if (page) {
+            page->mapping = (uintptr_t) anon | RMAP_TAG_ANON;
+            page->index = rmap_internal_index(vma, va) + i;
+        }
+    }
+    spinlock_unlock(&rmap_lock, r);
+}
+
+// record the private frames already mapped in [start, end) of vma; the area's directory has to be loaded
+void rmap_add_range(vmm_vma_t* vma, uintptr_t start, uintptr_t end) {
+    for (uintptr_t va = start; va < end; va += PAGE_SIZE) {
+        uint32_t pte = vmm_get_pte(vma->region, va);
+        if (!(pte & PAGE_PRESENT) || (pte & (PAGE_SHARED | PAGE_FILE)) || (pte & PAGE_MASK) == vma_zero_page()) {
+            continue;
+        }
+        rmap_add_anon(vma, va, pte & PAGE_MASK, 1);
+    }
+}
+
+// record that the file page behind va, held in frame, is mapped in place
+void rmap_add_file(vmm_vma_t* vma, uintptr_t va, uintptr_t frame) {
+    bool r = spinlock(&rmap_lock);
+    struct page* page = phys_to_page_index(frame);
+    if (page) {
+        page->mapping = (uintptr_t) vma->file;
+        page->index = rmap_internal_index(vma, va);
+    }
+    spinlock_unlock(&rmap_lock, r);
+}
+
+static bool rmap_internal_chain_push(rmap_link_t** head, rmap_anon_t* anon, uint32_t index) {
+    for (rmap_link_t* link = *head; link; link = link->next) {
+        if (link->anon == anon && link->index == index) {
+            return true;
+        }
+    }
+
+    rmap_link_t* link = (rmap_link_t*) kmalloc(sizeof(rmap_link_t));
+    if (!link) {
+        log("rmap_internal_chain_push: kmalloc failed\n", RED);
+        return false;
+    }
+
+    link->anon = anon;
+    link->index = index;
+    link->next = *head;
+    anon->refs++;
+    *head = link;
+    return true;
+}
+
+// note that a frame shared across areas is mapped at va of vma; the first call turns the frame's single
+// anon into a chain, which holds every anon it names alive until rmap_chain_release
+int rmap_chain_add(uintptr_t frame, vmm_vma_t* vma, uintptr_t va) {
+    struct page* page = phys_to_page_index(frame);
+    if (!page) {
+        return -1;
+    }
+
+    bool r = spinlock(&rmap_lock);
+    rmap_anon_t* anon = rmap_internal_anon_prepare(vma);
+    if (!anon) {
+        spinlock_unlock(&rmap_lock, r);
+        return -1;
+    }
+
+    rmap_link_t* head = NULL;
+    uintptr_t tag = page->mapping & RMAP_TAG_MASK;
+    if (tag == RMAP_TAG_CHAIN) {
+        head = (rmap_link_t*) (page->mapping & ~RMAP_TAG_MASK);
+    } else if (tag == RMAP_TAG_ANON) {
+        rmap_internal_chain_push(&head, (rmap_anon_t*) (page->mapping & ~RMAP_TAG_MASK), page->index);
+    }
+
+    bool ok = rmap_internal_chain_push(&head, anon, rmap_internal_index(vma, va));
+    page->mapping = head ? (uintptr_t) head | RMAP_TAG_CHAIN : 0;
+    spinlock_unlock(&rmap_lock, r);
+    return ok ? 0 : -1;
+}
+
+// drop the chain of a merged frame that is about to be freed
+void rmap_chain_release(uintptr_t frame) {
+    bool r = spinlock(&rmap_lock);
+    struct page* page = phys_to_page_index(frame);
+    if (page && (page->mapping & RMAP_TAG_MASK) == RMAP_TAG_CHAIN) {
+        rmap_link_t* link = (rmap_link_t*) (page->mapping & ~RMAP_TAG_MASK);
+        while (link) {
+            rmap_link_t* next = link->next;
+            rmap_internal_anon_put(link->anon);
+            kfree(link, sizeof(rmap_link_t));
+            link = next;
+        }
+        page->mapping = 0;
+    }
+    spinlock_unlock(&rmap_lock, r);
+}
+
+// frames a fork copied are mapped by the child's areas, which share the parent's anon
+void rmap_copy(uintptr_t dst_frame, uintptr_t src_frame, size_t pages) {
+    bool r = spinlock(&rmap_lock);
+    for (size_t i = 0; i < pages; i++) {
+        struct page* src = phys_to_page_index(src_frame + i * PAGE_SIZE);
+        struct page* dst = phys_to_page_index(dst_frame + i * PAGE_SIZE);
+        if (src && dst && (src->mapping & RMAP_TAG_MASK) == RMAP_TAG_ANON) {
+            dst->mapping = src->mapping;
+            dst->index = src->index;
+        }
+    }
+    spinlock_unlock(&rmap_lock, r);
+}
+
+// every pte mapping the frame can be found through its anon
+bool rmap_is_anon(uintptr_t frame) {
+    struct page* page = phys_to_page_index(frame);
+    return page && (page->mapping & RMAP_TAG_MASK) == RMAP_TAG_ANON;
+}
+
+// hand fn the pte of vma at index if it still maps frame
+static bool rmap_internal_visit(
+    vmm_vma_t* vma, uint32_t index, uintptr_t frame, rmap_visit_t fn, void* ctx, int* count) {
+    uintptr_t va;
+    if (!vma->region || !rmap_internal_va(vma, index, &va)) {
+        return true;
+    }
+
+    uint32_t* saved = read_pd();
+    load_pd(vma->region->pg_dir);
+
+    bool more = true;
+    uint32_t pte = vmm_get_pte(vma->region, va);
+    if ((pte & PAGE_PRESENT) && (pte & PAGE_MASK) == frame) {
+        (*count)++;
+        more = fn(vma->region, vma, va, ctx);
+    }
+
+    load_pd(saved);
+    return more;
+}
+
+static bool rmap_internal_walk_anon(
+    rmap_anon_t* anon, uint32_t index, uintptr_t frame, rmap_visit_t fn, void* ctx, int* count) {
+    for (vmm_vma_t* vma = anon->vmas; vma; vma = vma->anon_next) {
+        if (!rmap_internal_visit(vma, index, frame, fn, ctx, count)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// call fn for every pte that maps frame, in time proportional to the areas that could map it;
+// returns how many were visited
+int rmap_walk(uintptr_t frame, rmap_visit_t fn, void* ctx) {
+    struct page* page = phys_to_page_index(frame);
+    if (!page || !page->mapping || !fn) {
+        return 0;
+    }
+
+    bool r = spinlock(&rmap_lock);
+    int count = 0;
+    uintptr_t mapping = page->mapping;
+    uint32_t index = page->index;
+
+    switch (mapping & RMAP_TAG_MASK) {
+        case RMAP_TAG_ANON:
+            rmap_internal_walk_anon((rmap_anon_t*) (mapping & ~RMAP_TAG_MASK), index, frame, fn, ctx, &count);
+            break;
+        case RMAP_TAG_CHAIN:
+            for (rmap_link_t* link = (rmap_link_t*) (mapping & ~RMAP_TAG_MASK); link; link = link->next) {
+                if (!rmap_internal_walk_anon(link->anon, link->index, frame, fn, ctx, &count)) {
+                    break;
+                }
+            }
+            break;
+        default: {
+            rmap_file_t* file = *rmap_internal_file_slot((void*) mapping);
+            for (vmm_vma_t* vma = file ? file->vmas : NULL; vma; vma = vma->file_next) {
+                if (!rmap_internal_visit(vma, index, frame, fn, ctx, &count)) {
+                    break;
+                }
+            }
+            break;
+        }
+    }
+
+    spinlock_unlock(&rmap_lock, r);
+    return count;
+}
+
+typedef struct rmap_unmap {
+    uintptr_t frame;
+    uint32_t entry;
+    int done;
+} rmap_unmap_t;
+
+static bool rmap_internal_unmap_one(vmm_region_t* region, vmm_vma_t* vma, uintptr_t va, void* ctx) {
+    rmap_unmap_t* un = (rmap_unmap_t*) ctx;
+
+    // a page table some thread is faulting in is left alone, the pte keeps its reference
+    bool r;
+    if (!vmm_pt_trylock(region, va, &r)) {
+        return true;
+    }
+
+    int status;
+    if (!un->entry) {
+        status = vmm_unmap(region, va);
+    } else {
+        // the caller's entry covers the first pte, every further one takes its own reference on the slot
+        bool dup = un->done && swap_pte_is_entry(un->entry);
+        if (dup) {
+            swap_dup(un->entry);
+        }
+
+        status = vmm_split_huge(region, va) < 0 ? -1 : vmm_set_swap_entry(region, va, un->entry);
+        if (status < 0 && dup) {
+            swap_free(un->entry);
+        }
+    }
+    vmm_pt_unlock(region, va, r);
+
+    if (status == 0) {
+        un->done++;
+        pmm_page_put(un->frame);
+    }
+    return true;
+}
+
+// replace every pte that maps frame with entry, or clear it when entry is 0, and drop the reference each
+// of them held; the frame is freed with the last one unless the caller holds its own
+int rmap_unmap_frame(uintptr_t frame, uint32_t entry) {
+    rmap_unmap_t un = {frame, entry, 0};
+    rmap_walk(frame, rmap_internal_unmap_one, &un);
+    return un.done;
+}
@@ -0,0 +1,41 @@
+#ifndef RMAP_H
+#define RMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "vmm.h"
+#include "vma.h"
+
+// the mapping of a struct page is tagged in its low bits; an untagged value is the handle of the file
+// whose page the frame is, and 0 means nothing tracks the frame's mappers
+#define RMAP_TAG_ANON 0x1  // an rmap_anon_t, index is the page's slot in the areas that share it
+#define RMAP_TAG_CHAIN 0x2 // a chain of (anon, index) pairs, for frames merged across areas
+#define RMAP_TAG_MASK 0x3
+
+// buckets of the table that finds the areas mapping a file
+#define RMAP_FILE_BUCKETS 64
+
+// the anonymous memory shared by an area and every area forked or split off it; a frame faulted into one
+// of them can only be mapped by them, at the same page index
+typedef struct rmap_anon {
+    struct vmm_vma* vmas; // chained through anon_next
+    uint32_t refs;        // areas and chain links pointing here
+} rmap_anon_t;
+
+// called with the region's directory loaded; returning false ends the walk
+typedef bool (*rmap_visit_t)(vmm_region_t* region, vmm_vma_t* vma, uintptr_t va, void* ctx);
+
+void rmap_vma_link(vmm_vma_t* vma);
+void rmap_vma_unlink(vmm_vma_t* vma);
+void rmap_add_anon(vmm_vma_t* vma, uintptr_t va, uintptr_t frame, size_t pages);
+void rmap_add_range(vmm_vma_t* vma, uintptr_t start, uintptr_t end);
+void rmap_add_file(vmm_vma_t* vma, uintptr_t va, uintptr_t frame);
+int rmap_chain_add(uintptr_t frame, vmm_vma_t* vma, uintptr_t va);
+void rmap_chain_release(uintptr_t frame);
+void rmap_copy(uintptr_t dst_frame, uintptr_t src_frame, size_t pages);
+bool rmap_is_anon(uintptr_t frame);
+int rmap_walk(uintptr_t frame, rmap_visit_t fn, void* ctx);
+int rmap_unmap_frame(uintptr_t frame, uint32_t entry);
+
+#endif // RMAP_H
@@ -0,0 +1,516 @@
+/*
+
+Copyright 2024-2026 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of The Flopperating System.
+
+The Flopperating System is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+The Flopperating System is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with The Flopperating System. If not, see <https://www.gnu.org/licenses/>.
+
+[DESCRIPTION] - swapping anonymous pages out to the compressed pool and an ata swap area
+
+*/
+#include <stdint.h>
+#include "swap.h"
+#include "zram.h"
+#include "rmap.h"
+#include "vma.h"
+#include "vmm.h"
+#include "pmm.h"
+#include "alloc.h"
+#include "paging.h"
+#include "utils.h"
+#include "../drivers/ata/ata.h"
+#include "../task/sync/spinlock.h"
+#include "../lib/logging.h"
+
+#define SWAP_SECTORS_PER_PAGE (PAGE_SIZE / ATA_SECTOR_SIZE)
+#define SWAP_MAP_MAX 0xFF
+
+// the swap area, one page per slot; map holds the number of ptes that point at each slot
+typedef struct swap_area {
+    uint8_t drive;
+    uint32_t lba;
+    uint32_t pages;
+    uint32_t used;
+    uint32_t hint; // slot the next allocation starts looking at
+    uint8_t* map;
+} swap_area_t;
+
+static swap_area_t swap_area;
+static spinlock_t swap_lock = SPINLOCK_INIT;
+
+typedef struct swap_lru_entry {
+    vmm_region_t* region;
+    uintptr_t va;
+} swap_lru_entry_t;
+
+// fifo of candidate pages, entries are only hints and are checked again before they are acted on
+typedef struct swap_lru {
+    swap_lru_entry_t items[SWAP_LRU_SIZE];
+    uint32_t head;
+    uint32_t count;
+} swap_lru_t;
+
+// active pages were touched in their last period, inactive ones were not and go out first
+static swap_lru_t swap_active;
+static swap_lru_t swap_inactive;
+static spinlock_t swap_lru_lock = SPINLOCK_INIT;
+
+// where the next scan for fresh candidates picks up, NULL starts over at the first region
+static vmm_region_t* swap_scan_region = NULL;
+static uintptr_t swap_scan_va = 0;
+
+static bool swap_internal_lru_push(swap_lru_t* lru, vmm_region_t* region, uintptr_t va) {
+    if (lru->count == SWAP_LRU_SIZE) {
+        return false;
+    }
+
+    swap_lru_entry_t* entry = &lru->items[(lru->head + lru->count) % SWAP_LRU_SIZE];
+    entry->region = region;
+    entry->va = va;
+    lru->count++;
+    return true;
+}
+
+static bool swap_internal_lru_pop(swap_lru_t* lru, swap_lru_entry_t* out) {
+    if (!lru->count) {
+        return false;
+    }
+
+    *out = lru->items[lru->head];
+    lru->head = (lru->head + 1) % SWAP_LRU_SIZE;
+    lru->count--;
+    return true;
+}
+
+static void swap_internal_lru_forget(swap_lru_t* lru, vmm_region_t* region) {
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < lru->count; i++) {
+        swap_lru_entry_t entry = lru->items[(lru->head + i) % SWAP_LRU_SIZE];
+        if (entry.region != region) {
+            lru->items[(lru->head + kept) % SWAP_LRU_SIZE] = entry;
+            kept++;
+        }
+    }
+    lru->count = kept;
+}
+
+int swap_on(uint8_t drive, uint32_t lba, uint32_t pages) {
+    if (!pages || swap_area.map) {
+        return -1;
+    }
+
+    uint8_t* map = (uint8_t*) kmalloc(pages);
+    if (!map) {
+        log("swap_on: kmalloc failed for the slot map\n", RED);
+        return -1;
+    }
+    flop_memset(map, 0, pages);
+
+    bool r = spinlock(&swap_lock);
+    swap_area.drive = drive;
+    swap_area.lba = lba;
+    swap_area.pages = pages;
+    swap_area.used = 0;
+    swap_area.hint = 0;
+    swap_area.map = map;
+    spinlock_unlock(&swap_lock, r);
+    return 0;
+}
+
+void swap_init(void) {
+    if (!ata_drive_present(SWAP_ATA_DRIVE)) {
+        log(zram_enabled() ? "swap: no swap drive, compressed pool only\n" : "swap: no swap drive, running without swap\n",
+            YELLOW);
+        return;
+    }
+
+    if (swap_on(SWAP_ATA_DRIVE, SWAP_START_LBA, SWAP_AREA_PAGES) < 0) {
+        return;
+    }
+    log("swap: init - ok\n", GREEN);
+}
+
+static int32_t swap_internal_alloc_slot(void) {
+    bool r = spinlock(&swap_lock);
+    for (uint32_t i = 0; i < swap_area.pages; i++) {
+        uint32_t slot = (swap_area.hint + i) % swap_area.pages;
+        if (!swap_area.map[slot]) {
+            swap_area.map[slot] = 1;
+            swap_area.used++;
+            swap_area.hint = slot + 1;
+            spinlock_unlock(&swap_lock, r);
+            return (int32_t) slot;
+        }
+    }
+    spinlock_unlock(&swap_lock, r);
+    return -1;
+}
+
+// another pte now points at the slot, a fork copied it
+void swap_dup(uint32_t entry) {
+    uint32_t slot = swap_pte_slot(entry);
+    if (swap_pte_is_zram(entry)) {
+        zram_dup(slot);
+        return;
+    }
+
+    bool r = spinlock(&swap_lock);
+    if (slot < swap_area.pages && swap_area.map[slot] && swap_area.map[slot] < SWAP_MAP_MAX) {
+        swap_area.map[slot]++;
+    }
+    spinlock_unlock(&swap_lock, r);
+}
+
+// a pte stopped pointing at the slot, the last one gives it back
+// a slot whose count saturated stays allocated for good
+void swap_free(uint32_t entry) {
+    uint32_t slot = swap_pte_slot(entry);
+    if (swap_pte_is_zram(entry)) {
+        zram_free(slot);
+        return;
+    }
+
+    bool r = spinlock(&swap_lock);
+    if (slot < swap_area.pages && swap_area.map[slot] && swap_area.map[slot] < SWAP_MAP_MAX) {
+        if (--swap_area.map[slot] == 0) {
+            swap_area.used--;
+        }
+    }
+    spinlock_unlock(&swap_lock, r);
+}
+
+void swap_usage(uint32_t* out_total, uint32_t* out_used) {
+    bool r = spinlock(&swap_lock);
+    if (out_total) {
+        *out_total = swap_area.pages;
+    }
+    if (out_used) {
+        *out_used = swap_area.used;
+    }
+    spinlock_unlock(&swap_lock, r);
+}
+
+static void swap_internal_io(uint32_t slot, uintptr_t frame, bool write) {
+    uint32_t lba = swap_area.lba + slot * SWAP_SECTORS_PER_PAGE;
+    if (write) {
+        ata_write(swap_area.drive, lba, SWAP_SECTORS_PER_PAGE, (uint8_t*) frame, false);
+    } else {
+        ata_read(swap_area.drive, lba, SWAP_SECTORS_PER_PAGE, (uint8_t*) frame, false);
+    }
+}
+
+// only private anonymous 4 KiB frames can go out, and a frame mapped more than once only when the reverse map
+// can find every pte of it; cow, file and zero page frames are shared and huge pages are never split for this
+static bool swap_internal_eligible(vmm_region_t* region, uintptr_t va, uint32_t pte) {
+    if (!(pte & PAGE_PRESENT) || (pte & (PAGE_COW | PAGE_SHARED | PAGE_FILE))) {
+        return false;
+    }
+
+    if ((pte & PAGE_MASK) == vma_zero_page() || vmm_is_huge(region, va)) {
+        return false;
+    }
+
+    struct page* page = phys_to_page_index(pte & PAGE_MASK);
+    if (!page || (page->refs && !rmap_is_anon(pte & PAGE_MASK))) {
+        return false;
+    }
+
+    vmm_vma_t* vma = vma_find(region, va);
+    return vma && vma->kind == VMA_KIND_ANON && !vma->file;
+}
+
+// move the page at va into the compressed pool, or out to disk if it does not compress, and free its frame
+// region's directory has to be loaded
+static bool swap_internal_out(vmm_region_t* region, uintptr_t va) {
+    uint32_t pte = vmm_get_pte(region, va);
+    if (!swap_internal_eligible(region, va, pte)) {
+        return false;
+    }
+
+    uintptr_t frame = pte & PAGE_MASK;
+    uint32_t entry;
+    uint32_t zslot;
+    int32_t slot = -1;
+    if (zram_store(frame, &zslot) == 0) {
+        entry = swap_pte_make_zram(zslot);
+    } else if ((slot = swap_internal_alloc_slot()) >= 0) {
+        entry = swap_pte_make((uint32_t) slot);
+    } else {
+        return false;
+    }
+
+    // unmap every pte before the disk write, so nothing can write to the frame while it is on its way out;
+    // the reference taken here keeps the frame until the write is done
+    pmm_page_get(frame);
+    int unmapped;
+    if (rmap_is_anon(frame)) {
+        unmapped = rmap_unmap_frame(frame, entry);
+    } else {
+        bool r;
+        unmapped = vmm_pt_trylock(region, va, &r);
+        if (unmapped) {
+            unmapped = vmm_set_swap_entry(region, va, entry) == 0;
+            vmm_pt_unlock(region, va, r);
+        }
+        if (unmapped) {
+            pmm_page_put(frame);
+        }
+    }
+
+    if (!unmapped) {
+        swap_free(entry);
+        pmm_page_put(frame);
+        return false;
+    }
+
+    if (slot >= 0) {
+        swap_internal_io((uint32_t) slot, frame, true);
+    }
+    pmm_page_put(frame);
+    return true;
+}
+
+typedef struct swap_scan {
+    uint32_t budget;       // pages left to look at
+    vmm_region_t* resume;  // region the last scan stopped in, skipped up to until it is seen
+    uintptr_t resume_va;
+} swap_scan_t;
+
+// sort the resident anonymous pages of a region onto the lists by their accessed bit, from the cursor on
+static bool swap_internal_scan_region(vmm_region_t* region, void* ctx) {
+    swap_scan_t* scan = (swap_scan_t*) ctx;
+    uintptr_t from = 0;
+
+    if (scan->resume) {
+        if (region != scan->resume) {
+            return true;
+        }
+        scan->resume = NULL;
+        from = scan->resume_va;
+    }
+
+    // the kernel region has no areas and keeps its pages; the areas hold still under the mm_sem foreach holds
+    if (!region->pt_live) {
+        return true;
+    }
+
+    uint32_t* saved = read_pd();
+    load_pd(region->pg_dir);
+
+    for (vmm_vma_t* vma = region->vma_list; vma; vma = vma->next) {
+        if (vma->kind != VMA_KIND_ANON || vma->file || vma->end <= from) {
+            continue;
+        }
+
+        for (uintptr_t va = vma->start > from ? vma->start : from; va < vma->end; va += PAGE_SIZE) {
+            if (!scan->budget || swap_inactive.count == SWAP_LRU_SIZE || swap_active.count == SWAP_LRU_SIZE) {
+                swap_scan_region = region;
+                swap_scan_va = va;
+                load_pd(saved);
+                return false;
+            }
+            scan->budget--;
+
+            if (!swap_internal_eligible(region, va, vmm_get_pte(region, va))) {
+                continue;
+            }
+
+            if (vmm_test_and_clear_accessed(region, va)) {
+                swap_internal_lru_push(&swap_active, region, va);
+            } else {
+                swap_internal_lru_push(&swap_inactive, region, va);
+            }
+        }
+    }
+
+    load_pd(saved);
+    return true;
+}
+
+static void swap_internal_scan(uint32_t budget) {
+    swap_scan_t scan = {budget, swap_scan_region, swap_scan_va};
+
+    // a scan that runs off the last region wraps around to the first one next time
+    swap_scan_region = NULL;
+    swap_scan_va = 0;
+    vmm_region_foreach(swap_internal_scan_region, &scan);
+
+    // the region the cursor was in is gone, start over from the top
+    if (scan.resume) {
+        scan.resume = NULL;
+        vmm_region_foreach(swap_internal_scan_region, &scan);
+    }
+}
+
+// whether the page was touched since it was last looked at, clearing the bit for the next period, or -1 when its
+// page table is busy; the caller holds the region's mm_sem shared, so the table cannot be reclaimed under it
+static int swap_internal_referenced(swap_lru_entry_t* entry) {
+    bool r;
+    if (!vmm_pt_trylock(entry->region, entry->va, &r)) {
+        return -1;
+    }
+
+    uint32_t* saved = read_pd();
+    load_pd(entry->region->pg_dir);
+    int referenced = vmm_test_and_clear_accessed(entry->region, entry->va);
+    load_pd(saved);
+
+    vmm_pt_unlock(entry->region, entry->va, r);
+    return referenced;
+}
+
+// one pass over the active list: pages touched again stay, the rest are demoted, and a page whose region or page
+// table is busy loses its hint; swap_lru_lock is held, which keeps a region whose entries are still listed alive
+static void swap_internal_age_active(void) {
+    uint32_t n = swap_active.count;
+    swap_lru_entry_t entry;
+    for (uint32_t i = 0; i < n && swap_internal_lru_pop(&swap_active, &entry); i++) {
+        if (!rwsem_try_down_read(&entry.region->mm_sem)) {
+            continue;
+        }
+
+        int referenced = swap_internal_referenced(&entry);
+        if (referenced > 0 || (!referenced && !swap_internal_lru_push(&swap_inactive, entry.region, entry.va))) {
+            swap_internal_lru_push(&swap_active, entry.region, entry.va);
+        }
+        rwsem_up_read(&entry.region->mm_sem);
+    }
+}
+
+// write up to pages cold anonymous pages out to the swap area, returns how many frames were freed
+size_t swap_reclaim(size_t pages) {
+    if ((!swap_area.map && !zram_enabled()) || !pages) {
+        return 0;
+    }
+
+    size_t freed = 0;
+    uint32_t budget = SWAP_LRU_SIZE * 4;
+    while (freed < pages && budget) {
+        bool r = spinlock(&swap_lru_lock);
+        if (!swap_inactive.count) {
+            swap_internal_age_active();
+            swap_internal_scan(SWAP_LRU_SIZE);
+        }
+
+        // the candidate's region is taken shared before the list lets go of it: its teardown holds it exclusive
+        // before dropping the region's entries here, so the region outlives the unlocked part below. a busy
+        // region's page is dropped from the list, the next scan finds it again
+        swap_lru_entry_t entry;
+        bool popped = swap_internal_lru_pop(&swap_inactive, &entry);
+        bool held = popped && rwsem_try_down_read(&entry.region->mm_sem);
+        spinlock_unlock(&swap_lru_lock, r);
+        if (!popped) {
+            break;
+        }
+        budget--;
+        if (!held) {
+            continue;
+        }
+
+        // referenced while it sat on the inactive list, it gets another period; the write out may wait on the
+        // disk, so it runs with no spinlock held
+        int referenced = swap_internal_referenced(&entry);
+        if (referenced > 0) {
+            r = spinlock(&swap_lru_lock);
+            swap_internal_lru_push(&swap_active, entry.region, entry.va);
+            spinlock_unlock(&swap_lru_lock, r);
+        } else if (!referenced) {
+            uint32_t* saved = read_pd();
+            load_pd(entry.region->pg_dir);
+            freed += swap_internal_out(entry.region, entry.va);
+            load_pd(saved);
+        }
+        rwsem_up_read(&entry.region->mm_sem);
+    }
+    return freed;
+}
+
+// read the page behind a swap entry into a fresh frame; may reclaim and wait on the disk
+static uintptr_t swap_internal_fetch(uint32_t entry) {
+    uint32_t slot = swap_pte_slot(entry);
+    bool zram = swap_pte_is_zram(entry);
+
+    uintptr_t frame = (uintptr_t) pmm_alloc_page();
+    if (!frame && swap_reclaim(SWAP_CLUSTER)) {
+        frame = (uintptr_t) pmm_alloc_page();
+    }
+    if (!frame) {
+        log("swap_in: out of frames\n", RED);
+        return 0;
+    }
+
+    if (zram && zram_load(slot, frame) < 0) {
+        pmm_free_page((void*) frame);
+        return 0;
+    }
+
+    if (!zram) {
+        swap_internal_io(slot, frame, false);
+        if (zram_enabled()) {
+            zram_note_miss();
+        }
+    }
+    return frame;
+}
+
+// bring the page behind a swap entry back into a fresh frame mapped at va with flags
+// the caller holds va's page table lock through *r; it is dropped while the page is read, with the slot pinned
+// so it cannot be handed to another page meanwhile, and taken again to map the frame if the entry is still there
+int swap_in(vmm_region_t* region, uintptr_t va, uint32_t entry, uint32_t flags, bool* r) {
+    uint32_t slot = swap_pte_slot(entry);
+    if (!swap_pte_is_zram(entry) && (!swap_area.map || slot >= swap_area.pages)) {
+        return -1;
+    }
+
+    swap_dup(entry);
+    vmm_pt_unlock(region, va, *r);
+    uintptr_t frame = swap_internal_fetch(entry);
+    *r = vmm_pt_lock(region, va);
+
+    // another thread of the region faulted the page in while the table was unlocked, its copy stands
+    int status = frame ? 0 : -1;
+    if (frame && vmm_get_pte(region, va) != entry) {
+        pmm_free_page((void*) frame);
+        frame = 0;
+    }
+
+    // mapping over the entry hands the pte's reference on the slot back
+    if (frame && vmm_map(region, va, frame, flags) < 0) {
+        pmm_free_page((void*) frame);
+        frame = 0;
+        status = -1;
+    }
+    swap_free(entry);
+
+    if (!frame) {
+        return status;
+    }
+
+    vmm_vma_t* vma = vma_find(region, va);
+    if (vma) {
+        rmap_add_anon(vma, va, frame, 1);
+    }
+
+    // a page that was just faulted in is in use
+    bool lru_r = spinlock(&swap_lru_lock);
+    swap_internal_lru_push(&swap_active, region, va);
+    spinlock_unlock(&swap_lru_lock, lru_r);
+    return 0;
+}
+
+// drop every hint that points into a region that is going away
+void swap_forget_region(vmm_region_t* region) {
+    bool r = spinlock(&swap_lru_lock);
+    swap_internal_lru_forget(&swap_active, region);
+    swap_internal_lru_forget(&swap_inactive, region);
+    if (swap_scan_region == region) {
+        swap_scan_region = NULL;
+        swap_scan_va = 0;
+    }
+    spinlock_unlock(&swap_lru_lock, r);
+}
@@ -0,0 +1,54 @@
+#ifndef SWAP_H
+#define SWAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "paging.h"
+#include "vmm.h"
+
+// a non-present pte with this bit set keeps a swap slot in its frame bits
+#define SWAP_PTE_MARK 0x2
+// the slot is one of the compressed pool's rather than the disk's
+#define SWAP_PTE_ZRAM 0x4
+
+// default swap area, the slave disk on the primary channel from its first sector on
+#define SWAP_ATA_DRIVE 1
+#define SWAP_START_LBA 0
+#define SWAP_AREA_PAGES 16384
+
+// entries held on each of the active and inactive lists
+#define SWAP_LRU_SIZE 256
+// pages written out per reclaim when the caller needs just one
+#define SWAP_CLUSTER 16
+
+static inline bool swap_pte_is_entry(uint32_t pte) {
+    return (pte & (PAGE_PRESENT | SWAP_PTE_MARK)) == SWAP_PTE_MARK;
+}
+
+static inline uint32_t swap_pte_slot(uint32_t pte) {
+    return pte >> PAGE_SIZE_SHIFT;
+}
+
+static inline bool swap_pte_is_zram(uint32_t pte) {
+    return swap_pte_is_entry(pte) && (pte & SWAP_PTE_ZRAM);
+}
+
+static inline uint32_t swap_pte_make(uint32_t slot) {
+    return (slot << PAGE_SIZE_SHIFT) | SWAP_PTE_MARK;
+}
+
+static inline uint32_t swap_pte_make_zram(uint32_t slot) {
+    return (slot << PAGE_SIZE_SHIFT) | SWAP_PTE_MARK | SWAP_PTE_ZRAM;
+}
+
+void swap_init(void);
+int swap_on(uint8_t drive, uint32_t lba, uint32_t pages);
+void swap_dup(uint32_t entry);
+void swap_free(uint32_t entry);
+int swap_in(vmm_region_t* region, uintptr_t va, uint32_t entry, uint32_t flags, bool* r);
+size_t swap_reclaim(size_t pages);
+void swap_forget_region(vmm_region_t* region);
+void swap_usage(uint32_t* out_total, uint32_t* out_used);
+
+#endif // SWAP_H
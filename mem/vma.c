@@ -0,0 +1,1089 @@
+/*
+
+Copyright 2024-2026 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of The Flopperating System.
+
+The Flopperating System is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+The Flopperating System is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with The Flopperating System. If not, see <https://www.gnu.org/licenses/>.
+
+[DESCRIPTION] - virtual memory areas and demand paging
+
+*/
+#include <stdint.h>
+#include "vma.h"
+#include "vmm.h"
+#include "swap.h"
+#include "rmap.h"
+#include "pmm.h"
+#include "alloc.h"
+#include "paging.h"
+#include "utils.h"
+#include "../task/process.h"
+#include "../task/sched.h"
+#include "../fs/vfs/vfs.h"
+#include "../lib/logging.h"
+
+// one read only frame of zeroes shared by every untouched anonymous page in the system
+static uintptr_t vma_zero_pa = 0;
+
+void vma_init(void) {
+    vma_zero_pa = (uintptr_t) pmm_alloc_page();
+    if (!vma_zero_pa) {
+        log("vma_init: pmm_alloc_page failed for the zero page\n", RED);
+        return;
+    }
+
+    flop_memset((void*) vma_zero_pa, 0, PAGE_SIZE);
+    log("vma: init - ok\n", GREEN);
+}
+
+uintptr_t vma_zero_page(void) {
+    return vma_zero_pa;
+}
+
+static vmm_vma_t* vma_internal_alloc(uintptr_t start, uintptr_t end, uint32_t prot, vma_kind_t kind) {
+    vmm_vma_t* vma = (vmm_vma_t*) kmalloc(sizeof(vmm_vma_t));
+    if (!vma) {
+        log("vma_internal_alloc: kmalloc failed\n", RED);
+        return NULL;
+    }
+
+    vma->start = start;
+    vma->end = end;
+    vma->prot = prot;
+    vma->kind = kind;
+    vma->advice = MADV_NORMAL;
+    vma->lazy_free = false;
+    vma->file_ops = NULL;
+    vma->file = NULL;
+    vma->pgoff = 0;
+    vma->next = NULL;
+    vma->region = NULL;
+    vma->anon = NULL;
+    vma->anon_next = NULL;
+    vma->file_next = NULL;
+    return vma;
+}
+
+// every vma that points at a file holds one reference on the file's mapping handle
+static void vma_internal_file_ref(vmm_vma_t* vma, int delta) {
+    if (vma->file) {
+        vma->file_ops->mmap_ref(vma->file, delta);
+    }
+}
+
+static void vma_internal_free(vmm_vma_t* vma) {
+    rmap_vma_unlink(vma);
+    vma_internal_file_ref(vma, -1);
+    kfree(vma, sizeof(vmm_vma_t));
+}
+
+// keep the list sorted by start address; a fresh area joins the reverse map here,
+// copies of an existing one already joined it when they were made
+static void vma_internal_insert(vmm_region_t* region, vmm_vma_t* vma) {
+    if (!vma->region) {
+        vma->region = region;
+        rmap_vma_link(vma);
+    }
+
+    vmm_vma_t** link = &region->vma_list;
+    while (*link && (*link)->start < vma->start) {
+        link = &(*link)->next;
+    }
+    vma->next = *link;
+    *link = vma;
+}
+
+static vmm_vma_t* vma_internal_first_overlap(vmm_region_t* region, uintptr_t start, uintptr_t end) {
+    for (vmm_vma_t* vma = region->vma_list; vma && vma->start < end; vma = vma->next) {
+        if (vma->end > start) {
+            return vma;
+        }
+    }
+    return NULL;
+}
+
+// make sure no vma straddles va, so both sides of it can be edited on their own
+static int vma_internal_split_at(vmm_region_t* region, uintptr_t va) {
+    vmm_vma_t* vma = vma_find(region, va);
+    if (!vma || vma->start == va) {
+        return 0;
+    }
+
+    vmm_vma_t* tail = (vmm_vma_t*) kmalloc(sizeof(vmm_vma_t));
+    if (!tail) {
+        log("vma_internal_split_at: kmalloc failed\n", RED);
+        return -1;
+    }
+
+    *tail = *vma;
+    tail->start = va;
+    tail->pgoff += (va - vma->start) / PAGE_SIZE;
+    vma_internal_file_ref(tail, 1);
+    rmap_vma_link(tail);
+    vma->end = va;
+    vma->next = tail;
+    return 0;
+}
+
+// first mapped page in [start, end), or 0 if nothing there is backed; empty page tables are skipped whole
+static uintptr_t vma_internal_first_mapped(vmm_region_t* region, uintptr_t start, uintptr_t end) {
+    uintptr_t va = start;
+    while (va < end) {
+        if (!(vmm_get_pde(region, va) & PAGE_PRESENT)) {
+            uintptr_t next = (va & HUGE_PAGE_MASK) + HUGE_PAGE_SIZE;
+            if (next < va) {
+                break;
+            }
+            va = next;
+            continue;
+        }
+
+        if (vmm_is_mapped(region, va)) {
+            return va;
+        }
+        va += PAGE_SIZE;
+    }
+    return 0;
+}
+
+vmm_vma_t* vma_find(vmm_region_t* region, uintptr_t va) {
+    for (vmm_vma_t* vma = region->vma_list; vma && vma->start <= va; vma = vma->next) {
+        if (va < vma->end) {
+            return vma;
+        }
+    }
+    return NULL;
+}
+
+// reserve [start, end), replacing whatever areas overlapped it
+int vma_map(vmm_region_t* region, uintptr_t start, uintptr_t end, uint32_t prot, vma_kind_t kind) {
+    if (!region || start >= end || (start & ~PAGE_MASK) || (end & ~PAGE_MASK)) {
+        return -1;
+    }
+
+    vmm_vma_t* vma = vma_internal_alloc(start, end, prot, kind);
+    if (!vma) {
+        return -1;
+    }
+
+    if (vma_unmap(region, start, end) < 0) {
+        kfree(vma, sizeof(vmm_vma_t));
+        return -1;
+    }
+
+    vma_internal_insert(region, vma);
+    return 0;
+}
+
+// reserve [start, end) for page pgoff onwards of node, faulted in straight from the file's own frames;
+// fails when the filesystem cannot hand out its pages, so the caller can fall back to a copy
+int vma_map_file(
+    vmm_region_t* region, uintptr_t start, uintptr_t end, uint32_t prot, struct vfs_node* node, uint32_t pgoff, bool shared) {
+    if (!region || start >= end || (start & ~PAGE_MASK) || (end & ~PAGE_MASK)) {
+        return -1;
+    }
+
+    struct vfs_op_tbl* ops = NULL;
+    void* file = vfs_mmap(node, &ops);
+    if (!file) {
+        return -1;
+    }
+
+    vmm_vma_t* vma = vma_internal_alloc(start, end, prot | (shared ? PAGE_SHARED : 0), VMA_KIND_FILE);
+    if (!vma) {
+        ops->mmap_ref(file, -1);
+        return -1;
+    }
+    vma->file_ops = ops;
+    vma->file = file;
+    vma->pgoff = pgoff;
+
+    if (vma_unmap(region, start, end) < 0) {
+        vma_internal_free(vma);
+        return -1;
+    }
+
+    vma_internal_insert(region, vma);
+    return 0;
+}
+
+// forget [start, end), trimming or splitting areas that only partly overlap; frames are the caller's business
+int vma_unmap(vmm_region_t* region, uintptr_t start, uintptr_t end) {
+    if (vma_internal_split_at(region, start) < 0 || vma_internal_split_at(region, end) < 0) {
+        return -1;
+    }
+
+    vmm_vma_t** link = &region->vma_list;
+    while (*link && (*link)->start < end) {
+        vmm_vma_t* vma = *link;
+        if (vma->start >= start) {
+            *link = vma->next;
+            vma_internal_free(vma);
+            continue;
+        }
+        link = &vma->next;
+    }
+    return 0;
+}
+
+// apply prot to the backed pages of [start, end); runs of private pages go through one range update,
+// cow frames stay read only until written
+static int vma_internal_protect_pages(vmm_region_t* region, uintptr_t start, uintptr_t end, uint32_t prot) {
+    int status = 0;
+    uintptr_t run = start;
+    for (uintptr_t va = start; va < end; va += PAGE_SIZE) {
+        uint32_t cur = vmm_get_flags(region, va);
+        if ((cur & PAGE_PRESENT) && !(cur & PAGE_COW)) {
+            continue;
+        }
+
+        if (va > run && vmm_protect_range(region, run, (va - run) / PAGE_SIZE, prot) < 0) {
+            status = -1;
+        }
+        if ((cur & PAGE_COW) && vmm_protect(region, va, (prot & ~PAGE_RW) | PAGE_COW) < 0) {
+            status = -1;
+        }
+        run = va + PAGE_SIZE;
+    }
+
+    if (end > run && vmm_protect_range(region, run, (end - run) / PAGE_SIZE, prot) < 0) {
+        status = -1;
+    }
+    return status;
+}
+
+// change the protection of [start, end) for pages faulted in later and for the ones already backed
+int vma_protect(vmm_region_t* region, uintptr_t start, uintptr_t end, uint32_t prot) {
+    if (vma_internal_split_at(region, start) < 0 || vma_internal_split_at(region, end) < 0) {
+        return -1;
+    }
+
+    // areas keep their shared bit, gaps between them are pages mapped without an area
+    int status = 0;
+    uintptr_t va = start;
+    while (va < end) {
+        vmm_vma_t* vma = vma_find(region, va);
+        uintptr_t stop = end;
+        uint32_t flags = prot;
+
+        if (vma) {
+            vma->prot = prot | (vma->prot & PAGE_SHARED);
+            flags = vma->prot;
+            stop = vma->end;
+        } else {
+            vmm_vma_t* next = vma_internal_first_overlap(region, va, end);
+            stop = next ? next->start : end;
+        }
+
+        if (vma_internal_protect_pages(region, va, stop, flags) < 0) {
+            status = -1;
+        }
+        va = stop;
+    }
+    return status;
+}
+
+// move the area describing [old_start, old_start + old_len) to [new_start, new_start + new_len),
+// ranges that were mapped without an area get an anonymous one with prot
+int vma_remap(
+    vmm_region_t* region, uintptr_t old_start, size_t old_len, uintptr_t new_start, size_t new_len, uint32_t prot) {
+    vmm_vma_t* src = vma_find(region, old_start);
+
+    vmm_vma_t* vma = vma_internal_alloc(new_start, new_start + new_len, prot, VMA_KIND_ANON);
+    if (!vma) {
+        return -1;
+    }
+
+    if (src) {
+        *vma = *src;
+        vma->start = new_start;
+        vma->end = new_start + new_len;
+        vma->pgoff += (old_start - src->start) / PAGE_SIZE;
+        vma_internal_file_ref(vma, 1);
+        // linked before the old area goes, so the anon they share outlives the move
+        rmap_vma_link(vma);
+    }
+
+    if (vma_unmap(region, old_start, old_start + old_len) < 0 || vma_unmap(region, new_start, new_start + new_len) < 0) {
+        vma_internal_free(vma);
+        return -1;
+    }
+
+    vma_internal_insert(region, vma);
+    return 0;
+}
+
+// every page of [start, end) is either reserved by an area or already mapped
+bool vma_range_covered(vmm_region_t* region, uintptr_t start, uintptr_t end) {
+    uintptr_t va = start;
+    while (va < end) {
+        vmm_vma_t* vma = vma_find(region, va);
+        if (vma) {
+            va = vma->end;
+            continue;
+        }
+
+        if (!vmm_is_mapped(region, va)) {
+            return false;
+        }
+        va += PAGE_SIZE;
+    }
+    return true;
+}
+
+// nothing in [start, end) is reserved or mapped
+bool vma_range_free(vmm_region_t* region, uintptr_t start, uintptr_t end) {
+    if (end > KERNEL_VIRT_BASE || end < start) {
+        return false;
+    }
+
+    return !vma_internal_first_overlap(region, start, end) && !vma_internal_first_mapped(region, start, end);
+}
+
+// find len bytes of user address space that no area reserves and no page maps
+uintptr_t vma_find_free(vmm_region_t* region, size_t len, size_t align) {
+    uintptr_t va = ALIGN_UP(region->base_va ? region->base_va : PAGE_SIZE, align);
+
+    while (va && va < KERNEL_VIRT_BASE && KERNEL_VIRT_BASE - va >= len) {
+        vmm_vma_t* hit = vma_internal_first_overlap(region, va, va + len);
+        if (hit) {
+            va = ALIGN_UP(hit->end, align);
+            continue;
+        }
+
+        uintptr_t used = vma_internal_first_mapped(region, va, va + len);
+        if (!used) {
+            return va;
+        }
+        va = ALIGN_UP(used + PAGE_SIZE, align);
+    }
+    return 0;
+}
+
+// duplicate the area list of a forked region
+int vma_copy(vmm_region_t* src, vmm_region_t* dst) {
+    vmm_vma_t** tail = &dst->vma_list;
+    dst->vma_list = NULL;
+
+    for (vmm_vma_t* vma = src->vma_list; vma; vma = vma->next) {
+        vmm_vma_t* copy = (vmm_vma_t*) kmalloc(sizeof(vmm_vma_t));
+        if (!copy) {
+            log("vma_copy: kmalloc failed\n", RED);
+            vma_destroy_all(dst);
+            return -1;
+        }
+
+        *copy = *vma;
+        copy->next = NULL;
+        copy->region = dst;
+        vma_internal_file_ref(copy, 1);
+        rmap_vma_link(copy);
+        *tail = copy;
+        tail = &copy->next;
+    }
+    return 0;
+}
+
+static void vma_internal_cancel_prefetch(vmm_region_t* region);
+
+void vma_destroy_all(vmm_region_t* region) {
+    vma_internal_cancel_prefetch(region);
+
+    vmm_vma_t* vma = region->vma_list;
+    while (vma) {
+        vmm_vma_t* next = vma->next;
+        vma_internal_free(vma);
+        vma = next;
+    }
+    region->vma_list = NULL;
+}
+
+// grab a frame for a fault, falling back to lazily freed pages and then to swapping cold pages out
+// the fallbacks may sleep, so no page table lock may be held across this
+static uintptr_t vma_internal_alloc_page(void) {
+    uintptr_t pa = (uintptr_t) pmm_alloc_page();
+    if (!pa && (vma_reclaim_lazy(1) || swap_reclaim(SWAP_CLUSTER))) {
+        pa = (uintptr_t) pmm_alloc_page();
+    }
+    return pa;
+}
+
+// whether the pte at page still says what it said before its table was unlocked; the cpu may have set the
+// accessed and dirty bits in between
+static bool vma_internal_pte_same(vmm_region_t* region, uintptr_t page, uint32_t entry) {
+    return ((vmm_get_pte(region, page) ^ entry) & ~(PAGE_ACCESSED | PAGE_DIRTY)) == 0;
+}
+
+// give a page that sits on a shared frame its own copy, dropping the reference it held on the old one
+// the caller holds page's table lock through *r, which is dropped if memory has to be reclaimed first
+static int vma_internal_break_cow(vmm_region_t* region, vmm_vma_t* vma, uintptr_t page, bool* r) {
+    uint32_t entry = vmm_get_pte(region, page);
+    if (!(entry & PAGE_PRESENT) || !(entry & PAGE_COW)) {
+        return -1;
+    }
+
+    uintptr_t new_pa = (uintptr_t) pmm_alloc_page();
+    if (!new_pa) {
+        vmm_pt_unlock(region, page, *r);
+        new_pa = vma_internal_alloc_page();
+        *r = vmm_pt_lock(region, page);
+    }
+    if (!new_pa) {
+        log("vma_internal_break_cow: out of frames\n", RED);
+        return -1;
+    }
+
+    // another thread broke the share or reclaim took the page while the table was unlocked; the access is
+    // retried against whatever is there now
+    if (!vma_internal_pte_same(region, page, entry)) {
+        pmm_free_page((void*) new_pa);
+        return 0;
+    }
+
+    uintptr_t old_pa = vmm_resolve(region, page) & PAGE_MASK;
+
+    if (old_pa == vma_zero_pa) {
+        flop_memset((void*) new_pa, 0, PAGE_SIZE);
+    } else {
+        flop_memcpy((void*) new_pa, (void*) old_pa, PAGE_SIZE);
+    }
+
+    if (vmm_map(region, page, new_pa, vma->prot) < 0) {
+        pmm_free_page((void*) new_pa);
+        return -1;
+    }
+    rmap_add_anon(vma, page, new_pa, 1);
+
+    if (old_pa != vma_zero_pa) {
+        pmm_page_put(old_pa);
+    }
+    return 0;
+}
+
+// map pages contiguous pages at va of vma, either all onto the zero page or onto fresh zeroed frames
+static int
+vma_internal_map_run(vmm_region_t* region, vmm_vma_t* vma, uintptr_t va, size_t pages, uint32_t flags, bool zero) {
+    uintptr_t frames[VMA_FAULT_AROUND_MAX];
+
+    if (zero) {
+        for (size_t i = 0; i < pages; i++) {
+            frames[i] = vma_zero_pa;
+        }
+    } else {
+        size_t got = pmm_alloc_bulk(frames, pages);
+        if (got < pages) {
+            for (size_t i = 0; i < got; i++) {
+                pmm_free_page((void*) frames[i]);
+            }
+            return -1;
+        }
+
+        for (size_t i = 0; i < pages; i++) {
+            flop_memset((void*) frames[i], 0, PAGE_SIZE);
+        }
+    }
+
+    if (vmm_map_scatter(region, va, frames, pages, flags) < 0) {
+        for (size_t i = 0; !zero && i < pages; i++) {
+            pmm_free_page((void*) frames[i]);
+        }
+        return -1;
+    }
+
+    for (size_t i = 0; !zero && i < pages; i++) {
+        rmap_add_anon(vma, va + i * PAGE_SIZE, frames[i], 1);
+    }
+    return 0;
+}
+
+// back every untouched page of [start, end) of vma, which spans at most VMA_FAULT_AROUND_MAX
+static int vma_internal_fill(
+    vmm_region_t* region, vmm_vma_t* vma, uintptr_t start, uintptr_t end, uint32_t flags, bool zero) {
+    uintptr_t run = start;
+    for (uintptr_t va = start; va <= end; va += PAGE_SIZE) {
+        if (va < end && !vmm_is_mapped(region, va)) {
+            continue;
+        }
+
+        size_t pages = (va - run) / PAGE_SIZE;
+        if (pages && vma_internal_map_run(region, vma, run, pages, flags, zero) < 0) {
+            return -1;
+        }
+        run = va + PAGE_SIZE;
+    }
+    return 0;
+}
+
+// the fault-around window for page, sized by the area's access pattern advice and clipped to it
+static void vma_internal_window(vmm_vma_t* vma, uintptr_t page, uintptr_t* out_start, uintptr_t* out_end) {
+    uintptr_t start = page & ~(VMA_FAULT_AROUND_PAGES * PAGE_SIZE - 1);
+    size_t pages = VMA_FAULT_AROUND_PAGES;
+
+    if (vma->advice == MADV_RANDOM) {
+        start = page;
+        pages = 1;
+    } else if (vma->advice == MADV_SEQUENTIAL) {
+        // a sequential reader wants what comes after the fault, not what came before it
+        start = page;
+        pages = VMA_FAULT_AROUND_MAX;
+    }
+
+    uintptr_t end = start + pages * PAGE_SIZE;
+    *out_start = start < vma->start ? vma->start : start;
+    *out_end = end > vma->end || end < start ? vma->end : end;
+
+    // the window stays inside the faulting page's page table, the only one whose lock the fault holds
+    uintptr_t slot = page & HUGE_PAGE_MASK;
+    if (*out_end > slot + HUGE_PAGE_SIZE || *out_end < slot) {
+        *out_end = slot + HUGE_PAGE_SIZE;
+    }
+}
+
+// back the 4 MiB slot at base with one huge page, the frames of which all belong to vma's anon. the caller holds
+// base's table lock through *r, which is dropped while the block is zeroed; the slot is looked at again before the
+// block goes in, and it is given back if someone else filled the slot meanwhile
+static int vma_internal_map_huge(vmm_region_t* region, vmm_vma_t* vma, uintptr_t base, uintptr_t end, bool* r) {
+    if (end - base < HUGE_PAGE_SIZE || (vmm_get_pde(region, base) & PAGE_PRESENT)) {
+        return -1;
+    }
+
+    vmm_pt_unlock(region, base, *r);
+    uintptr_t pa = vmm_alloc_huge();
+    *r = vmm_pt_lock(region, base);
+    if (!pa) {
+        return -1;
+    }
+
+    if (vmm_map_huge(region, base, end, pa, vma->prot) < 0) {
+        vmm_free_huge(pa);
+        return -1;
+    }
+    rmap_add_anon(vma, base, pa, HUGE_PAGE_PAGES);
+    return 0;
+}
+
+// first touch of an anonymous page; reads share the zero page, writes get a private zeroed frame
+// the caller holds page's table lock through *r, which is dropped to zero a huge page or reclaim memory
+static int vma_internal_fault_anon(vmm_region_t* region, vmm_vma_t* vma, uintptr_t page, bool write, bool* r) {
+    // a write into an untouched 4 MiB slot that the area covers whole gets a huge page
+    uintptr_t base = page & HUGE_PAGE_MASK;
+    if (write && base >= vma->start && vma_internal_map_huge(region, vma, base, vma->end, r) == 0) {
+        return 0;
+    }
+
+    bool zero = !write && vma_zero_pa;
+    uint32_t flags = zero ? (vma->prot & ~PAGE_RW) | PAGE_COW : vma->prot;
+
+    // the untouched neighbours in the surrounding window are mapped in the same pass,
+    // so a scan over fresh memory traps once per window instead of once per page
+    uintptr_t start;
+    uintptr_t end;
+    vma_internal_window(vma, page, &start, &end);
+
+    if (vma_internal_fill(region, vma, start, end, flags, zero) == 0 && vmm_is_mapped(region, page)) {
+        return 0;
+    }
+
+    // short on memory, take back lazily freed pages or swap cold ones out and settle for the faulting page alone;
+    // the fill skips the page if another thread mapped it while the table was unlocked
+    if (!zero) {
+        vmm_pt_unlock(region, page, *r);
+        if (!vma_reclaim_lazy(1)) {
+            swap_reclaim(SWAP_CLUSTER);
+        }
+        *r = vmm_pt_lock(region, page);
+    }
+    if (vma_internal_fill(region, vma, page, page + PAGE_SIZE, flags, zero) < 0) {
+        log("vma_internal_fault_anon: out of frames\n", RED);
+        return -1;
+    }
+    return 0;
+}
+
+// map the file page behind va; shared areas get the file's frame itself, private ones get it read only
+// and copy it on the first write, which a write fault does straight away
+// the caller holds va's table lock through *r; reading the file and allocating the copy may sleep, so the
+// lock is dropped around them and the page is only mapped if nobody else mapped it meanwhile
+static int vma_internal_map_file_page(vmm_region_t* region, vmm_vma_t* vma, uintptr_t va, bool write, bool* r) {
+    bool shared = (vma->prot & PAGE_SHARED) != 0;
+    uintptr_t pa;
+    uintptr_t copy = 0;
+
+    vmm_pt_unlock(region, va, *r);
+    int status = vma->file_ops->get_page(vma->file, vma->pgoff + (va - vma->start) / PAGE_SIZE, &pa);
+    if (status == 0 && write && !shared) {
+        copy = vma_internal_alloc_page();
+        if (copy) {
+            flop_memcpy((void*) copy, (void*) pa, PAGE_SIZE);
+        } else {
+            log("vma_internal_map_file_page: out of frames\n", RED);
+            status = -1;
+        }
+    }
+    *r = vmm_pt_lock(region, va);
+
+    if (status < 0) {
+        return -1;
+    }
+    if (vmm_is_mapped(region, va)) {
+        if (copy) {
+            pmm_free_page((void*) copy);
+        }
+        return 0;
+    }
+
+    if (copy) {
+        if (vmm_map(region, va, copy, vma->prot) < 0) {
+            pmm_free_page((void*) copy);
+            return -1;
+        }
+        rmap_add_anon(vma, va, copy, 1);
+        return 0;
+    }
+
+    // private file frames are always cow, so a later mprotect to writable cannot expose the file's page
+    uint32_t flags = vma->prot | PAGE_FILE;
+    if (!shared) {
+        flags = (flags & ~PAGE_RW) | PAGE_COW;
+    }
+
+    pmm_page_get(pa);
+    if (vmm_map(region, va, pa, flags) < 0) {
+        pmm_page_put(pa);
+        return -1;
+    }
+    rmap_add_file(vma, va, pa);
+    return 0;
+}
+
+// map every untouched page of [start, end) that the file already holds, without copying any of them
+static void
+vma_internal_fill_file(vmm_region_t* region, vmm_vma_t* vma, uintptr_t start, uintptr_t end, bool* r) {
+    for (uintptr_t va = start; va < end; va += PAGE_SIZE) {
+        if (!vmm_is_mapped(region, va)) {
+            vma_internal_map_file_page(region, vma, va, false, r);
+        }
+    }
+}
+
+// first touch of a file page; the neighbours in the fault-around window come along read only
+static int vma_internal_fault_file(vmm_region_t* region, vmm_vma_t* vma, uintptr_t page, bool write, bool* r) {
+    uintptr_t start;
+    uintptr_t end;
+    vma_internal_window(vma, page, &start, &end);
+
+    if (vma_internal_map_file_page(region, vma, page, write, r) < 0) {
+        return -1;
+    }
+    vma_internal_fill_file(region, vma, start, end, r);
+    return 0;
+}
+
+static int vma_internal_resolve(vmm_region_t* region, uintptr_t va, uint32_t err) {
+    vmm_vma_t* vma = vma_find(region, va);
+    if (!vma) {
+        return -1;
+    }
+
+    if ((err & PF_ERR_WRITE) && !(vma->prot & PAGE_RW)) {
+        return -1;
+    }
+
+    if ((err & PF_ERR_USER) && !(vma->prot & PAGE_USER)) {
+        return -1;
+    }
+
+    uintptr_t page = va & PAGE_MASK;
+    bool write = (err & PF_ERR_WRITE) != 0;
+    bool major = false;
+    int status = -1;
+
+    // the pte is settled under its page table's lock, so threads faulting on the same page resolve it once;
+    // disk reads and reclaim drop the lock while they sleep and look at the pte again before installing anything
+    bool r = vmm_pt_lock(region, page);
+    uint32_t entry = vmm_get_pte(region, page);
+
+    // another thread of the process already did the work between the trap and the lock
+    if ((entry & PAGE_PRESENT) && (write ? (entry & PAGE_RW) != 0 : !(err & PF_ERR_PRESENT))) {
+        status = 0;
+    } else if (err & PF_ERR_PRESENT) {
+        // a protection fault is only ours to fix when it is a write to a shared frame
+        status = write ? vma_internal_break_cow(region, vma, page, &r) : -1;
+    } else if (swap_pte_is_entry(entry)) {
+        status = swap_in(region, page, entry, vma->prot, &r);
+        major = true;
+    } else if (vma->file) {
+        status = vma_internal_fault_file(region, vma, page, write, &r);
+    } else if (vma->kind == VMA_KIND_ANON) {
+        status = vma_internal_fault_anon(region, vma, page, write, &r);
+    }
+
+    // only a page read back from swap had to wait for the disk
+    if (status == 0 && major) {
+        region->rss.maj_faults++;
+    } else if (status == 0) {
+        region->rss.min_faults++;
+    }
+    vmm_pt_unlock(region, page, r);
+    return status;
+}
+
+// resolve a page fault against the current process's areas; returns 0 if the access can be retried
+int vma_handle_fault(uintptr_t va, uint32_t err) {
+    process_t* proc = proc_get_current();
+    if (!proc || !proc->region) {
+        return -1;
+    }
+
+    // faults only read the layout, so threads of one process fault in parallel; a fault taken while
+    // this thread changes the layout already holds it exclusive
+    vmm_region_t* region = proc->region;
+    bool shared = !rwsem_write_held(&region->mm_sem);
+    if (shared) {
+        rwsem_down_read(&region->mm_sem);
+    }
+
+    int status = vma_internal_resolve(region, va, err);
+
+    if (shared) {
+        rwsem_up_read(&region->mm_sem);
+    }
+    return status;
+}
+
+static bool vma_internal_is_anon(vmm_vma_t* vma) {
+    return vma->kind == VMA_KIND_ANON;
+}
+
+// pages of the area can be dropped and faulted back in, from zeroes or from the file
+static bool vma_internal_is_refaultable(vmm_vma_t* vma) {
+    return vma->kind == VMA_KIND_ANON || vma->file;
+}
+
+// every page of [start, end) lies in an area, and in one that satisfies ok if it is given
+static bool vma_internal_reserved(vmm_region_t* region, uintptr_t start, uintptr_t end, bool (*ok)(vmm_vma_t*)) {
+    uintptr_t va = start;
+    while (va < end) {
+        vmm_vma_t* vma = vma_find(region, va);
+        if (!vma || (ok && !ok(vma))) {
+            return false;
+        }
+        va = vma->end;
+    }
+    return true;
+}
+
+typedef struct vma_prefetch_job {
+    vmm_region_t* region;
+    uintptr_t start;
+    uintptr_t end;
+} vma_prefetch_job_t;
+
+#define VMA_PREFETCH_QUEUE 16
+
+static vma_prefetch_job_t vma_prefetch_queue[VMA_PREFETCH_QUEUE];
+static uint32_t vma_prefetch_head = 0;
+static uint32_t vma_prefetch_count = 0;
+static spinlock_t vma_prefetch_lock = SPINLOCK_INIT;
+static thread_t* vma_prefetch_thread = NULL;
+static bool vma_prefetch_waiting = true;
+// region the worker is populating right now, cleared when that region goes away under it
+static vmm_region_t* vma_prefetch_active = NULL;
+
+static void vma_internal_cancel_prefetch(vmm_region_t* region) {
+    bool r = spinlock(&vma_prefetch_lock);
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < vma_prefetch_count; i++) {
+        vma_prefetch_job_t job = vma_prefetch_queue[(vma_prefetch_head + i) % VMA_PREFETCH_QUEUE];
+        if (job.region != region) {
+            vma_prefetch_queue[(vma_prefetch_head + kept) % VMA_PREFETCH_QUEUE] = job;
+            kept++;
+        }
+    }
+    vma_prefetch_count = kept;
+
+    if (vma_prefetch_active == region) {
+        vma_prefetch_active = NULL;
+    }
+    spinlock_unlock(&vma_prefetch_lock, r);
+}
+
+// back the next chunk of [va, end) with private frames and return where the following chunk starts;
+// the region's directory has to be loaded, its page tables are only reachable through the recursive slot
+static uintptr_t vma_internal_prefetch_chunk(vmm_region_t* region, uintptr_t va, uintptr_t end) {
+    vmm_vma_t* vma = vma_find(region, va);
+    if (!vma) {
+        vmm_vma_t* next = vma_internal_first_overlap(region, va, end);
+        return next ? next->start : end;
+    }
+
+    uintptr_t stop = vma->end < end ? vma->end : end;
+    uintptr_t chunk = stop - va > VMA_FAULT_AROUND_MAX * PAGE_SIZE ? va + VMA_FAULT_AROUND_MAX * PAGE_SIZE : stop;
+    if (vma->kind != VMA_KIND_ANON && !vma->file) {
+        return stop;
+    }
+
+    // a chunk never leaves the page table it starts in, whose lock keeps faults off it meanwhile
+    uintptr_t slot_end = (va & HUGE_PAGE_MASK) + HUGE_PAGE_SIZE;
+    if (chunk > slot_end) {
+        chunk = slot_end;
+    }
+
+    bool r = vmm_pt_lock(region, va);
+    if (vma->file) {
+        vma_internal_fill_file(region, vma, va, chunk, &r);
+    } else if (!(va & ~HUGE_PAGE_MASK) && vma_internal_map_huge(region, vma, va, stop, &r) == 0) {
+        chunk = slot_end;
+    } else if (vma_internal_fill(region, vma, va, chunk, vma->prot, false) < 0) {
+        // out of frames, the rest of the hint is dropped
+        chunk = end;
+    }
+    vmm_pt_unlock(region, va, r);
+    return chunk;
+}
+
+// take the job's region shared unless it was cancelled; both under the queue lock, so a region being torn down
+// is either held here before its teardown takes it exclusive or never touched again
+static bool vma_internal_prefetch_enter(vma_prefetch_job_t* job, bool* cancelled) {
+    bool r = spinlock(&vma_prefetch_lock);
+    *cancelled = vma_prefetch_active != job->region;
+    bool got = !*cancelled && rwsem_try_down_read(&job->region->mm_sem);
+    spinlock_unlock(&vma_prefetch_lock, r);
+    return got;
+}
+
+static void vma_internal_prefetch(vma_prefetch_job_t* job) {
+    uintptr_t va = job->start;
+    bool cancelled = false;
+    while (va < job->end && !cancelled) {
+        // the areas can only be walked while nobody is changing them, a busy region is retried later
+        if (vma_internal_prefetch_enter(job, &cancelled)) {
+            uint32_t* saved = read_pd();
+            load_pd(job->region->pg_dir);
+            va = vma_internal_prefetch_chunk(job->region, va, job->end);
+            load_pd(saved);
+            rwsem_up_read(&job->region->mm_sem);
+        }
+
+        // let the owner run between chunks, it may already be touching the pages
+        sched_yield();
+    }
+}
+
+static void vma_prefetch_thread_entry(void) {
+    for (;;) {
+        bool r = spinlock(&vma_prefetch_lock);
+        if (!vma_prefetch_count) {
+            vma_prefetch_waiting = true;
+            spinlock_unlock(&vma_prefetch_lock, r);
+            sched_block();
+            continue;
+        }
+
+        vma_prefetch_job_t job = vma_prefetch_queue[vma_prefetch_head];
+        vma_prefetch_head = (vma_prefetch_head + 1) % VMA_PREFETCH_QUEUE;
+        vma_prefetch_count--;
+        vma_prefetch_active = job.region;
+        spinlock_unlock(&vma_prefetch_lock, r);
+
+        vma_internal_prefetch(&job);
+    }
+}
+
+void vma_prefetch_init(void) {
+    vma_prefetch_thread = sched_create_kernel_thread(vma_prefetch_thread_entry, 0, "vma_prefetch");
+    if (!vma_prefetch_thread) {
+        log("vma_prefetch_init: could not create the prefetch thread\n", RED);
+    }
+}
+
+// back [start, end) of the current region right away
+int vma_populate(vmm_region_t* region, uintptr_t start, uintptr_t end) {
+    if (!region || start >= end) {
+        return -1;
+    }
+
+    for (uintptr_t va = start; va < end;) {
+        va = vma_internal_prefetch_chunk(region, va, end);
+    }
+    return 0;
+}
+
+// hand [start, end) of the current region to the prefetch thread; a full queue drops the hint,
+// and without a worker the range is populated right here
+static void vma_internal_queue_prefetch(vmm_region_t* region, uintptr_t start, uintptr_t end) {
+    if (!vma_prefetch_thread) {
+        vma_populate(region, start, end);
+        return;
+    }
+
+    bool r = spinlock(&vma_prefetch_lock);
+    if (vma_prefetch_count < VMA_PREFETCH_QUEUE) {
+        vma_prefetch_job_t* job = &vma_prefetch_queue[(vma_prefetch_head + vma_prefetch_count) % VMA_PREFETCH_QUEUE];
+        job->region = region;
+        job->start = start;
+        job->end = end;
+        vma_prefetch_count++;
+    }
+
+    bool wake = vma_prefetch_waiting;
+    vma_prefetch_waiting = false;
+    spinlock_unlock(&vma_prefetch_lock, r);
+
+    if (wake) {
+        sched_unblock(vma_prefetch_thread);
+    }
+}
+
+// clear the dirty bits of [start, end) so a later write shows the page is wanted again
+static void vma_internal_mark_clean(vmm_region_t* region, uintptr_t start, uintptr_t end) {
+    for (uintptr_t va = start; va < end; va += PAGE_SIZE) {
+        uint32_t flags = vmm_get_flags(region, va);
+        if (!(flags & PAGE_DIRTY)) {
+            continue;
+        }
+
+        // a 4 MiB page that lies inside the range keeps its pde instead of being split
+        uintptr_t base = va & HUGE_PAGE_MASK;
+        if (vmm_is_huge(region, va) && base >= start && end - base >= HUGE_PAGE_SIZE) {
+            vmm_protect_range(region, base, HUGE_PAGE_PAGES, flags & ~PAGE_DIRTY);
+            va = base + HUGE_PAGE_SIZE - PAGE_SIZE;
+            continue;
+        }
+        vmm_protect(region, va, flags & ~PAGE_DIRTY);
+    }
+}
+
+int vma_advise(vmm_region_t* region, uintptr_t start, uintptr_t end, uint32_t advice) {
+    bool (*ok)(vmm_vma_t*) = NULL;
+    if (advice == MADV_DONTNEED) {
+        ok = vma_internal_is_refaultable;
+    } else if (advice == MADV_FREE) {
+        ok = vma_internal_is_anon;
+    }
+
+    if (!region || start >= end || !vma_internal_reserved(region, start, end, ok)) {
+        return -1;
+    }
+
+    switch (advice) {
+        case MADV_NORMAL:
+        case MADV_RANDOM:
+        case MADV_SEQUENTIAL:
+            if (vma_internal_split_at(region, start) < 0 || vma_internal_split_at(region, end) < 0) {
+                return -1;
+            }
+            for (vmm_vma_t* vma = vma_find(region, start); vma && vma->start < end; vma = vma->next) {
+                vma->advice = (uint8_t) advice;
+            }
+            return 0;
+        case MADV_WILLNEED:
+            vma_internal_queue_prefetch(region, start, end);
+            return 0;
+        case MADV_DONTNEED:
+            // the areas stay, so the next touch faults in zeroes or the file's current contents
+            vmm_free(region, start, (end - start) / PAGE_SIZE);
+            return 0;
+        case MADV_FREE:
+            if (vma_internal_split_at(region, start) < 0 || vma_internal_split_at(region, end) < 0) {
+                return -1;
+            }
+            for (vmm_vma_t* vma = vma_find(region, start); vma && vma->start < end; vma = vma->next) {
+                vma->lazy_free = true;
+            }
+            vma_internal_mark_clean(region, start, end);
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+// drop the clean pages of a lazily freed area in the page table covering va, up to want of them; returns how many
+// went. the table's lock is only tried, one a fault is filling is skipped
+static size_t vma_internal_reclaim_table(vmm_region_t* region, vmm_vma_t* vma, uintptr_t va, size_t want) {
+    uintptr_t base = va & HUGE_PAGE_MASK;
+    uintptr_t stop = base + HUGE_PAGE_SIZE < vma->end ? base + HUGE_PAGE_SIZE : vma->end;
+    size_t freed = 0;
+
+    bool r;
+    if (!vmm_pt_trylock(region, va, &r)) {
+        return 0;
+    }
+
+    if (!(vmm_get_pde(region, va) & PAGE_PRESENT)) {
+        vmm_pt_unlock(region, va, r);
+        return 0;
+    }
+
+    if (vmm_is_huge(region, va)) {
+        if (!(vmm_get_flags(region, va) & PAGE_DIRTY) && base >= vma->start && vma->end - base >= HUGE_PAGE_SIZE) {
+            vmm_free(region, base, HUGE_PAGE_PAGES);
+            freed = HUGE_PAGE_PAGES;
+        }
+        vmm_pt_unlock(region, va, r);
+        return freed;
+    }
+
+    for (uintptr_t page = va; page < stop && freed < want; page += PAGE_SIZE) {
+        uint32_t flags = vmm_get_flags(region, page);
+        if ((flags & PAGE_PRESENT) && !(flags & (PAGE_DIRTY | PAGE_COW))) {
+            vmm_free(region, page, 1);
+            freed++;
+        }
+    }
+    vmm_pt_unlock(region, va, r);
+    return freed;
+}
+
+// drop up to want clean pages of a lazily freed area; the region's directory has to be loaded
+static size_t vma_internal_reclaim_vma(vmm_region_t* region, vmm_vma_t* vma, size_t want) {
+    size_t freed = 0;
+    for (uintptr_t va = vma->start; va < vma->end && freed < want; va = (va & HUGE_PAGE_MASK) + HUGE_PAGE_SIZE) {
+        freed += vma_internal_reclaim_table(region, vma, va, want - freed);
+    }
+    return freed;
+}
+
+typedef struct vma_reclaim_ctx {
+    size_t want;
+    size_t freed;
+} vma_reclaim_ctx_t;
+
+// the areas are walked with mm_sem shared, which vmm_region_foreach holds
+static bool vma_internal_reclaim_region(vmm_region_t* region, void* ctx) {
+    vma_reclaim_ctx_t* rc = (vma_reclaim_ctx_t*) ctx;
+    uint32_t* saved = NULL;
+
+    if (!region->pt_live) {
+        return true;
+    }
+
+    for (vmm_vma_t* vma = region->vma_list; vma && rc->freed < rc->want; vma = vma->next) {
+        if (!vma->lazy_free) {
+            continue;
+        }
+        if (!saved) {
+            saved = read_pd();
+            load_pd(region->pg_dir);
+        }
+        rc->freed += vma_internal_reclaim_vma(region, vma, rc->want - rc->freed);
+    }
+
+    if (saved) {
+        load_pd(saved);
+    }
+    return rc->freed < rc->want;
+}
+
+// take back at least pages frames from areas advised MADV_FREE whose pages were not written since;
+// returns how many were freed
+size_t vma_reclaim_lazy(size_t pages) {
+    vma_reclaim_ctx_t ctx = {.want = pages, .freed = 0};
+    vmm_region_foreach(vma_internal_reclaim_region, &ctx);
+    return ctx.freed;
+}
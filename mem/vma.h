@@ -0,0 +1,78 @@
+#ifndef VMA_H
+#define VMA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "vmm.h"
+
+struct vfs_node;
+struct vfs_op_tbl;
+struct rmap_anon;
+
+// page fault error code bits
+#define PF_ERR_PRESENT 0x1
+#define PF_ERR_WRITE 0x2
+#define PF_ERR_USER 0x4
+
+// pages mapped around a faulting address in one trap, a power of two
+#define VMA_FAULT_AROUND_PAGES 16
+// pages mapped ahead of a fault in an area advised as sequential
+#define VMA_FAULT_AROUND_MAX 64
+
+// madvise advice values
+#define MADV_NORMAL 0
+#define MADV_RANDOM 1
+#define MADV_SEQUENTIAL 2
+#define MADV_WILLNEED 3
+#define MADV_DONTNEED 4
+#define MADV_FREE 8
+
+typedef enum {
+    VMA_KIND_ANON,
+    VMA_KIND_FILE
+} vma_kind_t;
+
+// a reserved range of a region; pages inside it may or may not be backed yet
+typedef struct vmm_vma {
+    uintptr_t start;
+    uintptr_t end;
+    uint32_t prot; // pte flags handed to pages faulted in here
+    vma_kind_t kind;
+    uint8_t advice;  // MADV_NORMAL, MADV_RANDOM or MADV_SEQUENTIAL, sizes the fault-around window
+    bool lazy_free;  // clean pages may be taken back under memory pressure
+    struct vfs_op_tbl* file_ops; // file whose pages back the area, NULL for anonymous memory and for
+    void* file;                  // file contents that were copied in when the area was mapped
+    uint32_t pgoff;              // file page that start maps
+    struct vmm_vma* next;
+
+    // reverse map: the region the area lives in, the anon its private frames belong to,
+    // and the links of the anon's and the file's area lists
+    vmm_region_t* region;
+    struct rmap_anon* anon;
+    struct vmm_vma* anon_next;
+    struct vmm_vma* file_next;
+} vmm_vma_t;
+
+void vma_init(void);
+uintptr_t vma_zero_page(void);
+vmm_vma_t* vma_find(vmm_region_t* region, uintptr_t va);
+int vma_map(vmm_region_t* region, uintptr_t start, uintptr_t end, uint32_t prot, vma_kind_t kind);
+int vma_map_file(
+    vmm_region_t* region, uintptr_t start, uintptr_t end, uint32_t prot, struct vfs_node* node, uint32_t pgoff, bool shared);
+int vma_unmap(vmm_region_t* region, uintptr_t start, uintptr_t end);
+int vma_protect(vmm_region_t* region, uintptr_t start, uintptr_t end, uint32_t prot);
+int vma_remap(
+    vmm_region_t* region, uintptr_t old_start, size_t old_len, uintptr_t new_start, size_t new_len, uint32_t prot);
+bool vma_range_covered(vmm_region_t* region, uintptr_t start, uintptr_t end);
+bool vma_range_free(vmm_region_t* region, uintptr_t start, uintptr_t end);
+uintptr_t vma_find_free(vmm_region_t* region, size_t len, size_t align);
+int vma_copy(vmm_region_t* src, vmm_region_t* dst);
+void vma_destroy_all(vmm_region_t* region);
+int vma_handle_fault(uintptr_t va, uint32_t err);
+int vma_populate(vmm_region_t* region, uintptr_t start, uintptr_t end);
+int vma_advise(vmm_region_t* region, uintptr_t start, uintptr_t end, uint32_t advice);
+size_t vma_reclaim_lazy(size_t pages);
+void vma_prefetch_init(void);
+
+#endif // VMA_H
@@ -19,7 +19,15 @@ You should have received a copy of the GNU General Public License along with The
 #include "alloc.h"
 #include "paging.h"
 #include "utils.h"
+#include "vma.h"
+#include "swap.h"
+#include "ksm.h"
+#include "rmap.h"
+#include "../task/sched.h"
 #include "../lib/logging.h"
+#include "../task/percpu.h"
+#include "../drivers/apic/lapic.h"
+#include "../interrupts/interrupts.h"
 
 extern uint32_t* pg_dir;
 extern uint32_t* pg_tbls;
@@ -41,6 +49,416 @@ static inline uint32_t page_offset(uintptr_t va) {
 
 #define RECURSIVE_ADDR 0xFFC00000
 #define RECURSIVE_PT(pdi) ((uint32_t*) (RECURSIVE_ADDR + (pdi) * PAGE_SIZE))
+#define HUGE_PAGE_ORDER MAX_ORDER
+
+static inline bool vmm_pde_is_huge(uint32_t pde) {
+    return (pde & (PAGE_PRESENT | PAGE_PSE)) == (PAGE_PRESENT | PAGE_PSE);
+}
+
+// pte bits that say what backs a frame rather than how it may be accessed, kept across protection changes
+#define VMM_PTE_KIND (PAGE_SHARED | PAGE_FILE)
+
+// frames copied between preemption points while forking
+#define VMM_COPY_RESCHED_PAGES 64
+
+// charge or credit pages mapped by a leaf entry to the bucket its kind bits select
+// a huge pde counts as PAGE_ENTRIES anonymous pages, the shared zero page is never counted
+static void vmm_internal_rss_add(vmm_region_t* region, uint32_t entry, int pages) {
+    if (swap_pte_is_entry(entry)) {
+        region->rss.swapped += pages;
+        return;
+    }
+
+    if (!(entry & PAGE_PRESENT) || (entry & PAGE_MASK) == vma_zero_page()) {
+        return;
+    }
+
+    vmm_rss_t* rss = &region->rss;
+    if (entry & PAGE_SHARED) {
+        rss->shared += pages;
+    } else if (entry & PAGE_FILE) {
+        rss->file += pages;
+    } else {
+        rss->anon += pages;
+    }
+
+    uint32_t total = rss->anon + rss->file + rss->shared;
+    if (total > rss->peak) {
+        rss->peak = total;
+    }
+}
+
+uint32_t vmm_rss_pages(vmm_region_t* region) {
+    return region ? region->rss.anon + region->rss.file + region->rss.shared : 0;
+}
+
+// uncount a leaf entry that is about to be cleared or overwritten and give back its swap slot
+// frames stay with the caller
+static void vmm_internal_release(vmm_region_t* region, uint32_t entry) {
+    vmm_internal_rss_add(region, entry, -1);
+    if (swap_pte_is_entry(entry)) {
+        swap_free(entry);
+    }
+}
+
+// fetch the leaf entry for va; 4 MiB pdes are turned into an equivalent 4 KiB entry
+static uint32_t vmm_internal_leaf(vmm_region_t* region, uintptr_t va) {
+    uint32_t pde = region->pg_dir[pd_index(va)];
+    if (!(pde & PAGE_PRESENT)) {
+        return 0;
+    }
+
+    if (pde & PAGE_PSE) {
+        return ((pde & HUGE_PAGE_MASK) + (va & ~HUGE_PAGE_MASK & PAGE_MASK)) | (pde & 0xFFF & ~PAGE_PSE);
+    }
+
+    return RECURSIVE_PT(pd_index(va))[pt_index(va)];
+}
+
+#define VMM_TLB_FLUSH_THRESHOLD 32
+// a range that asks for everything, for when page tables went away along with their entries
+#define VMM_TLB_FLUSH_ALL ((size_t) -1)
+
+// the shootdown in flight, one at a time; its targets flush the range and clear their tlb_pending
+static struct {
+    spinlock_t lock;
+    uintptr_t va;
+    size_t pages;
+} vmm_internal_shootdown = {.lock = SPINLOCK_INIT};
+
+// invalidate a range on this cpu, reloading cr3 once instead of an invlpg per page when the range is large
+static void vmm_internal_flush_local(uintptr_t va, size_t pages) {
+    if (pages > VMM_TLB_FLUSH_THRESHOLD) {
+        vmm_flush_tlb();
+        return;
+    }
+
+    for (size_t i = 0; i < pages; i++) {
+        invlpg((void*) (va + i * PAGE_SIZE));
+    }
+}
+
+// answer a shootdown aimed at this cpu, from its ipi or from a spin with interrupts off
+void vmm_tlb_serve(void) {
+    cpu_t* cpu = this_cpu();
+    if (!__atomic_load_n(&cpu->tlb_pending, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    vmm_internal_flush_local(vmm_internal_shootdown.va, vmm_internal_shootdown.pages);
+    __atomic_store_n(&cpu->tlb_pending, 0, __ATOMIC_RELEASE);
+}
+
+// invalidate a range of the loaded directory on this cpu and on every other one that may cache it: the ones
+// with the same directory loaded, or all of them for kernel addresses, which every directory shares. returns
+// once each of them has flushed, so whatever the range mapped can be freed
+static void vmm_internal_flush_range(uintptr_t va, size_t pages) {
+    if (smp_cpu_count == 1) {
+        vmm_internal_flush_local(va, pages);
+        return;
+    }
+
+    // taken before the local flush, so the thread cannot move off the cpu it flushed
+    bool r = spinlock(&vmm_internal_shootdown.lock);
+    vmm_internal_flush_local(va, pages);
+
+    uint32_t* pd = PERCPU_READ(loaded_pd);
+    bool everyone = va >= KERNEL_VIRT_BASE && va < RECURSIVE_ADDR;
+    uint32_t self = smp_processor_id();
+    vmm_internal_shootdown.va = va;
+    vmm_internal_shootdown.pages = pages;
+
+    // the pte changes are visible before the loaded directories are looked at, see load_pd
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    uint32_t targets = 0;
+    for (uint32_t i = 0; i < smp_cpu_count; i++) {
+        cpu_t* cpu = &smp_cpus[i];
+        if (i == self || !cpu->online) {
+            continue;
+        }
+        if (!everyone && __atomic_load_n(&cpu->loaded_pd, __ATOMIC_SEQ_CST) != pd) {
+            continue;
+        }
+        __atomic_store_n(&cpu->tlb_pending, 1, __ATOMIC_RELEASE);
+        lapic_send_ipi((uint8_t) cpu->apic_id, INT_TYPE_TLB_SHOOTDOWN);
+        targets |= 1u << i;
+    }
+
+    for (uint32_t i = 0; i < smp_cpu_count; i++) {
+        if (!(targets & (1u << i))) {
+            continue;
+        }
+        while (__atomic_load_n(&smp_cpus[i].tlb_pending, __ATOMIC_ACQUIRE)) {
+            IA32_CPU_RELAX();
+        }
+    }
+
+    spinlock_unlock(&vmm_internal_shootdown.lock, r);
+}
+
+// grab a max order buddy block that can back a pse pde, which has to be 4 MiB aligned
+static uintptr_t vmm_internal_alloc_huge(void) {
+    if (!pmm_count_free_of_order(HUGE_PAGE_ORDER)) {
+        return 0;
+    }
+
+    uintptr_t pa = (uintptr_t) pmm_alloc_pages(HUGE_PAGE_ORDER, 1);
+    if (!pa) {
+        return 0;
+    }
+
+    if (pa & ~HUGE_PAGE_MASK) {
+        pmm_free_pages((void*) pa, HUGE_PAGE_ORDER, 1);
+        return 0;
+    }
+
+    return pa;
+}
+
+// a zeroed 4 MiB block for vmm_map_huge; zeroing it takes a while, so no page table lock should be held across
+uintptr_t vmm_alloc_huge(void) {
+    uintptr_t pa = vmm_internal_alloc_huge();
+    if (pa) {
+        flop_memset((void*) pa, 0, HUGE_PAGE_SIZE);
+    }
+    return pa;
+}
+
+void vmm_free_huge(uintptr_t pa) {
+    pmm_free_pages((void*) pa, HUGE_PAGE_ORDER, 1);
+}
+
+// map the block at pa as the 4 MiB page at va if [va, end) covers the whole aligned chunk and no pt exists there
+// yet; the block stays with the caller when it is refused
+int vmm_map_huge(vmm_region_t* region, uintptr_t va, uintptr_t end, uintptr_t pa, uint32_t flags) {
+    if ((va & ~HUGE_PAGE_MASK) || end - va < HUGE_PAGE_SIZE) {
+        return -1;
+    }
+
+    if (va < USER_SPACE_START || va + HUGE_PAGE_SIZE > KERNEL_VIRT_BASE) {
+        return -1;
+    }
+
+    uint32_t pdi = pd_index(va);
+    if (region->pg_dir[pdi] & PAGE_PRESENT) {
+        return -1;
+    }
+
+    region->pg_dir[pdi] = pa | (flags & 0xFFF) | PAGE_PRESENT | PAGE_PSE;
+    vmm_internal_rss_add(region, region->pg_dir[pdi], PAGE_ENTRIES);
+    invlpg((void*) va);
+    return 0;
+}
+
+// map a zeroed 4 MiB page at va if [va, end) covers the whole aligned chunk and no pt exists there yet
+int vmm_try_map_huge(vmm_region_t* region, uintptr_t va, uintptr_t end, uint32_t flags) {
+    if ((va & ~HUGE_PAGE_MASK) || end - va < HUGE_PAGE_SIZE || (region->pg_dir[pd_index(va)] & PAGE_PRESENT)) {
+        return -1;
+    }
+
+    uintptr_t pa = vmm_alloc_huge();
+    if (!pa) {
+        return -1;
+    }
+
+    if (vmm_map_huge(region, va, end, pa, flags) < 0) {
+        vmm_free_huge(pa);
+        return -1;
+    }
+    return 0;
+}
+
+// drop a whole 4 MiB mapping and hand its block back to the buddy allocator
+static void vmm_internal_unmap_huge(vmm_region_t* region, uintptr_t va) {
+    uint32_t pdi = pd_index(va);
+    uintptr_t pa = region->pg_dir[pdi] & HUGE_PAGE_MASK;
+
+    vmm_internal_rss_add(region, region->pg_dir[pdi], -PAGE_ENTRIES);
+    region->pg_dir[pdi] = 0;
+    vmm_internal_flush_range(va & HUGE_PAGE_MASK, PAGE_ENTRIES);
+    pmm_free_pages((void*) pa, HUGE_PAGE_ORDER, 1);
+}
+
+int vmm_is_huge(vmm_region_t* region, uintptr_t va) {
+    return region && vmm_pde_is_huge(region->pg_dir[pd_index(va)]);
+}
+
+// split a 4 MiB mapping back into a page table of 4 KiB ptes covering the same frames
+int vmm_split_huge(vmm_region_t* region, uintptr_t va) {
+    uint32_t pdi = pd_index(va);
+    uint32_t pde = region->pg_dir[pdi];
+    if (!vmm_pde_is_huge(pde)) {
+        return 0;
+    }
+
+    uintptr_t pt_phys = (uintptr_t) pmm_alloc_page();
+    if (!pt_phys) {
+        log("vmm_split_huge: pmm_alloc_page failed\n", RED);
+        return -1;
+    }
+
+    // fill the table through its physical address, the recursive slot still points into the huge page
+    uint32_t* pt = (uint32_t*) pt_phys;
+    uintptr_t base_pa = pde & HUGE_PAGE_MASK;
+    uint32_t flags = pde & 0xFFF & ~PAGE_PSE;
+    for (uint32_t i = 0; i < PAGE_ENTRIES; i++) {
+        pt[i] = (base_pa + i * PAGE_SIZE) | flags;
+    }
+
+    // the frames stop being one buddy block so partial unmaps can free them page by page
+    pmm_split_allocated((void*) base_pa, HUGE_PAGE_ORDER);
+
+    region->pg_dir[pdi] = (pt_phys & PAGE_MASK) | PAGE_PRESENT | PAGE_RW | PAGE_USER;
+    region->rss.page_tables++;
+    if (region->pt_live) {
+        region->pt_live[pdi] = PAGE_ENTRIES;
+    }
+    invlpg((void*) (va & HUGE_PAGE_MASK));
+    invlpg((void*) RECURSIVE_PT(pdi));
+    return 0;
+}
+
+#define VMM_BULK_BATCH 64
+
+// live entry counts only exist for user regions; the kernel keeps its page tables for good
+static inline void vmm_internal_live_add(vmm_region_t* region, uint32_t pdi, int delta) {
+    if (region->pt_live) {
+        region->pt_live[pdi] += delta;
+    }
+}
+
+// swap entries count as live, the table is what remembers where their pages went
+static uint16_t vmm_internal_count_live(uint32_t* pt) {
+    uint16_t n = 0;
+    for (uint32_t pti = 0; pti < PAGE_ENTRIES; pti++) {
+        if (pt[pti]) {
+            n++;
+        }
+    }
+    return n;
+}
+
+// unhook pdi's page table once its last live entry is gone
+// the table is threaded onto dead and must only be freed after the tlb has been flushed
+static void vmm_internal_reclaim_pt(vmm_region_t* region, uint32_t pdi, uintptr_t* dead) {
+    if (!region->pt_live || region->pt_live[pdi] || pdi >= pd_index(KERNEL_VIRT_BASE)) {
+        return;
+    }
+
+    uint32_t pde = region->pg_dir[pdi];
+    if (!(pde & PAGE_PRESENT) || (pde & PAGE_PSE)) {
+        return;
+    }
+
+    uintptr_t pt_phys = pde & PAGE_MASK;
+    region->pg_dir[pdi] = 0;
+    region->rss.page_tables--;
+    *(uintptr_t*) pt_phys = *dead;
+    *dead = pt_phys;
+}
+
+static void vmm_internal_free_dead_pts(uintptr_t dead) {
+    while (dead) {
+        uintptr_t next = *(uintptr_t*) dead;
+        pmm_free_page((void*) dead);
+        dead = next;
+    }
+}
+
+// flush after an unmap, then release the page tables it emptied
+static void vmm_internal_finish_unmap(uintptr_t va, size_t pages, uintptr_t dead) {
+    if (dead) {
+        vmm_internal_flush_range(va, VMM_TLB_FLUSH_ALL);
+    } else {
+        vmm_internal_flush_range(va, pages);
+    }
+
+    vmm_internal_free_dead_pts(dead);
+}
+
+// pages left between va and the end of its page table, capped to pages
+static inline size_t vmm_internal_span(uintptr_t va, size_t pages) {
+    size_t left = PAGE_ENTRIES - pt_index(va);
+    return pages < left ? pages : left;
+}
+
+// point every pde covering [va, va + pages) at a page table before any pte is written
+// 4 MiB pages are split, and tables allocated here are released again if a later one fails
+static int vmm_internal_prepare_pts(vmm_region_t* region, uintptr_t va, size_t pages) {
+    uint32_t first = pd_index(va);
+    uint32_t last = pd_index(va + (pages - 1) * PAGE_SIZE);
+    uint32_t fresh[PAGE_DIRECTORY_SIZE / 32] = {0};
+
+    for (uint32_t pdi = first; pdi <= last; pdi++) {
+        uint32_t pde = region->pg_dir[pdi];
+
+        if (vmm_pde_is_huge(pde)) {
+            if (vmm_split_huge(region, (uintptr_t) pdi << 22) < 0) {
+                goto fail;
+            }
+            continue;
+        }
+
+        if (pde & PAGE_PRESENT) {
+            continue;
+        }
+
+        uintptr_t pt_phys = (uintptr_t) pmm_alloc_page();
+        if (!pt_phys) {
+            goto fail;
+        }
+
+        flop_memset((void*) pt_phys, 0, PAGE_SIZE);
+        region->pg_dir[pdi] = (pt_phys & PAGE_MASK) | PAGE_PRESENT | PAGE_RW | PAGE_USER;
+        invlpg((void*) RECURSIVE_PT(pdi));
+        fresh[pdi / 32] |= 1u << (pdi % 32);
+        region->rss.page_tables++;
+        if (region->pt_live) {
+            region->pt_live[pdi] = 0;
+        }
+    }
+    return 0;
+
+fail:
+    log_address("vmm_internal_prepare_pts: out of page tables mapping ", va);
+    uintptr_t dead = 0;
+    for (uint32_t pdi = first; pdi <= last; pdi++) {
+        if (fresh[pdi / 32] & (1u << (pdi % 32))) {
+            uintptr_t pt_phys = region->pg_dir[pdi] & PAGE_MASK;
+            region->pg_dir[pdi] = 0;
+            region->rss.page_tables--;
+            *(uintptr_t*) pt_phys = dead;
+            dead = pt_phys;
+        }
+    }
+    vmm_internal_finish_unmap(va, VMM_TLB_FLUSH_ALL, dead);
+    return -1;
+}
+
+// write consecutive ptes one page table at a time, frames come from the list if given, else from pa onwards
+// the page tables have to exist already, see vmm_internal_prepare_pts
+static void vmm_internal_fill_ptes(
+    vmm_region_t* region, uintptr_t va, uintptr_t pa, const uintptr_t* frames, size_t pages, uint32_t flags) {
+    size_t done = 0;
+    while (done < pages) {
+        uintptr_t cur = va + done * PAGE_SIZE;
+        size_t span = vmm_internal_span(cur, pages - done);
+        uint32_t* pte = RECURSIVE_PT(pd_index(cur)) + pt_index(cur);
+
+        int added = 0;
+        for (size_t i = 0; i < span; i++) {
+            uintptr_t frame = frames ? frames[done + i] : pa + (done + i) * PAGE_SIZE;
+            added += !pte[i];
+            vmm_internal_release(region, pte[i]);
+            pte[i] = (frame & PAGE_MASK) | flags | PAGE_PRESENT;
+            vmm_internal_rss_add(region, pte[i], 1);
+        }
+        vmm_internal_live_add(region, pd_index(cur), added);
+        done += span;
+    }
+    vmm_internal_flush_range(va, pages);
+}
 
 // allocate a virtual address
 uintptr_t vmm_alloc(vmm_region_t* region, size_t pages, uint32_t flags) {
@@ -67,15 +485,76 @@ uintptr_t vmm_alloc(vmm_region_t* region, size_t pages, uint32_t flags) {
     return va;
 }
 
-// free a virtual address
+// frames whose ptes were cleared, held until every cpu has dropped its tlb entries for them
+typedef struct vmm_gather {
+    uintptr_t frames[VMM_BULK_BATCH];
+    size_t count;
+} vmm_gather_t;
+
+static void vmm_internal_gather_release(vmm_gather_t* gather) {
+    for (size_t i = 0; i < gather->count; i++) {
+        pmm_page_put(gather->frames[i]);
+    }
+    gather->count = 0;
+}
+
+// a full batch flushes the whole range being freed, which covers every pte cleared so far
+static void vmm_internal_gather_add(vmm_gather_t* gather, uintptr_t frame, uintptr_t va, size_t pages) {
+    if (gather->count == VMM_BULK_BATCH) {
+        vmm_internal_flush_range(va, pages);
+        vmm_internal_gather_release(gather);
+    }
+    gather->frames[gather->count++] = frame;
+}
+
+// free a virtual address range along with its frames, and any page table it leaves empty
 void vmm_free(vmm_region_t* region, uintptr_t va, size_t pages) {
-    for (size_t i = 0; i < pages; i++) {
-        uintptr_t pa = vmm_resolve(region, va + i * PAGE_SIZE);
-        if (pa) {
-            pmm_free_page((void*) pa);
+    size_t done = 0;
+    uintptr_t dead = 0;
+    vmm_gather_t gather = {.count = 0};
+
+    while (done < pages) {
+        uintptr_t cur = va + done * PAGE_SIZE;
+        uint32_t pdi = pd_index(cur);
+        uint32_t pde = region->pg_dir[pdi];
+        size_t span = vmm_internal_span(cur, pages - done);
+        done += span;
+
+        if (!(pde & PAGE_PRESENT)) {
+            continue;
+        }
+
+        // whole 4 MiB pages go back as one block, anything partial gets split first
+        if ((pde & PAGE_PSE) && span == PAGE_ENTRIES) {
+            vmm_internal_unmap_huge(region, cur);
+            continue;
+        }
+
+        if ((pde & PAGE_PSE) && vmm_split_huge(region, cur) < 0) {
+            log_address("vmm_free: could not split huge page at ", cur);
+            continue;
+        }
+
+        uint32_t* pte = RECURSIVE_PT(pdi) + pt_index(cur);
+        int removed = 0;
+        for (size_t i = 0; i < span; i++) {
+            uint32_t entry = pte[i];
+            pte[i] = 0;
+            if ((entry & PAGE_PRESENT) && (entry & PAGE_MASK) != vma_zero_page()) {
+                vmm_internal_gather_add(&gather, entry & PAGE_MASK, va, pages);
+            }
+            if (entry) {
+                vmm_internal_release(region, entry);
+                removed++;
+            }
         }
-        vmm_unmap(region, va + i * PAGE_SIZE);
+
+        vmm_internal_live_add(region, pdi, -removed);
+        vmm_internal_reclaim_pt(region, pdi, &dead);
     }
+
+    vmm_internal_finish_unmap(va, pages, dead);
+    vmm_internal_gather_release(&gather);
 }
 
 // map a page to a virtual address
@@ -83,6 +562,10 @@ int vmm_map(vmm_region_t* region, uintptr_t va, uintptr_t pa, uint32_t flags) {
     uint32_t pdi = pd_index(va);
     uint32_t pti = pt_index(va);
 
+    if (vmm_pde_is_huge(region->pg_dir[pdi]) && vmm_split_huge(region, va) < 0) {
+        return -1;
+    }
+
     // allocate a new pt if needed
     if (!(region->pg_dir[pdi] & PAGE_PRESENT)) {
         uintptr_t pt_phys = (uintptr_t) pmm_alloc_page();
@@ -91,11 +574,26 @@ int vmm_map(vmm_region_t* region, uintptr_t va, uintptr_t pa, uint32_t flags) {
         }
         region->pg_dir[pdi] = (pt_phys & PAGE_MASK) | PAGE_PRESENT | PAGE_RW | PAGE_USER;
         flop_memset(RECURSIVE_PT(pdi), 0, PAGE_SIZE);
+        region->rss.page_tables++;
+        if (region->pt_live) {
+            region->pt_live[pdi] = 0;
+        }
     }
 
     uint32_t* pt = RECURSIVE_PT(pdi);
+    if (!pt[pti]) {
+        vmm_internal_live_add(region, pdi, 1);
+    }
+    vmm_internal_release(region, pt[pti]);
+    // only a replaced present entry can be cached elsewhere, the caller may free its frame once this returns
+    bool replaced = pt[pti] & PAGE_PRESENT;
     pt[pti] = (pa & PAGE_MASK) | flags | PAGE_PRESENT;
-    invlpg((void*) va);
+    vmm_internal_rss_add(region, pt[pti], 1);
+    if (replaced) {
+        vmm_internal_flush_range(va, 1);
+    } else {
+        invlpg((void*) va);
+    }
     return 0;
 }
 
@@ -106,9 +604,16 @@ int vmm_unmap(vmm_region_t* region, uintptr_t va) {
     if (!(region->pg_dir[pdi] & PAGE_PRESENT)) {
         return -1;
     }
+    if (vmm_split_huge(region, va) < 0) {
+        return -1;
+    }
     uint32_t* pt = RECURSIVE_PT(pdi);
+    if (pt[pti]) {
+        vmm_internal_live_add(region, pdi, -1);
+    }
+    vmm_internal_release(region, pt[pti]);
     pt[pti] = 0;
-    invlpg((void*) va);
+    vmm_internal_flush_range(va, 1);
     return 0;
 }
 
@@ -125,8 +630,13 @@ int vmm_is_mapped(vmm_region_t* region, uintptr_t va) {
         return 0;
     }
 
+    if (region->pg_dir[pdi] & PAGE_PSE) {
+        return 1;
+    }
+
+    // a swapped out page still belongs to the address space
     uint32_t* pt = RECURSIVE_PT(pdi);
-    if (!(pt[pti] & PAGE_PRESENT)) {
+    if (!(pt[pti] & PAGE_PRESENT) && !swap_pte_is_entry(pt[pti])) {
         return 0;
     }
 
@@ -149,6 +659,10 @@ int vmm_is_user_mapped(vmm_region_t* region, uintptr_t va) {
         return 0;
     }
 
+    if (region->pg_dir[pdi] & PAGE_PSE) {
+        return 1;
+    }
+
     uint32_t* pt = RECURSIVE_PT(pdi);
 
     if (!(pt[pti] & PAGE_PRESENT)) {
@@ -178,6 +692,10 @@ int vmm_is_kernel_mapped(vmm_region_t* region, uintptr_t va) {
         return 1;
     }
 
+    if (region->pg_dir[pdi] & PAGE_PSE) {
+        return 0;
+    }
+
     uint32_t* pt = RECURSIVE_PT(pdi);
 
     if (!(pt[pti] & PAGE_PRESENT)) {
@@ -194,6 +712,9 @@ uintptr_t vmm_resolve(vmm_region_t* region, uintptr_t va) {
     if (!(region->pg_dir[pdi] & PAGE_PRESENT)) {
         return 0;
     }
+    if (region->pg_dir[pdi] & PAGE_PSE) {
+        return (region->pg_dir[pdi] & HUGE_PAGE_MASK) | (va & ~HUGE_PAGE_MASK);
+    }
     uint32_t* pt = RECURSIVE_PT(pdi);
     if (!(pt[pti] & PAGE_PRESENT)) {
         return 0;
@@ -224,6 +745,46 @@ void vmm_region_remove(vmm_region_t* region) {
     spinlock_unlock(&region_list_lock, r);
 }
 
+static void vmm_internal_init_locks(vmm_region_t* region) {
+    rwsem_init(&region->mm_sem);
+    for (int i = 0; i < VMM_PT_LOCKS; i++) {
+        spinlock_init(&region->pt_locks[i]);
+    }
+}
+
+static inline spinlock_t* vmm_internal_pt_lock(vmm_region_t* region, uintptr_t va) {
+    return &region->pt_locks[pd_index(va) & (VMM_PT_LOCKS - 1)];
+}
+
+// serialise pte updates in the page table covering va against other threads of the region
+bool vmm_pt_lock(vmm_region_t* region, uintptr_t va) {
+    return spinlock(vmm_internal_pt_lock(region, va));
+}
+
+// for the background scanners, which skip a page table someone is busy in rather than wait for it
+bool vmm_pt_trylock(vmm_region_t* region, uintptr_t va, bool* out_r) {
+    bool r = IA32_INT_ENABLED();
+    IA32_INT_MASK();
+    if (!spinlock_trylock(vmm_internal_pt_lock(region, va))) {
+        if (r) {
+            IA32_INT_UNMASK();
+        }
+        return false;
+    }
+
+    *out_r = r;
+    return true;
+}
+
+void vmm_pt_unlock(vmm_region_t* region, uintptr_t va, bool r) {
+    spinlock_unlock(vmm_internal_pt_lock(region, va), r);
+}
+
+// whether the page tables covering va and other share a lock, which must then only be taken once
+bool vmm_pt_same_lock(vmm_region_t* region, uintptr_t va, uintptr_t other) {
+    return vmm_internal_pt_lock(region, va) == vmm_internal_pt_lock(region, other);
+}
+
 // create a new region descriptor
 vmm_region_t* vmm_region_create(size_t initial_pages, uint32_t flags, uintptr_t* out_va) {
     uintptr_t dir_phys = (uintptr_t) pmm_alloc_page();
@@ -244,8 +805,20 @@ vmm_region_t* vmm_region_create(size_t initial_pages, uint32_t flags, uintptr_t*
         return NULL;
     }
 
+    region->pt_live = (uint16_t*) kmalloc(PAGE_DIRECTORY_SIZE * sizeof(uint16_t));
+    if (!region->pt_live) {
+        log("vmm_region_create: kmalloc failed for pt_live\n", RED);
+        kfree(region, sizeof(vmm_region_t));
+        pmm_free_page((void*) dir_phys);
+        return NULL;
+    }
+    flop_memset(region->pt_live, 0, PAGE_DIRECTORY_SIZE * sizeof(uint16_t));
+
     region->pg_dir = dir;
     region->next = NULL;
+    region->vma_list = NULL;
+    vmm_internal_init_locks(region);
+    flop_memset(&region->rss, 0, sizeof(vmm_rss_t));
     region->base_va = USER_SPACE_START;
     region->next_free_va = region->base_va;
 
@@ -255,6 +828,7 @@ vmm_region_t* vmm_region_create(size_t initial_pages, uint32_t flags, uintptr_t*
         uintptr_t va = vmm_alloc(region, initial_pages, flags);
         if (va == (uintptr_t) (-1)) {
             vmm_region_remove(region);
+            kfree(region->pt_live, PAGE_DIRECTORY_SIZE * sizeof(uint16_t));
             kfree(region, sizeof(vmm_region_t));
             pmm_free_page((void*) dir_phys);
             return NULL;
@@ -266,13 +840,22 @@ vmm_region_t* vmm_region_create(size_t initial_pages, uint32_t flags, uintptr_t*
     return region;
 }
 
-// destroy a region descriptor
+// destroy a region descriptor; like teardown, the scanners are cut off with mm_sem held exclusive, which waits
+// out one that already holds the region
 void vmm_region_destroy(vmm_region_t* region) {
     if (!region) {
         return;
     }
+    rwsem_down_write(&region->mm_sem);
     vmm_region_remove(region);
+    vma_destroy_all(region);
+    swap_forget_region(region);
+    ksm_forget_region(region);
+    rwsem_up_write(&region->mm_sem);
     pmm_free_page((void*) region->pg_dir);
+    if (region->pt_live) {
+        kfree(region->pt_live, PAGE_DIRECTORY_SIZE * sizeof(uint16_t));
+    }
     kfree(region, sizeof(vmm_region_t));
 }
 
@@ -289,6 +872,7 @@ void vmm_switch(vmm_region_t* region) {
 void vmm_init() {
     kernel_region.pg_dir = pg_dir;
     kernel_region.next = 0;
+    vmm_internal_init_locks(&kernel_region);
     current_pg_dir = pg_dir;
     pg_dir[RECURSIVE_PDE] = ((uintptr_t) pg_dir & PAGE_MASK) | PAGE_PRESENT | PAGE_RW;
     vmm_region_insert(&kernel_region);
@@ -311,27 +895,106 @@ uint32_t* vmm_new_copied_pgdir() {
 
 int vmm_copy_frames(uint32_t* src_pt, uint32_t* dst_pt) {
     for (int pti = 0; pti < PAGE_ENTRIES; pti++) {
+        // both sides fault the page back in from the same slot
+        if (swap_pte_is_entry(src_pt[pti])) {
+            swap_dup(src_pt[pti]);
+            dst_pt[pti] = src_pt[pti];
+            continue;
+        }
+
         if (!(src_pt[pti] & PAGE_PRESENT)) {
             continue;
         }
 
+        // cow frames stay shared until either side writes, file frames stay shared with the file
+        if (src_pt[pti] & (PAGE_COW | VMM_PTE_KIND)) {
+            if ((src_pt[pti] & PAGE_MASK) != vma_zero_page()) {
+                pmm_page_get(src_pt[pti] & PAGE_MASK);
+            }
+            dst_pt[pti] = src_pt[pti];
+            continue;
+        }
+
         uintptr_t new_page = (uintptr_t) pmm_alloc_page();
         if (!new_page) {
             return -1;
         }
 
         flop_memcpy((void*) new_page, (void*) (src_pt[pti] & PAGE_MASK), PAGE_SIZE);
+        rmap_copy(new_page, src_pt[pti] & PAGE_MASK, 1);
         dst_pt[pti] = (new_page & PAGE_MASK) | (src_pt[pti] & ~PAGE_MASK);
+
+        if ((pti + 1) % VMM_COPY_RESCHED_PAGES == 0) {
+            cond_resched();
+        }
     }
     return 0;
 }
 
+// duplicate a 4 MiB mapping for a forked region, falling back to 4 KiB frames when no huge block is free
+static int vmm_internal_copy_huge(uint32_t src_pde, uint32_t* dst_pde) {
+    uintptr_t src_pa = src_pde & HUGE_PAGE_MASK;
+
+    uintptr_t huge = vmm_internal_alloc_huge();
+    if (huge) {
+        flop_memcpy((void*) huge, (void*) src_pa, HUGE_PAGE_SIZE);
+        rmap_copy(huge, src_pa, HUGE_PAGE_PAGES);
+        *dst_pde = huge | (src_pde & 0xFFF);
+        return 0;
+    }
+
+    uintptr_t pt_phys = (uintptr_t) pmm_alloc_page();
+    if (!pt_phys) {
+        return -1;
+    }
+
+    uint32_t* dst_pt = (uint32_t*) pt_phys;
+    flop_memset(dst_pt, 0, PAGE_SIZE);
+
+    uint32_t flags = src_pde & 0xFFF & ~PAGE_PSE;
+    for (uint32_t pti = 0; pti < PAGE_ENTRIES; pti++) {
+        uintptr_t new_page = (uintptr_t) pmm_alloc_page();
+        if (!new_page) {
+            vmm_free_physical_frames(dst_pt);
+            pmm_free_page((void*) pt_phys);
+            return -1;
+        }
+
+        flop_memcpy((void*) new_page, (void*) (src_pa + pti * PAGE_SIZE), PAGE_SIZE);
+        rmap_copy(new_page, src_pa + pti * PAGE_SIZE, 1);
+        dst_pt[pti] = new_page | flags;
+    }
+
+    *dst_pde = (pt_phys & PAGE_MASK) | PAGE_PRESENT | PAGE_RW | PAGE_USER;
+    return 0;
+}
+
+// copy the user half of src into dst; the kernel tables are shared rather than copied and the recursive slot is
+// dst's own, the same split teardown frees by, so only user pages count towards the child's rss and tables
 int vmm_iterate_and_copy_page_tables(vmm_region_t* src, vmm_region_t* dst) {
-    for (int pdi = 0; pdi < 1024; pdi++) {
+    for (uint32_t pdi = pd_index(KERNEL_VIRT_BASE); pdi < RECURSIVE_PDE; pdi++) {
+        dst->pg_dir[pdi] = src->pg_dir[pdi];
+    }
+
+    for (uint32_t pdi = 0; pdi < pd_index(KERNEL_VIRT_BASE); pdi++) {
         if (!(src->pg_dir[pdi] & PAGE_PRESENT)) {
             continue;
         }
 
+        if (src->pg_dir[pdi] & PAGE_PSE) {
+            if (vmm_internal_copy_huge(src->pg_dir[pdi], &dst->pg_dir[pdi]) < 0) {
+                return -1;
+            }
+            if (!(dst->pg_dir[pdi] & PAGE_PSE)) {
+                dst->rss.page_tables++;
+                if (dst->pt_live) {
+                    dst->pt_live[pdi] = PAGE_ENTRIES;
+                }
+            }
+            vmm_internal_rss_add(dst, src->pg_dir[pdi], PAGE_ENTRIES);
+            continue;
+        }
+
         uintptr_t pt_phys = (uintptr_t) pmm_alloc_page();
         if (!pt_phys) {
             return -1;
@@ -342,17 +1005,43 @@ int vmm_iterate_and_copy_page_tables(vmm_region_t* src, vmm_region_t* dst) {
 
         flop_memset(dst_pt, 0, PAGE_SIZE);
 
+        // the entries copied before the failure hold frames, references and swap slots of their own
         if (vmm_copy_frames(src_pt, dst_pt) < 0) {
+            vmm_free_physical_frames(dst_pt);
             pmm_free_page((void*) pt_phys);
             return -1;
         }
 
         dst->pg_dir[pdi] = (pt_phys & PAGE_MASK) | (src->pg_dir[pdi] & ~PAGE_MASK);
+        dst->rss.page_tables++;
+        for (uint32_t pti = 0; pti < PAGE_ENTRIES; pti++) {
+            vmm_internal_rss_add(dst, dst_pt[pti], 1);
+        }
+        if (dst->pt_live) {
+            dst->pt_live[pdi] = vmm_internal_count_live(dst_pt);
+        }
     }
     return 0;
 }
 
-vmm_region_t* vmm_copy_pagemap(vmm_region_t* src) {
+// free every page table of the user half and what its entries hold, dropping a reference per frame and per swap
+// slot; a region that is not loaded has its tables reached through their physical addresses instead of the
+// recursive slot
+static void vmm_internal_free_user_tables(vmm_region_t* region, bool loaded) {
+    for (uint32_t pdi = 0; pdi < pd_index(KERNEL_VIRT_BASE); pdi++) {
+        uint32_t pde = region->pg_dir[pdi];
+        if (!(pde & PAGE_PRESENT)) {
+            continue;
+        } else if (pde & PAGE_PSE) {
+            pmm_free_pages((void*) (pde & HUGE_PAGE_MASK), HUGE_PAGE_ORDER, 1);
+        } else {
+            vmm_free_physical_frames(loaded ? RECURSIVE_PT(pdi) : (uint32_t*) (pde & PAGE_MASK));
+            pmm_free_page((void*) (pde & PAGE_MASK));
+        }
+    }
+}
+
+static vmm_region_t* vmm_internal_copy_pagemap(vmm_region_t* src) {
     uint32_t* new_dir = vmm_new_copied_pgdir();
     if (!new_dir) {
         // yeah if this fails, fuck.
@@ -361,7 +1050,7 @@ vmm_region_t* vmm_copy_pagemap(vmm_region_t* src) {
 
     vmm_region_t* dst = (vmm_region_t*) kmalloc(sizeof(vmm_region_t));
     if (!dst) {
-        kfree(dst, sizeof(vmm_region_t));
+        pmm_free_page((void*) new_dir);
         return 0;
     }
 
@@ -369,8 +1058,17 @@ vmm_region_t* vmm_copy_pagemap(vmm_region_t* src) {
     dst->next = 0;
     dst->base_va = src->base_va;
     dst->next_free_va = src->next_free_va;
+    dst->vma_list = NULL;
+    vmm_internal_init_locks(dst);
+    flop_memset(&dst->rss, 0, sizeof(vmm_rss_t));
+    dst->pt_live = (uint16_t*) kmalloc(PAGE_DIRECTORY_SIZE * sizeof(uint16_t));
+    if (dst->pt_live) {
+        flop_memset(dst->pt_live, 0, PAGE_DIRECTORY_SIZE * sizeof(uint16_t));
+    }
 
-    if (vmm_iterate_and_copy_page_tables(src, dst) < 0) {
+    // the tables copied so far are unwound the way teardown frees them, destroy only takes the directory
+    if (vmm_iterate_and_copy_page_tables(src, dst) < 0 || vma_copy(src, dst) < 0) {
+        vmm_internal_free_user_tables(dst, false);
         vmm_region_destroy(dst);
         return 0;
     }
@@ -381,36 +1079,58 @@ vmm_region_t* vmm_copy_pagemap(vmm_region_t* src) {
     return dst;
 }
 
+// the source is held exclusive for the copy, so no fault or mapping change lands halfway through it
+vmm_region_t* vmm_copy_pagemap(vmm_region_t* src) {
+    rwsem_down_write(&src->mm_sem);
+    vmm_region_t* dst = vmm_internal_copy_pagemap(src);
+    rwsem_up_write(&src->mm_sem);
+    return dst;
+}
+
 void vmm_free_physical_frames(uint32_t* pt) {
     for (int pti = 0; pti < PAGE_ENTRIES; pti++) {
-        if (pt[pti] & PAGE_PRESENT) {
-            pmm_free_page((void*) (pt[pti] & PAGE_MASK));
+        if ((pt[pti] & PAGE_PRESENT) && (pt[pti] & PAGE_MASK) != vma_zero_page()) {
+            pmm_page_put(pt[pti] & PAGE_MASK);
+        } else if (swap_pte_is_entry(pt[pti])) {
+            swap_free(pt[pti]);
         }
     }
 }
 
+// free the user half of a region, which must be the loaded one; the kernel tables above
+// KERNEL_VIRT_BASE and the recursive slot are shared and stay put
 void vmm_iterate_through_page_tables(vmm_region_t* region) {
-    for (int pdi = 0; pdi < 1024; pdi++) {
-        if (!(region->pg_dir[pdi] & PAGE_PRESENT)) {
-            continue;
-        } else {
-            uint32_t* pt = &pg_tbls[pdi * PAGE_ENTRIES];
-
-            vmm_free_physical_frames(pt);
-
-            uintptr_t pt_phys = region->pg_dir[pdi] & PAGE_MASK;
-            pmm_free_page((void*) pt_phys);
-        }
-    }
+    vmm_internal_free_user_tables(region, true);
 }
 
+// tear a region down; everything that can reach it from elsewhere, the region list, the areas the reverse map
+// walks, the swap lru, the merge scanner and the prefetch worker, is cut off first with mm_sem held exclusive,
+// which also waits out a scanner already inside it. only then do its tables and directory go
 void vmm_nuke_pagemap(vmm_region_t* region) {
+    rwsem_down_write(&region->mm_sem);
+    vmm_region_remove(region);
+    vma_destroy_all(region);
+    swap_forget_region(region);
+    ksm_forget_region(region);
+
+    uint32_t* saved = read_pd();
+    load_pd(region->pg_dir);
+    // a cpu still switching away from the last thread of the region may have the directory loaded
+    vmm_internal_flush_range(0, VMM_TLB_FLUSH_ALL);
     vmm_iterate_through_page_tables(region);
+    load_pd(saved == region->pg_dir ? kernel_region.pg_dir : saved);
+    if (current_region == region) {
+        current_region = &kernel_region;
+        current_pg_dir = kernel_region.pg_dir;
+    }
 
     uintptr_t dir_phys = (uintptr_t) region->pg_dir;
     pmm_free_page((void*) dir_phys);
 
-    vmm_region_remove(region);
+    rwsem_up_write(&region->mm_sem);
+    if (region->pt_live) {
+        kfree(region->pt_live, PAGE_DIRECTORY_SIZE * sizeof(uint16_t));
+    }
     kfree(region, sizeof(vmm_region_t));
 }
 
@@ -436,24 +1156,202 @@ size_t vmm_count_regions() {
     return n;
 }
 
+// hand every region to fn, until fn returns false. fn runs with the list lock dropped and the region's mm_sem
+// held shared, which also keeps the region on the list, as teardown takes it exclusive before unlinking it; a
+// region busy changing its layout is passed over
+void vmm_region_foreach(bool (*fn)(vmm_region_t* region, void* ctx), void* ctx) {
+    bool r = spinlock(&region_list_lock);
+    vmm_region_t* iter = region_list;
+    while (iter) {
+        if (!rwsem_try_down_read(&iter->mm_sem)) {
+            iter = iter->next;
+            continue;
+        }
+        spinlock_unlock(&region_list_lock, r);
+
+        bool more = fn(iter, ctx);
+
+        r = spinlock(&region_list_lock);
+        vmm_region_t* next = iter->next;
+        rwsem_up_read(&iter->mm_sem);
+        if (!more) {
+            break;
+        }
+        iter = next;
+    }
+    spinlock_unlock(&region_list_lock, r);
+}
+
 // map a range of virtual addresses to physical addresses
+// page tables are allocated before any pte is touched, so a failure leaves the range as it was
 int vmm_map_range(vmm_region_t* region, uintptr_t va, uintptr_t pa, size_t pages, uint32_t flags) {
-    for (size_t i = 0; i < pages; i++) {
-        if (vmm_map(region, va + i * PAGE_SIZE, pa + i * PAGE_SIZE, flags) < 0) {
-            return -1;
+    if (!region) {
+        return -1;
+    }
+
+    if (pages == 0) {
+        return 0;
+    }
+
+    if (vmm_internal_prepare_pts(region, va, pages) < 0) {
+        return -1;
+    }
+
+    vmm_internal_fill_ptes(region, va, pa, NULL, pages, flags);
+    return 0;
+}
+
+// unmap a range, stopping at the first page without a page table
+// out_done receives the number of pages unmapped, so va + done * PAGE_SIZE is the page that failed
+int vmm_unmap_range_partial(vmm_region_t* region, uintptr_t va, size_t pages, size_t* out_done) {
+    size_t done = 0;
+    int status = 0;
+    uintptr_t dead = 0;
+
+    while (done < pages) {
+        uintptr_t cur = va + done * PAGE_SIZE;
+        uint32_t pdi = pd_index(cur);
+        uint32_t pde = region->pg_dir[pdi];
+        size_t span = vmm_internal_span(cur, pages - done);
+
+        if (!(pde & PAGE_PRESENT)) {
+            status = -1;
+            break;
+        }
+
+        // a 4 MiB page covered entirely is dropped at the pde; the caller still owns its frames
+        if ((pde & PAGE_PSE) && span == PAGE_ENTRIES) {
+            pmm_split_allocated((void*) (pde & HUGE_PAGE_MASK), HUGE_PAGE_ORDER);
+            vmm_internal_rss_add(region, pde, -PAGE_ENTRIES);
+            region->pg_dir[pdi] = 0;
+            done += span;
+            continue;
+        }
+
+        if ((pde & PAGE_PSE) && vmm_split_huge(region, cur) < 0) {
+            status = -1;
+            break;
+        }
+
+        uint32_t* pte = RECURSIVE_PT(pdi) + pt_index(cur);
+        int removed = 0;
+        for (size_t i = 0; i < span; i++) {
+            removed += pte[i] != 0;
+            vmm_internal_release(region, pte[i]);
+            pte[i] = 0;
+        }
+        done += span;
+
+        vmm_internal_live_add(region, pdi, -removed);
+        vmm_internal_reclaim_pt(region, pdi, &dead);
+    }
+
+    vmm_internal_finish_unmap(va, done, dead);
+
+    if (out_done) {
+        *out_done = done;
+    }
+    return status;
+}
+
+// unmap a range of virtual addresses from physical addresses
+int vmm_unmap_range(vmm_region_t* region, uintptr_t va, size_t pages) {
+    return vmm_unmap_range_partial(region, va, pages, NULL);
+}
+
+// pages until either side of a move crosses into the next page table
+static inline size_t vmm_internal_move_span(uintptr_t src, uintptr_t dst, size_t pages) {
+    size_t span = vmm_internal_span(src, pages);
+    return vmm_internal_span(dst, span);
+}
+
+// a chunk covering a whole table on both sides moves by its pde, as long as the destination pde is free
+static inline bool vmm_internal_moves_pde(vmm_region_t* region, uintptr_t dst, size_t span) {
+    return span == PAGE_ENTRIES && !(region->pg_dir[pd_index(dst)] & PAGE_PRESENT) &&
+           pd_index(dst) < pd_index(KERNEL_VIRT_BASE);
+}
+
+// move the translations of [old_va, old_va + pages) to new_va without touching the frames behind them
+// whole page tables (and 4 MiB pages) move by their pde when both sides line up, the rest pte by pte
+// the destination must be unmapped and must not overlap the source
+int vmm_move_range(vmm_region_t* region, uintptr_t old_va, uintptr_t new_va, size_t pages) {
+    if (!region || pages == 0) {
+        return -1;
+    }
+
+    if (new_va < old_va + pages * PAGE_SIZE && old_va < new_va + pages * PAGE_SIZE) {
+        log("vmm_move_range: source and destination overlap\n", RED);
+        return -1;
+    }
+
+    // everything that can fail happens up front: destination tables and source splits
+    for (size_t done = 0; done < pages;) {
+        uintptr_t src = old_va + done * PAGE_SIZE;
+        uintptr_t dst = new_va + done * PAGE_SIZE;
+        size_t span = vmm_internal_move_span(src, dst, pages - done);
+
+        if (!vmm_internal_moves_pde(region, dst, span)) {
+            if (vmm_pde_is_huge(region->pg_dir[pd_index(src)]) && vmm_split_huge(region, src) < 0) {
+                goto fail;
+            }
+            if ((region->pg_dir[pd_index(src)] & PAGE_PRESENT) && vmm_internal_prepare_pts(region, dst, span) < 0) {
+                goto fail;
+            }
+        }
+        done += span;
+    }
+
+    uintptr_t dead = 0;
+    for (size_t done = 0; done < pages;) {
+        uintptr_t src = old_va + done * PAGE_SIZE;
+        uintptr_t dst = new_va + done * PAGE_SIZE;
+        uint32_t spdi = pd_index(src);
+        uint32_t dpdi = pd_index(dst);
+        size_t span = vmm_internal_move_span(src, dst, pages - done);
+        done += span;
+
+        if (!(region->pg_dir[spdi] & PAGE_PRESENT)) {
+            continue;
+        }
+
+        if (vmm_internal_moves_pde(region, dst, span)) {
+            region->pg_dir[dpdi] = region->pg_dir[spdi];
+            region->pg_dir[spdi] = 0;
+            if (region->pt_live) {
+                region->pt_live[dpdi] = region->pt_live[spdi];
+                region->pt_live[spdi] = 0;
+            }
+            continue;
+        }
+
+        uint32_t* from = RECURSIVE_PT(spdi) + pt_index(src);
+        uint32_t* to = RECURSIVE_PT(dpdi) + pt_index(dst);
+        int moved = 0;
+        for (size_t i = 0; i < span; i++) {
+            if (from[i]) {
+                to[i] = from[i];
+                from[i] = 0;
+                moved++;
+            }
         }
+
+        vmm_internal_live_add(region, dpdi, moved);
+        vmm_internal_live_add(region, spdi, -moved);
+        vmm_internal_reclaim_pt(region, spdi, &dead);
     }
+
+    // one flush covers the source ptes, the moved pdes and their recursive slots
+    vmm_internal_finish_unmap(old_va, VMM_TLB_FLUSH_ALL, dead);
     return 0;
-}
 
-// unmap a range of virtual addresses from physical addresses
-int vmm_unmap_range(vmm_region_t* region, uintptr_t va, size_t pages) {
-    for (size_t i = 0; i < pages; i++) {
-        if (vmm_unmap(region, va + i * PAGE_SIZE) < 0) {
-            return -1;
-        }
+fail:
+    // only empty destination tables can exist at this point, drop them again
+    dead = 0;
+    for (uint32_t pdi = pd_index(new_va); pdi <= pd_index(new_va + (pages - 1) * PAGE_SIZE); pdi++) {
+        vmm_internal_reclaim_pt(region, pdi, &dead);
     }
-    return 0;
+    vmm_internal_finish_unmap(new_va, VMM_TLB_FLUSH_ALL, dead);
+    return -1;
 }
 
 // protect a memory region with flags
@@ -463,19 +1361,22 @@ int vmm_protect(vmm_region_t* region, uintptr_t va, uint32_t flags) {
     if (!(region->pg_dir[pdi] & PAGE_PRESENT)) {
         return -1;
     }
+    if (vmm_split_huge(region, va) < 0) {
+        return -1;
+    }
     uint32_t* pt = &pg_tbls[pdi * PAGE_ENTRIES];
     if (!(pt[pti] & PAGE_PRESENT)) {
         return -1;
     }
-    pt[pti] = (pt[pti] & PAGE_MASK) | flags | PAGE_PRESENT;
-    invlpg((void*) va);
+    pt[pti] = (pt[pti] & (PAGE_MASK | VMM_PTE_KIND)) | (flags & ~VMM_PTE_KIND) | PAGE_PRESENT;
+    vmm_internal_flush_range(va, 1);
     return 0;
 }
 
 // get pt of va in region
 uint32_t* vmm_get_pt(vmm_region_t* region, uintptr_t va) {
     uint32_t pdi = pd_index(va);
-    if (!(region->pg_dir[pdi] & PAGE_PRESENT)) {
+    if (!(region->pg_dir[pdi] & PAGE_PRESENT) || (region->pg_dir[pdi] & PAGE_PSE)) {
         return 0;
     }
     return &pg_tbls[pdi * PAGE_ENTRIES];
@@ -489,15 +1390,14 @@ uint32_t vmm_get_pde(vmm_region_t* region, uintptr_t va) {
 uintptr_t vmm_find_free_range(vmm_region_t* region, size_t pages) {
     size_t run = 0;
     uintptr_t start = 0;
-    for (uintptr_t va = 0; va < 0xFFFFFFFF; va += PAGE_SIZE) {
-        uint32_t* pt = vmm_get_pt(region, va);
-        uint32_t pde = vmm_get_pde(region, va);
-        int used = 0;
-        if (pde & PAGE_PRESENT) {
-            if (pt && (pt[pt_index(va)] & PAGE_PRESENT)) {
-                used = 1;
-            }
+    // va 0 is never handed out, callers treat 0 as failure
+    for (uintptr_t va = region->base_va ? region->base_va : PAGE_SIZE; va < 0xFFFFFFFF; va += PAGE_SIZE) {
+        // the scan can cover the whole address space, give way once per page table
+        if (!(va & ~HUGE_PAGE_MASK)) {
+            cond_resched();
         }
+
+        int used = vmm_is_mapped(region, va);
         if (!used) {
             if (run == 0) {
                 start = va;
@@ -549,38 +1449,129 @@ int vmm_map_direct(vmm_region_t* region, uintptr_t phys, size_t pages, uint32_t
     return 0;
 }
 
+// back an anonymous range with zeroed frames, using 4 MiB pages for every aligned chunk the range fully covers
+int vmm_populate_anonymous(vmm_region_t* region, uintptr_t va, size_t pages, uint32_t flags) {
+    if (!region || pages == 0) {
+        return -1;
+    }
+
+    uintptr_t end = va + pages * PAGE_SIZE;
+    uintptr_t cur = va;
+
+    while (cur < end) {
+        if (vmm_try_map_huge(region, cur, end, flags) == 0) {
+            cur += HUGE_PAGE_SIZE;
+            continue;
+        }
+
+        // otherwise fill the rest of this page table with 4 KiB frames in one pass
+        size_t span = vmm_internal_span(cur, (end - cur) / PAGE_SIZE);
+        if (vmm_internal_prepare_pts(region, cur, span) < 0) {
+            vmm_free(region, va, (cur - va) / PAGE_SIZE);
+            return -1;
+        }
+
+        // frames come from the buddy allocator in batches instead of one lock round trip per page
+        uint32_t* pte = RECURSIVE_PT(pd_index(cur)) + pt_index(cur);
+        uintptr_t frames[VMM_BULK_BATCH];
+        for (size_t i = 0; i < span;) {
+            size_t want = span - i < VMM_BULK_BATCH ? span - i : VMM_BULK_BATCH;
+            size_t got = pmm_alloc_bulk(frames, want);
+            for (size_t j = 0; j < got; j++, i++) {
+                flop_memset((void*) frames[j], 0, PAGE_SIZE);
+                pte[i] = (frames[j] & PAGE_MASK) | flags | PAGE_PRESENT;
+                vmm_internal_rss_add(region, pte[i], 1);
+            }
+            vmm_internal_live_add(region, pd_index(cur), (int) got);
+
+            if (got < want) {
+                vmm_internal_flush_local(cur, i);
+                vmm_free(region, va, (cur - va) / PAGE_SIZE + i);
+                return -1;
+            }
+        }
+        // the entries were empty, no other cpu can have them cached
+        vmm_internal_flush_local(cur, span);
+        cur += span * PAGE_SIZE;
+    }
+
+    return 0;
+}
+
 uintptr_t vmm_map_anonymous(vmm_region_t* region, size_t pages, uint32_t flags) {
-    uintptr_t va = vmm_find_free_range(region, pages);
+    uintptr_t va = 0;
+    if (pages >= HUGE_PAGE_PAGES) {
+        va = vmm_find_free_range_aligned(region, pages, HUGE_PAGE_SIZE);
+    }
+    if (!va) {
+        va = vmm_find_free_range(region, pages);
+    }
     if (!va) {
         return 0;
     }
 
-    for (size_t i = 0; i < pages; i++) {
-        uintptr_t pa = (uintptr_t) pmm_alloc_page();
-        if (!pa) {
-            for (size_t j = 0; j < i; j++) {
-                vmm_unmap(region, va + j * PAGE_SIZE);
-            }
-            return 0;
+    if (vmm_populate_anonymous(region, va, pages, flags) < 0) {
+        return 0;
+    }
+
+    return va;
+}
+
+// change the flags of a range, stopping at the first page that is not mapped
+// out_done receives the number of pages changed, so va + done * PAGE_SIZE is the page that failed
+int vmm_protect_range_partial(vmm_region_t* region, uintptr_t va, size_t pages, uint32_t flags, size_t* out_done) {
+    size_t done = 0;
+    int status = 0;
+
+    while (done < pages) {
+        uintptr_t cur = va + done * PAGE_SIZE;
+        uint32_t pdi = pd_index(cur);
+        uint32_t pde = region->pg_dir[pdi];
+        size_t span = vmm_internal_span(cur, pages - done);
+
+        if (!(pde & PAGE_PRESENT)) {
+            status = -1;
+            break;
         }
-        if (vmm_map(region, va + i * PAGE_SIZE, pa, flags) < 0) {
-            for (size_t j = 0; j <= i; j++) {
-                vmm_unmap(region, va + j * PAGE_SIZE);
-            }
-            pmm_free_page((void*) pa);
-            return 0;
+
+        // a 4 MiB page covered entirely keeps its pde, only a partial change splits it
+        if ((pde & PAGE_PSE) && span == PAGE_ENTRIES) {
+            region->pg_dir[pdi] = (pde & HUGE_PAGE_MASK) | (flags & ~VMM_PTE_KIND) | PAGE_PRESENT | PAGE_PSE;
+            done += span;
+            continue;
+        }
+
+        if ((pde & PAGE_PSE) && vmm_split_huge(region, cur) < 0) {
+            status = -1;
+            break;
+        }
+
+        uint32_t* pte = RECURSIVE_PT(pdi) + pt_index(cur);
+        size_t i = 0;
+        for (; i < span && (pte[i] & PAGE_PRESENT); i++) {
+            pte[i] = (pte[i] & (PAGE_MASK | VMM_PTE_KIND)) | (flags & ~VMM_PTE_KIND) | PAGE_PRESENT;
+        }
+        done += i;
+
+        if (i < span) {
+            status = -1;
+            break;
         }
     }
 
-    return va;
+    vmm_internal_flush_range(va, done);
+
+    if (out_done) {
+        *out_done = done;
+    }
+    return status;
 }
 
 int vmm_protect_range(vmm_region_t* region, uintptr_t va, size_t pages, uint32_t flags) {
-    for (size_t i = 0; i < pages; i++) {
-        if (vmm_protect(region, va + i * PAGE_SIZE, flags) < 0) {
-            log("vmm_protect_range: failed to protect page\n", RED);
-            return -1;
-        }
+    size_t done = 0;
+    if (vmm_protect_range_partial(region, va, pages, flags, &done) < 0) {
+        log_address("vmm_protect_range: failed to protect page ", va + done * PAGE_SIZE);
+        return -1;
     }
     return 0;
 }
@@ -626,13 +1617,15 @@ int vmm_map_scatter(vmm_region_t* region, uintptr_t va, uintptr_t* phys_pages, s
         return -1;
     }
 
-    for (size_t i = 0; i < pages; i++) {
-        uintptr_t pa = phys_pages[i];
-        if (vmm_map(region, va + i * PAGE_SIZE, pa, flags) < 0) {
-            vmm_unmap_range(region, va, i);
-            return -1;
-        }
+    if (pages == 0) {
+        return 0;
     }
+
+    if (vmm_internal_prepare_pts(region, va, pages) < 0) {
+        return -1;
+    }
+
+    vmm_internal_fill_ptes(region, va, 0, phys_pages, pages, flags);
     return 0;
 }
 
@@ -646,13 +1639,7 @@ int vmm_is_range_mapped(vmm_region_t* region, uintptr_t va, size_t pages) {
 }
 
 uint32_t vmm_get_flags(vmm_region_t* region, uintptr_t va) {
-    uint32_t* pt = vmm_get_pt(region, va);
-    if (!pt) {
-        return 0;
-    }
-
-    uint32_t pti = pt_index(va);
-    uint32_t entry = pt[pti];
+    uint32_t entry = vmm_internal_leaf(region, va);
 
     if (!(entry & PAGE_PRESENT)) {
         return 0;
@@ -661,6 +1648,62 @@ uint32_t vmm_get_flags(vmm_region_t* region, uintptr_t va) {
     return entry & 0xFFF;
 }
 
+// the raw leaf entry for va, present or not
+uint32_t vmm_get_pte(vmm_region_t* region, uintptr_t va) {
+    return region ? vmm_internal_leaf(region, va) : 0;
+}
+
+// replace the present 4 KiB pte at va with a non-present swap entry; the frame is left to the caller
+int vmm_set_swap_entry(vmm_region_t* region, uintptr_t va, uint32_t entry) {
+    uint32_t pdi = pd_index(va);
+    if (!(region->pg_dir[pdi] & PAGE_PRESENT) || (region->pg_dir[pdi] & PAGE_PSE)) {
+        return -1;
+    }
+
+    uint32_t* pte = RECURSIVE_PT(pdi) + pt_index(va);
+    if (!(*pte & PAGE_PRESENT)) {
+        return -1;
+    }
+
+    vmm_internal_rss_add(region, *pte, -1);
+    *pte = entry;
+    vmm_internal_rss_add(region, entry, 1);
+    vmm_internal_flush_range(va, 1);
+    return 0;
+}
+
+static bool vmm_internal_test_and_clear(vmm_region_t* region, uintptr_t va, uint32_t bit) {
+    uint32_t pdi = pd_index(va);
+    if (!(region->pg_dir[pdi] & PAGE_PRESENT) || (region->pg_dir[pdi] & PAGE_PSE)) {
+        return false;
+    }
+
+    uint32_t* pte = RECURSIVE_PT(pdi) + pt_index(va);
+    if ((*pte & (PAGE_PRESENT | bit)) != (PAGE_PRESENT | bit)) {
+        return false;
+    }
+
+    // a cpu that cached the entry dirty would write without setting the bit again; a stale accessed bit
+    // only makes the page look busier than it is, so that one stays local
+    *pte &= ~bit;
+    if (bit & PAGE_DIRTY) {
+        vmm_internal_flush_range(va, 1);
+    } else {
+        invlpg((void*) va);
+    }
+    return true;
+}
+
+// report whether the page at va was touched since the last call, and start a new period
+bool vmm_test_and_clear_accessed(vmm_region_t* region, uintptr_t va) {
+    return vmm_internal_test_and_clear(region, va, PAGE_ACCESSED);
+}
+
+// report whether the page at va was written since the last call
+bool vmm_test_and_clear_dirty(vmm_region_t* region, uintptr_t va) {
+    return vmm_internal_test_and_clear(region, va, PAGE_DIRTY);
+}
+
 void vmm_dump_map(vmm_region_t* region) {
     uintptr_t run_start = 0;
     int in_run = 0;
@@ -706,15 +1749,7 @@ uintptr_t vmm_find_free_range_aligned(vmm_region_t* region, size_t pages, size_t
             start = va;
         }
 
-        uint32_t* pt = vmm_get_pt(region, va);
-        uint32_t pde = vmm_get_pde(region, va);
-        int used = 0;
-
-        if (pde & PAGE_PRESENT) {
-            if (pt && (pt[pt_index(va)] & PAGE_PRESENT)) {
-                used = 1;
-            }
-        }
+        int used = vmm_is_mapped(region, va);
 
         if (!used) {
             run++;
@@ -778,12 +1813,7 @@ int vmm_check_buffer(vmm_region_t* region, uintptr_t va, size_t size, bool write
 
     for (size_t i = 0; i < pages; i++) {
         uintptr_t curr = start_page + i * PAGE_SIZE;
-        uint32_t* pt = vmm_get_pt(region, curr);
-
-        if (!pt) {
-            return 0;
-        }
-        uint32_t entry = pt[pt_index(curr)];
+        uint32_t entry = vmm_internal_leaf(region, curr);
 
         if (!(entry & PAGE_PRESENT)) {
             return 0;
@@ -845,11 +1875,7 @@ uintptr_t vmm_duplicate_page(vmm_region_t* region, uintptr_t va) {
 
     flop_memcpy((void*) new_pa, (void*) old_pa, PAGE_SIZE);
 
-    uint32_t flags = 0;
-    uint32_t* pt = vmm_get_pt(region, va);
-    if (pt) {
-        flags = pt[pt_index(va)] & 0xFFF;
-    }
+    uint32_t flags = vmm_get_flags(region, va);
 
     vmm_map(region, va, new_pa, flags);
     return new_pa;
@@ -1239,7 +2265,7 @@ vmm_pager_desc_t* vmm_pager_create(vmm_region_t* region) {
     desc->base_va = 0;
     desc->size_pages = 0;
     desc->next = NULL;
-    spinlock_init(&desc->lock);
+    rwsem_init(&desc->lock);
 
     return desc;
 }
@@ -1249,13 +2275,13 @@ void vmm_pager_destroy(vmm_pager_desc_t* vmm_pager) {
         return;
     }
 
-    spinlock(&vmm_pager->lock);
-    
+    rwsem_down_write(&vmm_pager->lock);
+
     if (vmm_pager->base_va && vmm_pager->size_pages > 0) {
         vmm_free(vmm_pager->region, vmm_pager->base_va, vmm_pager->size_pages);
     }
-    
-    spinlock_unlock(&vmm_pager->lock, true);
+
+    rwsem_up_write(&vmm_pager->lock);
 
     kfree(vmm_pager, sizeof(vmm_pager_desc_t));
 }
@@ -1320,6 +2346,16 @@ static int vmm_pager_handle_map_physical(vmm_pager_desc_t* vmm_pager, vmm_pager_
     return 0;
 }
 
+// where a range walk goes on after it stopped at pos: past the whole 4 MiB slot when the page table is missing,
+// so a hole costs one call instead of one per page, otherwise past the one page that stopped it
+static size_t vmm_pager_internal_resume(vmm_region_t* region, uintptr_t start_va, size_t pos) {
+    uintptr_t va = start_va + pos * PAGE_SIZE;
+    if (!(region->pg_dir[pd_index(va)] & PAGE_PRESENT)) {
+        return pos + ((va & HUGE_PAGE_MASK) + HUGE_PAGE_SIZE - va) / PAGE_SIZE;
+    }
+    return pos + 1;
+}
+
 static int vmm_pager_handle_unmap_physical(vmm_pager_desc_t* vmm_pager, vmm_pager_request_t* req) {
     uintptr_t start_va = vmm_pager->base_va + (req->virtual_offset * PAGE_SIZE);
 
@@ -1328,12 +2364,12 @@ static int vmm_pager_handle_unmap_physical(vmm_pager_desc_t* vmm_pager, vmm_page
         return -1;
     }
 
-    for (size_t i = 0; i < req->page_count; i++) {
-        uintptr_t curr_va = start_va + (i * PAGE_SIZE);
-        uintptr_t pa = vmm_resolve(vmm_pager->region, curr_va);
-        if (pa) {
-            vmm_unmap(vmm_pager->region, curr_va);
-        }
+    // the range goes out one page table at a time, a page without a table is stepped over
+    size_t pos = 0;
+    while (pos < req->page_count) {
+        size_t done = 0;
+        vmm_unmap_range_partial(vmm_pager->region, start_va + pos * PAGE_SIZE, req->page_count - pos, &done);
+        pos = vmm_pager_internal_resume(vmm_pager->region, start_va, pos + done);
     }
     return 0;
 }
@@ -1346,12 +2382,13 @@ static int vmm_pager_handle_protect(vmm_pager_desc_t* vmm_pager, vmm_pager_reque
         return -1;
     }
 
-    for (size_t i = 0; i < req->page_count; i++) {
-        uintptr_t curr_va = start_va + (i * PAGE_SIZE);
-        uintptr_t pa = vmm_resolve(vmm_pager->region, curr_va);
-        if (pa) {
-            vmm_map(vmm_pager->region, curr_va, pa, req->flags);
-        }
+    // runs of mapped pages take one range update each, holes are stepped over
+    size_t pos = 0;
+    while (pos < req->page_count) {
+        size_t done = 0;
+        vmm_protect_range_partial(vmm_pager->region, start_va + pos * PAGE_SIZE, req->page_count - pos, req->flags,
+                                  &done);
+        pos = vmm_pager_internal_resume(vmm_pager->region, start_va, pos + done);
     }
     return 0;
 }
@@ -1363,15 +2400,7 @@ static int vmm_pager_handle_query(vmm_pager_desc_t* vmm_pager, vmm_pager_request
         return -1;
     }
 
-    uint32_t pdi = pd_index(target_va);
-    uint32_t pti = pt_index(target_va);
-
-    if (!(vmm_pager->region->pg_dir[pdi] & PAGE_PRESENT)) {
-        return -1;
-    }
-
-    uint32_t* pt = RECURSIVE_PT(pdi);
-    uint32_t entry = pt[pti];
+    uint32_t entry = vmm_internal_leaf(vmm_pager->region, target_va);
 
     if (!(entry & PAGE_PRESENT)) {
         return -1;
@@ -1461,13 +2490,7 @@ static int vmm_pager_handle_nuke(vmm_pager_desc_t* vmm_pager, vmm_pager_request_
     return 0;
 }
 
-int vmm_pager_handle_request(vmm_pager_desc_t* vmm_pager, vmm_pager_request_t* req) {
-    if (!vmm_pager || !req || !vmm_pager->region) {
-        return -1;
-    }
-
-    spinlock(&vmm_pager->lock);
-
+static int vmm_pager_internal_dispatch(vmm_pager_desc_t* vmm_pager, vmm_pager_request_t* req) {
     int status = -1;
 
     switch (req->type) {
@@ -1512,10 +2535,261 @@ int vmm_pager_handle_request(vmm_pager_desc_t* vmm_pager, vmm_pager_request_t* r
             break;
     }
 
-    spinlock_unlock(&vmm_pager->lock, true);
     return status;
 }
 
+int vmm_pager_handle_request(vmm_pager_desc_t* vmm_pager, vmm_pager_request_t* req) {
+    if (!vmm_pager || !req || !vmm_pager->region) {
+        return -1;
+    }
+
+    rwsem_down_write(&vmm_pager->lock);
+    int status = vmm_pager_internal_dispatch(vmm_pager, req);
+    rwsem_up_write(&vmm_pager->lock);
+    return status;
+}
+
+static vmm_pager_batch_t* vmm_pager_queue_head = NULL;
+static vmm_pager_batch_t* vmm_pager_queue_tail = NULL;
+static spinlock_t vmm_pager_queue_lock = SPINLOCK_INIT;
+static thread_t* vmm_pager_thread = NULL;
+static bool vmm_pager_waiting = true;
+
+// whether next picks up where a run of prev ending after run_pages pages left off
+static bool vmm_pager_internal_continues(const vmm_pager_request_t* prev, size_t run_pages,
+                                         const vmm_pager_request_t* next) {
+    if (next->type != prev->type || next->flags != prev->flags) {
+        return false;
+    }
+
+    switch (prev->type) {
+        case VMM_PAGER_REQ_ALLOC:
+        case VMM_PAGER_REQ_MAP_ANON:
+        case VMM_PAGER_REQ_NUKE:
+            return true;
+        case VMM_PAGER_REQ_FREE:
+        case VMM_PAGER_REQ_PROTECT:
+        case VMM_PAGER_REQ_UNMAP_PHYSICAL:
+            return next->virtual_offset == prev->virtual_offset + run_pages;
+        case VMM_PAGER_REQ_MAP_PHYSICAL:
+            return next->virtual_offset == prev->virtual_offset + run_pages &&
+                   next->target_pa == prev->target_pa + run_pages * PAGE_SIZE;
+        default:
+            return false;
+    }
+}
+
+// run reqs[0..count) as a single request, then hand the anonymous mapping it made back to each of them
+static int vmm_pager_internal_run(vmm_pager_desc_t* vmm_pager, vmm_pager_request_t* reqs, size_t count) {
+    if (!vmm_pager->region) {
+        return -1;
+    }
+
+    vmm_pager_request_t merged = reqs[0];
+    uintptr_t base = 0;
+    merged.page_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        merged.page_count += reqs[i].page_count;
+    }
+    if (merged.type == VMM_PAGER_REQ_MAP_ANON) {
+        merged.response_pa = &base;
+    }
+
+    int status = vmm_pager_internal_dispatch(vmm_pager, &merged);
+
+    if (status == 0 && merged.type == VMM_PAGER_REQ_MAP_ANON) {
+        uintptr_t va = base;
+        for (size_t i = 0; i < count; i++) {
+            if (reqs[i].response_pa) {
+                *reqs[i].response_pa = va;
+            }
+            va += reqs[i].page_count * PAGE_SIZE;
+        }
+    }
+    return status;
+}
+
+// work through a batch with the pager's region loaded; a nuke drops it back to the kernel directory. the pager
+// is locked per coalesced run, with a sleeping lock, so a long teardown or copy neither keeps interrupts off
+// nor shuts out other users of the pager for the whole batch
+static void vmm_pager_internal_process(vmm_pager_batch_t* batch) {
+    vmm_pager_desc_t* vmm_pager = batch->pager;
+    size_t failed = 0;
+
+    uint32_t* saved = read_pd();
+
+    size_t i = 0;
+    while (i < batch->count) {
+        size_t run = 1;
+        size_t run_pages = batch->reqs[i].page_count;
+        while (i + run < batch->count &&
+               vmm_pager_internal_continues(&batch->reqs[i], run_pages, &batch->reqs[i + run])) {
+            run_pages += batch->reqs[i + run].page_count;
+            run++;
+        }
+
+        rwsem_down_write(&vmm_pager->lock);
+
+        // a nuke loads the region itself and must not come back to a directory it freed
+        vmm_region_t* region = vmm_pager->region;
+        if (region && batch->reqs[i].type == VMM_PAGER_REQ_NUKE) {
+            if (saved == region->pg_dir) {
+                saved = kernel_region.pg_dir;
+            }
+            load_pd(saved);
+        } else if (region) {
+            load_pd(region->pg_dir);
+        }
+
+        if (vmm_pager_internal_run(vmm_pager, &batch->reqs[i], run) < 0) {
+            failed += run;
+        }
+        rwsem_up_write(&vmm_pager->lock);
+        i += run;
+    }
+
+    load_pd(saved);
+
+    void (*complete)(vmm_pager_batch_t*, void*) = batch->complete;
+    void* ctx = batch->ctx;
+
+    bool r = spinlock(&vmm_pager_queue_lock);
+    batch->failed = failed;
+    batch->status = failed ? -1 : 0;
+    batch->done = true;
+    thread_t* waiter = batch->waiter;
+    spinlock_unlock(&vmm_pager_queue_lock, r);
+
+    if (waiter) {
+        sched_unblock(waiter);
+    }
+    // the callback may free the batch, so it goes last
+    if (complete) {
+        complete(batch, ctx);
+    }
+}
+
+static void vmm_pager_thread_entry(void) {
+    for (;;) {
+        bool r = spinlock(&vmm_pager_queue_lock);
+        if (!vmm_pager_queue_head) {
+            vmm_pager_waiting = true;
+            spinlock_unlock(&vmm_pager_queue_lock, r);
+            sched_block();
+            continue;
+        }
+
+        vmm_pager_batch_t* batch = vmm_pager_queue_head;
+        vmm_pager_queue_head = batch->next;
+        if (!vmm_pager_queue_head) {
+            vmm_pager_queue_tail = NULL;
+        }
+        spinlock_unlock(&vmm_pager_queue_lock, r);
+
+        vmm_pager_internal_process(batch);
+    }
+}
+
+void vmm_pager_init(void) {
+    vmm_pager_thread = sched_create_kernel_thread(vmm_pager_thread_entry, 0, "vmm_pager");
+    if (!vmm_pager_thread) {
+        log("vmm_pager_init: could not create the pager thread\n", RED);
+    }
+}
+
+// queue a batch for the pager thread and return at once; without a thread it runs right here
+int vmm_pager_submit(vmm_pager_batch_t* batch) {
+    if (!batch || !batch->pager || !batch->reqs || batch->count == 0) {
+        return -1;
+    }
+
+    batch->status = 0;
+    batch->failed = 0;
+    batch->done = false;
+    batch->waiter = NULL;
+    batch->next = NULL;
+
+    if (!vmm_pager_thread) {
+        vmm_pager_internal_process(batch);
+        return 0;
+    }
+
+    bool r = spinlock(&vmm_pager_queue_lock);
+    if (vmm_pager_queue_tail) {
+        vmm_pager_queue_tail->next = batch;
+    } else {
+        vmm_pager_queue_head = batch;
+    }
+    vmm_pager_queue_tail = batch;
+
+    bool wake = vmm_pager_waiting;
+    vmm_pager_waiting = false;
+    spinlock_unlock(&vmm_pager_queue_lock, r);
+
+    if (wake) {
+        sched_unblock(vmm_pager_thread);
+    }
+    return 0;
+}
+
+// block until a submitted batch has run; not for batches whose callback frees them
+int vmm_pager_wait(vmm_pager_batch_t* batch) {
+    if (!batch) {
+        return -1;
+    }
+
+    for (;;) {
+        bool r = spinlock(&vmm_pager_queue_lock);
+        if (batch->done) {
+            spinlock_unlock(&vmm_pager_queue_lock, r);
+            break;
+        }
+        batch->waiter = sched_current_thread();
+        spinlock_unlock(&vmm_pager_queue_lock, r);
+        sched_block();
+    }
+    return batch->status;
+}
+
+typedef struct vmm_pager_nuke {
+    vmm_pager_batch_t batch;
+    vmm_pager_request_t req;
+} vmm_pager_nuke_t;
+
+static void vmm_pager_internal_nuke_done(vmm_pager_batch_t* batch, void* ctx) {
+    vmm_pager_nuke_t* nuke = (vmm_pager_nuke_t*) ctx;
+    vmm_pager_destroy(batch->pager);
+    kfree(nuke, sizeof(vmm_pager_nuke_t));
+}
+
+// tear a dead region down on the pager thread so the exiting task does not pay for it
+int vmm_pager_nuke_async(vmm_region_t* region) {
+    if (!region || region == &kernel_region) {
+        return -1;
+    }
+
+    vmm_pager_nuke_t* nuke = (vmm_pager_nuke_t*) kmalloc(sizeof(vmm_pager_nuke_t));
+    if (!nuke) {
+        log("vmm_pager_nuke_async: kmalloc failed\n", RED);
+        return -1;
+    }
+
+    vmm_pager_desc_t* vmm_pager = vmm_pager_create(region);
+    if (!vmm_pager) {
+        kfree(nuke, sizeof(vmm_pager_nuke_t));
+        return -1;
+    }
+
+    flop_memset(nuke, 0, sizeof(vmm_pager_nuke_t));
+    nuke->req.type = VMM_PAGER_REQ_NUKE;
+    nuke->batch.pager = vmm_pager;
+    nuke->batch.reqs = &nuke->req;
+    nuke->batch.count = 1;
+    nuke->batch.complete = vmm_pager_internal_nuke_done;
+    nuke->batch.ctx = nuke;
+    return vmm_pager_submit(&nuke->batch);
+}
+
 static uint64_t vmm_rng_state = 123456789;
 
 static uint32_t vmm_rand(void) {
@@ -1524,11 +2798,7 @@ static uint32_t vmm_rand(void) {
 }
 
 static uint32_t vmm_get_entry_flags(vmm_region_t* region, uintptr_t va) {
-    uint32_t pdi = pd_index(va);
-    uint32_t pti = pt_index(va);
-
-    uint32_t* pt = RECURSIVE_PT(pdi);
-    return pt[pti] & 0xFFF;
+    return vmm_internal_leaf(region, va) & 0xFFF;
 }
 
 uintptr_t* vmm_shuffle(vmm_region_t* region, uintptr_t base_va, size_t pages) {
@@ -3,12 +3,18 @@
 
 #include <stdint.h>
 #include "../task/sync/spinlock.h"
+#include "../task/sync/rwsem.h"
 #define PAGE_SIZE 4096
 #define RECURSIVE_PDE 1023
 #define RECURSIVE_ADDR 0xFFC00000
 #define RECURSIVE_PT(pdi) ((uint32_t*) (RECURSIVE_ADDR + (pdi) * PAGE_SIZE))
 #define USER_SPACE_START 0x00100000U
 #define USER_SPACE_END 0xBFFFFFFFU
+#define HUGE_PAGE_SIZE 0x400000U
+#define HUGE_PAGE_MASK 0xFFC00000U
+#define HUGE_PAGE_PAGES 1024
+// locks guarding pte updates, page tables are hashed onto them by directory index
+#define VMM_PT_LOCKS 64
 
 extern uint32_t* pg_dir;
 extern uint32_t* pg_tbls;
@@ -48,12 +54,29 @@ typedef struct vmm_alloc_class {
     struct vmm_alloc_class* next;
 } vmm_alloc_class_t;
 
+// resident set of a region in pages, kept up to date wherever a pte or page table comes or goes
+typedef struct vmm_rss {
+    uint32_t anon;        // private frames, including 4 MiB pages
+    uint32_t file;        // file frames mapped in place and still shared with the file
+    uint32_t shared;      // frames of shared file mappings
+    uint32_t page_tables; // page tables hanging off the directory
+    uint32_t peak;        // highest anon + file + shared seen
+    uint32_t swapped;     // pages whose contents sit in a swap slot
+    uint32_t min_faults;  // faults resolved without any i/o
+    uint32_t maj_faults;  // faults that had to wait for a device
+} vmm_rss_t;
+
 typedef struct vmm_region {
     uint32_t* pg_dir;
     struct vmm_region* next;
     uintptr_t base_va;
     uintptr_t next_free_va;
     struct vmm_alloc_class* class_list;
+    struct vmm_vma* vma_list;
+    uint16_t* pt_live; // present ptes per page table, NULL for regions whose tables are never reclaimed
+    vmm_rss_t rss;
+    rwsem_t mm_sem; // taken shared by faults, exclusive by anything that changes the areas or copies them
+    spinlock_t pt_locks[VMM_PT_LOCKS];
 } vmm_region_t;
 
 typedef enum {
@@ -89,15 +112,36 @@ typedef struct vmm_pager_desc {
     size_t size_pages;
     uint32_t default_flags;
     vmm_region_t* region;
-    spinlock_t lock;
+    rwsem_t lock; // held for writing around each request, which may sleep on mm_sem or the allocator
     struct vmm_pager_desc* next;
 } vmm_pager_desc_t;
 
+struct thread;
+
+// requests handed to the pager thread in one go; adjacent ranges of the same kind are coalesced and run
+// as one range operation. done is set, the waiter woken and complete called once every request has run
+typedef struct vmm_pager_batch {
+    vmm_pager_desc_t* pager;
+    vmm_pager_request_t* reqs;
+    size_t count;
+    int status;    // 0 when every request succeeded, -1 otherwise
+    size_t failed; // requests that failed
+    volatile bool done;
+    struct thread* waiter;
+    void (*complete)(struct vmm_pager_batch* batch, void* ctx);
+    void* ctx;
+    struct vmm_pager_batch* next;
+} vmm_pager_batch_t;
+
 uintptr_t* vmm_shuffle(vmm_region_t* region, uintptr_t base_va, size_t pages);
 void vmm_unshuffle(vmm_region_t* region, uintptr_t base_va, size_t pages, uintptr_t* key);
 vmm_pager_desc_t* vmm_pager_create(vmm_region_t* region);
 void vmm_pager_destroy(vmm_pager_desc_t* vmm_pager);
 int vmm_pager_handle_request(vmm_pager_desc_t* vmm_pager, vmm_pager_request_t* req);
+void vmm_pager_init(void);
+int vmm_pager_submit(vmm_pager_batch_t* batch);
+int vmm_pager_wait(vmm_pager_batch_t* batch);
+int vmm_pager_nuke_async(vmm_region_t* region);
 void vmm_classes_init(vmm_region_t* region);
 int vmm_class_register(vmm_region_t* region, vmm_class_config_t* config);
 uintptr_t vmm_class_alloc(vmm_region_t* region, vm_class_type_t type, size_t pages);
@@ -110,11 +154,19 @@ uintptr_t vmm_alloc_mmio(vmm_region_t* region, size_t pages);
 int vmm_alloc_pde(uint32_t* dir, uint32_t pde_idx, uint32_t flags);
 void vmm_region_insert(vmm_region_t* region);
 void vmm_region_remove(vmm_region_t* region);
+void vmm_region_foreach(bool (*fn)(vmm_region_t* region, void* ctx), void* ctx);
+uint32_t vmm_rss_pages(vmm_region_t* region);
+uint32_t vmm_get_pte(vmm_region_t* region, uintptr_t va);
+int vmm_set_swap_entry(vmm_region_t* region, uintptr_t va, uint32_t entry);
+bool vmm_test_and_clear_accessed(vmm_region_t* region, uintptr_t va);
+bool vmm_test_and_clear_dirty(vmm_region_t* region, uintptr_t va);
 uintptr_t vmm_resolve(vmm_region_t* region, uintptr_t va);
 int vmm_map(vmm_region_t* region, uintptr_t va, uintptr_t pa, uint32_t flags);
 int vmm_unmap(vmm_region_t* region, uintptr_t va);
 int vmm_map_range(vmm_region_t* region, uintptr_t va, uintptr_t pa, size_t pages, uint32_t flags);
 int vmm_unmap_range(vmm_region_t* region, uintptr_t va, size_t pages);
+int vmm_unmap_range_partial(vmm_region_t* region, uintptr_t va, size_t pages, size_t* out_done);
+int vmm_move_range(vmm_region_t* region, uintptr_t old_va, uintptr_t new_va, size_t pages);
 uintptr_t vmm_find_free_range(vmm_region_t* region, size_t pages);
 int vmm_protect(vmm_region_t* region, uintptr_t va, uint32_t flags);
 vmm_region_t* vmm_region_create(size_t initial_pages, uint32_t flags, uintptr_t* out_va);
@@ -124,6 +176,7 @@ uintptr_t vmm_alloc(vmm_region_t* region, size_t pages, uint32_t flags);
 void vmm_free(vmm_region_t* region, uintptr_t va, size_t pages);
 void vmm_init();
 int vmm_protect_range(vmm_region_t* region, uintptr_t va, size_t pages, uint32_t flags);
+int vmm_protect_range_partial(vmm_region_t* region, uintptr_t va, size_t pages, uint32_t flags, size_t* out_done);
 uintptr_t vmm_alloc_stack(vmm_region_t* region, size_t pages, uint32_t flags);
 int vmm_map_scatter(vmm_region_t* region, uintptr_t va, uintptr_t* phys_pages, size_t pages, uint32_t flags);
 int vmm_is_range_mapped(vmm_region_t* region, uintptr_t va, size_t pages);
@@ -139,6 +192,10 @@ int vmm_is_phys_contiguous(vmm_region_t* region, uintptr_t va, size_t pages);
 uintptr_t vmm_duplicate_page(vmm_region_t* region, uintptr_t va);
 void vmm_flush_tlb(void);
 void vmm_free_physical_frames(uint32_t* pt);
+bool vmm_pt_lock(vmm_region_t* region, uintptr_t va);
+bool vmm_pt_trylock(vmm_region_t* region, uintptr_t va, bool* out_r);
+void vmm_pt_unlock(vmm_region_t* region, uintptr_t va, bool r);
+bool vmm_pt_same_lock(vmm_region_t* region, uintptr_t va, uintptr_t other);
 void vmm_iterate_through_page_tables(vmm_region_t* region);
 void vmm_nuke_pagemap(vmm_region_t* region);
 int vmm_copy_frames(uint32_t* src_pt, uint32_t* dst_pt);
@@ -147,5 +204,14 @@ vmm_region_t* vmm_copy_pagemap(vmm_region_t* src);
 int vmm_is_mapped(vmm_region_t* region, uintptr_t va);
 int vmm_is_user_mapped(vmm_region_t* region, uintptr_t va);
 int vmm_is_kernel_mapped(vmm_region_t* region, uintptr_t va);
+uintptr_t vmm_find_free_range_aligned(vmm_region_t* region, size_t pages, size_t alignment);
+int vmm_is_huge(vmm_region_t* region, uintptr_t va);
+int vmm_split_huge(vmm_region_t* region, uintptr_t va);
+uint32_t vmm_get_pde(vmm_region_t* region, uintptr_t va);
+uintptr_t vmm_alloc_huge(void);
+void vmm_free_huge(uintptr_t pa);
+int vmm_map_huge(vmm_region_t* region, uintptr_t va, uintptr_t end, uintptr_t pa, uint32_t flags);
+int vmm_try_map_huge(vmm_region_t* region, uintptr_t va, uintptr_t end, uint32_t flags);
+int vmm_populate_anonymous(vmm_region_t* region, uintptr_t va, size_t pages, uint32_t flags);
 
 #endif // VMM_H
@@ -0,0 +1,294 @@
+/*
+
+Copyright 2024-2026 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of The Flopperating System.
+
+The Flopperating System is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+The Flopperating System is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with The Flopperating System. If not, see <https://www.gnu.org/licenses/>.
+
+[DESCRIPTION] - compressed in memory swap tier
+
+*/
+#include <stdint.h>
+#include "zram.h"
+#include "pmm.h"
+#include "paging.h"
+#include "utils.h"
+#include "../lib/lz4.h"
+#include "../lib/str.h"
+#include "../lib/logging.h"
+#include "../task/sync/spinlock.h"
+
+// a pool frame; objects of one class follow the header and free ones are chained by offset
+typedef struct zram_zpage {
+    struct zram_zpage* prev;
+    struct zram_zpage* next;
+    uint32_t free_head; // offset of the first free object, 0 when full
+    uint16_t used;
+    uint16_t class_idx;
+} zram_zpage_t;
+
+// a stored page; obj is the address of its compressed bytes, 0 for a free slot
+typedef struct zram_slot {
+    uintptr_t obj;
+    uint16_t size;
+    uint8_t refs;
+    uint8_t class_idx;
+} zram_slot_t;
+
+#define ZRAM_TABLE_ORDER 5
+#define ZRAM_SLOTS ((PAGE_SIZE << ZRAM_TABLE_ORDER) / sizeof(zram_slot_t))
+#define ZRAM_REFS_MAX 0xFF
+
+static zram_slot_t* zram_slots = NULL;
+static uint32_t zram_slot_hint = 0;
+// pool pages of each class that still have a free object
+static zram_zpage_t* zram_partial[ZRAM_CLASSES];
+static zram_stats_t zram_stats;
+static spinlock_t zram_lock = SPINLOCK_INIT;
+
+// compression scratch, only touched under zram_lock
+static uint8_t zram_scratch[ZRAM_MAX_STORED];
+static uint16_t zram_table[LZ4_TABLE_ENTRIES];
+
+void zram_init(void) {
+    zram_slots = (zram_slot_t*) pmm_alloc_pages(ZRAM_TABLE_ORDER, 1);
+    if (!zram_slots) {
+        log("zram_init: pmm_alloc_pages failed for the slot table\n", RED);
+        return;
+    }
+
+    flop_memset(zram_slots, 0, PAGE_SIZE << ZRAM_TABLE_ORDER);
+    log("zram: init - ok\n", GREEN);
+}
+
+bool zram_enabled(void) {
+    return zram_slots != NULL;
+}
+
+static inline uint32_t zram_internal_obj_size(uint32_t class_idx) {
+    return (class_idx + 1) * ZRAM_CLASS_SIZE;
+}
+
+static void zram_internal_unlink(zram_zpage_t* zpage) {
+    if (zpage->prev) {
+        zpage->prev->next = zpage->next;
+    } else {
+        zram_partial[zpage->class_idx] = zpage->next;
+    }
+    if (zpage->next) {
+        zpage->next->prev = zpage->prev;
+    }
+    zpage->prev = zpage->next = NULL;
+}
+
+static void zram_internal_link(zram_zpage_t* zpage) {
+    zpage->prev = NULL;
+    zpage->next = zram_partial[zpage->class_idx];
+    if (zpage->next) {
+        zpage->next->prev = zpage;
+    }
+    zram_partial[zpage->class_idx] = zpage;
+}
+
+// a fresh pool frame with every object of the class chained on its free list
+static zram_zpage_t* zram_internal_grow(uint32_t class_idx) {
+    if (zram_stats.pool_pages >= ZRAM_MAX_POOL_PAGES) {
+        return NULL;
+    }
+
+    zram_zpage_t* zpage = (zram_zpage_t*) pmm_alloc_page();
+    if (!zpage) {
+        return NULL;
+    }
+
+    uint32_t size = zram_internal_obj_size(class_idx);
+    uint32_t first = sizeof(zram_zpage_t);
+    uint32_t count = (PAGE_SIZE - first) / size;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t off = first + i * size;
+        *(uint32_t*) ((uintptr_t) zpage + off) = i + 1 < count ? off + size : 0;
+    }
+
+    zpage->free_head = first;
+    zpage->used = 0;
+    zpage->class_idx = (uint16_t) class_idx;
+    zram_internal_link(zpage);
+    zram_stats.pool_pages++;
+    return zpage;
+}
+
+static uintptr_t zram_internal_obj_alloc(uint32_t class_idx) {
+    zram_zpage_t* zpage = zram_partial[class_idx];
+    if (!zpage && !(zpage = zram_internal_grow(class_idx))) {
+        return 0;
+    }
+
+    uintptr_t obj = (uintptr_t) zpage + zpage->free_head;
+    zpage->free_head = *(uint32_t*) obj;
+    zpage->used++;
+    if (!zpage->free_head) {
+        zram_internal_unlink(zpage);
+    }
+    return obj;
+}
+
+// objects never straddle a frame, so the header is found by masking
+static void zram_internal_obj_free(uintptr_t obj) {
+    zram_zpage_t* zpage = (zram_zpage_t*) (obj & PAGE_MASK);
+    if (!zpage->free_head) {
+        zram_internal_link(zpage);
+    }
+
+    *(uint32_t*) obj = zpage->free_head;
+    zpage->free_head = (uint32_t) (obj - (uintptr_t) zpage);
+
+    if (--zpage->used == 0) {
+        zram_internal_unlink(zpage);
+        pmm_free_page(zpage);
+        zram_stats.pool_pages--;
+    }
+}
+
+static int32_t zram_internal_slot_alloc(void) {
+    for (uint32_t i = 0; i < ZRAM_SLOTS; i++) {
+        uint32_t slot = (zram_slot_hint + i) % ZRAM_SLOTS;
+        if (!zram_slots[slot].obj) {
+            zram_slot_hint = slot + 1;
+            return (int32_t) slot;
+        }
+    }
+    return -1;
+}
+
+// compress the frame into the pool; fails for pages that would not at least halve, or when the pool is full
+int zram_store(uintptr_t frame, uint32_t* out_slot) {
+    if (!zram_slots) {
+        return -1;
+    }
+
+    bool r = spinlock(&zram_lock);
+
+    int len = lz4_compress((const uint8_t*) frame, PAGE_SIZE, zram_scratch, ZRAM_MAX_STORED, zram_table);
+    int32_t slot = len > 0 ? zram_internal_slot_alloc() : -1;
+    uint32_t class_idx = len > 0 ? ((uint32_t) len - 1) / ZRAM_CLASS_SIZE : 0;
+    uintptr_t obj = slot >= 0 ? zram_internal_obj_alloc(class_idx) : 0;
+
+    if (!obj) {
+        zram_stats.rejected++;
+        spinlock_unlock(&zram_lock, r);
+        return -1;
+    }
+
+    flop_memcpy((void*) obj, zram_scratch, (size_t) len);
+    zram_slots[slot].obj = obj;
+    zram_slots[slot].size = (uint16_t) len;
+    zram_slots[slot].refs = 1;
+    zram_slots[slot].class_idx = (uint8_t) class_idx;
+
+    zram_stats.stored++;
+    zram_stats.compr_bytes += (uint32_t) len;
+    spinlock_unlock(&zram_lock, r);
+
+    *out_slot = (uint32_t) slot;
+    return 0;
+}
+
+// expand a stored page into frame; the slot keeps its data until the last reference is dropped
+int zram_load(uint32_t slot, uintptr_t frame) {
+    if (!zram_slots || slot >= ZRAM_SLOTS) {
+        return -1;
+    }
+
+    bool r = spinlock(&zram_lock);
+    zram_slot_t* s = &zram_slots[slot];
+    int len = s->obj ? lz4_decompress((const uint8_t*) s->obj, s->size, (uint8_t*) frame, PAGE_SIZE) : -1;
+    if (len == PAGE_SIZE) {
+        zram_stats.hits++;
+    }
+    spinlock_unlock(&zram_lock, r);
+
+    if (len != PAGE_SIZE) {
+        log("zram_load: corrupt or missing page\n", RED);
+        return -1;
+    }
+    return 0;
+}
+
+void zram_dup(uint32_t slot) {
+    bool r = spinlock(&zram_lock);
+    if (slot < ZRAM_SLOTS && zram_slots[slot].obj && zram_slots[slot].refs < ZRAM_REFS_MAX) {
+        zram_slots[slot].refs++;
+    }
+    spinlock_unlock(&zram_lock, r);
+}
+
+// a slot whose count saturated stays in the pool for good
+void zram_free(uint32_t slot) {
+    bool r = spinlock(&zram_lock);
+    zram_slot_t* s = slot < ZRAM_SLOTS ? &zram_slots[slot] : NULL;
+    if (s && s->obj && s->refs < ZRAM_REFS_MAX && --s->refs == 0) {
+        zram_internal_obj_free(s->obj);
+        zram_stats.stored--;
+        zram_stats.compr_bytes -= s->size;
+        s->obj = 0;
+    }
+    spinlock_unlock(&zram_lock, r);
+}
+
+void zram_note_miss(void) {
+    bool r = spinlock(&zram_lock);
+    zram_stats.misses++;
+    spinlock_unlock(&zram_lock, r);
+}
+
+void zram_get_stats(zram_stats_t* out) {
+    bool r = spinlock(&zram_lock);
+    *out = zram_stats;
+    spinlock_unlock(&zram_lock, r);
+}
+
+// ratios are hundredths: what the pages would take uncompressed over their compressed size and pool footprint
+int zram_format_stats(char* buf, size_t size) {
+    if (!buf || size == 0) {
+        return -1;
+    }
+
+    zram_stats_t st;
+    zram_get_stats(&st);
+
+    uint32_t orig = st.stored * (PAGE_SIZE / 1024);
+    // both sides in 16 byte units, so the products stay within 32 bits
+    uint32_t compr_units = st.compr_bytes / 16;
+    uint32_t ratio = compr_units ? st.stored * (PAGE_SIZE / 16) * 100 / compr_units : 0;
+    uint32_t effective = st.pool_pages ? st.stored * 100 / st.pool_pages : 0;
+
+    return flopsnprintf(buf,
+                        size,
+                        "stored_pages: %u\n"
+                        "orig_data: %u kB\n"
+                        "compr_data: %u kB\n"
+                        "pool: %u kB\n"
+                        "compr_ratio: %u.%u%u\n"
+                        "pool_ratio: %u.%u%u\n"
+                        "hits: %u\n"
+                        "misses: %u\n"
+                        "rejected: %u\n",
+                        st.stored,
+                        orig,
+                        st.compr_bytes / 1024,
+                        st.pool_pages * (PAGE_SIZE / 1024),
+                        ratio / 100,
+                        ratio / 10 % 10,
+                        ratio % 10,
+                        effective / 100,
+                        effective / 10 % 10,
+                        effective % 10,
+                        st.hits,
+                        st.misses,
+                        st.rejected);
+}
@@ -0,0 +1,35 @@
+#ifndef ZRAM_H
+#define ZRAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// frames the compressed pool may take from the buddy allocator
+#define ZRAM_MAX_POOL_PAGES 4096
+// objects are carved out of pool pages in steps of this size
+#define ZRAM_CLASS_SIZE 32
+// largest compressed page the pool takes; two always share a frame, anything worse goes to disk
+#define ZRAM_MAX_STORED 2016
+#define ZRAM_CLASSES (ZRAM_MAX_STORED / ZRAM_CLASS_SIZE)
+
+typedef struct zram_stats {
+    uint32_t stored;      // pages held in the pool
+    uint32_t compr_bytes; // compressed size of those pages
+    uint32_t pool_pages;  // frames the pool holds them in
+    uint32_t hits;        // swap-ins served from the pool
+    uint32_t misses;      // swap-ins that had to go to disk
+    uint32_t rejected;    // pages that compressed too poorly or found the pool full
+} zram_stats_t;
+
+void zram_init(void);
+bool zram_enabled(void);
+int zram_store(uintptr_t frame, uint32_t* out_slot);
+int zram_load(uint32_t slot, uintptr_t frame);
+void zram_dup(uint32_t slot);
+void zram_free(uint32_t slot);
+void zram_note_miss(void);
+void zram_get_stats(zram_stats_t* out);
+int zram_format_stats(char* buf, size_t size);
+
+#endif // ZRAM_H
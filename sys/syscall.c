@@ -17,6 +17,8 @@ You should have received a copy of the GNU General Public License along with The
 #include "../mem/pmm.h"
 #include "../mem/paging.h"
 #include "../mem/vmm.h"
+#include "../mem/vma.h"
+#include "../mem/rmap.h"
 #include "../lib/logging.h"
 #include "../lib/str.h"
 #include "../lib/refcount.h"
@@ -367,13 +369,7 @@ int sys_print(struct syscall_args* args) {
 
 // rollback a failed mmap allocation
 static void sys_mmap_internal_rb(vmm_region_t* region, uintptr_t start_va, uintptr_t end_va) {
-    for (uintptr_t va = start_va; va < end_va; va += PAGE_SIZE) {
-        uintptr_t phys_addr = vmm_resolve(region, va);
-        if (phys_addr) {
-            vmm_unmap(region, va);
-            pmm_free_page((void*) phys_addr);
-        }
-    }
+    vmm_free(region, start_va, (end_va - start_va) / PAGE_SIZE);
 }
 
 // allocate and map pages for mmap
@@ -431,9 +427,15 @@ static int sys_mmap_internal_get_va(vmm_region_t* region, uint32_t requested_va,
         return -1;
     }
 
-    // look for a free virtual range
+    // look for a range no vma reserves, 4 MiB aligned if the mapping can use huge pages
     if (requested_va == 0) {
-        uint32_t found_va = vmm_find_free_range(region, length);
+        uint32_t found_va = 0;
+        if (length >= HUGE_PAGE_SIZE) {
+            found_va = vma_find_free(region, length, HUGE_PAGE_SIZE);
+        }
+        if (!found_va) {
+            found_va = vma_find_free(region, length, PAGE_SIZE);
+        }
 
         if (!found_va) {
             return -1;
@@ -476,16 +478,88 @@ int sys_mmap_internal_find_and_seek(int fd, struct vfs_node** out_node, uint32_t
     return 0;
 }
 
+// the body of mmap, run with the region's layout held exclusive
+static int sys_mmap_internal_map(vmm_region_t* region,
+                                 uintptr_t addr,
+                                 uint32_t len,
+                                 uint32_t flags,
+                                 bool populate,
+                                 bool shared,
+                                 int fd,
+                                 uint32_t offset) {
+    // find vfs_node if fd is given
+    struct vfs_node* node = NULL;
+    if (fd >= 0) {
+        if (sys_mmap_internal_find_and_seek(fd, &node, offset) < 0) {
+            return -1;
+        }
+    }
+
+    // get the virtual address to map
+    uintptr_t map_start_va;
+    if (sys_mmap_internal_get_va(region, addr, len, (uint32_t*) &map_start_va) < 0) {
+        return -1;
+    }
+
+    // a fixed address replaces whatever was mapped there
+    if (addr) {
+        vma_unmap(region, map_start_va, map_start_va + len);
+        sys_mmap_internal_rb(region, map_start_va, map_start_va + len);
+    }
+
+    // anonymous memory is only reserved, its pages are faulted in on first touch
+    if (!node) {
+        if (vma_map(region, map_start_va, map_start_va + len, flags, VMA_KIND_ANON) < 0) {
+            return -1;
+        }
+
+        // prefaulting goes through the bulk allocator and uses 4 MiB pages where the range allows
+        if (populate && vmm_populate_anonymous(region, map_start_va, len / PAGE_SIZE, flags) < 0) {
+            vma_unmap(region, map_start_va, map_start_va + len);
+            return -1;
+        }
+        if (populate) {
+            rmap_add_range(vma_find(region, map_start_va), map_start_va, map_start_va + len);
+        }
+        return map_start_va;
+    }
+
+    // files that can hand out their pages are mapped in place and faulted in on first touch
+    if (!(offset & (PAGE_SIZE - 1)) &&
+        vma_map_file(region, map_start_va, map_start_va + len, flags, node, offset / PAGE_SIZE, shared) == 0) {
+        if (populate) {
+            vma_populate(region, map_start_va, map_start_va + len);
+        }
+        return map_start_va;
+    }
+
+    // anything else gets a private copy of its contents now
+    if (sys_mmap_internal_alloc(region, map_start_va, len, flags, node) < 0) {
+        return -1;
+    }
+
+    if (vma_map(region, map_start_va, map_start_va + len, flags, VMA_KIND_FILE) < 0) {
+        sys_mmap_internal_rb(region, map_start_va, map_start_va + len);
+        return -1;
+    }
+
+    // return the starting virtual address
+    return map_start_va;
+}
+
 // mmap; returns virtual address or -1
 int sys_mmap(struct syscall_args* args) {
-    if (!args->a1 || !args->a2 || !args->a3 || !args->a4 || !args->a5) {
+    // addr 0 lets the kernel pick, fd -1 maps anonymous memory and offset 0 is the start of the file
+    if (!args->a2 || !args->a3) {
         log("sys: wrong args passed to sys_mmap", RED);
         return -1;
     }
 
     uintptr_t addr = (uintptr_t) args->a1;
     uint32_t len = (uint32_t) args->a2;
-    uint32_t flags = (uint32_t) args->a3;
+    uint32_t flags = (uint32_t) args->a3 & ~(MAP_POPULATE | MAP_SHARED);
+    bool populate = (args->a3 & MAP_POPULATE) != 0;
+    bool shared = (args->a3 & MAP_SHARED) != 0;
     int fd = (int) args->a4;
     uint32_t offset = (uint32_t) args->a5;
 
@@ -504,27 +578,10 @@ int sys_mmap(struct syscall_args* args) {
         return -1;
     }
 
-    // find vfs_node if fd is given
-    struct vfs_node* node = NULL;
-    if (fd >= 0) {
-        if (sys_mmap_internal_find_and_seek(fd, &node, offset) < 0) {
-            return -1;
-        }
-    }
-
-    // get the virtual address to map
-    uintptr_t map_start_va;
-    if (sys_mmap_internal_get_va(region, addr, len, (uint32_t*) &map_start_va) < 0) {
-        return -1;
-    }
-
-    // allocate and map pages
-    if (sys_mmap_internal_alloc(region, map_start_va, len, flags, node) < 0) {
-        return -1;
-    }
-
-    // return the starting virtual address
-    return map_start_va;
+    rwsem_down_write(&region->mm_sem);
+    int ret = sys_mmap_internal_map(region, addr, len, flags, populate, shared, fd, offset);
+    rwsem_up_write(&region->mm_sem);
+    return ret;
 }
 
 static int sys_internal_mremap_validate(struct syscall_args* args) {
@@ -545,37 +602,78 @@ static uintptr_t sys_internal_mremap_shrink(vmm_region_t* region, uintptr_t addr
     uintptr_t shrink_start = addr + new_len;
     uintptr_t shrink_end = addr + old_len;
 
-    // assuming sys_mmap_internal_rb is available in this context
+    vma_unmap(region, shrink_start, shrink_end);
     sys_mmap_internal_rb(region, shrink_start, shrink_end);
 
     return addr;
 }
 
+// pick a destination for a moving mremap that keeps addr's offset inside its 4 MiB slot,
+// so whole page tables can be moved by their pde instead of pte by pte
+static uintptr_t sys_internal_mremap_find_dest(vmm_region_t* region, uintptr_t addr, uint32_t new_len) {
+    if (new_len >= HUGE_PAGE_SIZE) {
+        uintptr_t base = vma_find_free(region, new_len + HUGE_PAGE_SIZE, HUGE_PAGE_SIZE);
+        if (base) {
+            return base + (addr & ~HUGE_PAGE_MASK);
+        }
+    }
+
+    return vma_find_free(region, new_len, PAGE_SIZE);
+}
+
+// carry the vma over to [new_addr, new_addr + new_len); anonymous and file backed tails fault in lazily,
+// copied file mappings are backed now
+static int sys_internal_mremap_grow_vma(
+    vmm_region_t* region, uintptr_t addr, uintptr_t new_addr, uint32_t old_len, uint32_t new_len, uint32_t page_flags) {
+    if (vma_remap(region, addr, old_len, new_addr, new_len, page_flags) < 0) {
+        return -1;
+    }
+
+    vmm_vma_t* vma = vma_find(region, new_addr);
+    if (vma->kind == VMA_KIND_ANON || vma->file) {
+        return 0;
+    }
+
+    if (vmm_populate_anonymous(region, new_addr + old_len, (new_len - old_len) / PAGE_SIZE, vma->prot) < 0) {
+        vma_remap(region, new_addr, new_len, addr, old_len, page_flags);
+        return -1;
+    }
+    rmap_add_range(vma, new_addr + old_len, new_addr + new_len);
+    return 0;
+}
+
 static uintptr_t
 sys_internal_mremap_expand(vmm_region_t* region, uintptr_t addr, uint32_t old_len, uint32_t new_len, uint32_t flags) {
-    uintptr_t expand_start = addr + old_len;
-    uintptr_t expand_end = addr + new_len;
-
-    for (uintptr_t va = expand_start; va < expand_end; va += PAGE_SIZE) {
-        void* phys_page = pmm_alloc_page();
+    uint32_t page_flags = flags & ~MREMAP_MAYMOVE;
 
-        // allocation failed, rollback
-        if (!phys_page) {
-            sys_mmap_internal_rb(region, expand_start, va);
+    // grow in place when the tail is free
+    if (vma_range_free(region, addr + old_len, addr + new_len)) {
+        if (sys_internal_mremap_grow_vma(region, addr, addr, old_len, new_len, page_flags) < 0) {
             return -1;
         }
+        return addr;
+    }
 
-        // zero out the page
-        uint8_t* bp = (uint8_t*) phys_page;
-        for (size_t i = 0; i < PAGE_SIZE; i++) {
-            bp[i] = 0;
-        }
+    if (!(flags & MREMAP_MAYMOVE)) {
+        return -1;
+    }
 
-        // map the page
-        vmm_map(region, va, (uintptr_t) phys_page, flags);
+    // otherwise relocate the existing translations, the data itself is never copied
+    uintptr_t new_addr = sys_internal_mremap_find_dest(region, addr, new_len);
+    if (!new_addr) {
+        return -1;
     }
 
-    return addr;
+    if (vmm_move_range(region, addr, new_addr, old_len / PAGE_SIZE) < 0) {
+        return -1;
+    }
+
+    if (sys_internal_mremap_grow_vma(region, addr, new_addr, old_len, new_len, page_flags) < 0) {
+        vmm_move_range(region, new_addr, addr, old_len / PAGE_SIZE);
+        return -1;
+    }
+
+    return new_addr;
 }
 
 // mremap; returns virtual address or -1
@@ -608,11 +706,11 @@ int sys_mremap(struct syscall_args* args) {
         return addr;
     }
 
-    if (new_len < old_len) {
-        return sys_internal_mremap_shrink(region, addr, old_len, new_len);
-    }
-
-    return sys_internal_mremap_expand(region, addr, old_len, new_len, flags);
+    rwsem_down_write(&region->mm_sem);
+    uintptr_t ret = new_len < old_len ? sys_internal_mremap_shrink(region, addr, old_len, new_len)
+                                      : sys_internal_mremap_expand(region, addr, old_len, new_len, flags);
+    rwsem_up_write(&region->mm_sem);
+    return ret;
 }
 
 // validate a memory mapping for munmap
@@ -636,27 +734,19 @@ static int sys_munmap_internal_validate(vmm_region_t* region, uintptr_t addr, ui
 
 // free physical pages for munmap; also unmaps them
 static void sys_munmap_internal_free_phys(vmm_region_t* region, uintptr_t start_va, uintptr_t end_va) {
-    for (uintptr_t va = start_va; va < end_va; va += PAGE_SIZE) {
-        uintptr_t phys = vmm_resolve(region, va);
-        if (phys) {
-            vmm_unmap(region, va);
-            pmm_free_page((void*) phys);
-        }
-    }
+    vmm_free(region, start_va, (end_va - start_va) / PAGE_SIZE);
 }
 
 // unmap a memory range for munmap
 static int sys_munmap_internal_unmap_range(vmm_region_t* region, uintptr_t addr, uint32_t len) {
     uintptr_t end = addr + len;
 
-    for (uintptr_t va = addr; va < end; va += PAGE_SIZE) {
-        uintptr_t phys = vmm_resolve(region, va);
-        if (!phys) {
-            // not mapped
-            return -1;
-        }
+    // pages of a vma that were never touched count as mapped
+    if (!vma_range_covered(region, addr, end)) {
+        return -1;
     }
 
+    vma_unmap(region, addr, end);
     sys_munmap_internal_free_phys(region, addr, end);
     return 0;
 }
@@ -675,7 +765,10 @@ static int sys_munmap_internal(process_t* proc, uintptr_t addr, uint32_t len) {
 
     len = ALIGN_UP(len, PAGE_SIZE);
 
-    return sys_munmap_internal_unmap_range(region, addr, len);
+    rwsem_down_write(&region->mm_sem);
+    int ret = sys_munmap_internal_unmap_range(region, addr, len);
+    rwsem_up_write(&region->mm_sem);
+    return ret;
 }
 
 // munmap; returns 0 or -1
@@ -1376,19 +1469,42 @@ int sys_mprotect(struct syscall_args* args) {
     len = ALIGN_UP(len, PAGE_SIZE);
     uintptr_t end = addr + len;
 
-    for (uintptr_t va = addr; va < end; va += PAGE_SIZE) {
-        uintptr_t phys = vmm_resolve(region, va);
+    rwsem_down_write(&region->mm_sem);
+    int ret = vma_range_covered(region, addr, end) ? vma_protect(region, addr, end, flags) : -1;
+    rwsem_up_write(&region->mm_sem);
+    return ret;
+}
 
-        if (!phys) {
-            return -1;
-        }
+// advise the vmm about how a range will be used; returns 0 or -1
+int sys_madvise(struct syscall_args* args) {
+    if (!args || !args->a1 || !args->a2) {
+        log("sys: wrong args passed to sys_madvise", RED);
+        return -1;
     }
 
-    for (uintptr_t va = addr; va < end; va += PAGE_SIZE) {
-        vmm_protect(region, va, flags);
+    uintptr_t addr = (uintptr_t) args->a1;
+    uint32_t len = (uint32_t) args->a2;
+    uint32_t advice = (uint32_t) args->a3;
+
+    if (args->a4 || args->a5) {
+        log("sys: invalid args passed to sys_madvise", RED);
+        return -1;
     }
 
-    return 0;
+    if (addr & (PAGE_SIZE - 1)) {
+        return -1;
+    }
+
+    process_t* proc = proc_get_current();
+    if (!proc || !proc->region) {
+        return -1;
+    }
+
+    len = ALIGN_UP(len, PAGE_SIZE);
+    rwsem_down_write(&proc->region->mm_sem);
+    int ret = vma_advise(proc->region, addr, addr + len, advice);
+    rwsem_up_write(&proc->region->mm_sem);
+    return ret;
 }
 
 int sys_getdents(struct syscall_args* args) {
@@ -1429,6 +1545,81 @@ int sys_waitpid(struct syscall_args* args) {
     return proc_waitpid(pid, status, options);
 }
 
+// restrict a thread or a whole process to a set of cpus; returns 0 or -1 on failure
+int sys_sched_setaffinity(struct syscall_args* args) {
+    if (!args || args->a3 || args->a4 || args->a5) {
+        log("sys: invalid args passed to sys_sched_setaffinity", RED);
+        return -1;
+    }
+
+    pid_t pid = (pid_t) args->a1;
+    uint32_t mask = (uint32_t) args->a2;
+
+    if (!pid) {
+        return sched_set_affinity(sched_current_thread(), mask);
+    }
+
+    process_t* proc = proc_get_current();
+    process_t* target = proc_get_process_by_pid(pid);
+    if (!proc || !target) {
+        return -1;
+    }
+
+    // only root moves another user's threads
+    if (proc->uid != 0 && proc->uid != target->uid) {
+        return -1;
+    }
+    return proc_set_affinity(target, mask);
+}
+
+// read the cpus a thread or process may run on; returns 0 or -1 on failure
+int sys_sched_getaffinity(struct syscall_args* args) {
+    if (!args || !args->a2 || args->a3 || args->a4 || args->a5) {
+        log("sys: invalid args passed to sys_sched_getaffinity", RED);
+        return -1;
+    }
+
+    pid_t pid = (pid_t) args->a1;
+    uint32_t* mask = (uint32_t*) args->a2;
+
+    if (!vmm_is_user_mapped(vmm_get_current(), (uintptr_t) mask)) {
+        return -1;
+    }
+
+    if (!pid) {
+        *mask = sched_current_thread()->affinity;
+        return 0;
+    }
+
+    process_t* target = proc_get_process_by_pid(pid);
+    if (!target) {
+        return -1;
+    }
+    *mask = target->affinity;
+    return 0;
+}
+
+// move the calling thread to the realtime class with a reservation of runtime_ms in every period_ms, or back to
+// the normal class when runtime_ms is 0; returns 0 or -1 when it is refused
+int sys_sched_setdeadline(struct syscall_args* args) {
+    if (!args || args->a4 || args->a5) {
+        log("sys: invalid args passed to sys_sched_setdeadline", RED);
+        return -1;
+    }
+
+    // realtime bandwidth is shared by everyone, only root reserves it
+    process_t* proc = proc_get_current();
+    if (!proc || proc->uid != 0) {
+        return -1;
+    }
+
+    thread_t* thread = sched_current_thread();
+    if (!args->a1) {
+        return sched_set_class(thread, SCHED_CLASS_NORMAL);
+    }
+    return sched_set_deadline(thread, (uint32_t) args->a1, (uint32_t) args->a2, (uint32_t) args->a3);
+}
+
 syscall_function_pointer* syscall_dispatch_table = NULL;
 
 void syscall_init() {
@@ -1476,6 +1667,10 @@ void syscall_init() {
                                                       [SYSCALL_MREMAP] = sys_mremap,
                                                       [SYSCALL_GETDENTS] = sys_getdents,
                                                       [SYSCALL_WAITPID] = sys_waitpid,
+                                                      [SYSCALL_MADVISE] = sys_madvise,
+                                                      [SYSCALL_SCHED_SETAFFINITY] = sys_sched_setaffinity,
+                                                      [SYSCALL_SCHED_GETAFFINITY] = sys_sched_getaffinity,
+                                                      [SYSCALL_SCHED_SETDEADLINE] = sys_sched_setdeadline,
                                                       [SYSCALL_NUM] = NULL};
 
     syscall_dispatch_table = sys_init_tbl;
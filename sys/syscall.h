@@ -16,6 +16,15 @@ struct syscall_args {
 
 typedef int (*syscall_function_pointer)(struct syscall_args*);
 
+// mremap flag, above the page flag bits that are passed on to the grown part of the mapping
+#define MREMAP_MAYMOVE 0x10000
+
+// mmap flag, prefaults the whole range instead of waiting for first touch
+#define MAP_POPULATE 0x20000
+// mmap flag, writes go to the file's own pages and are seen by every other shared mapping of it;
+// without it a file mapping is private and copies a page on its first write
+#define MAP_SHARED 0x40000
+
 int c_syscall_routine(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5);
 
 typedef enum syscall_num {
@@ -63,7 +72,11 @@ typedef enum syscall_num {
     SYSCALL_MREMAP = 41,
     SYSCALL_GETDENTS = 42,
     SYSCALL_WAITPID = 43,
-    SYSCALL_NUM = 44
+    SYSCALL_MADVISE = 44,
+    SYSCALL_SCHED_SETAFFINITY = 45,
+    SYSCALL_SCHED_GETAFFINITY = 46,
+    SYSCALL_SCHED_SETDEADLINE = 47,
+    SYSCALL_NUM = 48
 } syscall_num_t;
 
 typedef struct syscall_table {
@@ -111,6 +124,10 @@ typedef struct syscall_table {
     int (*sys_getsid)(struct syscall_args* args);
     int (*sys_waitpid)(struct syscall_args* args);
     int (*sys_getdents)(struct syscall_args* args);
+    int (*sys_madvise)(struct syscall_args* args);
+    int (*sys_sched_setaffinity)(struct syscall_args* args);
+    int (*sys_sched_getaffinity)(struct syscall_args* args);
+    int (*sys_sched_setdeadline)(struct syscall_args* args);
 } syscall_table_t;
 
 int syscall(syscall_num_t num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5);
@@ -130,7 +147,7 @@ int sys_open(struct syscall_args* args);
 // 4: close(fd)
 int sys_close(struct syscall_args* args);
 
-// 5: mmap(addr, len, flags, fd, offset)
+// 5: mmap(addr, len, flags | MAP_POPULATE | MAP_SHARED, fd, offset)
 int sys_mmap(struct syscall_args* args);
 
 // 6: seek(fd, offset, whence)
@@ -238,7 +255,7 @@ int sys_getcwd(struct syscall_args* args);
 // 40: mprotect(addr, len, flags)
 int sys_mprotect(struct syscall_args* args);
 
-// 41: mremap(addr, old_len, new_len, flags)
+// 41: mremap(addr, old_len, new_len, flags | MREMAP_MAYMOVE)
 int sys_mremap(struct syscall_args* args);
 
 // 42: getdents(fd, buf, count)
@@ -247,6 +264,18 @@ int sys_getdents(struct syscall_args* args);
 // 43: waitpid(pid, status, options)
 int sys_waitpid(struct syscall_args* args);
 
+// 44: madvise(addr, len, advice)
+int sys_madvise(struct syscall_args* args);
+
+// 45: sched_setaffinity(pid, mask), pid 0 is the calling thread, any other pid every thread of that process
+int sys_sched_setaffinity(struct syscall_args* args);
+
+// 46: sched_getaffinity(pid, mask_ptr)
+int sys_sched_getaffinity(struct syscall_args* args);
+
+// 47: sched_setdeadline(runtime_ms, deadline_ms, period_ms), for the calling thread, runtime 0 drops the reservation
+int sys_sched_setdeadline(struct syscall_args* args);
+
 void syscall_init();
 
 extern syscall_table_t syscall_table;
@@ -1,5 +1,12 @@
 global context_switch
 section .text
+
+; void context_switch(cpu_ctx_t* old, cpu_ctx_t* new)
+; the callee saved registers and eflags go on the old thread's stack and its esp into old->esp,
+; then the new thread's are popped off the stack new->esp points at
+CTX_ESP equ 20
+CTX_ON_CPU equ 24
+
 context_switch:
 	mov eax, [esp + 4]
 	mov edx, [esp + 8]
@@ -10,8 +17,16 @@ context_switch:
 	push esi
 	push edi
 
-	mov eax, esp
-	mov esp, edx
+	; a thread switched out with interrupts on gets them back on when it resumes
+	pushfd
+
+	mov [eax + CTX_ESP], esp
+	mov esp, [edx + CTX_ESP]
+
+	; nothing touches the old stack from here on, another cpu may now resume the old thread
+	mov dword [eax + CTX_ON_CPU], 0
+
+	popfd
 
 	; restore gprs
 	pop edi
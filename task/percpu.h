@@ -0,0 +1,71 @@
+/*
+
+Copyright 2024-2026 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of FloppaOS.
+
+FloppaOS is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+FloppaOS is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with FloppaOS. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+#ifndef PERCPU_H
+#define PERCPU_H
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "tss.h"
+#include "../mem/gdt.h"
+
+#define SMP_MAX_CPUS 8
+
+struct thread;
+struct process;
+
+// everything a cpu keeps to itself; its own gdt has a data segment based here that the kernel keeps in %gs,
+// so the same selector finds the right copy on every cpu
+typedef struct cpu {
+    struct cpu* self; // %gs:0, turns the segment back into a pointer
+    struct thread* thread;   // running on it
+    struct process* process; // the running thread's
+    uint32_t preempt;        // preempt_count of the running thread
+    struct thread* idle_thread;
+    uint32_t id;      // index into smp_cpus, 0 is the boot cpu
+    uint32_t apic_id; // what the interrupt controller knows it as
+    volatile bool online;
+    uint32_t* loaded_pd;           // directory in its cr3, shootdowns of that directory's entries reach it
+    volatile uint32_t tlb_pending; // set by a shootdown aimed at it, cleared once it has flushed
+    tss_entry_t tss;
+    uint64_t gdt[GDT_ENTRIES] __attribute__((aligned(8)));
+} cpu_t;
+
+extern cpu_t smp_cpus[SMP_MAX_CPUS];
+extern uint32_t smp_cpu_count;
+
+// single instruction accesses of a 32 bit field of the running cpu's data, so a thread moved to another cpu
+// halfway through cannot read one cpu's pointer and then another cpu's field
+#define PERCPU_READ(field)                                                                                             \
+    ({                                                                                                                 \
+        __typeof__(((cpu_t*) 0)->field) percpu_val;                                                                    \
+        __asm__ volatile("mov %%gs:%c1, %0" : "=r"(percpu_val) : "i"(offsetof(cpu_t, field)));                        \
+        percpu_val;                                                                                                    \
+    })
+
+#define PERCPU_WRITE(field, val)                                                                                       \
+    __asm__ volatile("mov %0, %%gs:%c1" ::"r"(val), "i"(offsetof(cpu_t, field)) : "memory")
+
+#define PERCPU_INC(field) __asm__ volatile("incl %%gs:%c0" ::"i"(offsetof(cpu_t, field)) : "memory")
+
+#define PERCPU_DEC(field) __asm__ volatile("decl %%gs:%c0" ::"i"(offsetof(cpu_t, field)) : "memory")
+
+// only stable while the caller cannot migrate, with preemption or interrupts off
+static inline cpu_t* this_cpu(void) {
+    return PERCPU_READ(self);
+}
+
+static inline uint32_t smp_processor_id(void) {
+    return PERCPU_READ(id);
+}
+#endif // PERCPU_H
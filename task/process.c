@@ -17,6 +17,7 @@ You should have received a copy of the GNU General Public License along with The
 #include "../mem/pmm.h"
 #include "../mem/paging.h"
 #include "../mem/vmm.h"
+#include "../mem/swap.h"
 #include "../mem/utils.h"
 #include "../fs/vfs/vfs.h"
 #include "../fs/procfs/procfs.h"
@@ -34,7 +35,6 @@ static bool init_process_ran = false;
 static process_t* init_process;
 proc_table_t* proc_tbl;
 static proc_info_t* proc_info_local;
-process_t* current_process;
 
 static void proc_info_init() {
     proc_info_local->next_pid = 1;
@@ -276,11 +276,11 @@ static process_t* proc_alloc(void) {
     }
 
     process->region = NULL;
-    process->mem_usage = 0;
     process->parent = NULL;
     process->children = NULL;
     process->siblings = NULL;
     process->name = NULL;
+    process->affinity = SCHED_AFFINITY_ALL;
 
     proc_alloc_assign_ids(process);
 
@@ -328,7 +328,6 @@ static int proc_init_process_create_region(process_t* process, size_t initial_pa
     if (!process->region) {
         return -1;
     }
-    process->mem_usage = initial_pages * PAGE_SIZE;
     return 0;
 }
 
@@ -448,8 +447,6 @@ int proc_create_init_process() {
         return -1;
     }
 
-    init_process->mem_usage = 4 * PAGE_SIZE;
-
     if (proc_init_process_family_create(init_process) < 0) {
         log("init_process family_create failed\n", RED);
         proc_init_process_free_data_structures(init_process);
@@ -585,7 +582,6 @@ static int proc_copy_child_pagemap(process_t* parent, process_t* child) {
     if (!child->region) {
         return -1;
     }
-    child->mem_usage = parent->mem_usage;
     return 0;
 }
 
@@ -691,6 +687,10 @@ pid_t proc_fork(process_t* parent) {
     child->parent = parent;
     child->state = RUNNABLE;
 
+    // the child's threads may run where the forking thread may
+    thread_t* forker = sched_current_thread();
+    child->affinity = forker && forker->process == parent ? forker->affinity : parent->affinity;
+
     spinlock_unlock(&proc_tbl->proc_table_lock, true);
 
     proc_copy_signal_state(parent, child); // potential race
@@ -761,7 +761,6 @@ void* proc_alloc_within_process(process_t* process, size_t size) {
         return NULL;
     }
 
-    process->mem_usage += pages * PAGE_SIZE;
     return (void*) alloc_addr;
 }
 
@@ -775,8 +774,7 @@ void proc_free_within_process(process_t* process, uintptr_t addr, size_t size) {
         pages += 1;
     }
 
-    vmm_unmap(process->region, addr);
-    process->mem_usage -= pages * PAGE_SIZE;
+    vmm_free(process->region, addr, pages);
 }
 
 void* proc_zero_process_memory(process_t* process, size_t size) {
@@ -850,8 +848,11 @@ static int proc_terminate_all_threads(process_t* process) {
     thread_t* iter_thread = process->threads->head;
     while (iter_thread) {
         thread_t* next_thread = iter_thread->next;
-        sched_remove(&sched.ready_queue, iter_thread);
-        sched_remove(&sched.sleep_queue, iter_thread);
+        // a realtime thread gives its bandwidth back, which also stops its replenishment timer; done before the
+        // thread is taken off its queue, since a parked thread is queued again in the normal class
+        sched_set_class(iter_thread, SCHED_CLASS_NORMAL);
+        sched_runqueue_remove(iter_thread);
+        timer_cancel_sync(&iter_thread->sleep_timer);
         iter_thread = next_thread;
     }
 
@@ -860,6 +861,28 @@ static int proc_terminate_all_threads(process_t* process) {
     return 0;
 }
 
+// restrict every thread of a process, and the ones it creates later, to the cpus in mask
+int proc_set_affinity(process_t* process, uint32_t mask) {
+    if (!process || !(mask & sched_online_cpus())) {
+        return -1;
+    }
+
+    int ret = 0;
+    spinlock(&process->threads->lock);
+    for (thread_t* t = process->threads->head; t; t = t->next) {
+        if (sched_set_affinity(t, mask) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+    spinlock_unlock(&process->threads->lock, true);
+
+    if (ret == 0) {
+        process->affinity = mask;
+    }
+    return ret;
+}
+
 static int proc_clean(process_t* process) {
     if (!process) {
         return -1;
@@ -870,8 +893,11 @@ static int proc_clean(process_t* process) {
         process->cwd = NULL;
     }
 
+    // the pager thread frees the address space; destroy it here only if it cannot be queued
     if (process->region) {
-        vmm_region_destroy(process->region);
+        if (vmm_pager_nuke_async(process->region) < 0) {
+            vmm_region_destroy(process->region);
+        }
         process->region = NULL;
     }
 
@@ -968,8 +994,6 @@ static int proc_copy_process_memory(process_t* source_process, process_t* target
     if (!target_process->region) {
         return -1;
     }
-
-    target_process->mem_usage = source_process->mem_usage;
     return 0;
 }
 
@@ -1018,7 +1042,7 @@ void proc_debug_dump_process_info(process_t* process) {
                            process->pid,
                            process->name ? process->name : "NULL",
                            process->state,
-                           process->mem_usage,
+                           proc_mem_usage(process),
                            (void*) process->cwd);
     log(buffer, GREEN);
 }
@@ -1035,21 +1059,126 @@ void proc_debug_dump_all_processes() {
     spinlock_unlock(&proc_tbl->proc_table_lock, true);
 }
 
-void proc_fetch_mem_usage_all_processes() {
-    uint32_t total_mem_usage = 0;
+// resident memory of a process in bytes, frames shared with other processes are counted in each of them
+uint32_t proc_mem_usage(process_t* process) {
+    if (!process || !process->region) {
+        return 0;
+    }
+    return vmm_rss_pages(process->region) * PAGE_SIZE;
+}
+
+// one line per counter, sizes in KiB; returns the length written like flopsnprintf
+int proc_format_mem_usage(process_t* process, char* buf, size_t size) {
+    if (!process || !buf || size == 0) {
+        return -1;
+    }
+
+    vmm_rss_t rss = {0};
+    if (process->region) {
+        rss = process->region->rss;
+    }
+
+    uint32_t kib = PAGE_SIZE / 1024;
+    return flopsnprintf(buf,
+                        size,
+                        "pid: %d\n"
+                        "rss: %u kB\n"
+                        "rss_anon: %u kB\n"
+                        "rss_file: %u kB\n"
+                        "rss_shared: %u kB\n"
+                        "rss_peak: %u kB\n"
+                        "swapped: %u kB\n"
+                        "page_tables: %u kB\n"
+                        "min_faults: %u\n"
+                        "maj_faults: %u\n",
+                        process->pid,
+                        (rss.anon + rss.file + rss.shared) * kib,
+                        rss.anon * kib,
+                        rss.file * kib,
+                        rss.shared * kib,
+                        rss.peak * kib,
+                        rss.swapped * kib,
+                        rss.page_tables * kib,
+                        rss.min_faults,
+                        rss.maj_faults);
+}
+
+// totals over every process followed by the largest resident set, the first pick when memory runs out
+int proc_format_mem_usage_all(char* buf, size_t size) {
+    if (!buf || size == 0) {
+        return -1;
+    }
+
+    vmm_rss_t total = {0};
+    process_t* largest = NULL;
+    uint32_t largest_rss = 0;
 
     spinlock(&proc_tbl->proc_table_lock);
 
-    process_t* current = proc_tbl->processes;
-    while (current) {
-        total_mem_usage += current->mem_usage;
-        current = current->siblings;
+    for (process_t* current = proc_tbl->processes; current; current = current->siblings) {
+        if (!current->region) {
+            continue;
+        }
+
+        vmm_rss_t* rss = &current->region->rss;
+        total.anon += rss->anon;
+        total.file += rss->file;
+        total.shared += rss->shared;
+        total.swapped += rss->swapped;
+        total.page_tables += rss->page_tables;
+        total.min_faults += rss->min_faults;
+        total.maj_faults += rss->maj_faults;
+
+        uint32_t pages = vmm_rss_pages(current->region);
+        if (pages > largest_rss) {
+            largest_rss = pages;
+            largest = current;
+        }
     }
 
+    pid_t largest_pid = largest ? largest->pid : -1;
     spinlock_unlock(&proc_tbl->proc_table_lock, true);
 
-    char buffer[128];
-    flopsnprintf(buffer, sizeof(buffer), "Total memory usage by all processes: %u bytes\n", total_mem_usage);
+    uint32_t swap_total = 0;
+    uint32_t swap_used = 0;
+    swap_usage(&swap_total, &swap_used);
+
+    uint32_t kib = PAGE_SIZE / 1024;
+    return flopsnprintf(buf,
+                        size,
+                        "rss: %u kB\n"
+                        "rss_anon: %u kB\n"
+                        "rss_file: %u kB\n"
+                        "rss_shared: %u kB\n"
+                        "swapped: %u kB\n"
+                        "page_tables: %u kB\n"
+                        "swap_total: %u kB\n"
+                        "swap_used: %u kB\n"
+                        "min_faults: %u\n"
+                        "maj_faults: %u\n"
+                        "largest_pid: %d\n"
+                        "largest_rss: %u kB\n",
+                        (total.anon + total.file + total.shared) * kib,
+                        total.anon * kib,
+                        total.file * kib,
+                        total.shared * kib,
+                        total.swapped * kib,
+                        total.page_tables * kib,
+                        swap_total * kib,
+                        swap_used * kib,
+                        total.min_faults,
+                        total.maj_faults,
+                        largest_pid,
+                        largest_rss * kib);
+}
+
+void proc_fetch_mem_usage_all_processes() {
+    char buffer[512];
+    if (proc_format_mem_usage_all(buffer, sizeof(buffer)) < 0) {
+        return;
+    }
+
+    log("Memory usage by all processes:\n", YELLOW);
     log(buffer, YELLOW);
 }
 
@@ -52,10 +52,7 @@ typedef struct process {
     // address space
     vmm_region_t* region;
 
-    // memory usage in bytes
-    // for now we can just increment this when we allocate
-    // TODO: there's probably a better way of tracking this.
-    uint32_t mem_usage;
+    // resident memory is accounted on the region as its ptes change, see vmm_rss_t and proc_mem_usage
 
     // we can add a pointer to the procfs node of the process
     // but we can easily get the path by looking up /process/[PID]
@@ -111,6 +108,9 @@ typedef struct process {
     uint32_t sig_pending;
 
     spinlock_t sig_lock;
+
+    // cpus its new threads may run on, taken from the thread that forked it
+    uint32_t affinity;
 } process_t;
 
 typedef enum wait_options {
@@ -132,5 +132,10 @@ process_t* proc_get_process_by_pid(pid_t pid);
 int proc_exit_all_threads(process_t* process);
 static int proc_clean(process_t* process);
 pid_t proc_waitpid(pid_t pid, int* status, int options);
+int proc_set_affinity(process_t* process, uint32_t mask);
+uint32_t proc_mem_usage(process_t* process);
+int proc_format_mem_usage(process_t* process, char* buf, size_t size);
+int proc_format_mem_usage_all(char* buf, size_t size);
+void proc_fetch_mem_usage_all_processes();
 
 #endif
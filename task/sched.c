@@ -22,21 +22,47 @@ You should have received a copy of the GNU General Public License along with The
 #include "../interrupts/interrupts.h"
 #include "../task/sync/spinlock.h"
 #include "../drivers/time/floptime.h"
+#include "../drivers/apic/lapic.h"
+#include "tss.h"
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
 #include "sched.h"
+#include "tick.h"
 
 uint64_t sched_ticks_counter;
 
-extern process_t* current_process;
+static void stealer_thread_entry(void);
+static bool sched_internal_steal(uint32_t cpu);
 
-static void idle_thread_loop() {
+static void sched_internal_sleep_expired(void* arg);
+static void sched_internal_dl_replenish(void* arg);
+static void sched_internal_dl_release(thread_t* thread);
+
+// the running cpu's run queue
+static inline sched_runqueue_t* sched_internal_this_rq(void) {
+    return &sched.runqueues[smp_processor_id()];
+}
+
+// every cpu ends up here once it has nothing else to run: work queued on it or taken from a busier cpu is
+// scheduled, otherwise it halts until an interrupt, with the tick stopped up to the next timer on the boot cpu
+void sched_idle_loop(void) {
     for (;;) {
+        IA32_INT_MASK();
+        tick_nohz_update();
+        if (sched_internal_this_rq()->count || sched_internal_steal(smp_processor_id())) {
+            IA32_INT_UNMASK();
+            sched_schedule();
+        } else {
+            IA32_CPU_IDLE();
+        }
     }
 }
 
-static void stealer_thread_entry() {}
+// the running cpu's idle thread
+static inline thread_t* sched_internal_idle(void) {
+    return PERCPU_READ(idle_thread);
+}
 
 static thread_t*
 sched_internal_init_thread(void (*entry)(void), unsigned int priority, char* name, int user, process_t* process);
@@ -54,15 +80,14 @@ extern void usermode_entry_routine(uint32_t sp, uint32_t ip);
 scheduler_t sched = {
     .kernel_threads = {.head = NULL, .tail = NULL, .count = 0, .name = "kernel_threads", .lock = SPINLOCK_INIT},
     .user_threads = {.head = NULL, .tail = NULL, .count = 0, .name = "user_threads", .lock = SPINLOCK_INIT},
-    .ready_queue = {.head = NULL, .tail = NULL, .count = 0, .name = "ready_queue", .lock = SPINLOCK_INIT},
-    .sleep_queue = {.head = NULL, .tail = NULL, .count = 0, .name = "sleep_queue", .lock = SPINLOCK_INIT},
     .next_tid = 1,
-    .idle_thread = NULL,
     .stealer_thread = NULL,
 };
 
 #define USER_STACK_TOP 0xC0000000
 #define USER_STACK_SIZE 0x1000
+// a new thread starts with interrupts on
+#define SCHED_INITIAL_EFLAGS 0x202
 
 static uintptr_t sched_internal_alloc_user_stack(process_t* process, uint32_t stack_index) {
     uintptr_t user_stack_top = USER_STACK_TOP - (stack_index * USER_STACK_SIZE);
@@ -78,14 +103,33 @@ static uintptr_t sched_internal_alloc_user_stack(process_t* process, uint32_t st
     return user_stack_top;
 }
 
-static void sched_internal_setup_thread_stack(thread_t* thread, void (*entry)(void), uintptr_t user_stack_top) {
-    uint32_t* kstack = (uint32_t*) ((uintptr_t) thread->kernel_stack + 4096);
+// lay out what the first context_switch to a thread pops: eflags, the callee saved registers and a
+// return into eip, which finds arg0 and arg1 where a cdecl call would have put them
+static void sched_internal_build_frame(thread_t* thread, uint32_t eip, uint32_t arg0, uint32_t arg1) {
+    uint32_t* sp = (uint32_t*) thread->kernel_stack;
+
+    *--sp = arg1;
+    *--sp = arg0;
+    *--sp = 0; // return address of eip, it never returns
+    *--sp = eip;
+    *--sp = thread->context.ebp;
+    *--sp = thread->context.ebx;
+    *--sp = thread->context.esi;
+    *--sp = thread->context.edi;
+    *--sp = SCHED_INITIAL_EFLAGS;
+
+    thread->context.eip = eip;
+    thread->context.esp = (uint32_t) sp;
+}
 
-    *--kstack = (uint32_t) entry;
-    *--kstack = (uint32_t) user_stack_top;
+static void sched_internal_setup_thread_stack(thread_t* thread, void (*entry)(void), uintptr_t user_stack_top) {
+    sched_internal_build_frame(thread, (uint32_t) usermode_entry_routine, (uint32_t) user_stack_top, (uint32_t) entry);
+}
 
-    thread->context.eip = (uint32_t) usermode_entry_routine;
-    thread->kernel_stack = kstack;
+// every kernel thread starts here, so one whose entry returns is retired instead of running off its stack
+static void sched_internal_kernel_thread_start(void (*entry)(void)) {
+    entry();
+    sched_thread_exit();
 }
 
 static inline uint32_t sched_internal_fetch_next_stack_index(process_t* process) {
@@ -95,18 +139,44 @@ static inline uint32_t sched_internal_fetch_next_stack_index(process_t* process)
 int sched_init_kernel_worker_pool(void);
 
 void sched_init(void) {
-    sched.idle_thread = sched_internal_init_thread(idle_thread_loop, 0, "idle", 0, NULL);
+    thread_t* idle = sched_internal_init_thread(sched_idle_loop, 0, "idle", 0, NULL);
     // idle thread must be lowest class
-    sched.idle_thread->cls = SCHED_CLASS_IDLE;
+    idle->cls = SCHED_CLASS_IDLE;
+    this_cpu()->idle_thread = idle;
 
-    sched.stealer_thread = sched_internal_init_thread(stealer_thread_entry, 0, "reaper", 0, NULL);
-    sched.stealer_thread->cls = SCHED_CLASS_REALTIME;
+    // started by smp_init once there is more than one cpu to balance
+    sched.stealer_thread = sched_internal_init_thread(stealer_thread_entry, 0, "stealer", 0, NULL);
 
-    sched_thread_list_add(sched.idle_thread, &sched.ready_queue);
+    // the idle thread never sits on the run queue, it is what runs when the queue is empty
+
+    // the code that called us becomes a thread too, its registers are saved the first time it is switched out
+    thread_t* kmain = sched_internal_init_thread(NULL, 0, "kmain", 0, NULL);
+    kmain->thread_state = THREAD_RUNNING;
+    kmain->context.on_cpu = 1;
+    kmain->time_slice = SCHED_TARGET_LATENCY;
+    PERCPU_WRITE(thread, kmain);
 
     log("sched: init - ok\n", GREEN);
 }
 
+// a cpu brought up later runs its boot code on this thread's stack and stays in it as its idle thread, the
+// way kmain became a thread on the boot cpu
+thread_t* sched_create_idle_thread(cpu_t* cpu) {
+    thread_t* idle = sched_internal_init_thread(NULL, 0, "idle", 0, NULL);
+    if (!idle) {
+        return NULL;
+    }
+
+    idle->cls = SCHED_CLASS_IDLE;
+    idle->thread_state = THREAD_RUNNING;
+    idle->time_slice = TIMESLICE_IDLE;
+    idle->cpu = cpu->id;
+    idle->context.on_cpu = 1;
+    cpu->idle_thread = idle;
+    cpu->thread = idle;
+    return idle;
+}
+
 // add thread to the end of a thread queue
 // uses the FIFO method
 void sched_enqueue(thread_list_t* list, thread_t* thread) {
@@ -118,7 +188,7 @@ void sched_enqueue(thread_list_t* list, thread_t* thread) {
     // this can lead to a race condition if many cores access it at once
     // this isnt a huge concern for now but it does disable interrupts
     // which is important for us here.
-    spinlock(&list->lock);
+    bool r = spinlock(&list->lock);
 
     thread->next = NULL;
 
@@ -133,7 +203,7 @@ void sched_enqueue(thread_list_t* list, thread_t* thread) {
     // atomic addition for increasing list->count
     atomic_fetch_add_explicit((atomic_uint*) &list->count, 1, memory_order_release);
 
-    spinlock_unlock(&list->lock, true);
+    spinlock_unlock(&list->lock, r);
 }
 
 // remove head of a thread queue
@@ -143,11 +213,11 @@ thread_t* sched_dequeue(thread_list_t* list) {
     }
 
     // we must lock when accessesing a thread list
-    spinlock(&list->lock);
+    bool r = spinlock(&list->lock);
 
     thread_t* thread = list->head;
     if (!thread) {
-        spinlock_unlock(&list->lock, true);
+        spinlock_unlock(&list->lock, r);
         return NULL;
     }
 
@@ -163,7 +233,7 @@ thread_t* sched_dequeue(thread_list_t* list) {
 
     thread->next = NULL;
 
-    spinlock_unlock(&list->lock, true);
+    spinlock_unlock(&list->lock, r);
 
     return thread;
 }
@@ -175,7 +245,7 @@ thread_t* sched_remove(thread_list_t* list, thread_t* target) {
     if (!list || !target) {
         return NULL;
     }
-    spinlock(&list->lock);
+    bool r = spinlock(&list->lock);
     thread_t* prev = NULL;
     thread_t* curr = list->head;
     while (curr) {
@@ -193,18 +263,18 @@ thread_t* sched_remove(thread_list_t* list, thread_t* target) {
             list->count--;
             curr->next = NULL;
 
-            spinlock_unlock(&list->lock, true);
+            spinlock_unlock(&list->lock, r);
             return curr;
         }
         prev = curr;
         curr = curr->next;
     }
-    spinlock_unlock(&list->lock, true);
+    spinlock_unlock(&list->lock, r);
     return NULL;
 }
 
 #define KERNEL_STACK_PAGES 1
-extern vmm_region_t* kernel_region;
+extern vmm_region_t kernel_region;
 
 static void* sched_internal_init_thread_stack_alloc(thread_t* thread) {
     uintptr_t pa = (uintptr_t) pmm_alloc_pages(0, KERNEL_STACK_PAGES);
@@ -213,7 +283,7 @@ static void* sched_internal_init_thread_stack_alloc(thread_t* thread) {
         return NULL;
     }
 
-    uintptr_t va = vmm_alloc(kernel_region, KERNEL_STACK_PAGES, PAGE_PRESENT | PAGE_RW);
+    uintptr_t va = vmm_alloc(&kernel_region, KERNEL_STACK_PAGES, PAGE_PRESENT | PAGE_RW);
     if (va == (uintptr_t) (-1)) {
         pmm_free_pages((void*) pa, 0, KERNEL_STACK_PAGES);
         log("sched: vmm_alloc failed for kernel stack\n", RED);
@@ -221,7 +291,7 @@ static void* sched_internal_init_thread_stack_alloc(thread_t* thread) {
     }
 
     for (size_t i = 0; i < KERNEL_STACK_PAGES; i++) {
-        vmm_map(kernel_region, va + i * PAGE_SIZE, pa + i * PAGE_SIZE, PAGE_PRESENT | PAGE_RW);
+        vmm_map(&kernel_region, va + i * PAGE_SIZE, pa + i * PAGE_SIZE, PAGE_PRESENT | PAGE_RW);
     }
 
     thread->kernel_stack = (void*) (va + KERNEL_STACK_PAGES * PAGE_SIZE);
@@ -260,6 +330,8 @@ sched_internal_init_thread(void (*entry)(void), unsigned priority, char* name, i
         return NULL;
     }
     flop_memset(this_thread, 0, sizeof(thread_t));
+    timer_init(&this_thread->sleep_timer, sched_internal_sleep_expired, this_thread);
+    timer_init(&this_thread->dl_timer, sched_internal_dl_replenish, this_thread);
 
     this_thread->kernel_stack = sched_internal_init_thread_stack_alloc(this_thread);
 
@@ -270,7 +342,9 @@ sched_internal_init_thread(void (*entry)(void), unsigned priority, char* name, i
     this_thread->context.esi = 0;
     this_thread->context.ebx = 0;
     this_thread->context.ebp = 0;
-    this_thread->context.eip = (uint32_t) entry;
+    if (this_thread->kernel_stack) {
+        sched_internal_build_frame(this_thread, (uint32_t) sched_internal_kernel_thread_start, (uint32_t) entry, 0);
+    }
 
     // by default we assign the normal class
     // this can be changed later or by the specific create function
@@ -285,6 +359,9 @@ sched_internal_init_thread(void (*entry)(void), unsigned priority, char* name, i
 
     this_thread->id = sched.next_tid++;
 
+    // a user thread starts with the cpus its process hands down, see proc_fork
+    this_thread->affinity = process && process->affinity ? process->affinity : SCHED_AFFINITY_ALL;
+
     this_thread->name = name;
 
     this_thread->uptime = 0;
@@ -340,14 +417,12 @@ thread_t* sched_create_user_thread(void (*entry)(void), unsigned priority, char*
     return new_thread;
 }
 
-extern process_t* current_process;
-
 void sched_thread_list_add(thread_t* thread, thread_list_t* list) {
     if (!thread || !list) {
         return;
     }
 
-    spinlock(&list->lock);
+    bool r = spinlock(&list->lock);
 
     thread->next = NULL;
 
@@ -361,170 +436,637 @@ void sched_thread_list_add(thread_t* thread, thread_list_t* list) {
 
     list->count++;
 
-    spinlock_unlock(&list->lock, true);
+    spinlock_unlock(&list->lock, r);
 }
 
 thread_t* sched_create_kernel_thread(void (*entry)(void), unsigned priority, char* name) {
     thread_t* new_thread = sched_internal_init_thread((void*) entry, priority, name, 0, NULL);
 
-    // kernel threads are critical so we put them in realtime class
-    // NOTE: this might change
-    new_thread->cls = SCHED_CLASS_REALTIME;
+    // kernel threads stay in the normal class, most of them are background or bulk work that realtime bandwidth
+    // would only be wasted on; one with a latency bound asks for a reservation itself with sched_set_deadline
 
     log("sched: kernel thread created", GREEN);
     sched_thread_list_add(new_thread, &sched.kernel_threads);
     return new_thread;
 }
 
-thread_t* current_thread;
 
-void sched_boost_starved_threads(thread_list_t* list) {
-    spinlock(&list->lock);
+// list index of a priority, the best priority gets the lowest index
+static inline uint32_t sched_internal_rq_index(uint32_t prio) {
+    return MAX_PRIORITY - prio;
+}
+
+// the best list of a class that has a thread on it, two find-first-set lookups
+static inline uint32_t sched_internal_first_index(sched_prio_array_t* array) {
+    uint32_t word = (uint32_t) __builtin_ctz(array->summary);
+    return word * 32 + (uint32_t) __builtin_ctz(array->bitmap[word]);
+}
+
+// weights of the fair class from priority 0 up, each about 1.25 times the last, and 2^32 divided by each so
+// charging a thread multiplies instead of dividing
+static const uint32_t sched_internal_weights[SCHED_WEIGHT_LEVELS] = {
+    1024, 1277, 1586, 1991, 2501, 3121, 3906, 4904, 6100, 7620, 9548,
+    11916, 14949, 18705, 23254, 29154, 36291, 46273, 56483, 71755, 88761,
+};
+
+static const uint32_t sched_internal_inv_weights[SCHED_WEIGHT_LEVELS] = {
+    4194304, 3363326, 2708050, 2157191, 1717300, 1376151, 1099582, 875809, 704093, 563644, 449829,
+    360437, 287308, 229616, 184698, 147320, 118348, 92818, 76040, 59856, 48388,
+};
 
-    uint32_t max_wait = 0;
+static inline uint32_t sched_internal_weight_level(thread_t* thread) {
+    uint32_t prio = thread->priority.effective > MAX_PRIORITY ? MAX_PRIORITY : thread->priority.effective;
+    return prio * SCHED_WEIGHT_LEVELS / SCHED_PRIORITIES;
+}
 
-    for (thread_t* thread = list->head; thread; thread = thread->next) {
-        thread->time_since_last_run++;
-        if (thread->cls == SCHED_CLASS_NORMAL && thread->time_since_last_run > max_wait) {
-            max_wait = thread->time_since_last_run;
+// vruntime for ticks of cpu time, ticks * SCHED_NICE_0_WEIGHT / weight in 1 << SCHED_VRUNTIME_SHIFT units
+static inline uint64_t sched_internal_vruntime_delta(thread_t* thread, uint32_t ticks) {
+    uint64_t scaled = (uint64_t) ticks * SCHED_NICE_0_WEIGHT << SCHED_VRUNTIME_SHIFT;
+    return (scaled * sched_internal_inv_weights[sched_internal_weight_level(thread)]) >> 32;
+}
+
+static bool sched_internal_fair_less(const rb_node_t* a, const rb_node_t* b) {
+    return rb_entry(a, thread_t, rq_node)->vruntime < rb_entry(b, thread_t, rq_node)->vruntime;
+}
+
+static void sched_internal_fair_link(sched_runqueue_t* rq, thread_t* thread) {
+    thread->weight = sched_internal_weights[sched_internal_weight_level(thread)];
+    rb_insert(&rq->fair_tree, &thread->rq_node, sched_internal_fair_less);
+    rq->fair_count++;
+    rq->fair_weight += thread->weight;
+}
+
+static void sched_internal_fair_unlink(sched_runqueue_t* rq, thread_t* thread) {
+    rb_erase(&rq->fair_tree, &thread->rq_node);
+    rq->fair_count--;
+    rq->fair_weight -= thread->weight;
+}
+
+// the smallest vruntime of the queue and the normal thread running on it; the floor only moves forward
+static void sched_internal_update_min_vruntime(sched_runqueue_t* rq, thread_t* running) {
+    rb_node_t* first = rb_first(&rq->fair_tree);
+    bool found = false;
+    uint64_t low = 0;
+
+    if (running && running->cls == SCHED_CLASS_NORMAL) {
+        low = running->vruntime;
+        found = true;
+    }
+    if (first) {
+        uint64_t vruntime = rb_entry(first, thread_t, rq_node)->vruntime;
+        if (!found || vruntime < low) {
+            low = vruntime;
         }
+        found = true;
     }
 
-    if (max_wait > STARVATION_THRESHOLD) {
-        for (thread_t* thread = list->head; thread; thread = thread->next) {
-            if (thread->cls == SCHED_CLASS_NORMAL && thread->time_since_last_run > STARVATION_THRESHOLD) {
-                uint32_t boost = (uint32_t) ((thread->time_since_last_run * BOOST_AMOUNT) / max_wait);
+    if (found && low > rq->min_vruntime) {
+        rq->min_vruntime = low;
+    }
+}
 
-                if (boost == 0) {
-                    boost = 1;
-                }
+// a thread waking up after a long sleep would otherwise hold the cpu until it caught up; it gets half a target
+// latency of credit over what is running now and no more
+static void sched_internal_place(sched_runqueue_t* rq, thread_t* thread) {
+    uint64_t credit = (uint64_t) SCHED_TARGET_LATENCY << (SCHED_VRUNTIME_SHIFT - 1);
+    uint64_t floor = rq->min_vruntime > credit ? rq->min_vruntime - credit : 0;
+    if (thread->vruntime < floor) {
+        thread->vruntime = floor;
+    }
+}
+
+// vruntime only means something against its own queue's floor, a thread moving between cpus keeps its lead
+static void sched_internal_renormalize(sched_runqueue_t* src, sched_runqueue_t* dst, thread_t* thread) {
+    uint64_t lead = thread->vruntime > src->min_vruntime ? thread->vruntime - src->min_vruntime : 0;
+    thread->vruntime = dst->min_vruntime + lead;
+}
+
+// a turn of the target latency split by weight, never shorter than the minimum granularity; the period grows
+// with the queue so that many threads do not all get a sliver
+static uint32_t sched_internal_fair_slice(sched_runqueue_t* rq, thread_t* thread) {
+    uint32_t running = rq->fair_count + 1;
+    uint32_t period = SCHED_TARGET_LATENCY;
+    if (running * SCHED_MIN_GRANULARITY > period) {
+        period = running * SCHED_MIN_GRANULARITY;
+    }
+
+    uint32_t weight = sched_internal_weights[sched_internal_weight_level(thread)];
+    uint32_t slice = period * weight / (rq->fair_weight + weight);
+    return slice < SCHED_MIN_GRANULARITY ? SCHED_MIN_GRANULARITY : slice;
+}
+
+// start a new deadline with a full budget
+static inline void sched_internal_dl_renew(thread_t* thread, uint64_t now) {
+    thread->dl_abs_deadline = now + thread->dl_deadline;
+    thread->dl_budget = (int32_t) thread->dl_runtime;
+}
+
+// the cbs wakeup rule: the old deadline is kept only if the budget left could be used up by then without
+// running faster than the reservation, budget / (deadline - now) <= runtime / period
+static void sched_internal_dl_wakeup(thread_t* thread) {
+    uint64_t now = sched_ticks_counter;
+    if (thread->dl_abs_deadline <= now || thread->dl_budget <= 0 ||
+        (uint64_t) thread->dl_budget * thread->dl_period > (thread->dl_abs_deadline - now) * thread->dl_runtime) {
+        sched_internal_dl_renew(thread, now);
+    }
+}
+
+// a period's worth of budget for every period overrun, each pushing the deadline back by a period; one that
+// has fallen behind the clock starts over from now
+static void sched_internal_dl_refill(thread_t* thread, uint64_t now) {
+    while (thread->dl_budget <= 0) {
+        thread->dl_abs_deadline += thread->dl_period;
+        thread->dl_budget += (int32_t) thread->dl_runtime;
+    }
+    if (thread->dl_abs_deadline <= now) {
+        sched_internal_dl_renew(thread, now);
+    }
+}
+
+static bool sched_internal_dl_less(const rb_node_t* a, const rb_node_t* b) {
+    return rb_entry(a, thread_t, rq_node)->dl_abs_deadline < rb_entry(b, thread_t, rq_node)->dl_abs_deadline;
+}
+
+static void sched_internal_rq_link(sched_runqueue_t* rq, thread_t* thread, uint32_t prio) {
+    rq->class_mask |= 1u << thread->cls;
+    rq->count++;
+    thread->rq_prio = prio;
+    thread->on_runqueue = true;
+
+    if (thread->cls == SCHED_CLASS_NORMAL) {
+        sched_internal_fair_link(rq, thread);
+        return;
+    }
+    if (thread->cls == SCHED_CLASS_REALTIME) {
+        rb_insert(&rq->dl_tree, &thread->rq_node, sched_internal_dl_less);
+        return;
+    }
+
+    sched_prio_array_t* array = &rq->idle;
+    uint32_t idx = sched_internal_rq_index(prio);
+
+    thread->rq_next = NULL;
+    thread->rq_prev = array->tails[idx];
+    if (array->tails[idx]) {
+        array->tails[idx]->rq_next = thread;
+    } else {
+        array->heads[idx] = thread;
+    }
+    array->tails[idx] = thread;
+
+    array->bitmap[idx / 32] |= 1u << (idx % 32);
+    array->summary |= 1u << (idx / 32);
+    array->count++;
+}
+
+static void sched_internal_rq_unlink(sched_runqueue_t* rq, thread_t* thread) {
+    rq->count--;
+    thread->on_runqueue = false;
+
+    if (thread->cls == SCHED_CLASS_NORMAL) {
+        sched_internal_fair_unlink(rq, thread);
+        if (!rq->fair_count) {
+            rq->class_mask &= ~(1u << SCHED_CLASS_NORMAL);
+        }
+        return;
+    }
+    if (thread->cls == SCHED_CLASS_REALTIME) {
+        rb_erase(&rq->dl_tree, &thread->rq_node);
+        if (!rq->dl_tree.node) {
+            rq->class_mask &= ~(1u << SCHED_CLASS_REALTIME);
+        }
+        return;
+    }
+
+    sched_prio_array_t* array = &rq->idle;
+    uint32_t idx = sched_internal_rq_index(thread->rq_prio);
+
+    if (thread->rq_prev) {
+        thread->rq_prev->rq_next = thread->rq_next;
+    } else {
+        array->heads[idx] = thread->rq_next;
+    }
+    if (thread->rq_next) {
+        thread->rq_next->rq_prev = thread->rq_prev;
+    } else {
+        array->tails[idx] = thread->rq_prev;
+    }
+
+    // the last thread of a list clears its bit, and the last list of a word clears the summary bit
+    if (!array->heads[idx]) {
+        array->bitmap[idx / 32] &= ~(1u << (idx % 32));
+        if (!array->bitmap[idx / 32]) {
+            array->summary &= ~(1u << (idx / 32));
+        }
+    }
+    if (--array->count == 0) {
+        rq->class_mask &= ~(1u << SCHED_CLASS_IDLE);
+    }
+
+    thread->rq_next = NULL;
+    thread->rq_prev = NULL;
+}
+
+// lock the run queue a thread belongs to; it can be moved between reading its cpu and taking the lock,
+// so the cpu is checked again under it
+static sched_runqueue_t* sched_internal_lock_thread_rq(thread_t* thread, bool* r) {
+    for (;;) {
+        uint32_t cpu = __atomic_load_n(&thread->cpu, __ATOMIC_ACQUIRE);
+        sched_runqueue_t* rq = &sched.runqueues[cpu];
+        *r = spinlock(&rq->lock);
+        if (thread->cpu == cpu) {
+            return rq;
+        }
+        spinlock_unlock(&rq->lock, *r);
+    }
+}
+
+// two run queues are always taken in array order so two cpus moving threads at each other cannot deadlock
+static bool sched_internal_double_lock(sched_runqueue_t* a, sched_runqueue_t* b) {
+    if (a > b) {
+        sched_runqueue_t* tmp = a;
+        a = b;
+        b = tmp;
+    }
+
+    bool r = spinlock(&a->lock);
+    if (a != b) {
+        spinlock(&b->lock);
+    }
+    return r;
+}
+
+static void sched_internal_double_unlock(sched_runqueue_t* a, sched_runqueue_t* b, bool r) {
+    if (a != b) {
+        spinlock_unlock(&b->lock, false);
+    }
+    spinlock_unlock(&a->lock, r);
+}
+
+// a cpu with nothing to do, which a woken thread would start on right away
+static inline bool sched_internal_cpu_idle(uint32_t cpu) {
+    cpu_t* c = &smp_cpus[cpu];
+    return c->online && c->thread == c->idle_thread && !sched.runqueues[cpu].count;
+}
+
+// threads queued plus the one running, what the balancer evens out
+static inline uint32_t sched_internal_cpu_load(uint32_t cpu) {
+    cpu_t* c = &smp_cpus[cpu];
+    return sched.runqueues[cpu].count + (c->thread != c->idle_thread ? 1 : 0);
+}
+
+static inline bool sched_internal_cpu_allowed(thread_t* thread, uint32_t cpu) {
+    return (thread->affinity & (1u << cpu)) != 0;
+}
+
+// cpus that are up, what an affinity mask has to overlap
+uint32_t sched_online_cpus(void) {
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < smp_cpu_count; i++) {
+        if (smp_cpus[i].online) {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+}
 
-                if (thread->priority.effective + boost >= MAX_PRIORITY) {
-                    thread->priority.effective = MAX_PRIORITY;
-                } else {
-                    thread->priority.effective += boost;
+// where a woken thread is queued: the cpu it last ran on, whose cache may still hold its working set, unless
+// that cpu is busy and another one it may use sits idle; the loads are read without locks, it is only a hint
+static uint32_t sched_internal_select_cpu(thread_t* thread) {
+    uint32_t prev = thread->cpu;
+    bool allowed = sched_internal_cpu_allowed(thread, prev);
+
+    // still running or being switched out, it stays where its state is
+    if (allowed && (thread->context.on_cpu || sched_internal_cpu_idle(prev))) {
+        return prev;
+    }
+
+    // a thread whose mask no longer has its last cpu goes to the least loaded one it does have
+    uint32_t fallback = prev;
+    for (uint32_t i = 0; i < smp_cpu_count; i++) {
+        if (!sched_internal_cpu_allowed(thread, i)) {
+            continue;
+        }
+        if (sched_internal_cpu_idle(i)) {
+            return i;
+        }
+        if (!sched_internal_cpu_allowed(thread, fallback) ||
+            sched_internal_cpu_load(i) < sched_internal_cpu_load(fallback)) {
+            fallback = i;
+        }
+    }
+    return allowed ? prev : fallback;
+}
+
+// make a thread runnable; it goes to the back of the list for its class and effective priority, or into the
+// fair tree by its vruntime
+void sched_runqueue_add(thread_t* thread) {
+    if (!thread) {
+        return;
+    }
+
+    uint32_t target = sched_internal_select_cpu(thread);
+    sched_runqueue_t* dst = &sched.runqueues[target];
+
+    // the queue it is moved from has to be held too, so a second waker sees it queued
+    for (;;) {
+        uint32_t cpu = __atomic_load_n(&thread->cpu, __ATOMIC_ACQUIRE);
+        sched_runqueue_t* src = &sched.runqueues[cpu];
+        bool r = sched_internal_double_lock(src, dst);
+        if (thread->cpu != cpu) {
+            sched_internal_double_unlock(src, dst, r);
+            continue;
+        }
+
+        if (thread->dl_throttled) {
+            // its budget is gone, the replenishment queues it
+            thread->dl_parked = true;
+        } else if (!thread->on_runqueue) {
+            uint32_t prio = thread->priority.effective > MAX_PRIORITY ? MAX_PRIORITY : thread->priority.effective;
+            if (thread->cls == SCHED_CLASS_NORMAL) {
+                if (src != dst) {
+                    sched_internal_renormalize(src, dst, thread);
                 }
+                sched_internal_place(dst, thread);
+            } else if (thread->cls == SCHED_CLASS_REALTIME && !thread->context.on_cpu) {
+                sched_internal_dl_wakeup(thread);
             }
+            thread->cpu = target;
+            sched_internal_rq_link(dst, thread, prio);
         }
+        sched_internal_double_unlock(src, dst, r);
+        break;
     }
 
-    spinlock_unlock(&list->lock, true);
+    // the running thread now has company, its time slice has to be counted again
+    if (tick_stopped()) {
+        tick_nohz_update();
+    }
 }
 
-void sched_find_best_thread_iterate(thread_list_t* list,
-                                    thread_t** out_best,
-                                    thread_t** out_prev_best,
-                                    thread_t** out_prev) {
-    thread_t* iter = list->head;
-    thread_t* prev = NULL;
+// take a thread off the run queue; returns whether it was on it
+bool sched_runqueue_remove(thread_t* thread) {
+    if (!thread) {
+        return false;
+    }
 
-    while (iter) {
-        bool better = false;
+    bool r;
+    sched_runqueue_t* rq = sched_internal_lock_thread_rq(thread, &r);
+    bool queued = thread->on_runqueue;
+    if (queued) {
+        sched_internal_rq_unlink(rq, thread);
+    }
+    thread->dl_parked = false;
+    spinlock_unlock(&rq->lock, r);
+    return queued;
+}
 
-        if (!*out_best) {
-            better = true;
-        } else {
-            // here is where we check the class first
-            // realtime (0) is better than normal (1) is better than idle (2).
-            if (iter->cls < (*out_best)->cls) {
-                better = true;
-            } else if (iter->cls == (*out_best)->cls) {
-                // if the classes are the same, we fall back to priority
-                if (iter->priority.effective > (*out_best)->priority.effective) {
-                    better = true;
+// whether any cpu has a thread waiting for it, the tick is needed to take turns
+bool sched_has_queued(void) {
+    for (uint32_t i = 0; i < smp_cpu_count; i++) {
+        if (sched.runqueues[i].count) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// a thread being switched out is left where it is, the cpu switching it out would only have to wait for it
+static inline bool sched_internal_can_migrate(thread_t* thread, uint32_t dst) {
+    return !thread->context.on_cpu && sched_internal_cpu_allowed(thread, dst);
+}
+
+static void sched_internal_move(sched_runqueue_t* src, sched_runqueue_t* dst, uint32_t dst_cpu, thread_t* thread) {
+    sched_internal_rq_unlink(src, thread);
+    if (thread->cls == SCHED_CLASS_NORMAL) {
+        sched_internal_renormalize(src, dst, thread);
+    }
+    thread->cpu = dst_cpu;
+    sched_internal_rq_link(dst, thread, thread->rq_prio);
+}
+
+// the idle class from its worst list up
+static uint32_t
+sched_internal_migrate_array(sched_runqueue_t* src, sched_runqueue_t* dst, uint32_t dst_cpu, uint32_t count) {
+    sched_prio_array_t* array = &src->idle;
+    uint32_t moved = 0;
+
+    for (int word = SCHED_BITMAP_WORDS - 1; word >= 0 && moved < count; word--) {
+        uint32_t bits = array->bitmap[word];
+        while (bits && moved < count) {
+            uint32_t bit = 31 - (uint32_t) __builtin_clz(bits);
+            bits &= ~(1u << bit);
+
+            thread_t* thread = array->tails[word * 32 + bit];
+            while (thread && moved < count) {
+                thread_t* prev = thread->rq_prev;
+                if (sched_internal_can_migrate(thread, dst_cpu)) {
+                    sched_internal_move(src, dst, dst_cpu, thread);
+                    moved++;
                 }
+                thread = prev;
             }
         }
+    }
+    return moved;
+}
 
-        if (better) {
-            *out_best = iter;
-            *out_prev_best = prev;
+// a tree from its rightmost node, the thread it would run last
+static uint32_t sched_internal_migrate_tree(
+    sched_runqueue_t* src, sched_runqueue_t* dst, uint32_t dst_cpu, rb_root_t* tree, uint32_t count) {
+    uint32_t moved = 0;
+
+    rb_node_t* node = rb_last(tree);
+    while (node && moved < count) {
+        rb_node_t* prev = rb_prev(node);
+        thread_t* thread = rb_entry(node, thread_t, rq_node);
+        if (sched_internal_can_migrate(thread, dst_cpu)) {
+            sched_internal_move(src, dst, dst_cpu, thread);
+            moved++;
         }
-        prev = iter;
-        iter = iter->next;
+        node = prev;
     }
+    return moved;
 }
 
-static thread_t* sched_find_best_thread(thread_list_t* list, thread_t** out_prev) {
-    if (!list || !list->head) {
-        return NULL;
+// move up to count threads from src to dst, both held, taking the worst placed ones first so src keeps the
+// work it would have run next: the idle class, the fair threads furthest ahead, then the latest deadlines
+static uint32_t sched_internal_migrate(sched_runqueue_t* src, sched_runqueue_t* dst, uint32_t dst_cpu, uint32_t count) {
+    uint32_t moved = sched_internal_migrate_array(src, dst, dst_cpu, count);
+    if (moved < count) {
+        moved += sched_internal_migrate_tree(src, dst, dst_cpu, &src->fair_tree, count - moved);
     }
+    if (moved < count) {
+        moved += sched_internal_migrate_tree(src, dst, dst_cpu, &src->dl_tree, count - moved);
+    }
+    return moved;
+}
 
-    thread_t* best = NULL;
-    thread_t* best_prev = NULL;
+// an idle cpu takes half the queue of the busiest other one, rounded up so a lone waiting thread moves too
+static bool sched_internal_steal(uint32_t cpu) {
+    uint32_t victim = cpu;
+    uint32_t most = 0;
+    for (uint32_t i = 0; i < smp_cpu_count; i++) {
+        if (i != cpu && sched.runqueues[i].count > most) {
+            most = sched.runqueues[i].count;
+            victim = i;
+        }
+    }
+    if (victim == cpu) {
+        return false;
+    }
 
-    sched_find_best_thread_iterate(list, &best, &best_prev, NULL);
+    sched_runqueue_t* src = &sched.runqueues[victim];
+    sched_runqueue_t* dst = &sched.runqueues[cpu];
+    bool r = sched_internal_double_lock(src, dst);
+    uint32_t moved = sched_internal_migrate(src, dst, cpu, (src->count + 1) / 2);
+    sched_internal_double_unlock(src, dst, r);
+    return moved != 0;
+}
 
-    if (out_prev) {
-        *out_prev = best_prev;
+// send a cpu to its next preemption point, waking it if it is halted
+static void sched_internal_kick(uint32_t cpu) {
+    if (cpu != smp_processor_id() && lapic_present()) {
+        lapic_send_ipi((uint8_t) smp_cpus[cpu].apic_id, INT_TYPE_RESCHED);
     }
-
-    return best;
 }
 
-static void sched_unlink_thread(thread_list_t* list, thread_t* thread, thread_t* prev) {
-    if (!list || !thread) {
+// a busy cpu does not go looking for work, so the stealer moves half the difference between the busiest and
+// the least loaded cpu whenever it grows past SCHED_BALANCE_IMBALANCE
+static void sched_internal_balance(void) {
+    uint32_t busiest = 0;
+    uint32_t idlest = 0;
+    for (uint32_t i = 1; i < smp_cpu_count; i++) {
+        if (sched_internal_cpu_load(i) > sched_internal_cpu_load(busiest)) {
+            busiest = i;
+        }
+        if (sched_internal_cpu_load(i) < sched_internal_cpu_load(idlest)) {
+            idlest = i;
+        }
+    }
+
+    uint32_t high = sched_internal_cpu_load(busiest);
+    uint32_t low = sched_internal_cpu_load(idlest);
+    if (busiest == idlest || high - low < SCHED_BALANCE_IMBALANCE) {
         return;
     }
 
-    if (prev) {
-        prev->next = thread->next;
-    } else {
-        list->head = thread->next;
+    sched_runqueue_t* src = &sched.runqueues[busiest];
+    sched_runqueue_t* dst = &sched.runqueues[idlest];
+    bool r = sched_internal_double_lock(src, dst);
+    uint32_t moved = sched_internal_migrate(src, dst, idlest, (high - low) / 2);
+    sched_internal_double_unlock(src, dst, r);
+
+    if (moved && smp_cpus[idlest].thread == smp_cpus[idlest].idle_thread) {
+        smp_cpus[idlest].idle_thread->need_resched = true;
+        sched_internal_kick(idlest);
+    }
+}
+
+static void stealer_thread_entry(void) {
+    for (;;) {
+        sched_internal_balance();
+        sched_thread_sleep(SCHED_BALANCE_MS);
     }
+}
 
-    if (list->tail == thread) {
-        list->tail = prev;
+// restrict a thread to the cpus in mask; a queued thread on a cpu it lost is queued again on one it kept, a
+// running one moves at its next preemption point
+int sched_set_affinity(thread_t* thread, uint32_t mask) {
+    if (!thread || !(mask & sched_online_cpus())) {
+        log("sched: affinity mask has no online cpu\n", RED);
+        return -1;
     }
 
-    if (list->count > 0) {
-        list->count--;
+    bool r;
+    sched_runqueue_t* rq = sched_internal_lock_thread_rq(thread, &r);
+    thread->affinity = mask;
+    uint32_t cpu = thread->cpu;
+    bool misplaced = !sched_internal_cpu_allowed(thread, cpu);
+    bool requeue = misplaced && thread->on_runqueue;
+    if (requeue) {
+        sched_internal_rq_unlink(rq, thread);
     }
+    spinlock_unlock(&rq->lock, r);
 
-    thread->next = NULL;
+    if (requeue) {
+        sched_runqueue_add(thread);
+    } else if (misplaced && smp_cpus[cpu].thread == thread) {
+        thread->need_resched = true;
+        sched_internal_kick(cpu);
+    }
+    return 0;
+}
+
+// called by smp_init once the other cpus are up, one cpu has nothing to balance
+void sched_balance_start(void) {
+    if (smp_cpu_count > 1) {
+        sched_unblock(sched.stealer_thread);
+    }
+}
+
+// the best class with anything runnable gives up its next thread: the earliest deadline, the fair thread furthest
+// behind sized to its share of the target latency, or the head of the best idle list
+static thread_t* sched_internal_rq_pick(sched_runqueue_t* rq) {
+    if (!rq->class_mask) {
+        return NULL;
+    }
+
+    uint32_t cls = (uint32_t) __builtin_ctz(rq->class_mask);
+    if (cls == SCHED_CLASS_REALTIME) {
+        thread_t* next = rb_entry(rb_first(&rq->dl_tree), thread_t, rq_node);
+        sched_internal_rq_unlink(rq, next);
+        return next;
+    }
+    if (cls == SCHED_CLASS_NORMAL) {
+        thread_t* next = rb_entry(rb_first(&rq->fair_tree), thread_t, rq_node);
+        sched_internal_rq_unlink(rq, next);
+        next->time_slice = sched_internal_fair_slice(rq, next);
+        sched_internal_update_min_vruntime(rq, next);
+        return next;
+    }
+
+    sched_prio_array_t* array = &rq->idle;
+    thread_t* next = array->heads[sched_internal_first_index(array)];
+    sched_internal_rq_unlink(rq, next);
+    return next;
 }
 
 static inline void sched_assign_time_slice(thread_t* thread) {
     // assign time slice based on the thread class
-    // realtime threads get the most time, idle get the least.
+    // realtime threads run on their budget instead, idle get the least.
     switch (thread->cls) {
         case SCHED_CLASS_REALTIME:
-            thread->time_slice = TIMESLICE_REALTIME;
+            // it runs until its budget is used up, see sched_internal_dl_charge
             break;
         case SCHED_CLASS_IDLE:
             thread->time_slice = TIMESLICE_IDLE;
             break;
         case SCHED_CLASS_NORMAL:
         default:
-            // normal threads use the base priority to calculate slice
-            thread->time_slice = thread->priority.base ? thread->priority.base : TIMESLICE_NORMAL;
+            // the fair class sized the slice when it picked the thread
             break;
     }
 }
 
-static thread_t* sched_select_by_time_slice(thread_list_t* list) {
-    if (!list || !list->head) {
-        return NULL;
-    }
-
-    thread_t* prev = NULL;
-    thread_t* best = sched_find_best_thread(list, &prev);
-    if (!best) {
-        return NULL;
-    }
-    sched_unlink_thread(list, best, prev);
-    sched_assign_time_slice(best);
-
-    return best;
+static thread_t* sched_internal_pick_local(void) {
+    sched_runqueue_t* rq = sched_internal_this_rq();
+    bool r = spinlock(&rq->lock);
+    thread_t* next = sched_internal_rq_pick(rq);
+    spinlock_unlock(&rq->lock, r);
+    return next;
 }
 
+// called with preemption off, so the cpu cannot change under it
 static thread_t* sched_select_next(void) {
-    sched_boost_starved_threads(&sched.ready_queue);
-
-    spinlock(&sched.ready_queue.lock);
-    thread_t* next = sched_select_by_time_slice(&sched.ready_queue);
-    spinlock_unlock(&sched.ready_queue.lock, true);
+    thread_t* next = sched_internal_pick_local();
+    if (!next && sched_internal_steal(smp_processor_id())) {
+        next = sched_internal_pick_local();
+    }
 
+    if (next) {
+        sched_assign_time_slice(next);
+    }
     return next;
 }
 
@@ -533,7 +1075,7 @@ static thread_t* sched_select_idle_if_needed(thread_t* candidate) {
         return candidate;
     }
 
-    thread_t* idle = sched.idle_thread;
+    thread_t* idle = sched_internal_idle();
     idle->time_slice = TIMESLICE_IDLE;
     return idle;
 }
@@ -543,33 +1085,68 @@ static inline bool sched_should_skip(thread_t* next) {
 }
 
 static inline void sched_prepare_thread(thread_t* next) {
+    // taken from a queue while the cpu it last ran on was still saving it
+    while (__atomic_load_n(&next->context.on_cpu, __ATOMIC_ACQUIRE)) {
+        spinlock_internal_relax();
+    }
+    next->context.on_cpu = 1;
+
     next->time_since_last_run = 0;
+    next->need_resched = false;
+    next->thread_state = THREAD_RUNNING;
 }
 
 static void sched_determine_and_switch(thread_t* next) {
+    // an interrupt landing halfway through would see a mix of the two threads
+    bool r = IA32_INT_ENABLED();
+    IA32_INT_MASK();
+
     thread_t* prev = current_thread;
-    current_thread = next;
-    current_process = next->process;
+    PERCPU_WRITE(thread, next);
+    PERCPU_WRITE(process, next->process);
+
+    prev->saved_preempt_count = preempt_count;
+    PERCPU_WRITE(preempt, next->saved_preempt_count);
 
-    if (next->process != NULL) {
+    prev->saved_pd = (uintptr_t) read_pd();
+    if (next->saved_pd) {
+        load_pd((uint32_t*) next->saved_pd);
+    } else if (next->process != NULL) {
         load_pd(next->process->region->pg_dir);
     } else {
-        load_pd(kernel_region->pg_dir);
+        load_pd(kernel_region.pg_dir);
+    }
+
+    // traps from user mode land on the top of the incoming thread's kernel stack
+    if (next->kernel_stack) {
+        tss_set_kernel_stack((uint32_t) next->kernel_stack);
     }
 
     context_switch(&prev->context, &next->context);
+
+    if (r) {
+        IA32_INT_UNMASK();
+    }
 }
 
 void sched_schedule(void) {
+    // an interrupt must not reschedule while the next thread is being picked
+    preempt_disable();
+
     thread_t* next = sched_select_next();
     next = sched_select_idle_if_needed(next);
 
-    if (sched_should_skip(next)) {
-        return;
+    if (!sched_should_skip(next)) {
+        sched_prepare_thread(next);
+        sched_determine_and_switch(next);
+    } else {
+        // a wakeup that landed between marking ourselves blocked and getting here queued us again and we were
+        // picked back; we keep running, so we have to say so or we are never preempted or requeued again
+        next->need_resched = false;
+        next->thread_state = THREAD_RUNNING;
     }
 
-    sched_prepare_thread(next);
-    sched_determine_and_switch(next);
+    preempt_enable_no_resched();
 }
 
 thread_t* sched_current_thread(void) {
@@ -578,7 +1155,20 @@ thread_t* sched_current_thread(void) {
 
 void sched_thread_exit(void) {
     thread_t* current = sched_current_thread();
-    sched_yield();
+    if (!current) {
+        return;
+    }
+
+    sched_internal_dl_release(current);
+    current->thread_state = THREAD_EXITED;
+    for (;;) {
+        sched_schedule();
+    }
+}
+
+// a thread that blocked or went to sleep before yielding is on some other queue and stays off the run queue
+static inline bool sched_internal_is_runnable(thread_t* thread) {
+    return thread->thread_state == THREAD_RUNNING || thread->thread_state == THREAD_READY;
 }
 
 void sched_yield(void) {
@@ -586,13 +1176,68 @@ void sched_yield(void) {
         return;
     }
 
-    if (current_thread != sched.idle_thread) {
-        sched_enqueue(&sched.ready_queue, current_thread);
+    if (current_thread != sched_internal_idle() && sched_internal_is_runnable(current_thread)) {
+        current_thread->thread_state = THREAD_READY;
+        sched_runqueue_add(current_thread);
     }
 
     sched_schedule();
 }
 
+// called at preemption points; gives up the cpu if the tick or a wakeup asked for it
+void sched_preempt(void) {
+    thread_t* current = current_thread;
+    if (!current || !current->need_resched || preempt_count) {
+        return;
+    }
+
+    // a thread caught between marking itself blocked or asleep and scheduling is about to give up the cpu
+    // anyway, switching it out here would leave it off every queue
+    if (current != sched_internal_idle() && !sched_internal_is_runnable(current)) {
+        return;
+    }
+
+    current->need_resched = false;
+    sched_yield();
+}
+
+// for long kernel loops, lets a pending reschedule happen between iterations
+void cond_resched(void) {
+    if (!preempt_count) {
+        sched_preempt();
+    }
+}
+
+// whether a woken thread of the same class should take the cpu; a fair thread has to be behind by more than
+// the minimum granularity, so two threads waking each other do not switch on every wakeup, a realtime one has
+// to be due first
+static inline bool sched_internal_beats(thread_t* woken, thread_t* current) {
+    if (woken->cls == SCHED_CLASS_NORMAL) {
+        uint64_t gran = (uint64_t) SCHED_MIN_GRANULARITY << SCHED_VRUNTIME_SHIFT;
+        return woken->vruntime + gran < current->vruntime;
+    }
+    if (woken->cls == SCHED_CLASS_REALTIME) {
+        return woken->dl_abs_deadline < current->dl_abs_deadline;
+    }
+    return woken->priority.effective > current->priority.effective;
+}
+
+// a thread made runnable that beats the one running on the cpu it was queued on takes over at that cpu's next
+// preemption point
+static void sched_internal_check_preempt(thread_t* woken) {
+    uint32_t cpu = woken->cpu;
+    thread_t* current = smp_cpus[cpu].thread;
+    if (!current || current == woken) {
+        return;
+    }
+
+    if (current == smp_cpus[cpu].idle_thread || woken->cls < current->cls ||
+        (woken->cls == current->cls && sched_internal_beats(woken, current))) {
+        current->need_resched = true;
+        sched_internal_kick(cpu);
+    }
+}
+
 void sched_block(void) {
     thread_t* current = sched_current_thread();
     if (!current) {
@@ -610,7 +1255,22 @@ void sched_unblock(thread_t* thread) {
     }
 
     thread->thread_state = THREAD_READY;
-    sched_enqueue(&sched.ready_queue, thread);
+    sched_runqueue_add(thread);
+    sched_internal_check_preempt(thread);
+}
+
+static void sched_wake_thread(thread_t* thread) {
+    thread->thread_state = THREAD_READY;
+    sched_runqueue_add(thread);
+    sched_internal_check_preempt(thread);
+}
+
+// the sleep timer of a thread fired, runs in softirq context
+static void sched_internal_sleep_expired(void* arg) {
+    thread_t* thread = (thread_t*) arg;
+    if (thread->thread_state == THREAD_SLEEPING) {
+        sched_wake_thread(thread);
+    }
 }
 
 void sched_thread_sleep(uint32_t ms) {
@@ -619,70 +1279,253 @@ void sched_thread_sleep(uint32_t ms) {
         return;
     }
 
-    current->wake_time = sched_ticks_counter + (uint64_t) ms;
     current->thread_state = THREAD_SLEEPING;
+    timer_add(&current->sleep_timer, sched_get_ticks() + timer_ms_to_ticks(ms));
+    sched_schedule();
+}
 
-    sched_enqueue(&sched.sleep_queue, current);
-    sched_yield();
+uint64_t sched_get_ticks(void) {
+    tick_sync();
+    return sched_ticks_counter;
 }
 
-static inline bool sched_thread_should_wake(thread_t* thread) {
-    return thread->wake_time <= sched_ticks_counter;
+// take the ticks off a realtime thread's budget; one that overran is throttled until the period after the
+// one its deadline falls in, unless that has already begun. returns whether it has to leave the cpu, which a
+// throttled thread has to on every tick until it does. the thread may have been queued again between the tick
+// and its switch: the deadline tree is keyed by the deadline a refill moves, so a queued thread is taken out
+// while it changes, and a throttled one is parked for the replenishment rather than left to be picked
+static bool sched_internal_dl_charge(thread_t* thread, uint32_t ticks) {
+    bool r;
+    sched_runqueue_t* rq = sched_internal_lock_thread_rq(thread, &r);
+    if (thread->cls != SCHED_CLASS_REALTIME) {
+        spinlock_unlock(&rq->lock, r);
+        return false;
+    }
+
+    thread->dl_budget -= (int32_t) ticks;
+    bool resched = thread->dl_throttled;
+    if (thread->dl_budget <= 0 && !thread->dl_throttled) {
+        bool queued = thread->on_runqueue;
+        uint32_t prio = thread->rq_prio;
+        if (queued) {
+            sched_internal_rq_unlink(rq, thread);
+        }
+
+        uint64_t now = sched_ticks_counter;
+        uint64_t next = thread->dl_abs_deadline - thread->dl_deadline + thread->dl_period;
+        if (next <= now) {
+            sched_internal_dl_refill(thread, now);
+            if (queued) {
+                sched_internal_rq_link(rq, thread, prio);
+            }
+        } else {
+            thread->dl_throttled = true;
+            thread->dl_parked = queued;
+            timer_add(&thread->dl_timer, next);
+        }
+        resched = true;
+    }
+    spinlock_unlock(&rq->lock, r);
+    return resched;
 }
 
-static void sched_remove_from_sleep_queue(thread_list_t* sleep_queue, thread_t* thread, thread_t* prev) {
-    if (prev) {
-        prev->next = thread->next;
+// the dl timer of a throttled thread fired, runs in softirq context; its budget comes back and, if it was
+// made runnable meanwhile, it is queued again
+static void sched_internal_dl_replenish(void* arg) {
+    thread_t* thread = (thread_t*) arg;
+    bool r;
+    sched_runqueue_t* rq = sched_internal_lock_thread_rq(thread, &r);
+    if (!thread->dl_throttled) {
+        spinlock_unlock(&rq->lock, r);
+        return;
+    }
+
+    sched_internal_dl_refill(thread, sched_ticks_counter);
+    thread->dl_throttled = false;
+    bool parked = thread->dl_parked;
+    if (parked) {
+        uint32_t prio = thread->priority.effective > MAX_PRIORITY ? MAX_PRIORITY : thread->priority.effective;
+        thread->dl_parked = false;
+        sched_internal_rq_link(rq, thread, prio);
+    }
+    spinlock_unlock(&rq->lock, r);
+
+    if (parked) {
+        sched_internal_check_preempt(thread);
+    }
+}
+
+// charge vruntime by weight and move the queue's floor along with it. the thread may have been queued again
+// between the tick and its switch, maybe on another cpu's queue; the fair tree is keyed by vruntime, so a queued
+// thread is taken out of it while the key changes
+static void sched_internal_fair_charge(uint32_t cpu, thread_t* thread, uint32_t ticks) {
+    bool r;
+    sched_runqueue_t* rq = sched_internal_lock_thread_rq(thread, &r);
+    if (thread->cls != SCHED_CLASS_NORMAL) {
+        spinlock_unlock(&rq->lock, r);
+        return;
+    }
+
+    uint64_t delta = sched_internal_vruntime_delta(thread, ticks);
+    if (thread->on_runqueue) {
+        uint32_t prio = thread->rq_prio;
+        sched_internal_rq_unlink(rq, thread);
+        thread->vruntime += delta;
+        sched_internal_rq_link(rq, thread, prio);
     } else {
-        sleep_queue->head = thread->next;
+        thread->vruntime += delta;
+        if (smp_cpus[cpu].thread == thread) {
+            sched_internal_update_min_vruntime(rq, thread);
+        }
     }
+    spinlock_unlock(&rq->lock, r);
+}
 
-    if (sleep_queue->tail == thread) {
-        sleep_queue->tail = prev;
+// charge the ticks to the thread running on a cpu and ask for a reschedule once its slice is used up
+static void sched_internal_charge(uint32_t cpu, uint32_t ticks) {
+    thread_t* current = smp_cpus[cpu].thread;
+    if (!current) {
+        return;
     }
 
-    if (sleep_queue->count > 0) {
-        sleep_queue->count--;
+    current->uptime += ticks;
+
+    // the idle thread has no slice to use up, anything runnable replaces it
+    bool resched;
+    if (current == smp_cpus[cpu].idle_thread) {
+        resched = sched.runqueues[cpu].count != 0;
+    } else {
+        if (current->cls == SCHED_CLASS_NORMAL) {
+            sched_internal_fair_charge(cpu, current, ticks);
+        }
+
+        if (current->cls == SCHED_CLASS_REALTIME) {
+            resched = sched_internal_dl_charge(current, ticks);
+        } else {
+            current->time_slice = current->time_slice > ticks ? current->time_slice - ticks : 0;
+            resched = !current->time_slice;
+        }
     }
 
-    thread->next = NULL;
+    if (resched && !current->need_resched) {
+        current->need_resched = true;
+        sched_internal_kick(cpu);
+    }
 }
 
-static void sched_wake_thread(thread_t* thread) {
-    thread->thread_state = THREAD_READY;
-    sched_enqueue(&sched.ready_queue, thread);
+// called with the ticks that went by, one per timer interrupt or several at once while the tick was stopped;
+// sleepers are woken by their timers in the softirq that follows. only the boot cpu takes the tick, so it
+// charges the threads running on the others as well
+void sched_tick(uint32_t ticks) {
+    sched_ticks_counter += ticks;
+    timer_tick();
+
+    for (uint32_t i = 0; i < smp_cpu_count; i++) {
+        sched_internal_charge(i, ticks);
+    }
 }
 
-static thread_t* sched_process_sleep_thread(thread_list_t* sleep_queue, thread_t* thread, thread_t* prev) {
-    thread_t* next = thread->next;
+// a queued thread moves to the other class's lists with it; one entering the realtime class starts its first
+// period now with a full budget
+static void sched_internal_change_class(thread_t* thread, sched_class_t cls) {
+    if (cls == SCHED_CLASS_REALTIME) {
+        timer_cancel_sync(&thread->dl_timer);
+    }
 
-    if (sched_thread_should_wake(thread)) {
-        sched_remove_from_sleep_queue(sleep_queue, thread, prev);
-        sched_wake_thread(thread);
-        return prev; // prev stays the same since we removed thread
+    bool r;
+    sched_runqueue_t* rq = sched_internal_lock_thread_rq(thread, &r);
+    // a parked thread is runnable, it only waits for its budget
+    bool queued = thread->on_runqueue || thread->dl_parked;
+    if (thread->on_runqueue) {
+        sched_internal_rq_unlink(rq, thread);
+    }
+    thread->cls = cls;
+    thread->dl_throttled = false;
+    thread->dl_parked = false;
+    if (cls == SCHED_CLASS_REALTIME) {
+        sched_internal_dl_renew(thread, sched_ticks_counter);
     } else {
-        return thread; // prev moves forward
+        sched_internal_place(rq, thread);
     }
+    if (queued) {
+        uint32_t prio = thread->priority.effective > MAX_PRIORITY ? MAX_PRIORITY : thread->priority.effective;
+        sched_internal_rq_link(rq, thread, prio);
+    }
+    spinlock_unlock(&rq->lock, r);
 }
 
-void sched_tick(void) {
-    sched_ticks_counter++;
-
-    spinlock(&sched.sleep_queue.lock);
+// give back the bandwidth a thread's reservation was admitted with
+static void sched_internal_dl_release(thread_t* thread) {
+    bool r = spinlock(&sched.dl_lock);
+    sched.dl_util -= thread->dl_util;
+    thread->dl_util = 0;
+    thread->dl_runtime = 0;
+    spinlock_unlock(&sched.dl_lock, r);
+    timer_cancel_sync(&thread->dl_timer);
+}
 
-    thread_t* prev = NULL;
-    thread_t* curr = sched.sleep_queue.head;
+// move a thread to another class; returns -1 and leaves the thread where it was when it asks for the realtime
+// class and its reservation cannot be admitted
+int sched_set_class(thread_t* thread, sched_class_t cls) {
+    if (!thread) {
+        return -1;
+    }
 
-    while (curr) {
-        prev = sched_process_sleep_thread(&sched.sleep_queue, curr, prev);
-        curr = (prev) ? prev->next : sched.sleep_queue.head;
+    if (cls == SCHED_CLASS_REALTIME) {
+        // a thread that did not declare a reservation gets the default one
+        if (!thread->dl_runtime && sched_set_deadline(thread, SCHED_DL_DEFAULT_RUNTIME_MS,
+                                                      SCHED_DL_DEFAULT_PERIOD_MS, SCHED_DL_DEFAULT_PERIOD_MS) < 0) {
+            log("sched: no realtime bandwidth left, thread keeps its class\n", YELLOW);
+            return -1;
+        }
+        return 0;
     }
 
-    spinlock_unlock(&sched.sleep_queue.lock, true);
+    sched_internal_dl_release(thread);
+    sched_internal_change_class(thread, cls);
+    return 0;
 }
 
-void sched_set_class(thread_t* thread, sched_class_t cls) {
-    if (thread) {
-        thread->cls = cls;
+// the boot cpu counts before smp_init has marked it online
+static uint32_t sched_internal_dl_cpus(void) {
+    uint32_t cpus = 0;
+    for (uint32_t mask = sched_online_cpus(); mask; mask &= mask - 1) {
+        cpus++;
     }
+    return cpus ? cpus : 1;
+}
+
+// reserve runtime ticks in every period for the thread, due deadline after the period starts, and move it to
+// the realtime class. the reservation is admitted only while every reservation's runtime / period adds up to
+// at most SCHED_DL_UTIL_LIMIT per online cpu, so earliest deadline first can meet all of them
+int sched_set_deadline(thread_t* thread, uint32_t runtime_ms, uint32_t deadline_ms, uint32_t period_ms) {
+    if (!thread || !runtime_ms || runtime_ms > deadline_ms || deadline_ms > period_ms) {
+        log("sched: set deadline - invalid parameters\n", RED);
+        return -1;
+    }
+
+    uint32_t runtime = timer_ms_to_ticks(runtime_ms);
+    uint32_t deadline = timer_ms_to_ticks(deadline_ms);
+    uint32_t period = timer_ms_to_ticks(period_ms);
+    if (period > SCHED_DL_MAX_PERIOD) {
+        log("sched: set deadline - period too long\n", RED);
+        return -1;
+    }
+    uint32_t util = (runtime << SCHED_DL_SHIFT) / period;
+
+    bool r = spinlock(&sched.dl_lock);
+    if (sched.dl_util - thread->dl_util + util > sched_internal_dl_cpus() * SCHED_DL_UTIL_LIMIT) {
+        spinlock_unlock(&sched.dl_lock, r);
+        log("sched: set deadline - bandwidth exceeded\n", RED);
+        return -1;
+    }
+    sched.dl_util = sched.dl_util - thread->dl_util + util;
+    thread->dl_util = util;
+    thread->dl_runtime = runtime;
+    thread->dl_deadline = deadline;
+    thread->dl_period = period;
+    spinlock_unlock(&sched.dl_lock, r);
+
+    sched_internal_change_class(thread, SCHED_CLASS_REALTIME);
+    return 0;
 }
@@ -10,6 +10,9 @@
 #include "ipc/signal.h"
 #include "../fs/vfs/vfs.h"
 #include "process.h"
+#include "timer.h"
+#include "percpu.h"
+#include "../lib/rbtree.h"
 typedef struct process process_t;
 
 // state of the cpu upon a context switch
@@ -17,12 +20,15 @@ typedef struct process process_t;
 // within our context switch function
 typedef struct cpu_ctx {
     uint32_t edi;
-    // we dont need the stack pointer here.
-    // we have it at thread->kernel_stack
     uint32_t esi;
     uint32_t ebx;
     uint32_t ebp;
     uint32_t eip;
+    // where context_switch left the saved registers, ctx.asm knows its offset
+    uint32_t esp;
+    // set while a cpu runs the thread, ctx.asm clears it once the registers above are saved so another cpu
+    // can pick the thread up without resuming a half saved context
+    volatile uint32_t on_cpu;
 } cpu_ctx_t;
 
 typedef enum thread_state {
@@ -51,15 +57,43 @@ typedef struct thread_priority {
     unsigned effective;
 } thread_priority_t;
 
-#define STARVATION_THRESHOLD 1000
-#define BOOST_AMOUNT 5
 #define MAX_PRIORITY 255
 
-// time slice configuration for different classes
-#define TIMESLICE_REALTIME 100
-#define TIMESLICE_NORMAL 20
+// the idle class keeps one fifo per priority, found through a bitmap
+#define SCHED_PRIORITIES (MAX_PRIORITY + 1)
+#define SCHED_BITMAP_WORDS (SCHED_PRIORITIES / 32)
+
 #define TIMESLICE_IDLE 1
 
+// the realtime class runs earliest deadline first on reservations of runtime every period; they are admitted
+// while their utilisation, runtime / period in SCHED_DL_UNIT, adds up to at most SCHED_DL_UTIL_LIMIT per
+// online cpu, what is left over goes to the other classes
+#define SCHED_DL_SHIFT 16
+#define SCHED_DL_UNIT (1u << SCHED_DL_SHIFT)
+#define SCHED_DL_UTIL_LIMIT (SCHED_DL_UNIT * 95 / 100)
+// in ticks, so runtime << SCHED_DL_SHIFT fits
+#define SCHED_DL_MAX_PERIOD 0xFFFF
+// what a thread put in the realtime class without declaring a reservation gets
+#define SCHED_DL_DEFAULT_RUNTIME_MS 10
+#define SCHED_DL_DEFAULT_PERIOD_MS 100
+
+// the fair class gives every runnable normal thread a turn within the target latency, stretched once turns would
+// get shorter than the minimum granularity; both in ticks
+#define SCHED_TARGET_LATENCY (60 * PIT_FREQUENCY / 1000)
+#define SCHED_MIN_GRANULARITY (10 * PIT_FREQUENCY / 1000)
+// vruntime advances by 1 << SCHED_VRUNTIME_SHIFT per tick run at the weight of priority 0, less for heavier
+// threads; the priorities are split evenly over SCHED_WEIGHT_LEVELS weights, each about a quarter above the last
+#define SCHED_NICE_0_WEIGHT 1024
+#define SCHED_VRUNTIME_SHIFT 10
+#define SCHED_WEIGHT_LEVELS 21
+
+// how often the stealer evens out the run queues, and the gap in load it leaves alone
+#define SCHED_BALANCE_MS 100
+#define SCHED_BALANCE_IMBALANCE 2
+
+// one bit per cpu id, a thread only runs on the cpus whose bit is set
+#define SCHED_AFFINITY_ALL ((1u << SMP_MAX_CPUS) - 1)
+
 typedef struct thread_list {
     thread_t* head;
     thread_t* tail;
@@ -97,10 +131,8 @@ typedef struct thread {
     sched_class_t cls;
 
     // priority is the base priority assigned when the thread is created
-    // if the thread is starved a priority boost will be added to the effective priority
-    // if the effective priority is higher than the base priority
-    // the scheduler will treat the effective priority of the thread to be the priority
-    // within sched_schedule()
+    // the effective priority is what the thread is queued at, raised above the base by priority inheritance
+    // in the normal class it sets the thread's weight instead, its share of the cpu
     thread_priority_t priority;
 
     thread_state_t thread_state;
@@ -121,21 +153,86 @@ typedef struct thread {
     uint32_t uptime;
     uint32_t time_since_last_run;
     uint32_t time_slice;
+    // set by the tick or a wakeup, the thread gives up the cpu at the next preemption point
+    volatile bool need_resched;
+    // preempt_count and the loaded page directory while it is switched out, a kernel thread working in
+    // some region's address space gets it back when it runs again
+    uint32_t saved_preempt_count;
+    uintptr_t saved_pd;
+
+    // armed while the thread sleeps, firing makes it runnable again
+    ktimer_t sleep_timer;
+
+    // run queue linkage, separate from next so a runnable thread can stay on its other lists
+    thread_t* rq_next;
+    thread_t* rq_prev;
+    bool on_runqueue;
+    uint32_t rq_prio; // the priority list it sits on, which may lag behind priority.effective
+    rb_node_t rq_node; // its place in the fair or the deadline tree
+
+    // the fair class orders its threads by vruntime, the cpu time they had scaled down by their weight
+    uint64_t vruntime;
+    uint32_t weight; // what it added to its queue's fair_weight
+
+    // the realtime class: dl_runtime ticks in every dl_period, due dl_deadline ticks after the period starts.
+    // the budget left for the current deadline is used up as it runs, once it is gone the thread is throttled
+    // until dl_timer starts its next period
+    uint32_t dl_runtime;
+    uint32_t dl_deadline;
+    uint32_t dl_period;
+    uint32_t dl_util; // what admission counted for it
+    uint64_t dl_abs_deadline;
+    int32_t dl_budget;
+    bool dl_throttled;
+    bool dl_parked; // made runnable while throttled, queued when the budget comes back
+    ktimer_t dl_timer;
 
-    uint64_t wake_time;
+    // the cpu whose run queue it is on, or the one it last ran on; changed only under that queue's lock
+    uint32_t cpu;
+    uint32_t affinity; // cpus it may run on, honoured by wakeups, stealing and balancing
 } thread_t;
 
+// runnable threads of one class; list i holds priority MAX_PRIORITY - i so the first set bit is the best one
+typedef struct sched_prio_array {
+    thread_t* heads[SCHED_PRIORITIES];
+    thread_t* tails[SCHED_PRIORITIES];
+    uint32_t bitmap[SCHED_BITMAP_WORDS];
+    uint32_t summary; // bitmap words with any bit set
+    uint32_t count;
+} sched_prio_array_t;
+
+typedef struct sched_runqueue {
+    // runnable realtime threads by absolute deadline, the leftmost runs next
+    rb_root_t dl_tree;
+    // runnable normal threads by vruntime, the leftmost runs next
+    rb_root_t fair_tree;
+    uint32_t fair_count;
+    uint32_t fair_weight;
+    uint64_t min_vruntime; // never goes back, woken and migrated threads are placed against it
+    sched_prio_array_t idle;
+    uint32_t class_mask; // classes with a runnable thread
+    uint32_t count;
+    spinlock_t lock;
+} sched_runqueue_t;
+
 typedef struct scheduler {
-    thread_list_t ready_queue;
-    thread_list_t sleep_queue;
+    // one per cpu, indexed by its id; a cpu only takes its own lock except to steal or balance
+    sched_runqueue_t runqueues[SMP_MAX_CPUS];
     thread_list_t kernel_threads;
     thread_list_t user_threads;
     uint32_t next_tid;
-    thread_t* idle_thread;
     thread_t* stealer_thread;
+    // utilisation of every admitted realtime reservation, in SCHED_DL_UNIT
+    uint32_t dl_util;
+    spinlock_t dl_lock;
 } scheduler_t;
 
 void sched_block(void);
+thread_t* sched_current_thread(void);
+
+// the running cpu's thread and the process it belongs to, kept in the cpu's data
+#define current_thread PERCPU_READ(thread)
+#define current_process PERCPU_READ(process)
 void sched_unblock(thread_t* thread);
 extern scheduler_t sched;
 
@@ -147,14 +244,30 @@ void sched_thread_list_add(thread_t* thread, thread_list_t* list);
 thread_t* sched_create_user_thread(void (*entry)(void), unsigned priority, char* name, process_t* process);
 
 void sched_init(void);
+thread_t* sched_create_idle_thread(cpu_t* cpu);
 void sched_enqueue(thread_list_t* list, thread_t* thread);
 thread_t* sched_dequeue(thread_list_t* list);
 thread_t* sched_remove(thread_list_t* list, thread_t* target);
+void sched_runqueue_add(thread_t* thread);
+bool sched_runqueue_remove(thread_t* thread);
 void sched_schedule(void);
 void sched_yield(void);
+void sched_preempt(void);
+void cond_resched(void);
+void sched_thread_exit(void);
+void sched_thread_sleep(uint32_t ms);
+uint64_t sched_get_ticks(void);
+
+// helper to manually set a thread's class, -1 when a realtime reservation is refused
+int sched_set_class(thread_t* thread, sched_class_t cls);
+int sched_set_deadline(thread_t* thread, uint32_t runtime_ms, uint32_t deadline_ms, uint32_t period_ms);
+
+int sched_set_affinity(thread_t* thread, uint32_t mask);
+uint32_t sched_online_cpus(void);
 
-// helper to manually set a thread's class
-void sched_set_class(thread_t* thread, sched_class_t cls);
+void sched_idle_loop(void);
+void sched_balance_start(void);
+bool sched_has_queued(void);
 
-extern void sched_tick(void);
+extern void sched_tick(uint32_t ticks);
 #endif // SCHED_H
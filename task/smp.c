@@ -0,0 +1,131 @@
+/*
+
+Copyright 2024-2026 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of FloppaOS.
+
+FloppaOS is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+FloppaOS is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with FloppaOS. If not, see <https://www.gnu.org/licenses/>.
+
+[DESCRIPTION] - bring up the application processors with init and startup ipis, giving each its own per cpu data,
+gdt, tss and idle thread
+
+*/
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "smp.h"
+#include "sched.h"
+#include "../mem/gdt.h"
+#include "../mem/paging.h"
+#include "../mem/utils.h"
+#include "../drivers/acpi/acpi.h"
+#include "../drivers/apic/lapic.h"
+#include "../drivers/io/io.h"
+#include "../interrupts/interrupts.h"
+#include "../lib/logging.h"
+
+extern char smp_trampoline_start[];
+extern char smp_trampoline_end[];
+extern char smp_trampoline_params[];
+
+cpu_t smp_cpus[SMP_MAX_CPUS];
+uint32_t smp_cpu_count = 1;
+
+// a write to the post code port takes about a microsecond and needs no timer
+static void smp_internal_delay_us(uint32_t us) {
+    for (uint32_t i = 0; i < us; i++) {
+        outb(0x80, 0);
+    }
+}
+
+// where the trampoline lands, on the stack of the cpu's idle thread with paging already on; it stays there
+// scheduling from its own run queue
+static void smp_internal_ap_entry(cpu_t* cpu) {
+    gdt_cpu_init(cpu);
+    idt_load();
+    lapic_enable();
+    tss_set_kernel_stack((uint32_t) cpu->idle_thread->kernel_stack);
+
+    __atomic_store_n(&cpu->online, true, __ATOMIC_RELEASE);
+    log_uint("smp: cpu online, apic id ", cpu->apic_id);
+
+    sched_idle_loop();
+}
+
+static int smp_internal_boot_ap(cpu_t* cpu, volatile smp_trampoline_params_t* params) {
+    if (!sched_create_idle_thread(cpu)) {
+        return -1;
+    }
+
+    params->pd = (uint32_t) read_pd();
+    params->stack = (uint32_t) cpu->idle_thread->kernel_stack;
+    params->entry = (uint32_t) smp_internal_ap_entry;
+    params->arg = (uint32_t) cpu;
+
+    if (lapic_send_ipi(cpu->apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT | LAPIC_ICR_LEVEL) < 0) {
+        return -1;
+    }
+    smp_internal_delay_us(SMP_INIT_DELAY_US);
+
+    // a second startup ipi only if the first was missed
+    for (int attempt = 0; attempt < SMP_SIPI_ATTEMPTS && !cpu->online; attempt++) {
+        if (lapic_send_ipi(cpu->apic_id, LAPIC_ICR_STARTUP | (SMP_TRAMPOLINE_BASE >> PAGE_SIZE_SHIFT)) < 0) {
+            return -1;
+        }
+        smp_internal_delay_us(SMP_SIPI_DELAY_US);
+    }
+
+    for (uint32_t waited = 0; waited < SMP_AP_TIMEOUT_US && !cpu->online; waited += SMP_SIPI_DELAY_US) {
+        smp_internal_delay_us(SMP_SIPI_DELAY_US);
+    }
+
+    if (!__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE)) {
+        log_uint("smp: cpu did not come up, apic id ", cpu->apic_id);
+        return -1;
+    }
+    return 0;
+}
+
+// start every enabled cpu the madt lists; the boot cpu's data was set up by gdt_init
+void smp_init(void) {
+    cpu_t* boot = &smp_cpus[0];
+    boot->online = true;
+
+    // the madt is parsed even when the tables lack what power off needs
+    acpi_init();
+
+    uint32_t count = acpi_cpu_count();
+    if (count <= 1 || lapic_init(acpi_lapic_base()) < 0) {
+        log("smp: running on the boot cpu only\n", YELLOW);
+        return;
+    }
+    boot->apic_id = lapic_id();
+
+    size_t size = (size_t) (smp_trampoline_end - smp_trampoline_start);
+    flop_memcpy((void*) SMP_TRAMPOLINE_BASE, smp_trampoline_start, size);
+    volatile smp_trampoline_params_t* params =
+        (volatile smp_trampoline_params_t*) (SMP_TRAMPOLINE_BASE + (smp_trampoline_params - smp_trampoline_start));
+
+    for (uint32_t i = 0; i < count && smp_cpu_count < SMP_MAX_CPUS; i++) {
+        uint8_t apic_id = acpi_cpu_apic_id(i);
+        if (apic_id == boot->apic_id) {
+            continue;
+        }
+
+        cpu_t* cpu = &smp_cpus[smp_cpu_count];
+        flop_memset(cpu, 0, sizeof(cpu_t));
+        cpu->id = smp_cpu_count;
+        cpu->apic_id = apic_id;
+
+        if (smp_internal_boot_ap(cpu, params) == 0) {
+            smp_cpu_count++;
+        }
+    }
+
+    log_uint("smp: cpus online: ", smp_cpu_count);
+    sched_balance_start();
+}
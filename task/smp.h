@@ -0,0 +1,37 @@
+/*
+
+Copyright 2024-2026 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of FloppaOS.
+
+FloppaOS is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+FloppaOS is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with FloppaOS. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+#ifndef SMP_H
+#define SMP_H
+#include <stdint.h>
+#include <stdbool.h>
+#include "percpu.h"
+
+// page the real mode trampoline is copied to, the startup ipi vector is its page number
+#define SMP_TRAMPOLINE_BASE 0x8000
+// the spec's waits between init and the startup ipis, and how long an ap gets to report in
+#define SMP_INIT_DELAY_US 10000
+#define SMP_SIPI_DELAY_US 200
+#define SMP_AP_TIMEOUT_US 100000
+#define SMP_SIPI_ATTEMPTS 2
+
+// what the trampoline reads at the end of its page, laid out as in smp_trampoline.asm
+typedef struct smp_trampoline_params {
+    uint32_t pd;
+    uint32_t stack;
+    uint32_t entry;
+    uint32_t arg;
+} smp_trampoline_params_t;
+
+void smp_init(void);
+#endif // SMP_H
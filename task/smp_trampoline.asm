@@ -0,0 +1,91 @@
+; Copyright 2024-2026 Amar Djulovic <aaamargml@gmail.com>
+;
+; This file is part of The Flopperating System.
+;
+; The Flopperating System is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+;
+; The Flopperating System is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+;
+; You should have received a copy of the GNU General Public License along with The Flopperating System. If not, see <https://www.gnu.org/licenses/>.
+;
+; [DESCRIPTION] - real mode entry of the application processors. smp_init copies this below 1 MiB and
+; points the startup ipi at it; it gets the cpu into protected mode with paging on and calls into C
+
+section .text
+global smp_trampoline_start
+global smp_trampoline_end
+global smp_trampoline_params
+
+; where smp_init copies it, must match SMP_TRAMPOLINE_BASE in smp.h
+SMP_TRAMPOLINE_BASE equ 0x8000
+
+; the code runs from the copy, so every address it uses is rebased onto it
+%define TRAMPOLINE(label) (SMP_TRAMPOLINE_BASE + (label) - smp_trampoline_start)
+
+CR0_PE equ 0x00000001
+CR0_PG_WP equ 0x80010000
+CR4_PSE equ 0x00000010
+
+bits 16
+smp_trampoline_start:
+	cli
+	cld
+	xor ax, ax
+	mov ds, ax
+
+	lgdt [TRAMPOLINE(smp_trampoline_gdtr)]
+
+	mov eax, cr0
+	or eax, CR0_PE
+	mov cr0, eax
+
+	jmp dword 0x08:TRAMPOLINE(smp_trampoline_protected)
+
+bits 32
+smp_trampoline_protected:
+	mov ax, 0x10
+	mov ds, ax
+	mov es, ax
+	mov fs, ax
+	mov gs, ax
+	mov ss, ax
+
+	; the boot cpu's page directory, with the kernel and this page identity mapped
+	mov eax, [TRAMPOLINE(smp_trampoline_params) + 0]
+	mov cr3, eax
+
+	mov eax, cr4
+	or eax, CR4_PSE
+	mov cr4, eax
+
+	mov eax, cr0
+	or eax, CR0_PG_WP
+	mov cr0, eax
+
+	; the stack of the cpu's idle thread, then entry(arg) never to return
+	mov esp, [TRAMPOLINE(smp_trampoline_params) + 4]
+	push dword [TRAMPOLINE(smp_trampoline_params) + 12]
+	push dword 0
+	mov eax, [TRAMPOLINE(smp_trampoline_params) + 8]
+	jmp eax
+
+align 8
+smp_trampoline_gdt:
+	dq 0x0000000000000000
+	dq 0x00CF9A000000FFFF
+	dq 0x00CF92000000FFFF
+smp_trampoline_gdt_end:
+
+smp_trampoline_gdtr:
+	dw smp_trampoline_gdt_end - smp_trampoline_gdt - 1
+	dd TRAMPOLINE(smp_trampoline_gdt)
+
+; filled in by the boot cpu before each startup ipi: page directory, stack, entry, argument
+align 4
+smp_trampoline_params:
+	dd 0
+	dd 0
+	dd 0
+	dd 0
+
+smp_trampoline_end:
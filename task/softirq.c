@@ -0,0 +1,62 @@
+/*
+
+Copyright 2024-2026 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of FloppaOS.
+
+FloppaOS is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+FloppaOS is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with FloppaOS. If not, see <https://www.gnu.org/licenses/>.
+
+[DESCRIPTION] - softirqs, the work an interrupt handler leaves for after it has acknowledged the irq
+
+*/
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "softirq.h"
+#include "../interrupts/interrupts.h"
+
+// rounds of newly raised softirqs handled before giving up until the next irq
+#define SOFTIRQ_MAX_RESTART 8
+
+static softirq_handler_t softirq_internal_handlers[SOFTIRQ_COUNT];
+static volatile uint32_t softirq_internal_pending;
+// set while the handlers run, an irq that interrupts one of them leaves the work to it
+static volatile bool softirq_internal_active;
+
+void softirq_open(softirq_nr_t nr, softirq_handler_t handler) {
+    softirq_internal_handlers[nr] = handler;
+}
+
+void softirq_raise(softirq_nr_t nr) {
+    __atomic_or_fetch(&softirq_internal_pending, 1U << nr, __ATOMIC_RELEASE);
+}
+
+bool softirq_pending(void) {
+    return softirq_internal_pending != 0;
+}
+
+// called with interrupts masked from the irq exit path
+void softirq_run(void) {
+    // one cpu at a time, the pending mask is shared
+    if (!softirq_internal_pending || __atomic_exchange_n(&softirq_internal_active, true, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    for (uint32_t round = 0; round < SOFTIRQ_MAX_RESTART && softirq_internal_pending; round++) {
+        uint32_t pending = __atomic_exchange_n(&softirq_internal_pending, 0, __ATOMIC_ACQUIRE);
+
+        IA32_INT_UNMASK();
+        for (uint32_t nr = 0; nr < SOFTIRQ_COUNT; nr++) {
+            if ((pending & (1U << nr)) && softirq_internal_handlers[nr]) {
+                softirq_internal_handlers[nr]();
+            }
+        }
+        IA32_INT_MASK();
+    }
+
+    __atomic_store_n(&softirq_internal_active, false, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,32 @@
+/*
+
+Copyright 2024-2026 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of FloppaOS.
+
+FloppaOS is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+FloppaOS is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with FloppaOS. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+#ifndef SOFTIRQ_H
+#define SOFTIRQ_H
+#include <stdint.h>
+#include <stdbool.h>
+
+// deferred halves of interrupt handlers, run on the way out of a hardware irq with interrupts enabled
+// and preemption still off, so a handler may not sleep
+typedef enum softirq_nr {
+    SOFTIRQ_TIMER,
+    SOFTIRQ_COUNT
+} softirq_nr_t;
+
+typedef void (*softirq_handler_t)(void);
+
+void softirq_open(softirq_nr_t nr, softirq_handler_t handler);
+void softirq_raise(softirq_nr_t nr);
+void softirq_run(void);
+bool softirq_pending(void);
+#endif // SOFTIRQ_H
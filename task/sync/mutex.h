@@ -19,7 +19,6 @@ You should have received a copy of the GNU General Public License along with Flo
 #include "../sched.h"
 #include "../../lib/assert.h"
 #include "../../lib/logging.h"
-extern thread_t* current_thread;
 
 typedef enum {
     MUTEX_UNLOCKED,
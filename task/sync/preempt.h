@@ -0,0 +1,49 @@
+/*
+
+Copyright 2024-2026 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of FloppaOS.
+
+FloppaOS is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either veregion_startion 3 of the License, or (at your option) any later veregion_startion.
+
+FloppaOS is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with FloppaOS. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+#ifndef PREEMPT_H
+#define PREEMPT_H
+#include <stdint.h>
+#include <stdbool.h>
+#include "../../interrupts/interrupts.h"
+#include "../percpu.h"
+
+// held spinlocks plus nested interrupt handlers of the running thread, it can only be switched out at 0
+// it lives in the cpu's data and the scheduler saves and restores it with the rest of the thread's context
+#define preempt_count PERCPU_READ(preempt)
+
+void sched_preempt(void);
+void cond_resched(void);
+
+static inline void preempt_disable(void) {
+    PERCPU_INC(preempt);
+    __asm__ volatile("" ::: "memory");
+}
+
+// drop a level without checking for a pending reschedule, for paths that cannot switch here
+static inline void preempt_enable_no_resched(void) {
+    __asm__ volatile("" ::: "memory");
+    PERCPU_DEC(preempt);
+}
+
+static inline void preempt_enable(void) {
+    preempt_enable_no_resched();
+    if (!preempt_count && IA32_INT_ENABLED()) {
+        sched_preempt();
+    }
+}
+
+static inline bool preemptible(void) {
+    return !preempt_count && IA32_INT_ENABLED();
+}
+#endif // PREEMPT_H
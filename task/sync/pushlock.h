@@ -22,7 +22,6 @@ You should have received a copy of the GNU General Public License along with Flo
 #include "../../lib/str.h"
 #include "spinlock.h"
 
-extern thread_t* current_thread;
 
 #define PUSHLOCK_LOCKED (1u << 0)
 #define PUSHLOCK_WAITERS (1u << 1)
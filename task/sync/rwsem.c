@@ -0,0 +1,142 @@
+/*
+
+Copyright 2024-2026 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of FloppaOS.
+
+FloppaOS is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+FloppaOS is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with FloppaOS. If not, see <https://www.gnu.org/licenses/>.
+
+[DESCRIPTION] - reader/writer semaphore, sleeping instead of spinning while it is contended
+
+*/
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "rwsem.h"
+#include "../sched.h"
+
+void rwsem_init(rwsem_t* sem) {
+    sem->count = 0;
+    sem->owner = NULL;
+    sem->head = NULL;
+    sem->tail = NULL;
+    spinlock_init(&sem->lock);
+}
+
+// hand the semaphore to the waiters at the head of the queue, a writer alone or every reader up to the next writer
+static void rwsem_internal_wake(rwsem_t* sem) {
+    while (sem->head && sem->count >= 0) {
+        rwsem_waiter_t* w = sem->head;
+        if (w->write && sem->count != 0) {
+            return;
+        }
+
+        sem->head = w->next;
+        if (!sem->head) {
+            sem->tail = NULL;
+        }
+
+        if (w->write) {
+            sem->count = -1;
+            sem->owner = w->thread;
+        } else {
+            sem->count++;
+        }
+
+        w->granted = true;
+        sched_unblock(w->thread);
+
+        if (sem->count < 0) {
+            return;
+        }
+    }
+}
+
+// queue behind the current waiters and sleep until the semaphore is handed over; called with sem->lock held
+static void rwsem_internal_wait(rwsem_t* sem, bool write, bool r) {
+    rwsem_waiter_t w = {sched_current_thread(), write, false, NULL};
+
+    if (sem->tail) {
+        sem->tail->next = &w;
+    } else {
+        sem->head = &w;
+    }
+    sem->tail = &w;
+
+    for (;;) {
+        spinlock_unlock(&sem->lock, r);
+        sched_block();
+        r = spinlock(&sem->lock);
+        if (w.granted) {
+            break;
+        }
+    }
+    spinlock_unlock(&sem->lock, r);
+}
+
+void rwsem_down_read(rwsem_t* sem) {
+    bool r = spinlock(&sem->lock);
+    if (sem->count >= 0 && !sem->head) {
+        sem->count++;
+        spinlock_unlock(&sem->lock, r);
+        return;
+    }
+    rwsem_internal_wait(sem, false, r);
+}
+
+bool rwsem_try_down_read(rwsem_t* sem) {
+    bool r = spinlock(&sem->lock);
+    bool got = sem->count >= 0 && !sem->head;
+    if (got) {
+        sem->count++;
+    }
+    spinlock_unlock(&sem->lock, r);
+    return got;
+}
+
+void rwsem_up_read(rwsem_t* sem) {
+    bool r = spinlock(&sem->lock);
+    if (sem->count > 0 && --sem->count == 0) {
+        rwsem_internal_wake(sem);
+    }
+    spinlock_unlock(&sem->lock, r);
+}
+
+void rwsem_down_write(rwsem_t* sem) {
+    bool r = spinlock(&sem->lock);
+    if (sem->count == 0 && !sem->head) {
+        sem->count = -1;
+        sem->owner = sched_current_thread();
+        spinlock_unlock(&sem->lock, r);
+        return;
+    }
+    rwsem_internal_wait(sem, true, r);
+}
+
+bool rwsem_try_down_write(rwsem_t* sem) {
+    bool r = spinlock(&sem->lock);
+    bool got = sem->count == 0 && !sem->head;
+    if (got) {
+        sem->count = -1;
+        sem->owner = sched_current_thread();
+    }
+    spinlock_unlock(&sem->lock, r);
+    return got;
+}
+
+void rwsem_up_write(rwsem_t* sem) {
+    bool r = spinlock(&sem->lock);
+    sem->count = 0;
+    sem->owner = NULL;
+    rwsem_internal_wake(sem);
+    spinlock_unlock(&sem->lock, r);
+}
+
+// whether the calling thread is the writer, so a fault taken while it changes the layout does not wait on itself
+bool rwsem_write_held(rwsem_t* sem) {
+    return sem->count < 0 && sem->owner && sem->owner == sched_current_thread();
+}
@@ -0,0 +1,49 @@
+/*
+
+Copyright 2024-2026 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of FloppaOS.
+
+FloppaOS is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+FloppaOS is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with FloppaOS. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+#ifndef RWSEM_H
+#define RWSEM_H
+#include <stdint.h>
+#include <stdbool.h>
+#include "spinlock.h"
+
+struct thread;
+
+// a waiter lives on the stack of the thread that sleeps on it
+typedef struct rwsem_waiter {
+    struct thread* thread;
+    bool write;
+    volatile bool granted;
+    struct rwsem_waiter* next;
+} rwsem_waiter_t;
+
+// any number of readers or a single writer; waiters are served in arrival order,
+// so a queued writer holds back the readers behind it
+typedef struct rwsem {
+    int32_t count; // readers holding it, -1 while a writer does
+    struct thread* owner;
+    rwsem_waiter_t* head;
+    rwsem_waiter_t* tail;
+    spinlock_t lock;
+} rwsem_t;
+
+void rwsem_init(rwsem_t* sem);
+void rwsem_down_read(rwsem_t* sem);
+bool rwsem_try_down_read(rwsem_t* sem);
+void rwsem_up_read(rwsem_t* sem);
+void rwsem_down_write(rwsem_t* sem);
+bool rwsem_try_down_write(rwsem_t* sem);
+void rwsem_up_write(rwsem_t* sem);
+bool rwsem_write_held(rwsem_t* sem);
+
+#endif // RWSEM_H
@@ -18,6 +18,7 @@ You should have received a copy of the GNU General Public License along with Flo
 #include <stdbool.h>
 #include <stdatomic.h>
 #include "../../interrupts/interrupts.h"
+#include "preempt.h"
 #define SPINLOCK_INIT ATOMIC_FLAG_INIT
 
 typedef struct spinlock {
@@ -33,12 +34,31 @@ static inline void spinlock_destroy(spinlock_t* lock) {
     atomic_store(&lock->state, __ATOMIC_RELAXED);
 }
 
-// try to acquire lock without blocking
-static inline bool spinlock_trylock(spinlock_t* lock) {
+void vmm_tlb_serve(void);
+
+// a cpu spinning with interrupts off still answers tlb shootdowns, the holder may be waiting for it
+static inline void spinlock_internal_relax(void) {
+    if (PERCPU_READ(tlb_pending)) {
+        vmm_tlb_serve();
+    }
+    IA32_CPU_RELAX();
+}
+
+static inline bool spinlock_internal_cas(spinlock_t* lock) {
     unsigned int expected = 0;
     return __atomic_compare_exchange_n(&lock->state, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
 }
 
+// try to acquire lock without blocking, a held lock keeps its holder from being preempted
+static inline bool spinlock_trylock(spinlock_t* lock) {
+    preempt_disable();
+    if (spinlock_internal_cas(lock)) {
+        return true;
+    }
+    preempt_enable_no_resched();
+    return false;
+}
+
 // acquire lock while disabling interrupts
 static inline bool spinlock(spinlock_t* lock) {
     // remember current interrupt state
@@ -46,15 +66,18 @@ static inline bool spinlock(spinlock_t* lock) {
     IA32_INT_MASK();
 
     // spin until trylock succeeds
-    while (!spinlock_trylock(lock)) {
-        IA32_CPU_RELAX();
+    preempt_disable();
+    while (!spinlock_internal_cas(lock)) {
+        spinlock_internal_relax();
     }
     return interrupts_enabled;
 }
 
 // release lock with interrupt restoration flag
+// a reschedule that came due while it was held waits for the next preemption point
 static inline void spinlock_unlock(spinlock_t* lock, bool restore_interrupts) {
     __atomic_clear(&lock->state, __ATOMIC_RELEASE);
+    preempt_enable_no_resched();
 
     // restore interrupt state if requested
     if (restore_interrupts) {
@@ -64,13 +87,15 @@ static inline void spinlock_unlock(spinlock_t* lock, bool restore_interrupts) {
 
 // acquire lock without disabling interrupts
 static inline void spinlock_noint(spinlock_t* lock) {
+    preempt_disable();
     while (__atomic_test_and_set(&lock->state, __ATOMIC_ACQUIRE)) {
-        IA32_CPU_RELAX();
+        spinlock_internal_relax();
     }
 }
 
 // release lock without restoring interrupts
 static inline void spinlock_unlock_noint(spinlock_t* lock) {
     __atomic_clear(&lock->state, __ATOMIC_RELEASE);
+    preempt_enable_no_resched();
 }
 #endif // SPINLOCK_H
@@ -17,7 +17,6 @@ You should have received a copy of the GNU General Public License along with Flo
 #include "spinlock.h"
 #include "../sched.h"
 
-extern thread_t* current_thread;
 
 #define TURNSTILE_HASH_SIZE 128
 
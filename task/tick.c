@@ -0,0 +1,155 @@
+/*
+
+Copyright 2024-2026 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of FloppaOS.
+
+FloppaOS is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+FloppaOS is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with FloppaOS. If not, see <https://www.gnu.org/licenses/>.
+
+[DESCRIPTION] - dynamic ticks, the periodic timer interrupt is stopped while nothing needs it and the pit is
+programmed for the next tick that has work to do instead
+
+*/
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "tick.h"
+#include "timer.h"
+#include "sched.h"
+#include "../interrupts/interrupts.h"
+
+extern uint64_t sched_ticks_counter;
+
+typedef struct tick_state {
+    bool oneshot;    // the pit is counting down a one-shot instead of firing every tick
+    uint32_t armed;  // input clocks the one-shot had left when it was last looked at
+    uint32_t offset; // input clocks of the current tick already gone by then
+} tick_state_t;
+
+// offset + armed always ends on a tick boundary, so the one-shot expiring means whole ticks went by
+static tick_state_t tick_internal_state;
+
+// move the clocks the one-shot counted since it was last looked at into whole ticks, returns how many
+static uint32_t tick_internal_fold(uint32_t remaining) {
+    tick_state_t* state = &tick_internal_state;
+
+    // a one-shot that ran out wraps around and keeps counting, its irq is just not delivered yet
+    if (remaining > state->armed) {
+        remaining = 0;
+    }
+
+    uint32_t total = state->offset + (state->armed - remaining);
+    state->armed = remaining;
+    state->offset = total % PIT_TICK_COUNTS;
+    return total / PIT_TICK_COUNTS;
+}
+
+static void tick_internal_account(uint32_t ticks) {
+    if (!ticks) {
+        return;
+    }
+    global_tick_count += ticks;
+    sched_tick(ticks);
+}
+
+// program the one-shot to end on the boundary of the ticks'th tick from now
+static void tick_internal_arm(uint32_t ticks) {
+    tick_state_t* state = &tick_internal_state;
+    state->armed = (PIT_TICK_COUNTS - state->offset) + (ticks - 1) * PIT_TICK_COUNTS;
+    state->oneshot = true;
+    pit_set_oneshot((uint16_t) state->armed);
+}
+
+// the tick only has work while something else could take the cpu from the running thread
+static inline bool tick_internal_needed(void) {
+    return sched_has_queued();
+}
+
+// hardware irqs call this on entry, catching the tick count up with the time the tick was stopped
+void tick_irq_enter(bool timer) {
+    tick_state_t* state = &tick_internal_state;
+
+    // the pit and the tick count belong to the boot cpu
+    if (smp_processor_id()) {
+        return;
+    }
+
+    if (!state->oneshot) {
+        tick_internal_account(timer ? 1 : 0);
+        return;
+    }
+
+    // read the count even for the timer irq, one left pending by a one-shot that was since reprogrammed
+    // must not be taken for the expiry of the current one
+    tick_internal_account(tick_internal_fold(pit_read_count()));
+}
+
+// decide whether the coming ticks are needed, called on irq exit and by the idle thread before it halts
+void tick_nohz_update(void) {
+    tick_state_t* state = &tick_internal_state;
+
+    if (smp_processor_id()) {
+        return;
+    }
+
+    bool r = IA32_INT_ENABLED();
+    IA32_INT_MASK();
+
+    bool needed = tick_internal_needed();
+
+    if (!state->oneshot) {
+        if (!needed) {
+            // stop partway through a tick, the part already gone counts towards the one-shot
+            uint32_t remaining = pit_read_count();
+            if (!remaining || remaining > PIT_TICK_COUNTS) {
+                remaining = PIT_TICK_COUNTS;
+            }
+            state->offset = PIT_TICK_COUNTS - remaining;
+            tick_internal_arm(timer_next_event(sched_ticks_counter, TICK_MAX_STOPPED));
+        }
+    } else if (!state->armed) {
+        // the one-shot expired on a tick boundary
+        if (needed) {
+            state->oneshot = false;
+            pit_set_periodic();
+        } else {
+            tick_internal_arm(timer_next_event(sched_ticks_counter, TICK_MAX_STOPPED));
+        }
+    } else {
+        // woken early, a timer may have been added for sooner or a thread made runnable; when the tick is
+        // needed again the current one is finished on a one-shot and the periodic tick resumes from its end
+        tick_internal_account(tick_internal_fold(pit_read_count()));
+        tick_internal_arm(needed ? 1 : timer_next_event(sched_ticks_counter, TICK_MAX_STOPPED));
+    }
+
+    if (r) {
+        IA32_INT_UNMASK();
+    }
+}
+
+// bring the tick count up to date while the tick is stopped, for readers outside an irq
+void tick_sync(void) {
+    tick_state_t* state = &tick_internal_state;
+    if (!state->oneshot || smp_processor_id()) {
+        return;
+    }
+
+    bool r = IA32_INT_ENABLED();
+    IA32_INT_MASK();
+
+    if (state->oneshot && state->armed) {
+        tick_internal_account(tick_internal_fold(pit_read_count()));
+    }
+
+    if (r) {
+        IA32_INT_UNMASK();
+    }
+}
+
+bool tick_stopped(void) {
+    return tick_internal_state.oneshot;
+}
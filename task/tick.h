@@ -0,0 +1,27 @@
+/*
+
+Copyright 2024-2026 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of FloppaOS.
+
+FloppaOS is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+FloppaOS is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with FloppaOS. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+#ifndef TICK_H
+#define TICK_H
+#include <stdint.h>
+#include <stdbool.h>
+#include "../interrupts/interrupts.h"
+
+// a stopped tick is one pit one-shot, whose 16 bit count covers this many whole ticks
+#define TICK_MAX_STOPPED (0xFFFF / PIT_TICK_COUNTS)
+
+void tick_irq_enter(bool timer);
+void tick_nohz_update(void);
+void tick_sync(void);
+bool tick_stopped(void);
+#endif // TICK_H
@@ -0,0 +1,264 @@
+/*
+
+Copyright 2024-2026 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of FloppaOS.
+
+FloppaOS is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+FloppaOS is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with FloppaOS. If not, see <https://www.gnu.org/licenses/>.
+
+[DESCRIPTION] - kernel timers on a hierarchical timing wheel, O(1) to add and cancel, expired from the timer softirq
+
+*/
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "timer.h"
+#include "softirq.h"
+#include "tick.h"
+#include "sched.h"
+#include "sync/spinlock.h"
+#include "../interrupts/interrupts.h"
+
+typedef struct timer_wheel {
+    ktimer_t* root[TIMER_ROOT_SIZE];
+    ktimer_t* levels[TIMER_LEVELS][TIMER_LEVEL_SIZE];
+    uint64_t clock; // next tick whose root slot has not been run
+    uint32_t count;    // queued timers, an empty wheel is skipped instead of stepped
+    ktimer_t* running; // whose callback is running with the lock dropped, see timer_cancel_sync
+    spinlock_t lock;
+} timer_wheel_t;
+
+static timer_wheel_t timer_internal_wheel = {.lock = SPINLOCK_INIT};
+
+static inline uint32_t timer_internal_level_index(uint64_t ticks, int level) {
+    return (uint32_t) (ticks >> (TIMER_ROOT_BITS + level * TIMER_LEVEL_BITS)) & TIMER_LEVEL_MASK;
+}
+
+static void timer_internal_link(ktimer_t** head, ktimer_t* timer) {
+    timer->next = *head;
+    if (timer->next) {
+        timer->next->pprev = &timer->next;
+    }
+    *head = timer;
+    timer->pprev = head;
+}
+
+static void timer_internal_unlink(ktimer_t* timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+// the slot is picked by how far off the timer is, so the levels only ever hold timers a full turn of the
+// level below away; a timer already due goes in the slot run next
+static void timer_internal_enqueue(timer_wheel_t* wheel, ktimer_t* timer) {
+    uint64_t expires = timer->expires;
+    uint64_t delta = expires > wheel->clock ? expires - wheel->clock : 0;
+
+    if (delta == 0) {
+        timer_internal_link(&wheel->root[wheel->clock & TIMER_ROOT_MASK], timer);
+        return;
+    }
+
+    if (delta < TIMER_ROOT_SIZE) {
+        timer_internal_link(&wheel->root[expires & TIMER_ROOT_MASK], timer);
+        return;
+    }
+
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        uint64_t span = 1ULL << (TIMER_ROOT_BITS + (level + 1) * TIMER_LEVEL_BITS);
+        if (delta < span || level == TIMER_LEVELS - 1) {
+            // past the reach of the wheel it waits at the far end and is placed again on the way down
+            if (delta >= span) {
+                expires = wheel->clock + span - 1;
+            }
+            timer_internal_link(&wheel->levels[level][timer_internal_level_index(expires, level)], timer);
+            return;
+        }
+    }
+}
+
+// move a slot of a level down into the ones below it, returns the index so the caller knows whether the
+// level wrapped and the next one has to cascade as well
+static uint32_t timer_internal_cascade(timer_wheel_t* wheel, int level) {
+    uint32_t index = timer_internal_level_index(wheel->clock, level);
+    ktimer_t* list = wheel->levels[level][index];
+    wheel->levels[level][index] = NULL;
+
+    while (list) {
+        ktimer_t* timer = list;
+        list = timer->next;
+        timer->next = NULL;
+        timer->pprev = NULL;
+        timer_internal_enqueue(wheel, timer);
+    }
+    return index;
+}
+
+// step the wheel up to now, running everything that expired; the lock is dropped around each callback so
+// it can re-arm or cancel timers, including its own
+static void timer_internal_run(void) {
+    timer_wheel_t* wheel = &timer_internal_wheel;
+    uint64_t now = sched_get_ticks();
+
+    bool r = spinlock(&wheel->lock);
+
+    while (wheel->clock <= now) {
+        if (!wheel->count) {
+            wheel->clock = now + 1;
+            break;
+        }
+
+        uint32_t index = (uint32_t) (wheel->clock & TIMER_ROOT_MASK);
+        if (!index) {
+            for (int level = 0; level < TIMER_LEVELS; level++) {
+                if (timer_internal_cascade(wheel, level)) {
+                    break;
+                }
+            }
+        }
+
+        // detach the slot so timers added by the callbacks land in a later one
+        ktimer_t* work = wheel->root[index];
+        wheel->root[index] = NULL;
+        if (work) {
+            work->pprev = &work;
+        }
+        wheel->clock++;
+
+        while (work) {
+            ktimer_t* timer = work;
+            timer_internal_unlink(timer);
+            wheel->count--;
+
+            timer_fn_t fn = timer->fn;
+            void* arg = timer->arg;
+            wheel->running = timer;
+
+            spinlock_unlock(&wheel->lock, r);
+            fn(arg);
+            r = spinlock(&wheel->lock);
+            wheel->running = NULL;
+        }
+    }
+
+    spinlock_unlock(&wheel->lock, r);
+}
+
+void timer_subsystem_init(void) {
+    timer_internal_wheel.clock = sched_get_ticks();
+    softirq_open(SOFTIRQ_TIMER, timer_internal_run);
+}
+
+void timer_init(ktimer_t* timer, timer_fn_t fn, void* arg) {
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+    timer->fn = fn;
+    timer->arg = arg;
+}
+
+// arm the timer for an absolute tick, moving it if it is already queued
+void timer_add(ktimer_t* timer, uint64_t expires) {
+    timer_wheel_t* wheel = &timer_internal_wheel;
+    bool r = spinlock(&wheel->lock);
+
+    if (timer->pprev) {
+        timer_internal_unlink(timer);
+    } else {
+        // an empty wheel is not stepped, catch its clock up before placing anything relative to it
+        if (!wheel->count) {
+            uint64_t now = sched_get_ticks();
+            if (wheel->clock < now) {
+                wheel->clock = now;
+            }
+        }
+        wheel->count++;
+    }
+
+    timer->expires = expires;
+    timer_internal_enqueue(wheel, timer);
+
+    spinlock_unlock(&wheel->lock, r);
+
+    // a stopped tick may be set to come back after this timer is due
+    if (tick_stopped()) {
+        tick_nohz_update();
+    }
+}
+
+// returns whether the timer was still queued; its callback may still be running on another cpu, use
+// timer_cancel_sync before freeing what the timer is embedded in
+bool timer_cancel(ktimer_t* timer) {
+    timer_wheel_t* wheel = &timer_internal_wheel;
+    bool r = spinlock(&wheel->lock);
+
+    bool queued = timer->pprev != NULL;
+    if (queued) {
+        timer_internal_unlink(timer);
+        wheel->count--;
+    }
+
+    spinlock_unlock(&wheel->lock, r);
+    return queued;
+}
+
+// cancel and wait out a callback already running on another cpu; it must not be called from that callback
+// or with a lock the callback takes
+bool timer_cancel_sync(ktimer_t* timer) {
+    timer_wheel_t* wheel = &timer_internal_wheel;
+    bool queued = timer_cancel(timer);
+    while (__atomic_load_n(&wheel->running, __ATOMIC_ACQUIRE) == timer) {
+        IA32_CPU_RELAX();
+    }
+    return queued;
+}
+
+bool timer_pending(ktimer_t* timer) {
+    return timer->pprev != NULL;
+}
+
+// whole ticks covering ms, rounded up so a timer never fires early; kept in 32 bits, there is no 64 bit divide
+uint32_t timer_ms_to_ticks(uint32_t ms) {
+    return (ms / 1000) * PIT_FREQUENCY + ((ms % 1000) * PIT_FREQUENCY + 999) / 1000;
+}
+
+// ticks after now until the first one the wheel has work on, a due slot or a cascade, capped at max; only
+// the root slots are looked at, the levels come down into them at a cascade
+uint32_t timer_next_event(uint64_t now, uint32_t max) {
+    timer_wheel_t* wheel = &timer_internal_wheel;
+    bool r = spinlock(&wheel->lock);
+
+    uint32_t ticks = max;
+    if (wheel->count) {
+        if (wheel->clock <= now) {
+            // a tick the softirq has not got to yet
+            ticks = 1;
+        } else {
+            for (uint32_t d = 1; d < max; d++) {
+                uint32_t index = (uint32_t) ((now + d) & TIMER_ROOT_MASK);
+                if (!index || wheel->root[index]) {
+                    ticks = d;
+                    break;
+                }
+            }
+        }
+    }
+
+    spinlock_unlock(&wheel->lock, r);
+    return ticks;
+}
+
+// called from the timer interrupt after the tick count moved, the wheel itself is stepped in the softirq
+void timer_tick(void) {
+    if (timer_internal_wheel.count) {
+        softirq_raise(SOFTIRQ_TIMER);
+    }
+}
@@ -0,0 +1,49 @@
+/*
+
+Copyright 2024-2026 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of FloppaOS.
+
+FloppaOS is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+FloppaOS is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with FloppaOS. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+#ifndef TIMER_H
+#define TIMER_H
+#include <stdint.h>
+#include <stdbool.h>
+
+// the wheel: 256 slots one tick apart, then four levels of 64 slots, each slot of a level spanning a whole
+// turn of the level below, together covering 2^32 ticks
+#define TIMER_ROOT_BITS 8
+#define TIMER_LEVEL_BITS 6
+#define TIMER_ROOT_SIZE (1 << TIMER_ROOT_BITS)
+#define TIMER_LEVEL_SIZE (1 << TIMER_LEVEL_BITS)
+#define TIMER_ROOT_MASK (TIMER_ROOT_SIZE - 1)
+#define TIMER_LEVEL_MASK (TIMER_LEVEL_SIZE - 1)
+#define TIMER_LEVELS 4
+
+typedef void (*timer_fn_t)(void* arg);
+
+// embedded in whatever it times; callbacks run in softirq context and must not sleep
+typedef struct ktimer {
+    struct ktimer* next;
+    struct ktimer** pprev; // the link pointing at this timer, NULL while it is not queued
+    uint64_t expires;      // tick it fires on
+    timer_fn_t fn;
+    void* arg;
+} ktimer_t;
+
+void timer_subsystem_init(void);
+void timer_init(ktimer_t* timer, timer_fn_t fn, void* arg);
+void timer_add(ktimer_t* timer, uint64_t expires);
+bool timer_cancel(ktimer_t* timer);
+bool timer_cancel_sync(ktimer_t* timer);
+bool timer_pending(ktimer_t* timer);
+uint32_t timer_ms_to_ticks(uint32_t ms);
+uint32_t timer_next_event(uint64_t now, uint32_t max);
+void timer_tick(void);
+#endif // TIMER_H
@@ -12,37 +12,37 @@ You should have received a copy of the GNU General Public License along with Flo
 
 */
 #include "tss.h"
+#include "percpu.h"
 #include "../mem/gdt.h"
 #include "../mem/utils.h"
 #include "../lib/logging.h"
 
-extern void gdt_set_gate(int num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran);
+// each cpu has its own tss in its per cpu data, described in its own gdt
+void tss_init(cpu_t* cpu, uint32_t idx, uint32_t kss, uint32_t kesp) {
+    tss_entry_t* tss = &cpu->tss;
+    uint32_t base = (uint32_t) tss;
+    uint32_t limit = sizeof(tss_entry_t) - 1;
 
-static tss_entry_t tss_entry;
+    gdt_set_gate(cpu->gdt, idx, base, limit, 0x89, 0x00);
 
-void tss_init(uint32_t idx, uint32_t kss, uint32_t kesp) {
-    uint32_t base = (uint32_t) &tss_entry;
-    uint32_t limit = base + sizeof(tss_entry_t);
+    flop_memset(tss, 0, sizeof(tss_entry_t));
 
-    gdt_set_gate(idx, base, limit, 0x89, 0x00);
-
-    flop_memset(&tss_entry, 0, sizeof(tss_entry));
-
-    tss_entry.ss0 = kss;
-    tss_entry.esp0 = kesp;
-    tss_entry.cs = 0x0b;
-    tss_entry.ss = 0x13;
-    tss_entry.ds = 0x13;
-    tss_entry.es = 0x13;
-    tss_entry.fs = 0x13;
-    tss_entry.gs = 0x13;
-    tss_entry.iomap_base = sizeof(tss_entry_t);
+    tss->ss0 = kss;
+    tss->esp0 = kesp;
+    tss->cs = 0x0b;
+    tss->ss = 0x13;
+    tss->ds = 0x13;
+    tss->es = 0x13;
+    tss->fs = 0x13;
+    tss->gs = 0x13;
+    tss->iomap_base = sizeof(tss_entry_t);
 
     __asm__ volatile("ltr %%ax" : : "a"((idx * 8) | 0x0));
 
     log("tss: init - ok\n", GREEN);
 }
 
+// the running cpu's tss, called from the context switch with interrupts off
 void tss_set_kernel_stack(uint32_t stack) {
-    tss_entry.esp0 = stack;
+    this_cpu()->tss.esp0 = stack;
 }
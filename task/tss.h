@@ -33,7 +33,9 @@ typedef struct __attribute__((packed)) tss_entry {
     uint16_t iomap_base;
 } tss_entry_t;
 
-void tss_init(uint32_t idx, uint32_t kss, uint32_t kesp);
+struct cpu;
+
+void tss_init(struct cpu* cpu, uint32_t idx, uint32_t kss, uint32_t kesp);
 void tss_set_kernel_stack(uint32_t stack);
 
 #endif
@@ -18,15 +18,17 @@ global usermode_entry_routine
 ; user threads will automatically jump to this.
 ; this sets up the stack to execute the entry of the user thread
 usermode_entry_routine:
+    mov ecx, [esp+4]
+    mov edx, [esp+8]
     mov ax, 0x23
     mov ds, ax
     mov es, ax
     mov fs, ax
     mov gs, ax
     push dword 0x23
-    push dword [esp+4]
+    push ecx
     pushfd
     or dword [esp], 0x200
     push dword 0x1B
-    push dword [esp+12]
+    push edx
     iretd